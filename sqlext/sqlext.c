@@ -36,6 +36,21 @@
      select '04', like('O', 'Ø') = 0;
      select '05', like('%test\%', 'testx', '\') = 0;
      select '06', like('Ö', 'o') = 1;
+  5. Check that the search index (see db_init.c) selects the same rows as LIKE,
+     also for negations and NULL values
+     create table t (id integer primary key, s text);
+     insert into t values (1, 'Abcé'), (2, null), (3, 'x_y'), (4, 'xzy');
+     create virtual table t_fts using fts5(s, content='', tokenize='trigram');
+     insert into t_fts (rowid, s) select id, daap_fold(s) from t;
+     select '07', daap_fold('ÅBC') = 'abc';
+     select '08', count(*) = 1 from t where id in (select rowid from t_fts where s match '"bce"') and s like '%bce%';
+     select '09', count(*) = 2 from t where not (s like '%bce%');
+     select '10', count(*) = 3 from t where not (id in (select rowid from t_fts where s match '"bce"') and s like '%bce%');
+     select '11', count(*) = 1 from t where id in (select rowid from t_fts where s match '"x_y"') and s like '%x\_y%' escape '\';
+     select '12', count(*) = 2 from t where s like '%x_y%';
+  '10' shows why the index must not be used for a negated LIKE: the NULL row
+  matches the negation of the combined filter, but not NOT LIKE. '12' shows why
+  LIKE wildcards must be escaped when the index is used.
 */
 
 #ifdef HAVE_CONFIG_H
@@ -488,6 +503,107 @@ daap_no_zero_xfunc(sqlite3_context *pv, int n, sqlite3_value **ppv)
     sqlite3_result_int64(pv, old_value);
 }
 
+// Returns the string folded the same way as our LIKE function compares, i.e.
+// case and diacritics insensitive. Used for maintaining the search index.
+static void
+daap_fold_xfunc(sqlite3_context *pv, int n, sqlite3_value **ppv)
+{
+  const uint8_t *in;
+  uint8_t *out;
+  uint32_t uc;
+  int len;
+  int pos;
+  int ret;
+
+  if (n != 1)
+    {
+      sqlite3_result_error(pv, "daap_fold() requires 1 parameter", -1);
+      return;
+    }
+
+  in = sqlite3_value_text(ppv[0]);
+  if (!in)
+    {
+      sqlite3_result_null(pv);
+      return;
+    }
+
+  // Folding may turn a 2 byte char into a 3 byte char, so reserve extra
+  len = 2 * sqlite3_value_bytes(ppv[0]) + 1;
+  out = sqlite3_malloc(len);
+  if (!out)
+    {
+      sqlite3_result_error_nomem(pv);
+      return;
+    }
+
+  for (pos = 0; *in; pos += ret)
+    {
+      SQLITE_ICU_READ_UTF8(in, uc);
+      ret = u8_uctomb(out + pos, sqlite3Fts5UnicodeFold(uc, 1), len - pos);
+      if (ret < 0)
+	ret = 0; // Skip invalid char
+    }
+
+  sqlite3_result_text(pv, (const char *)out, pos, sqlite3_free);
+}
+
+// For ASCII case folding is just lowercasing, NFD doesn't change anything, and
+// uc_is_alpha() is true for the same chars as isalpha() in the C locale, so the
+// strings can be compared byte by byte. Returns 0 and sets *result if both
+// strings are ASCII.
+static int
+daap_ascii_collation(int *result, int llen, const uint8_t *left, int rlen, const uint8_t *right)
+{
+#define ASCII_IS_ALPHA(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z'))
+#define ASCII_TO_LOWER(c) (((c) >= 'A' && (c) <= 'Z') ? (c) + ('a' - 'A') : (c))
+  uint8_t lc;
+  uint8_t rc;
+  int lalpha;
+  int ralpha;
+  int i;
+
+  for (i = 0; i < llen; i++)
+    {
+      if (left[i] & 0x80)
+	return -1;
+    }
+
+  for (i = 0; i < rlen; i++)
+    {
+      if (right[i] & 0x80)
+	return -1;
+    }
+
+  // An empty string is not alpha, like the NUL u8_mbtoucr() reads below
+  lalpha = (llen > 0) && ASCII_IS_ALPHA(left[0]);
+  ralpha = (rlen > 0) && ASCII_IS_ALPHA(right[0]);
+
+  if (!lalpha && ralpha)
+    *result = 1;
+  else if (lalpha && !ralpha)
+    *result = -1;
+  else
+    {
+      for (i = 0; i < llen && i < rlen; i++)
+	{
+	  lc = ASCII_TO_LOWER(left[i]);
+	  rc = ASCII_TO_LOWER(right[i]);
+	  if (lc != rc)
+	    break;
+	}
+
+      if (i < llen && i < rlen)
+	*result = (lc < rc) ? -1 : 1;
+      else
+	*result = (llen > rlen) - (llen < rlen);
+    }
+
+  return 0;
+#undef ASCII_IS_ALPHA
+#undef ASCII_TO_LOWER
+}
+
 static int
 daap_unicode_xcollation(void *notused, int llen, const void *left, int rlen, const void *right)
 {
@@ -498,6 +614,9 @@ daap_unicode_xcollation(void *notused, int llen, const void *left, int rlen, con
   int rpp;
   int ret;
 
+  if (daap_ascii_collation(&rpp, llen, left, rlen, right) == 0)
+    return rpp;
+
   /* Extract first utf-8 character */
   ret = u8_mbtoucr(&lch, (const uint8_t *)left, llen);
   if (ret < 0)
@@ -552,6 +671,13 @@ sqlite3_extension_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines
       goto error;
     }
 
+  ret = sqlite3_create_function(db, "daap_fold", 1, SQLITE_UTF8|SQLITEICU_EXTRAFLAGS, NULL, daap_fold_xfunc, NULL, NULL);
+  if (ret != SQLITE_OK)
+    {
+      errmsg = "Could not create daap_fold function";
+      goto error;
+    }
+
   ret = sqlite3_create_collation(db, "DAAP", SQLITE_UTF8, NULL, daap_unicode_xcollation);
   if (ret != SQLITE_OK)
     {
@@ -24,14 +24,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "db.h"
 #include "misc.h"
@@ -42,6 +45,7 @@
 #include "cache.h"
 #include "http.h"
 #include "transcode.h"
+#include "worker.h"
 
 #include "artwork.h"
 
@@ -55,7 +59,7 @@
  * actual work of getting the artwork.
  *
  * There are two types of handlers: item and group. Item handlers are capable of
- * finding artwork for a single item (a dbmfi), while group handlers can get for
+ * finding artwork for a single item (an mfi), while group handlers can get for
  * an album or artist (a persistentid).
  *
  * An artwork source handler must return one of the following:
@@ -73,6 +77,19 @@
 #define ONLINE_SEARCH_COOLDOWN_TIME 3600
 #define ONLINE_SEARCH_FAILURES_MAX 5
 
+// See online_sources_lookup(), the deadline is in seconds
+#define ONLINE_SEARCH_DEADLINE 20
+#define ONLINE_SEARCH_PARALLEL_MAX 8
+// Marks an online source that hasn't been queried for the current item
+#define ONLINE_SEARCH_NOT_QUERIED INT_MIN
+
+// How long to remember that no artwork was found, see miss_add(). Changes to
+// files in the directories of the items will make us look again before that.
+#define ART_MISS_TTL_LOCAL (30 * 24 * 3600)
+#define ART_MISS_TTL_ONLINE (24 * 3600)
+// A miss for items in more directories than this is not recorded
+#define ART_MISS_DIRS_MAX 16
+
 enum artwork_cache
 {
   NEVER = 0,       // No caching of any results
@@ -107,7 +124,7 @@ struct artwork_ctx {
   int individual;
 
   // Input data for item handlers
-  struct db_media_file_info *dbmfi;
+  struct media_file_info *mfi;
   int id;
   uint32_t data_kind;
   uint32_t media_kind;
@@ -120,6 +137,14 @@ struct artwork_ctx {
   struct query_params qp;
   // Not to be used by handler - should the result be cached
   enum artwork_cache cache;
+  // Not to be used by handler - skip sources that make online requests
+  bool local_only;
+  // Not to be used by handler - info for recording a miss, see miss_add()
+  bool online_tried;
+  bool online_skipped;
+  bool online_incomplete;
+  char *miss_dirs[ART_MISS_DIRS_MAX];
+  int miss_ndirs; // -1 if too many
 };
 
 /* Definition of an artwork source. Covers both item and group sources.
@@ -139,6 +164,9 @@ struct artwork_source {
 
   // When should results from the source be cached?
   enum artwork_cache cache;
+
+  // Source makes requests to an online service
+  bool is_online;
 };
 
 /* Since online sources of artwork have similar characteristics there generic
@@ -151,6 +179,20 @@ enum parse_result {
   ONLINE_SOURCE_PARSE_NO_PARSER,
 };
 
+// An online source that is queried in parallel with others. Since the caller
+// may give up waiting, it has its own copy of the item info that the online
+// sources use (id, path, artist, album, data_kind and media_kind).
+struct online_lookup_arg {
+  int source_idx;
+  struct artwork_req_params req_params;
+  int individual;
+  struct media_file_info mfi;
+
+  // Result
+  struct evbuffer *evbuf;
+  char path[PATH_MAX];
+};
+
 // Remember previous artwork searches, used to avoid futile requests
 struct online_search_history {
   pthread_mutex_t mutex;
@@ -239,7 +281,7 @@ static struct artwork_source artwork_group_source[] =
   };
 
 /* List of sources that can provide artwork for an item (a track characterized
- * by a dbmfi). The source handlers will be called in the order of this list.
+ * by an mfi). The source handlers will be called in the order of this list.
  * The handler will only be called if the data_kind matches. Must be terminated
  * by a NULL struct.
  */
@@ -286,6 +328,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_SPOTIFY),
       .media_kinds = MEDIA_KIND_ALL,
       .cache = ON_SUCCESS | ON_FAILURE,
+      .is_online = true,
     },
     {
       // Note that even though caching is set for this handler, it will in most
@@ -304,6 +347,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_FILE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = ON_SUCCESS | ON_FAILURE,
+      .is_online = true,
     },
     {
       .name = "Spotify search web api (streams)",
@@ -311,6 +355,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_HTTP) | (1 << DATA_KIND_PIPE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = NEVER,
+      .is_online = true,
     },
     {
       .name = "Discogs (files)",
@@ -318,6 +363,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_FILE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = ON_SUCCESS | ON_FAILURE,
+      .is_online = true,
     },
     {
       .name = "Discogs (streams)",
@@ -325,6 +371,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_HTTP) | (1 << DATA_KIND_PIPE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = NEVER,
+      .is_online = true,
     },
     {
       // The Cover Art Archive seems rather slow, so low priority
@@ -333,6 +380,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_FILE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = ON_SUCCESS | ON_FAILURE,
+      .is_online = true,
     },
     {
       // The Cover Art Archive seems rather slow, so low priority
@@ -341,6 +389,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_HTTP) | (1 << DATA_KIND_PIPE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = NEVER,
+      .is_online = true,
     },
     {
       .name = "own (pipe)",
@@ -653,6 +702,9 @@ artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *in_buf, bool is
   struct encode_ctx *xcode_encode = NULL;
   struct transcode_evbuf_io xcode_evbuf_io = { 0 };
   struct evbuffer *xcode_buf = NULL;
+  struct timespec start;
+  struct timespec end;
+  size_t len;
   void *frame;
   int src_width;
   int src_height;
@@ -691,6 +743,10 @@ artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *in_buf, bool is
       xcode_decode_args.is_http = (data_kind == DATA_KIND_HTTP);
     }
 
+  // Lets the decoder skip work for JPEGs that will be scaled down anyway
+  xcode_decode_args.width = req_params.max_w;
+  xcode_decode_args.height = req_params.max_h;
+
   xcode_decode = transcode_decode_setup(xcode_decode_args);
   if (!xcode_decode)
     {
@@ -737,6 +793,10 @@ artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *in_buf, bool is
 
   size_calculate(&dst_width, &dst_height, src_width, src_height, req_params.max_w, req_params.max_h);
 
+  // WebP is for thumbnails, if the image won't be rescaled we send the original
+  if (dst_format == ART_FMT_WEBP && dst_width == src_width && dst_height == src_height)
+    dst_format = src_format;
+
   // Fast path. Won't work for embedded, since we need to extract the image from
   // the file.
   if (!is_embedded && dst_format == src_format && dst_width == src_width && dst_height == src_height)
@@ -759,6 +819,8 @@ artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *in_buf, bool is
     xcode_encode_args.profile = XCODE_PNG;
   else if (dst_format == ART_FMT_VP8)
     xcode_encode_args.profile = XCODE_VP8;
+  else if (dst_format == ART_FMT_WEBP)
+    xcode_encode_args.profile = XCODE_WEBP;
   else
     xcode_encode_args.profile = XCODE_JPEG;
 
@@ -782,6 +844,9 @@ artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *in_buf, bool is
       goto out;
     }
 
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  len = evbuffer_get_length(evbuf);
+
   ret = transcode_encode(evbuf, xcode_encode, frame, 1);
   if (ret < 0)
     {
@@ -790,6 +855,11 @@ artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *in_buf, bool is
       goto out;
     }
 
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  DPRINTF(E_DBG, L_ART, "Scaled and encoded %dx%d artwork as format %d: %zu bytes in %ld ms\n", dst_width, dst_height, dst_format,
+    evbuffer_get_length(evbuf) - len, (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000));
+
   ret = dst_format;
 
  out:
@@ -803,11 +873,15 @@ artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *in_buf, bool is
 }
 
 /*
- * Checks if an image file with one of the configured artwork_basenames exists in
- * the given directory "dir". Returns 0 if an image exists, -1 if no image was
+ * Looks for artwork files in the given directory "dir", which are the ones with
+ * one of the configured artwork_basenames or with the name of the directory.
+ * Names are matched in the same way as when the filescanner records the
+ * artwork of a directory, see artwork_dir_file_rank(), so e.g. Cover.JPG is
+ * found on all file systems. Returns 0 if an image exists, -1 if no image was
  * found or an error occurred.
  *
- * If an image exists, "out_path" will contain the absolute path to this image.
+ * If an image exists, "out_path" will contain the absolute path to the most
+ * preferred image.
  *
  * @param out_path If return value is 0, contains the absolute path to the image
  * @param len If return value is 0, contains the length of the absolute path
@@ -817,124 +891,46 @@ artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *in_buf, bool is
 static int
 dir_image_find(char *out_path, size_t len, const char *dir)
 {
+  DIR *dirp;
+  struct dirent *de;
   char path[PATH_MAX];
-  int i;
-  int j;
-  int path_len;
-  int ret;
-  cfg_t *lib;
-  int nbasenames;
-  int nextensions;
-
-  ret = snprintf(path, sizeof(path), "%s", dir);
-  if ((ret < 0) || (ret >= sizeof(path)))
-    {
-      DPRINTF(E_LOG, L_ART, "Artwork path exceeds PATH_MAX (%s)\n", dir);
-      return -1;
-    }
-
-  path_len = strlen(path);
-
-  lib = cfg_getsec(cfg, "library");
-  nbasenames = cfg_size(lib, "artwork_basenames");
-
-  if (nbasenames == 0)
-    return -1;
-
-  nextensions = ARRAY_SIZE(cover_extension);
-
-  for (i = 0; i < nbasenames; i++)
-    {
-      for (j = 0; j < nextensions; j++)
-	{
-	  ret = snprintf(path + path_len, sizeof(path) - path_len, "/%s.%s", cfg_getnstr(lib, "artwork_basenames", i), cover_extension[j]);
-	  if ((ret < 0) || (ret >= sizeof(path) - path_len))
-	    {
-	      DPRINTF(E_LOG, L_ART, "Artwork path will exceed PATH_MAX (%s/%s)\n", dir, cfg_getnstr(lib, "artwork_basenames", i));
-	      continue;
-	    }
-
-	  DPRINTF(E_SPAM, L_ART, "Trying directory artwork file %s\n", path);
-
-	  ret = access(path, F_OK);
-	  if (ret == 0)
-	    {
-	      snprintf(out_path, len, "%s", path);
-	      return 0;
-	    }
-	}
-    }
-
-  return -1;
-}
-
-/*
- * Checks if an image file exists in the given directory "dir" with the basename
- * equal to the directory name. Returns 0 if an image exists, -1 if no image was
- * found or an error occurred.
- *
- * If an image exists, "out_path" will contain the absolute path to this image.
- *
- * @param out_path If return value is 0, contains the absolute path to the image
- * @param len If return value is 0, contains the length of the absolute path
- * @param dir The directory to search
- * @return 0 if image exists, -1 otherwise
- */
-static int
-parent_dir_image_find(char *out_path, size_t len, const char *dir)
-{
-  char path[PATH_MAX];
-  char parentdir[PATH_MAX];
-  char *ptr;
-  int i;
-  int nextensions;
-  int path_len;
+  int best_rank;
+  int rank;
   int ret;
 
-  ret = snprintf(path, sizeof(path), "%s", dir);
-  if ((ret < 0) || (ret >= sizeof(path)))
-    {
-      DPRINTF(E_LOG, L_ART, "Artwork path exceeds PATH_MAX (%s)\n", dir);
-      return -1;
-    }
-
-  ptr = strrchr(path, '/');
-  if ((!ptr) || (strlen(ptr) <= 1))
+  dirp = opendir(dir);
+  if (!dirp)
     {
-      DPRINTF(E_LOG, L_ART, "Could not find parent dir name (%s)\n", path);
+      DPRINTF(E_DBG, L_ART, "Could not open directory '%s': %s\n", dir, strerror(errno));
       return -1;
     }
 
-  ret = snprintf(parentdir, sizeof(parentdir), "%s", ptr + 1);
-  if ((ret < 0) || (ret >= sizeof(parentdir)))
+  best_rank = -1;
+  while ((de = readdir(dirp)))
     {
-      DPRINTF(E_LOG, L_ART, "Impossible error occured in parent_dir_image_find(), cause was: %s\n", ptr + 1);
-      return -1;
-    }
+      if (de->d_name[0] == '.')
+	continue;
 
-  path_len = strlen(path);
-  nextensions = ARRAY_SIZE(cover_extension);
+      rank = artwork_dir_file_rank(dir, de->d_name);
+      if (rank < 0 || (best_rank >= 0 && rank >= best_rank))
+	continue;
 
-  for (i = 0; i < nextensions; i++)
-    {
-      ret = snprintf(path + path_len, sizeof(path) - path_len, "/%s.%s", parentdir, cover_extension[i]);
-      if ((ret < 0) || (ret >= sizeof(path) - path_len))
-        {
-	  DPRINTF(E_LOG, L_ART, "Artwork path will exceed PATH_MAX (%s)\n", parentdir);
+      ret = snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+      if ((ret < 0) || (ret >= sizeof(path)) || (ret >= len))
+	{
+	  DPRINTF(E_LOG, L_ART, "Artwork path will exceed PATH_MAX (%s/%s)\n", dir, de->d_name);
 	  continue;
 	}
 
-      DPRINTF(E_SPAM, L_ART, "Trying parent directory artwork file %s\n", path);
+      DPRINTF(E_SPAM, L_ART, "Found directory artwork file candidate %s\n", path);
 
-      ret = access(path, F_OK);
-      if (ret == 0)
-	{
-	  snprintf(out_path, len, "%s", path);
-	  return 0;
-	}
+      snprintf(out_path, len, "%s", path);
+      best_rank = rank;
     }
 
-  return -1;
+  closedir(dirp);
+
+  return (best_rank >= 0) ? 0 : -1;
 }
 
 /* Looks for an artwork file in a directory. Will rescale if needed.
@@ -951,13 +947,25 @@ artwork_get_bydir(struct evbuffer *evbuf, char *out_path, size_t len, char *dir,
 {
   int ret;
 
-  ret = dir_image_find(out_path, len, dir);
-  if (ret >= 0)
+  // The filescanner records the artwork file of the directories it scans
+  ret = db_directory_artwork_bypath(out_path, len, dir);
+  if (ret == 0)
     {
-      return artwork_get(evbuf, out_path, NULL, false, DATA_KIND_FILE, req_params);
+      if (*out_path == '\0')
+	return ART_E_NONE;
+
+      ret = artwork_get(evbuf, out_path, NULL, false, DATA_KIND_FILE, req_params);
+      if (ret != ART_E_ERROR)
+	return ret;
+
+      DPRINTF(E_DBG, L_ART, "Artwork file '%s' of directory '%s' could not be read, searching directory\n", out_path, dir);
     }
 
-  ret = parent_dir_image_find(out_path, len, dir);
+  // Not scanned (yet) or the file is gone, so look for the files ourselves
+  if (access(dir, F_OK) < 0)
+    return ART_E_NONE;
+
+  ret = dir_image_find(out_path, len, dir);
   if (ret >= 0)
     {
       return artwork_get(evbuf, out_path, NULL, false, DATA_KIND_FILE, req_params);
@@ -1001,10 +1009,10 @@ artwork_get_byurl(struct evbuffer *artwork, const char *url, struct artwork_req_
   if (format <= 0)
     goto out;
 
-  // Takes care of resizing
+  // Takes care of resizing, and returns the format of the result, which may
+  // not be the format of the source if a format was requested
   ret = artwork_get(artwork, NULL, raw, false, 0, req_params);
-  if (ret < 0)
-    format = ART_E_ERROR;
+  format = (ret < 0) ? ART_E_ERROR : ret;
 
  out:
   evbuffer_free(raw);
@@ -1205,8 +1213,8 @@ online_source_search_url_make(char *url, size_t url_size, const struct online_so
   else
     {
       // We will just search for artist and album
-      artist = ctx->dbmfi->artist;
-      album = ctx->dbmfi->album;
+      artist = ctx->mfi->artist;
+      album = ctx->mfi->album;
     }
 
   if (!artist || (!album && !title))
@@ -1440,7 +1448,7 @@ online_source_search(const struct online_source *src, struct artwork_ctx *ctx)
   char *artwork_url;
   int ret;
 
-  DPRINTF(E_SPAM, L_ART, "Trying %s for %s\n", src->name, ctx->dbmfi->path);
+  DPRINTF(E_SPAM, L_ART, "Trying %s for %s\n", src->name, ctx->mfi->path);
 
   ret = online_source_search_url_make(search_url, sizeof(search_url), src, ctx);
   if (ret < 0)
@@ -1475,6 +1483,26 @@ online_source_is_enabled(const struct online_source *src)
 
 /* ---------------------- SOURCE HANDLER IMPLEMENTATION -------------------- */
 
+/* Checks if a search that covered the sources we would query found nothing.
+ * Only called once the artwork cache has missed, since it is a round trip to
+ * the cache thread.
+ */
+static bool
+miss_is_cached(int type, int64_t persistentid, bool local_only)
+{
+  int sources;
+  int cached;
+  int ret;
+
+  sources = CACHE_ARTWORK_MISS_LOCAL;
+  if (!local_only)
+    sources |= CACHE_ARTWORK_MISS_ONLINE;
+
+  ret = cache_artwork_miss_get(type, persistentid, sources, &cached);
+
+  return (ret == 0 && cached);
+}
+
 /* Looks in the cache for group artwork
  */
 static int
@@ -1484,12 +1512,12 @@ source_group_cache_get(struct artwork_ctx *ctx)
   int cached;
   int ret;
 
-  ret = cache_artwork_get(CACHE_ARTWORK_GROUP, ctx->persistentid, ctx->req_params.max_w, ctx->req_params.max_h, &cached, &format, ctx->evbuf);
+  ret = cache_artwork_get(CACHE_ARTWORK_GROUP, ctx->persistentid, ctx->req_params.max_w, ctx->req_params.max_h, ctx->req_params.format, &cached, &format, ctx->evbuf);
   if (ret < 0)
     return ART_E_ERROR;
 
   if (!cached)
-    return ART_E_NONE;
+    return miss_is_cached(CACHE_ARTWORK_GROUP, ctx->persistentid, ctx->local_only) ? ART_E_ABORT : ART_E_NONE;
 
   if (!format)
     return ART_E_ABORT;
@@ -1523,10 +1551,8 @@ source_group_dir_get(struct artwork_ctx *ctx)
 
   while (((ret = db_query_fetch_string(&dir, &qp)) == 0) && (dir))
     {
-      /* The db query may return non-directories (eg if item is an internet stream or Spotify) */
-      if (access(dir, F_OK) < 0)
-	continue;
-
+      /* The db query may return non-directories (eg if item is an internet stream
+       * or Spotify), artwork_get_bydir() will not find anything for those */
       ret = artwork_get_bydir(ctx->evbuf, ctx->path, sizeof(ctx->path), dir, ctx->req_params);
       if (ret > 0)
 	{
@@ -1559,10 +1585,17 @@ source_item_cache_get(struct artwork_ctx *ctx)
   if (!ctx->individual)
     return ART_E_NONE;
 
-  ret = cache_artwork_get(CACHE_ARTWORK_INDIVIDUAL, ctx->id, ctx->req_params.max_w, ctx->req_params.max_h, &cached, &format, ctx->evbuf);
+  ret = cache_artwork_get(CACHE_ARTWORK_INDIVIDUAL, ctx->id, ctx->req_params.max_w, ctx->req_params.max_h, ctx->req_params.format, &cached, &format, ctx->evbuf);
   if (ret < 0)
     return ART_E_ERROR;
 
+  if (!cached && miss_is_cached(CACHE_ARTWORK_INDIVIDUAL, ctx->id, ctx->local_only))
+    {
+      // Stops the item sources, artwork_get_by_file_id() still tries the group
+      ctx->individual = 0;
+      return ART_E_ABORT;
+    }
+
   if (!cached)
     return ART_E_NONE;
 
@@ -1577,20 +1610,12 @@ source_item_cache_get(struct artwork_ctx *ctx)
 static int
 source_item_embedded_get(struct artwork_ctx *ctx)
 {
-  int artwork;
+  DPRINTF(E_SPAM, L_ART, "Trying embedded artwork in %s\n", ctx->mfi->path);
 
-  DPRINTF(E_SPAM, L_ART, "Trying embedded artwork in %s\n", ctx->dbmfi->path);
-
-  if (safe_atoi32(ctx->dbmfi->artwork, &artwork) < 0)
-    {
-      DPRINTF(E_LOG, L_ART, "Error converting dbmfi artwork to number for '%s'\n", ctx->dbmfi->path);
-      return ART_E_ERROR;
-    }
-
-  if (artwork != ARTWORK_EMBEDDED)
+  if (ctx->mfi->artwork != ARTWORK_EMBEDDED)
     return ART_E_NONE;
 
-  snprintf(ctx->path, sizeof(ctx->path), "%s", ctx->dbmfi->path);
+  snprintf(ctx->path, sizeof(ctx->path), "%s", ctx->mfi->path);
 
   return artwork_get(ctx->evbuf, ctx->path, NULL, true, ctx->data_kind, ctx->req_params);
 }
@@ -1608,10 +1633,10 @@ source_item_own_get(struct artwork_ctx *ctx)
   int i;
   int ret;
 
-  ret = snprintf(path, sizeof(path), "%s", ctx->dbmfi->path);
+  ret = snprintf(path, sizeof(path), "%s", ctx->mfi->path);
   if ((ret < 0) || (ret >= sizeof(path)))
     {
-      DPRINTF(E_LOG, L_ART, "Artwork path exceeds PATH_MAX (%s)\n", ctx->dbmfi->path);
+      DPRINTF(E_LOG, L_ART, "Artwork path exceeds PATH_MAX (%s)\n", ctx->mfi->path);
       return ART_E_ERROR;
     }
 
@@ -1628,7 +1653,7 @@ source_item_own_get(struct artwork_ctx *ctx)
       ret = snprintf(path + len, sizeof(path) - len, ".%s", cover_extension[i]);
       if ((ret < 0) || (ret >= sizeof(path) - len))
 	{
-	  DPRINTF(E_LOG, L_ART, "Artwork path will exceed PATH_MAX (%s)\n", ctx->dbmfi->path);
+	  DPRINTF(E_LOG, L_ART, "Artwork path will exceed PATH_MAX (%s)\n", ctx->mfi->path);
 	  continue;
 	}
 
@@ -1654,7 +1679,7 @@ source_item_artwork_url_get(struct artwork_ctx *ctx)
 {
   int ret;
 
-  DPRINTF(E_SPAM, L_ART, "Trying artwork url for %s\n", ctx->dbmfi->path);
+  DPRINTF(E_SPAM, L_ART, "Trying artwork url for %s\n", ctx->mfi->path);
 
   if (ctx->queue_item)
     {
@@ -1684,7 +1709,7 @@ source_item_pipe_get(struct artwork_ctx *ctx)
   char *path;
   int ret;
 
-  DPRINTF(E_SPAM, L_ART, "Trying pipe metadata from %s.metadata\n", ctx->dbmfi->path);
+  DPRINTF(E_SPAM, L_ART, "Trying pipe metadata from %s.metadata\n", ctx->mfi->path);
 
   queue_item = db_queue_fetch_byfileid(ctx->id);
   if (!queue_item || !queue_item->artwork_url)
@@ -1763,10 +1788,10 @@ source_item_spotifywebapi_track_get(struct artwork_ctx *ctx)
   char *artwork_url;
   int ret;
 
-  artwork_url = spotifywebapi_artwork_url_get(ctx->dbmfi->path, ctx->req_params.max_w, ctx->req_params.max_h);
+  artwork_url = spotifywebapi_artwork_url_get(ctx->mfi->path, ctx->req_params.max_w, ctx->req_params.max_h);
   if (!artwork_url)
     {
-      DPRINTF(E_WARN, L_ART, "No artwork from Spotify for %s\n", ctx->dbmfi->path);
+      DPRINTF(E_WARN, L_ART, "No artwork from Spotify for %s\n", ctx->mfi->path);
       return ART_E_NONE;
     }
 
@@ -1827,10 +1852,10 @@ source_item_ownpl_get(struct artwork_ctx *ctx)
   int format;
   int ret;
 
-  ret = db_snprintf(filter, sizeof(filter), "filepath = '%q'", ctx->dbmfi->path);
+  ret = db_snprintf(filter, sizeof(filter), "filepath = '%q'", ctx->mfi->path);
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_ART, "Artwork path is too long: '%s'\n", ctx->dbmfi->path);
+      DPRINTF(E_LOG, L_ART, "Artwork path is too long: '%s'\n", ctx->mfi->path);
       return ART_E_ERROR;
     }
 
@@ -1845,7 +1870,7 @@ source_item_ownpl_get(struct artwork_ctx *ctx)
       return ART_E_ERROR;
     }
 
-  mfi_path = ctx->dbmfi->path;
+  mfi_path = ctx->mfi->path;
 
   format = ART_E_NONE;
   while (((ret = db_query_fetch_pl(&dbpli, &qp)) == 0) && (dbpli.id) && (format == ART_E_NONE))
@@ -1863,12 +1888,12 @@ source_item_ownpl_get(struct artwork_ctx *ctx)
       // Only handle non-remote paths with source_item_own_get()
       if (dbpli.path && dbpli.path[0] == '/')
 	{
-	  ctx->dbmfi->path = dbpli.path;
+	  ctx->mfi->path = dbpli.path;
 	  format = source_item_own_get(ctx);
 	}
     }
 
-  ctx->dbmfi->path = mfi_path;
+  ctx->mfi->path = mfi_path;
 
   if ((ret < 0) || (format < 0))
     format = ART_E_ERROR;
@@ -1916,10 +1941,200 @@ source_queue_item_artwork_url_get(struct artwork_ctx *ctx)
 
 /* --------------------------- SOURCE PROCESSING --------------------------- */
 
+static void
+online_lookup_free(void *arg)
+{
+  struct online_lookup_arg *cmdarg = arg;
+
+  free_mfi(&cmdarg->mfi, 1);
+  evbuffer_free(cmdarg->evbuf);
+  free(cmdarg);
+}
+
+// Lookup thread job
+static int
+online_lookup_cb(void *arg)
+{
+  struct online_lookup_arg *cmdarg = arg;
+  struct artwork_ctx ctx = { 0 };
+  int ret;
+
+  ctx.evbuf = cmdarg->evbuf;
+  ctx.req_params = cmdarg->req_params;
+  ctx.individual = cmdarg->individual;
+  ctx.mfi = &cmdarg->mfi;
+  ctx.id = cmdarg->mfi.id;
+  ctx.data_kind = cmdarg->mfi.data_kind;
+  ctx.media_kind = cmdarg->mfi.media_kind;
+
+  ret = artwork_item_source[cmdarg->source_idx].handler(&ctx);
+
+  snprintf(cmdarg->path, sizeof(cmdarg->path), "%s", ctx.path);
+
+  return ret;
+}
+
+// A source that found artwork, or that stopped the search, decides the result
+static bool
+online_lookup_is_decided(int ret)
+{
+  return (ret > 0 || ret == ART_E_ABORT);
+}
+
+/* Queries the online sources that apply to the item, starting with source
+ * "first" and up until the next source that is not online, in parallel on the
+ * lookup threads (see worker_lookups_run). Waits at most ONLINE_SEARCH_DEADLINE
+ * and then sets rets[] for each queried source. Sources that didn't finish get
+ * ART_E_ERROR and mark the search as incomplete, so no miss is recorded. The
+ * artwork from the first source in the list that found anything is put in
+ * ctx->evbuf, so the caller can evaluate rets[] in the same way as if the
+ * sources had been called one by one.
+ */
+static void
+online_sources_lookup(int *rets, int first, struct artwork_ctx *ctx)
+{
+  struct worker_lookups *lookups;
+  struct online_lookup_arg *cmdargs[ONLINE_SEARCH_PARALLEL_MAX];
+  int lookup_rets[ONLINE_SEARCH_PARALLEL_MAX];
+  int idx[ONLINE_SEARCH_PARALLEL_MAX];
+  int n;
+  int i;
+
+  for (i = first, n = 0; artwork_item_source[i].handler && n < ONLINE_SEARCH_PARALLEL_MAX; i++)
+    {
+      if ((artwork_item_source[i].data_kinds & (1 << ctx->data_kind)) == 0)
+	continue;
+
+      if ((artwork_item_source[i].media_kinds & ctx->media_kind) == 0)
+	continue;
+
+      if (!artwork_item_source[i].is_online)
+	break;
+
+      idx[n++] = i;
+    }
+
+  // Nothing to gain from a lookup thread
+  if (n == 1)
+    {
+      rets[first] = artwork_item_source[first].handler(ctx);
+      return;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      CHECK_NULL(L_ART, cmdargs[i] = calloc(1, sizeof(struct online_lookup_arg)));
+      CHECK_NULL(L_ART, cmdargs[i]->evbuf = evbuffer_new());
+      cmdargs[i]->source_idx = idx[i];
+      cmdargs[i]->req_params = ctx->req_params;
+      cmdargs[i]->individual = ctx->individual;
+      cmdargs[i]->mfi.id = ctx->id;
+      cmdargs[i]->mfi.data_kind = ctx->data_kind;
+      cmdargs[i]->mfi.media_kind = ctx->media_kind;
+      cmdargs[i]->mfi.path = safe_strdup(ctx->mfi->path);
+      cmdargs[i]->mfi.artist = safe_strdup(ctx->mfi->artist);
+      cmdargs[i]->mfi.album = safe_strdup(ctx->mfi->album);
+    }
+
+  lookups = worker_lookups_run(online_lookup_cb, (void **)cmdargs, n, online_lookup_free, online_lookup_is_decided, ONLINE_SEARCH_DEADLINE, lookup_rets);
+
+  for (i = 0; i < n; i++)
+    {
+      if (lookup_rets[i] != WORKER_LOOKUP_PENDING)
+	{
+	  rets[idx[i]] = lookup_rets[i];
+	  continue;
+	}
+
+      DPRINTF(E_WARN, L_ART, "Source '%s' did not respond in time\n", artwork_item_source[idx[i]].name);
+      rets[idx[i]] = ART_E_ERROR;
+      ctx->online_incomplete = true;
+    }
+
+  // Only the arguments of lookups that finished may be used
+  for (i = 0; i < n; i++)
+    {
+      if (lookup_rets[i] == ART_E_ABORT)
+	break;
+      if (lookup_rets[i] > 0)
+	{
+	  evbuffer_add_buffer(ctx->evbuf, cmdargs[i]->evbuf);
+	  snprintf(ctx->path, sizeof(ctx->path), "%s", cmdargs[i]->path);
+	  break;
+	}
+    }
+
+  worker_lookups_free(lookups);
+}
+
+static void
+miss_dirs_clear(struct artwork_ctx *ctx)
+{
+  int i;
+
+  for (i = 0; i < ctx->miss_ndirs; i++)
+    free(ctx->miss_dirs[i]);
+
+  ctx->miss_ndirs = 0;
+}
+
+static void
+miss_dir_add(struct artwork_ctx *ctx, const char *path)
+{
+  char *ptr;
+  int i;
+
+  ptr = strrchr(path, '/');
+  if (!ptr || ctx->miss_ndirs < 0)
+    return;
+
+  for (i = 0; i < ctx->miss_ndirs; i++)
+    {
+      if (strncmp(ctx->miss_dirs[i], path, ptr - path) == 0 && ctx->miss_dirs[i][ptr - path] == '\0')
+	return;
+    }
+
+  if (ctx->miss_ndirs == ART_MISS_DIRS_MAX)
+    {
+      miss_dirs_clear(ctx);
+      ctx->miss_ndirs = -1;
+      return;
+    }
+
+  CHECK_NULL(L_ART, ctx->miss_dirs[ctx->miss_ndirs] = strndup(path, ptr - path));
+  ctx->miss_ndirs++;
+}
+
+// Records in the cache that no artwork was found, so that we don't search all
+// the sources again for every request. The sources that were skipped and the
+// directories searched are included, so the record can be invalidated.
+static void
+miss_add(struct artwork_ctx *ctx, int type, int64_t persistentid)
+{
+  int sources;
+  time_t ttl;
+
+  if (ctx->miss_ndirs < 0)
+    return;
+
+  // We don't know if the sources that timed out have artwork
+  if (ctx->online_incomplete)
+    return;
+
+  sources = CACHE_ARTWORK_MISS_LOCAL;
+  if (!ctx->online_skipped)
+    sources |= CACHE_ARTWORK_MISS_ONLINE;
+
+  ttl = ctx->online_tried ? ART_MISS_TTL_ONLINE : ART_MISS_TTL_LOCAL;
+
+  cache_artwork_miss_add(type, persistentid, sources, time(NULL) + ttl, (const char **)ctx->miss_dirs, ctx->miss_ndirs);
+}
+
 static int
 process_file_items(struct artwork_ctx *ctx, int item_mode)
 {
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
+  int online_rets[ARRAY_SIZE(artwork_item_source)];
   int i;
   int ret;
 
@@ -1931,25 +2146,30 @@ process_file_items(struct artwork_ctx *ctx, int item_mode)
       return -1;
     }
 
-  while ((ret = db_query_fetch_file(&dbmfi, &ctx->qp)) == 0)
+  while ((ret = db_query_fetch_mfi(&mfi, &ctx->qp)) == 0)
     {
       // Save the first songalbumid, might need it for process_group() if this search doesn't give anything
       if (!ctx->persistentid)
-	safe_atoi64(dbmfi.songalbumid, &ctx->persistentid);
+	ctx->persistentid = mfi.songalbumid;
 
       if (item_mode && !ctx->individual)
 	goto no_artwork;
 
-      ret = (safe_atoi32(dbmfi.id, &ctx->id) < 0) ||
-            (safe_atou32(dbmfi.data_kind, &ctx->data_kind) < 0) ||
-            (safe_atou32(dbmfi.media_kind, &ctx->media_kind) < 0) ||
-            (ctx->data_kind > 30);
-      if (ret)
+      ctx->id = mfi.id;
+      ctx->data_kind = mfi.data_kind;
+      ctx->media_kind = mfi.media_kind;
+      if (ctx->data_kind > 30)
 	{
-	  DPRINTF(E_LOG, L_ART, "Error converting dbmfi id, data_kind or media_kind to number for '%s'\n", dbmfi.path);
+	  DPRINTF(E_LOG, L_ART, "Invalid data_kind %" PRIu32 " for '%s'\n", ctx->data_kind, mfi.path);
 	  continue;
 	}
 
+      for (i = 0; i < ARRAY_SIZE(online_rets); i++)
+	online_rets[i] = ONLINE_SEARCH_NOT_QUERIED;
+
+      if (ctx->data_kind == DATA_KIND_FILE)
+	miss_dir_add(ctx, mfi.path);
+
       for (i = 0; artwork_item_source[i].handler; i++)
 	{
 	  if ((artwork_item_source[i].data_kinds & (1 << ctx->data_kind)) == 0)
@@ -1958,32 +2178,49 @@ process_file_items(struct artwork_ctx *ctx, int item_mode)
 	  if ((artwork_item_source[i].media_kinds & ctx->media_kind) == 0)
 	    continue;
 
+	  // A miss will be recorded as not covering the online sources
+	  if (ctx->local_only && artwork_item_source[i].is_online)
+	    {
+	      ctx->online_skipped = true;
+	      continue;
+	    }
+
 	  // If just one handler says we should not cache a negative result then we obey that
 	  if ((artwork_item_source[i].cache & ON_FAILURE) == 0)
 	    ctx->cache = NEVER;
 
 	  DPRINTF(E_SPAM, L_ART, "Checking item source '%s'\n", artwork_item_source[i].name);
 
-	  ctx->dbmfi = &dbmfi;
-	  ret = artwork_item_source[i].handler(ctx);
-	  ctx->dbmfi = NULL;
+	  ctx->mfi = &mfi;
+	  if (artwork_item_source[i].is_online)
+	    {
+	      ctx->online_tried = true;
+
+	      // Queries this and any following online sources in one go
+	      if (online_rets[i] == ONLINE_SEARCH_NOT_QUERIED)
+		online_sources_lookup(online_rets, i, ctx);
+	      ret = online_rets[i];
+	    }
+	  else
+	    ret = artwork_item_source[i].handler(ctx);
+	  ctx->mfi = NULL;
 
 	  if (ret > 0)
 	    {
-	      DPRINTF(E_DBG, L_ART, "Artwork for '%s' found in source '%s'\n", dbmfi.title, artwork_item_source[i].name);
+	      DPRINTF(E_DBG, L_ART, "Artwork for '%s' found in source '%s'\n", mfi.title, artwork_item_source[i].name);
 	      ctx->cache = artwork_item_source[i].cache;
 	      db_query_end(&ctx->qp);
 	      return ret;
 	    }
 	  else if (ret == ART_E_ABORT)
 	    {
-	      DPRINTF(E_DBG, L_ART, "Source '%s' stopped search for artwork for '%s'\n", artwork_item_source[i].name, dbmfi.title);
+	      DPRINTF(E_DBG, L_ART, "Source '%s' stopped search for artwork for '%s'\n", artwork_item_source[i].name, mfi.title);
 	      ctx->cache = NEVER;
 	      break;
 	    }
 	  else if (ret == ART_E_ERROR)
 	    {
-	      DPRINTF(E_LOG, L_ART, "Source '%s' returned an error for '%s'\n", artwork_item_source[i].name, dbmfi.title);
+	      DPRINTF(E_LOG, L_ART, "Source '%s' returned an error for '%s'\n", artwork_item_source[i].name, mfi.title);
 	      ctx->cache = NEVER;
 	    }
 	}
@@ -2103,6 +2340,178 @@ process_queue_item(struct artwork_ctx *ctx)
   return -1;
 }
 
+static int
+group_get(struct evbuffer *evbuf, int64_t persistentid, int max_w, int max_h, int format, bool local_only)
+{
+  struct artwork_ctx ctx = { 0 };
+  int ret;
+
+  ctx.persistentid = persistentid;
+  ctx.qp.type = Q_GROUP_ITEMS;
+  ctx.qp.persistentid = persistentid;
+  ctx.evbuf = evbuf;
+  ctx.req_params.max_w = max_w;
+  ctx.req_params.max_h = max_h;
+  ctx.req_params.format = format;
+  ctx.cache = ON_FAILURE;
+  ctx.individual = cfg_getbool(cfg_getsec(cfg, "library"), "artwork_individual");
+  ctx.local_only = local_only;
+
+  ret = process_group(&ctx);
+  if (ret > 0)
+    {
+      if (ctx.cache & ON_SUCCESS)
+	cache_artwork_add(CACHE_ARTWORK_GROUP, persistentid, max_w, max_h, format, ret, ctx.path, evbuf);
+
+      miss_dirs_clear(&ctx);
+      return ret;
+    }
+
+  DPRINTF(E_DBG, L_ART, "No artwork found for group %" PRIi64 "\n", persistentid);
+
+  if (ctx.cache & ON_FAILURE)
+    miss_add(&ctx, CACHE_ARTWORK_GROUP, persistentid);
+
+  miss_dirs_clear(&ctx);
+  return -1;
+}
+
+
+/* ------------------------------ PRERENDERING ----------------------------- */
+
+// Checks once if ffmpeg/libav can encode WebP
+static bool
+webp_is_supported(void)
+{
+  static int webp_supported = -1;
+  int supported;
+
+  supported = __atomic_load_n(&webp_supported, __ATOMIC_RELAXED);
+  if (supported < 0)
+    {
+      supported = transcode_encode_supported(XCODE_WEBP);
+      if (!supported)
+	DPRINTF(E_INFO, L_ART, "ffmpeg/libav has no WebP encoder, artwork will not be sent as WebP\n");
+
+      __atomic_store_n(&webp_supported, supported, __ATOMIC_RELAXED);
+    }
+
+  return supported;
+}
+
+/* After a library scan the album artwork is rendered into the cache in the
+ * sizes given by artwork_prerender_sizes, so that the first visit to an album
+ * grid doesn't have to decode and scale all the images. The job works through
+ * the albums in slices on a worker thread, and sleeps after each slice so that
+ * it only takes ART_PRERENDER_BUDGET_PCT of the time. Online sources are not
+ * used. If WebP can be encoded, the WebP variant that artwork_format_negotiate()
+ * gives to clients that accept it is rendered too.
+ */
+#define ART_PRERENDER_BUDGET_PCT 10
+#define ART_PRERENDER_SLICE_MS 500
+
+struct prerender_arg {
+  int requests;
+  int group_id;
+  int rendered;
+};
+
+// Number of prerender requests not yet served by a completed run
+static int prerender_requests;
+
+static int
+prerender_group(struct evbuffer *evbuf, int id)
+{
+  cfg_t *lib;
+  int64_t persistentid;
+  int formats[] = { 0, ART_FMT_WEBP };
+  int nformats;
+  int size;
+  int cached;
+  int rendered;
+  int i;
+  int j;
+  int ret;
+
+  ret = db_group_persistentid_byid(id, &persistentid);
+  if (ret < 0)
+    return 0;
+
+  lib = cfg_getsec(cfg, "library");
+  nformats = webp_is_supported() ? ARRAY_SIZE(formats) : 1;
+  rendered = 0;
+
+  for (i = 0; i < cfg_size(lib, "artwork_prerender_sizes"); i++)
+    {
+      size = cfg_getnint(lib, "artwork_prerender_sizes", i);
+      if (size <= 0)
+	continue;
+
+      for (j = 0; j < nformats; j++)
+	{
+	  ret = cache_artwork_exists(CACHE_ARTWORK_GROUP, persistentid, size, size, formats[j], &cached);
+	  if (ret < 0 || cached)
+	    continue;
+
+	  ret = group_get(evbuf, persistentid, size, size, formats[j], true);
+	  if (ret > 0)
+	    rendered++;
+
+	  evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+	}
+    }
+
+  return rendered;
+}
+
+static void
+prerender_cb(void *arg)
+{
+  struct prerender_arg *cmdarg = arg;
+  struct evbuffer *evbuf;
+  struct timespec start;
+  struct timespec now;
+  int elapsed_ms;
+  int delay;
+
+  CHECK_NULL(L_ART, evbuf = evbuffer_new());
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  elapsed_ms = 0;
+
+  while (elapsed_ms < ART_PRERENDER_SLICE_MS)
+    {
+      cmdarg->group_id = db_group_album_next_id(cmdarg->group_id);
+      if (cmdarg->group_id <= 0)
+	break;
+
+      cmdarg->rendered += prerender_group(evbuf, cmdarg->group_id);
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    }
+
+  evbuffer_free(evbuf);
+
+  delay = (elapsed_ms * (100 - ART_PRERENDER_BUDGET_PCT) / ART_PRERENDER_BUDGET_PCT + 999) / 1000;
+
+  if (cmdarg->group_id > 0)
+    {
+      worker_execute(prerender_cb, cmdarg, sizeof(struct prerender_arg), delay);
+      return;
+    }
+
+  DPRINTF(E_INFO, L_ART, "Artwork prerendering completed, %d images added to cache\n", cmdarg->rendered);
+
+  // More scans completed while we were running, so go again (mostly cache hits)
+  cmdarg->requests = __atomic_sub_fetch(&prerender_requests, cmdarg->requests, __ATOMIC_ACQ_REL);
+  if (cmdarg->requests > 0)
+    {
+      cmdarg->group_id = 0;
+      cmdarg->rendered = 0;
+      worker_execute(prerender_cb, cmdarg, sizeof(struct prerender_arg), delay);
+    }
+}
 
 /* ------------------------------ ARTWORK API ------------------------------ */
 
@@ -2140,11 +2549,25 @@ artwork_get_by_file_id(struct evbuffer *evbuf, int id, int max_w, int max_h, int
   if (ret > 0)
     {
       if (ctx.cache & ON_SUCCESS)
-	cache_artwork_add(CACHE_ARTWORK_INDIVIDUAL, id, max_w, max_h, ret, ctx.path, evbuf);
+	cache_artwork_add(CACHE_ARTWORK_INDIVIDUAL, id, max_w, max_h, format, ret, ctx.path, evbuf);
 
+      miss_dirs_clear(&ctx);
       return ret;
     }
 
+  if (ctx.individual && (ctx.cache & ON_FAILURE))
+    miss_add(&ctx, CACHE_ARTWORK_INDIVIDUAL, id);
+
+  miss_dirs_clear(&ctx);
+  ctx.online_tried = false;
+  ctx.online_skipped = false;
+  ctx.online_incomplete = false;
+
+  // A cached individual miss stopped the item search, that says nothing about
+  // whether a group miss may be cached
+  if (!ctx.individual)
+    ctx.cache = ON_FAILURE;
+
   ctx.qp.type = Q_GROUP_ITEMS;
   ctx.qp.persistentid = ctx.persistentid;
 
@@ -2152,59 +2575,38 @@ artwork_get_by_file_id(struct evbuffer *evbuf, int id, int max_w, int max_h, int
   if (ret > 0)
     {
       if (ctx.cache & ON_SUCCESS)
-	cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, ret, ctx.path, evbuf);
+	cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, format, ret, ctx.path, evbuf);
 
+      miss_dirs_clear(&ctx);
       return ret;
     }
 
   DPRINTF(E_DBG, L_ART, "No artwork found for item %d\n", id);
 
   if (ctx.cache & ON_FAILURE)
-    cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, 0, "", evbuf);
+    miss_add(&ctx, CACHE_ARTWORK_GROUP, ctx.persistentid);
 
+  miss_dirs_clear(&ctx);
   return -1;
 }
 
 int
 artwork_get_by_group_id(struct evbuffer *evbuf, int id, int max_w, int max_h, int format)
 {
-  struct artwork_ctx ctx = { 0 };
+  int64_t persistentid;
   int ret;
 
   DPRINTF(E_DBG, L_ART, "Artwork request for group %d (max_w=%d, max_h=%d)\n", id, max_w, max_h);
 
   /* Get the persistent id for the given group id */
-  ret = db_group_persistentid_byid(id, &ctx.persistentid);
+  ret = db_group_persistentid_byid(id, &persistentid);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_ART, "Error fetching persistent id for group id %d\n", id);
       return -1;
     }
 
-  ctx.qp.type = Q_GROUP_ITEMS;
-  ctx.qp.persistentid = ctx.persistentid;
-  ctx.evbuf = evbuf;
-  ctx.req_params.max_w = max_w;
-  ctx.req_params.max_h = max_h;
-  ctx.req_params.format = format;
-  ctx.cache = ON_FAILURE;
-  ctx.individual = cfg_getbool(cfg_getsec(cfg, "library"), "artwork_individual");
-
-  ret = process_group(&ctx);
-  if (ret > 0)
-    {
-      if (ctx.cache & ON_SUCCESS)
-	cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, ret, ctx.path, evbuf);
-
-      return ret;
-    }
-
-  DPRINTF(E_DBG, L_ART, "No artwork found for group %d\n", id);
-
-  if (ctx.cache & ON_FAILURE)
-    cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, 0, "", evbuf);
-
-  return -1;
+  return group_get(evbuf, persistentid, max_w, max_h, format, false);
 }
 
 int
@@ -2249,6 +2651,24 @@ artwork_get_by_queue_item_id(struct evbuffer *evbuf, int item_id, int max_w, int
   return -1;
 }
 
+void
+artwork_prerender_start(void)
+{
+  struct prerender_arg cmdarg = { 0 };
+
+  if (cfg_size(cfg_getsec(cfg, "library"), "artwork_prerender_sizes") == 0)
+    return;
+
+  // If a run is already in progress it will do another round when done
+  if (__atomic_fetch_add(&prerender_requests, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  DPRINTF(E_DBG, L_ART, "Starting artwork prerendering\n");
+
+  cmdarg.requests = 1;
+  worker_execute(prerender_cb, &cmdarg, sizeof(struct prerender_arg), 0);
+}
+
 /* Checks if the file is an artwork file */
 bool
 artwork_file_is_artwork(const char *filename)
@@ -2282,6 +2702,94 @@ artwork_file_is_artwork(const char *filename)
   return false;
 }
 
+/* Returns true if the Accept header explicitly lists mime with a non-zero q.
+ * Wildcard types don't count, since clients that send those can't be assumed
+ * to handle anything else than jpeg/png.
+ */
+static bool
+accept_has(const char *accept, const char *mime)
+{
+  const char *p;
+  const char *next;
+  const char *q;
+  size_t len;
+
+  len = strlen(mime);
+
+  for (p = accept; p; p = next)
+    {
+      next = strchr(p, ',');
+      if (next)
+	next++;
+
+      p += strspn(p, " \t");
+      if (strncasecmp(p, mime, len) != 0 || !strchr(",; \t", p[len]))
+	continue;
+
+      q = strstr(p + len, "q=");
+      if (q && (!next || q < next) && strtod(q + 2, NULL) == 0.0)
+	return false;
+
+      return true;
+    }
+
+  return false;
+}
+
+int
+artwork_format_negotiate(const char *accept)
+{
+  if (!accept || !accept_has(accept, "image/webp"))
+    return 0;
+
+  return webp_is_supported() ? ART_FMT_WEBP : 0;
+}
+
+int
+artwork_dir_file_rank(const char *dir, const char *filename)
+{
+  cfg_t *lib;
+  const char *dirname;
+  const char *ext;
+  size_t baselen;
+  int nbasenames;
+  int i;
+  int j;
+
+  ext = strrchr(filename, '.');
+  if (!ext || ext == filename)
+    return -1;
+
+  baselen = ext - filename;
+  ext++;
+
+  for (j = 0; j < ARRAY_SIZE(cover_extension); j++)
+    {
+      if (strcasecmp(ext, cover_extension[j]) == 0)
+	break;
+    }
+
+  if (j == ARRAY_SIZE(cover_extension))
+    return -1;
+
+  // The configured names in the configured order, then the directory name
+  lib = cfg_getsec(cfg, "library");
+  nbasenames = cfg_size(lib, "artwork_basenames");
+
+  for (i = 0; i < nbasenames; i++)
+    {
+      if (strlen(cfg_getnstr(lib, "artwork_basenames", i)) == baselen && strncasecmp(cfg_getnstr(lib, "artwork_basenames", i), filename, baselen) == 0)
+	return i * ARRAY_SIZE(cover_extension) + j;
+    }
+
+  dirname = strrchr(dir, '/');
+  dirname = dirname ? dirname + 1 : dir;
+  if (strlen(dirname) == baselen && strncasecmp(dirname, filename, baselen) == 0)
+    return nbasenames * ARRAY_SIZE(cover_extension) + j;
+
+  return -1;
+}
+
 bool
 artwork_extension_is_artwork(const char *path)
 {
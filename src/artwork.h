@@ -5,6 +5,7 @@
 #define ART_FMT_PNG     1
 #define ART_FMT_JPEG    2
 #define ART_FMT_VP8     3
+#define ART_FMT_WEBP    4
 
 #define ART_DEFAULT_HEIGHT 600
 #define ART_DEFAULT_WIDTH  600
@@ -52,6 +53,14 @@ artwork_get_by_group_id(struct evbuffer *evbuf, int id, int max_w, int max_h, in
 int
 artwork_get_by_queue_item_id(struct evbuffer *evbuf, int item_id, int max_w, int max_h, int format);
 
+/*
+ * Starts rendering album artwork in the sizes configured with
+ * artwork_prerender_sizes into the artwork cache. Runs in the background with a
+ * limited CPU budget. Does nothing if no sizes are configured.
+ */
+void
+artwork_prerender_start(void);
+
 /*
  * Checks if the file is an artwork file (based on user config)
  *
@@ -61,6 +70,31 @@ artwork_get_by_queue_item_id(struct evbuffer *evbuf, int item_id, int max_w, int
 bool
 artwork_file_is_artwork(const char *filename);
 
+/*
+ * Selects the format of artwork for a http client from its Accept header, so
+ * that clients that support it can get smaller thumbnails
+ *
+ * @in  accept   Value of the Accept header, may be NULL
+ * @return       ART_FMT_* to request, or 0 for default
+ */
+int
+artwork_format_negotiate(const char *accept);
+
+/*
+ * Checks if the file is a candidate for being the artwork of the directory it
+ * is in, which is the case for the configured artwork file names, and for an
+ * image with the same name as the directory. Names are compared without regard
+ * to case, so that e.g. Cover.JPG is found like it is on case-insensitive file
+ * systems. Since there can be several candidates they are ranked in order of
+ * preference.
+ *
+ * @in  dir      Path of the directory
+ * @in  filename Name of the file
+ * @return       Rank (0 is the preferred), or -1 if not a candidate
+ */
+int
+artwork_dir_file_rank(const char *dir, const char *filename);
+
 /*
  * Checks if the path (or URL) has file extension that is recognized as a
  * supported file type (e.g. ".jpg"). Also supports URL-encoded paths, e.g.
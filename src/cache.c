@@ -31,6 +31,7 @@
 #include <time.h>
 #include <string.h>
 #include <pthread.h>
+#include <sys/queue.h>
 
 #include <event2/event.h>
 #include <sqlite3.h>
@@ -64,10 +65,14 @@ struct cache_arg
   int64_t persistentid;
   int max_w;
   int max_h;
+  int req_format; // requested format, 0 for the format of the source
   int format;
   time_t mtime;
   int cached;
   int del;
+  int sources; // source classes tried for an artwork miss
+  const char **dirs;
+  int ndirs;
 
   struct evbuffer *evbuf;
 };
@@ -78,6 +83,9 @@ struct cachelist
   uint32_t ts;
 };
 
+#define CACHE_ARTWORK_MEM_STRIPES 16
+#define CACHE_ARTWORK_MEM_BUCKETS 64
+
 struct cache_db_def
 {
   const char *name;
@@ -93,6 +101,59 @@ struct cache_artwork_stash
   uint8_t *data;
 };
 
+struct cache_artwork_mem_entry
+{
+  int type;
+  int64_t persistentid;
+  int max_w;
+  int max_h;
+  int req_format;
+  int format;
+  char *path;
+  time_t timestamp; // Like db_timestamp in the artwork table
+  size_t size;
+  uint8_t *data;
+
+  struct cache_artwork_mem_entry *bucket_next;
+  struct cache_artwork_mem_entry *path_next;
+  TAILQ_ENTRY(cache_artwork_mem_entry) lru;
+};
+
+struct cache_artwork_mem_stripe
+{
+  pthread_mutex_t lck;
+  struct cache_artwork_mem_entry *buckets[CACHE_ARTWORK_MEM_BUCKETS];
+  struct cache_artwork_mem_entry *path_buckets[CACHE_ARTWORK_MEM_BUCKETS]; // Entries by path, see artwork_mem_expire()
+  TAILQ_HEAD(cache_artwork_mem_lru, cache_artwork_mem_entry) lru; // Most recently used first
+  size_t size;
+  struct cache_artwork_mem_stats stats;
+};
+
+struct cache_daap_job
+{
+  int query_id;
+  char *query;
+  char *ua;
+  int is_remote;
+  // In: version of the cached reply (0 if none), out: version of the new reply
+  int64_t version;
+
+  struct event *ev;
+  bool is_building;
+  bool is_failed;
+
+  struct evbuffer *gzbuf; // NULL if the reply didn't change
+};
+
+struct cache_daap_query
+{
+  int id;
+  char *query;
+  char *ua;
+  int is_remote;
+  int64_t version;
+};
+
 struct cache_xcode_job
 {
   const char *format;
@@ -130,9 +191,24 @@ static bool cache_is_suspended;
   }
 
 // DAAP cache
-#define CACHE_DAAP_VERSION 5
+#define CACHE_DAAP_VERSION 8
+#define CACHE_DAAP_NTHREADS 4
 static sqlite3 *cache_daap_hdl;
 static struct event *cache_daap_updateev;
+// Replies are rebuilt by worker threads, see cache_daap_update_cb()
+static struct cache_daap_job cache_daap_jobs[CACHE_DAAP_NTHREADS];
+// Number of jobs handed to a worker, the cache thread waits for it to be zero
+// before it exits
+static int cache_daap_nworking;
+static pthread_mutex_t cache_daap_working_lck = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_daap_working_cond = PTHREAD_COND_INITIALIZER;
+// Set if an update was requested or interrupted while suspended
+static bool cache_daap_update_pending;
+static struct cache_daap_query *cache_daap_queries;
+static int cache_daap_nqueries;
+static int cache_daap_next;
+static int cache_daap_nchanged;
+static bool cache_daap_update_again;
 // The user may configure a threshold (in msec), and queries slower than
 // that will have their reply cached
 static int cache_daap_threshold;
@@ -142,7 +218,8 @@ static struct cache_db_def cache_daap_db_def[] = {
     "replies",
     "CREATE TABLE IF NOT EXISTS replies ("
     "   id                 INTEGER PRIMARY KEY NOT NULL,"
-    "   query              VARCHAR(4096) NOT NULL,"
+    "   query              VARCHAR(4096) UNIQUE NOT NULL,"
+    "   version            INTEGER DEFAULT 0,"
     "   reply              BLOB"
     ");",
     "DROP TABLE IF EXISTS replies;",
@@ -159,17 +236,17 @@ static struct cache_db_def cache_daap_db_def[] = {
     ");",
     "DROP TABLE IF EXISTS queries;",
   },
-  {
-    "idx_query",
-    "CREATE INDEX IF NOT EXISTS idx_query ON replies (query);",
-    "DROP INDEX IF EXISTS idx_query;",
-  },
 };
 
 // Artwork cache
-#define CACHE_ARTWORK_VERSION 5
+#define CACHE_ARTWORK_VERSION 7
 static sqlite3 *cache_artwork_hdl;
 static struct cache_artwork_stash cache_stash;
+// In-memory tier of the artwork cache, which can be read without going through
+// the cache thread. Split in stripes with a lock and a share of the size each.
+static struct cache_artwork_mem_stripe cache_artwork_mem[CACHE_ARTWORK_MEM_STRIPES];
+static size_t cache_artwork_mem_stripe_max; // 0 if disabled
+static int cache_artwork_mem_nentries; // In all stripes
 static struct cache_db_def cache_artwork_db_def[] = {
   DB_DEF_ADMIN,
   {
@@ -180,6 +257,7 @@ static struct cache_db_def cache_artwork_db_def[] = {
     "   persistentid        INTEGER NOT NULL,"
     "   max_w               INTEGER NOT NULL,"
     "   max_h               INTEGER NOT NULL,"
+    "   req_format          INTEGER NOT NULL DEFAULT 0,"
     "   format              INTEGER NOT NULL,"
     "   filepath            VARCHAR(4096) NOT NULL,"
     "   db_timestamp        INTEGER DEFAULT 0,"
@@ -189,7 +267,7 @@ static struct cache_db_def cache_artwork_db_def[] = {
   },
   {
     "idx_persistentidwh",
-    "CREATE INDEX IF NOT EXISTS idx_persistentidwh ON artwork(type, persistentid, max_w, max_h);",
+    "CREATE INDEX IF NOT EXISTS idx_persistentidwh ON artwork(type, persistentid, max_w, max_h, req_format);",
     "DROP INDEX IF EXISTS idx_persistentidwh;",
   },
   {
@@ -197,6 +275,29 @@ static struct cache_db_def cache_artwork_db_def[] = {
     "CREATE INDEX IF NOT EXISTS idx_pathtime ON artwork(filepath, db_timestamp);",
     "DROP INDEX IF EXISTS idx_pathtime;",
   },
+  {
+    "artwork_misses",
+    "CREATE TABLE IF NOT EXISTS artwork_misses ("
+    "   id                  INTEGER PRIMARY KEY NOT NULL,"
+    "   type                INTEGER NOT NULL,"
+    "   persistentid        INTEGER NOT NULL,"
+    "   sources             INTEGER NOT NULL,"
+    "   dirpath             VARCHAR(4096) NOT NULL,"
+    "   db_timestamp        INTEGER NOT NULL,"
+    "   expires             INTEGER NOT NULL"
+    ");",
+    "DROP TABLE IF EXISTS artwork_misses;",
+  },
+  {
+    "idx_misses_persistentid",
+    "CREATE INDEX IF NOT EXISTS idx_misses_persistentid ON artwork_misses(type, persistentid);",
+    "DROP INDEX IF EXISTS idx_misses_persistentid;",
+  },
+  {
+    "idx_misses_dirpath",
+    "CREATE INDEX IF NOT EXISTS idx_misses_dirpath ON artwork_misses(dirpath, db_timestamp);",
+    "DROP INDEX IF EXISTS idx_misses_dirpath;",
+  },
 };
 
 // Transcoding cache
@@ -572,11 +673,12 @@ cache_open(void)
 }
 
 
-/* Adds the reply (stored in evbuf) to the cache */
+/* Adds the reply (stored in evbuf) to the cache, replacing the previous reply
+ * for the query, if any */
 static int
-cache_daap_reply_add(sqlite3 *hdl, const char *query, struct evbuffer *evbuf)
+cache_daap_reply_add(sqlite3 *hdl, const char *query, struct evbuffer *evbuf, int64_t version)
 {
-#define Q_TMPL "INSERT INTO replies (query, reply) VALUES (?, ?);"
+#define Q_TMPL "INSERT OR REPLACE INTO replies (query, version, reply) VALUES (?, ?, ?);"
   sqlite3_stmt *stmt;
   unsigned char *data;
   size_t datalen;
@@ -593,7 +695,8 @@ cache_daap_reply_add(sqlite3 *hdl, const char *query, struct evbuffer *evbuf)
     }
 
   sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
-  sqlite3_bind_blob(stmt, 2, data, datalen, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, version);
+  sqlite3_bind_blob(stmt, 3, data, datalen, SQLITE_STATIC);
 
   ret = sqlite3_step(stmt);
   if (ret != SQLITE_DONE)
@@ -793,82 +896,273 @@ cache_daap_query_delete(sqlite3 *hdl, const int id)
 #undef Q_TMPL
 }
 
-/* Here we actually update the cache by asking httpd_daap for responses
- * to the queries set for caching
- */
 static void
-cache_daap_update_cb(int fd, short what, void *arg)
+cache_daap_job_clear(struct cache_daap_job *job)
 {
-  sqlite3 *hdl = cache_daap_hdl;
-  sqlite3_stmt *stmt;
-  struct evbuffer *evbuf;
-  struct evbuffer *gzbuf;
-  char *errmsg;
-  char *query;
-  int ret;
+  if (job->gzbuf)
+    evbuffer_free(job->gzbuf);
+
+  // Can't just memset to zero, because *ev is persistent
+  job->query_id = 0;
+  job->query = NULL;
+  job->ua = NULL;
+  job->is_remote = 0;
+  job->version = 0;
+  job->is_building = false;
+  job->is_failed = false;
+  job->gzbuf = NULL;
+}
+
+static void
+cache_daap_queries_free(void)
+{
+  int i;
 
-  if (cache_is_suspended)
+  for (i = 0; i < cache_daap_nqueries; i++)
     {
-      DPRINTF(E_DBG, L_CACHE, "Got a request to update DAAP cache while suspended\n");
-      return;
+      free(cache_daap_queries[i].query);
+      free(cache_daap_queries[i].ua);
     }
 
-  DPRINTF(E_INFO, L_CACHE, "Beginning DAAP cache update\n");
+  free(cache_daap_queries);
+  cache_daap_queries = NULL;
+  cache_daap_nqueries = 0;
+  cache_daap_next = 0;
+}
+
+// Loads the queries to rebuild, with the version of their current reply
+static int
+cache_daap_queries_load(sqlite3 *hdl)
+{
+#define Q_COUNT "SELECT COUNT(*) FROM queries;"
+#define Q_TMPL "SELECT q.id, q.user_agent, q.is_remote, q.query, r.version FROM queries q LEFT JOIN replies r ON r.query = q.query;"
+  struct cache_daap_query *q;
+  sqlite3_stmt *stmt;
+  int count;
+  int ret;
 
-  ret = sqlite3_exec(hdl, "DELETE FROM replies;", NULL, NULL, &errmsg);
+  ret = sqlite3_prepare_v2(hdl, Q_COUNT, -1, &stmt, 0);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error clearing reply cache before update: %s\n", errmsg);
-      sqlite3_free(errmsg);
-      return;
+      DPRINTF(E_LOG, L_CACHE, "Error preparing for cache update: %s\n", sqlite3_errmsg(hdl));
+      return -1;
     }
 
-  ret = sqlite3_prepare_v2(hdl, "SELECT id, user_agent, is_remote, query FROM queries;", -1, &stmt, 0);
+  count = (sqlite3_step(stmt) == SQLITE_ROW) ? sqlite3_column_int(stmt, 0) : 0;
+  sqlite3_finalize(stmt);
+
+  if (count == 0)
+    return 0;
+
+  ret = sqlite3_prepare_v2(hdl, Q_TMPL, -1, &stmt, 0);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_CACHE, "Error preparing for cache update: %s\n", sqlite3_errmsg(hdl));
-      return;
+      return -1;
     }
 
-  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+  CHECK_NULL(L_CACHE, cache_daap_queries = calloc(count, sizeof(struct cache_daap_query)));
+
+  while (cache_daap_nqueries < count && (ret = sqlite3_step(stmt)) == SQLITE_ROW)
     {
-      query = strdup((char *)sqlite3_column_text(stmt, 3));
+      q = &cache_daap_queries[cache_daap_nqueries];
 
-      evbuf = daap_reply_build(query, (char *)sqlite3_column_text(stmt, 1), sqlite3_column_int(stmt, 2));
-      if (!evbuf)
-	{
-	  DPRINTF(E_LOG, L_CACHE, "Error building DAAP reply for query: %s\n", query);
-	  cache_daap_query_delete(hdl, sqlite3_column_int(stmt, 0));
-	  free(query);
+      q->id = sqlite3_column_int(stmt, 0);
+      q->ua = safe_strdup((char *)sqlite3_column_text(stmt, 1));
+      q->is_remote = sqlite3_column_int(stmt, 2);
+      q->query = strdup((char *)sqlite3_column_text(stmt, 3));
+      q->version = sqlite3_column_int64(stmt, 4);
+
+      cache_daap_nqueries++;
+    }
+
+  sqlite3_finalize(stmt);
+
+  return cache_daap_nqueries;
+#undef Q_TMPL
+#undef Q_COUNT
+}
+
+// Thread: worker
+static void
+cache_daap_worker(void *arg)
+{
+  struct cache_daap_job *job = *(struct cache_daap_job **)arg;
+  struct evbuffer *evbuf;
+  int64_t version;
+
+  evbuf = daap_reply_build(job->query, job->ua, job->is_remote);
+  if (!evbuf)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error building DAAP reply for query: %s\n", job->query);
+      job->is_failed = true;
+      goto out;
+    }
 
-	  continue;
+  // The version is a hash of the uncompressed reply, if it is the same as the
+  // cached reply's we skip compressing and saving it
+  version = (int64_t)murmur_hash64(evbuffer_pullup(evbuf, -1), evbuffer_get_length(evbuf), 0);
+  if (version != job->version)
+    {
+      job->gzbuf = httpd_gzip_deflate(evbuf);
+      if (!job->gzbuf)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Error gzipping DAAP reply for query: %s\n", job->query);
+	  job->is_failed = true;
 	}
+    }
+
+  job->version = version;
+  evbuffer_free(evbuf);
 
-      gzbuf = httpd_gzip_deflate(evbuf);
-      if (!gzbuf)
+ out:
+  // Tell the cache thread that we are done. Only the cache thread can save the
+  // result to the DB. After this the job must not be touched, since the cache
+  // thread may be exiting.
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&cache_daap_working_lck));
+  event_active(job->ev, 0, 0);
+  cache_daap_nworking--;
+  CHECK_ERR(L_CACHE, pthread_cond_signal(&cache_daap_working_cond));
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&cache_daap_working_lck));
+}
+
+// The update will be started by cache_daap_resume()
+static void
+cache_daap_update_postpone(void)
+{
+  struct timeval delay = { 10, 0 };
+
+  __atomic_store_n(&cache_daap_update_pending, true, __ATOMIC_SEQ_CST);
+
+  // Resumed in the meantime, so cache_daap_resume() may not have seen the flag
+  if (!__atomic_load_n(&cache_is_suspended, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&cache_daap_update_pending, false, __ATOMIC_SEQ_CST))
+    evtimer_add(cache_daap_updateev, &delay);
+}
+
+// Dispatches queries to free jobs, and finishes the update when all are done
+static void
+cache_daap_dispatch(void)
+{
+  struct cache_daap_job *job;
+  struct cache_daap_query *q;
+  bool is_building = false;
+  struct timeval delay = { 0, 0 };
+  char *errmsg;
+  int ret;
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(cache_daap_jobs); i++)
+    {
+      job = &cache_daap_jobs[i];
+      if (!job->is_building && !__atomic_load_n(&cache_is_suspended, __ATOMIC_SEQ_CST) && cache_daap_next < cache_daap_nqueries)
 	{
-	  DPRINTF(E_LOG, L_CACHE, "Error gzipping DAAP reply for query: %s\n", query);
-	  cache_daap_query_delete(hdl, sqlite3_column_int(stmt, 0));
-	  free(query);
-	  evbuffer_free(evbuf);
+	  q = &cache_daap_queries[cache_daap_next++];
+
+	  job->query_id = q->id;
+	  job->query = q->query;
+	  job->ua = q->ua;
+	  job->is_remote = q->is_remote;
+	  job->version = q->version;
+	  job->is_building = true;
 
-	  continue;
+	  CHECK_ERR(L_CACHE, pthread_mutex_lock(&cache_daap_working_lck));
+	  cache_daap_nworking++;
+	  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&cache_daap_working_lck));
+
+	  worker_execute(cache_daap_worker, &job, sizeof(struct cache_daap_job *), 0);
 	}
 
-      evbuffer_free(evbuf);
+      is_building |= job->is_building;
+    }
+
+  if (is_building)
+    return;
 
-      cache_daap_reply_add(hdl, query, gzbuf);
+  // We were suspended before all queries were dispatched. The remaining
+  // replies would be stale, so instead of finishing, the update is dropped and
+  // started over when the cache is resumed (see cache_daap_resume).
+  if (cache_daap_next < cache_daap_nqueries)
+    {
+      DPRINTF(E_DBG, L_CACHE, "DAAP cache update interrupted, will update again when resumed\n");
 
-      free(query);
-      evbuffer_free(gzbuf);
+      cache_daap_queries_free();
+      cache_daap_update_again = false;
+      cache_daap_update_postpone();
+      return;
     }
 
-  if (ret != SQLITE_DONE)
-    DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(hdl));
+  // Replies for queries that were removed from the list
+  ret = sqlite3_exec(cache_daap_hdl, "DELETE FROM replies WHERE query NOT IN (SELECT query FROM queries);", NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error cleaning up reply cache after update: %s\n", errmsg);
+      sqlite3_free(errmsg);
+    }
 
-  sqlite3_finalize(stmt);
+  DPRINTF(E_INFO, L_CACHE, "DAAP cache updated (%d of %d replies changed)\n", cache_daap_nchanged, cache_daap_nqueries);
+
+  cache_daap_queries_free();
 
-  DPRINTF(E_INFO, L_CACHE, "DAAP cache updated\n");
+  // The library changed again while we were updating
+  if (cache_daap_update_again)
+    {
+      cache_daap_update_again = false;
+      evtimer_add(cache_daap_updateev, &delay);
+    }
+}
+
+static void
+cache_daap_job_complete_cb(int fd, short what, void *arg)
+{
+  struct cache_daap_job *job = arg;
+
+  if (job->is_failed)
+    cache_daap_query_delete(cache_daap_hdl, job->query_id);
+  else if (job->gzbuf)
+    {
+      // Replaces the old reply in one statement, so clients never get a miss
+      cache_daap_reply_add(cache_daap_hdl, job->query, job->gzbuf, job->version);
+      cache_daap_nchanged++;
+    }
+
+  cache_daap_job_clear(job); // Makes the job available again
+  cache_daap_dispatch();
+}
+
+/* Here we actually update the cache by asking httpd_daap for responses
+ * to the queries set for caching. The replies are built by worker threads,
+ * and the current replies are served until they are replaced.
+ */
+static void
+cache_daap_update_cb(int fd, short what, void *arg)
+{
+  int ret;
+
+  if (__atomic_load_n(&cache_is_suspended, __ATOMIC_SEQ_CST))
+    {
+      DPRINTF(E_DBG, L_CACHE, "Got a request to update DAAP cache while suspended\n");
+      cache_daap_update_postpone();
+      return;
+    }
+
+  if (cache_daap_queries)
+    {
+      DPRINTF(E_DBG, L_CACHE, "DAAP cache update already running, will update again when done\n");
+      cache_daap_update_again = true;
+      return;
+    }
+
+  ret = cache_daap_queries_load(cache_daap_hdl);
+  if (ret <= 0)
+    {
+      cache_daap_queries_free();
+      return;
+    }
+
+  DPRINTF(E_INFO, L_CACHE, "Beginning DAAP cache update\n");
+
+  cache_daap_nchanged = 0;
+  cache_daap_dispatch();
 }
 
 
@@ -1305,6 +1599,17 @@ cache_database_update(void *arg, int *retval)
   return COMMAND_END;
 }
 
+static enum command_state
+cache_daap_update_resume(void *arg, int *retval)
+{
+  struct timeval delay_daap = { 10, 0 };
+
+  event_add(cache_daap_updateev, &delay_daap);
+
+  *retval = 0;
+  return COMMAND_END;
+}
+
 /* Callback from filescanner thread */
 static void
 cache_daap_listener_cb(short event_mask, void *ctx)
@@ -1327,9 +1632,11 @@ cache_artwork_ping_impl(void *arg, int *retval)
 {
 #define Q_TMPL_PING "UPDATE artwork SET db_timestamp = %" PRIi64 " WHERE filepath = '%q' AND db_timestamp >= %" PRIi64 ";"
 #define Q_TMPL_DEL "DELETE FROM artwork WHERE filepath = '%q' AND db_timestamp < %" PRIi64 ";"
+#define Q_TMPL_MISSES "DELETE FROM artwork_misses WHERE (type, persistentid) IN (SELECT type, persistentid FROM artwork_misses WHERE dirpath = '%.*q' AND db_timestamp < %" PRIi64 ");"
   struct cache_arg *cmdarg = arg;
   char *query;
   char *errmsg;
+  char *ptr;
   int ret;
 
   query = sqlite3_mprintf(Q_TMPL_PING, (int64_t)time(NULL), cmdarg->pathcopy, (int64_t)cmdarg->mtime);
@@ -1345,6 +1652,27 @@ cache_artwork_ping_impl(void *arg, int *retval)
       goto error_ping;
     }
 
+  // A recorded artwork miss for items in the same directory may no longer be
+  // valid if the file changed after it was recorded (e.g. artwork embedded by a
+  // tag editor). New files may have an older mtime than the miss, so those are
+  // handled by cache_artwork_miss_delete_by_dir().
+  ptr = strrchr(cmdarg->pathcopy, '/');
+  if (ptr)
+    {
+      query = sqlite3_mprintf(Q_TMPL_MISSES, (int)(ptr - cmdarg->pathcopy), cmdarg->pathcopy, (int64_t)cmdarg->mtime);
+
+      DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
+
+      ret = sqlite3_exec(cmdarg->hdl, query, NULL, NULL, &errmsg);
+      sqlite3_free(query);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+
+	  goto error_ping;
+	}
+    }
+
   if (cmdarg->del > 0)
     {
       query = sqlite3_mprintf(Q_TMPL_DEL, cmdarg->pathcopy, (int64_t)cmdarg->mtime);
@@ -1375,6 +1703,7 @@ cache_artwork_ping_impl(void *arg, int *retval)
   
 #undef Q_TMPL_PING
 #undef Q_TMPL_DEL
+#undef Q_TMPL_MISSES
 }
 
 /*
@@ -1425,6 +1754,7 @@ static enum command_state
 cache_artwork_purge_cruft_impl(void *arg, int *retval)
 {
 #define Q_TMPL "DELETE FROM artwork WHERE db_timestamp < %" PRIi64 ";"
+#define Q_TMPL_MISSES "DELETE FROM artwork_misses WHERE expires < %" PRIi64 ";"
 
   struct cache_arg *cmdarg = arg;
   char *query;
@@ -1448,10 +1778,27 @@ cache_artwork_purge_cruft_impl(void *arg, int *retval)
 
   DPRINTF(E_DBG, L_CACHE, "Purged %d rows\n", sqlite3_changes(cmdarg->hdl));
 
+  // Recorded misses are not pinged during scans, so they only go when expired
+  query = sqlite3_mprintf(Q_TMPL_MISSES, (int64_t)time(NULL));
+
+  DPRINTF(E_DBG, L_CACHE, "Running purge query '%s'\n", query);
+
+  ret = sqlite3_exec(cmdarg->hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
   *retval = 0;
   return COMMAND_END;
 
 #undef Q_TMPL
+#undef Q_TMPL_MISSES
 }
 
 /*
@@ -1460,6 +1807,7 @@ cache_artwork_purge_cruft_impl(void *arg, int *retval)
  * @param cmdarg->persistentid persistent songalbumid or songartistid
  * @param cmdarg->max_w maximum image width
  * @param cmdarg->max_h maximum image height
+ * @param cmdarg->req_format the format that was requested, 0 for default
  * @param cmdarg->format ART_FMT_PNG for png, ART_FMT_JPEG for jpeg or 0 if no artwork available
  * @param cmdarg->filename the full path to the artwork file (could be an jpg/png image or a media file with embedded artwork) or empty if no artwork available
  * @param cmdarg->evbuf event buffer containing the (scaled) image
@@ -1475,7 +1823,7 @@ cache_artwork_add_impl(void *arg, int *retval)
   int datalen;
   int ret;
 
-  query = "INSERT INTO artwork (id, persistentid, max_w, max_h, format, filepath, db_timestamp, data, type) VALUES (NULL, ?, ?, ?, ?, ?, ?, ?, ?);";
+  query = "INSERT INTO artwork (id, persistentid, max_w, max_h, format, filepath, db_timestamp, data, type, req_format) VALUES (NULL, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
 
   ret = sqlite3_prepare_v2(cmdarg->hdl, query, -1, &stmt, 0);
   if (ret != SQLITE_OK)
@@ -1496,6 +1844,7 @@ cache_artwork_add_impl(void *arg, int *retval)
   sqlite3_bind_int(stmt, 6, (uint64_t)time(NULL));
   sqlite3_bind_blob(stmt, 7, data, datalen, SQLITE_STATIC);
   sqlite3_bind_int(stmt, 8, cmdarg->type);
+  sqlite3_bind_int(stmt, 9, cmdarg->req_format);
 
   ret = sqlite3_step(stmt);
   if (ret != SQLITE_DONE)
@@ -1528,22 +1877,25 @@ cache_artwork_add_impl(void *arg, int *retval)
  * @param cmdarg->persistentid persistent itemid, songalbumid or songartistid
  * @param cmdarg->max_w maximum image width
  * @param cmdarg->max_h maximum image height
+ * @param cmdarg->req_format requested format, 0 for default
  * @param cmdarg->cached set by this function to 0 if no cache entry exists, otherwise 1
  * @param cmdarg->format set by this function to the format of the cache entry
  * @param cmdarg->evbuf event buffer filled by this function with the scaled image
+ * @param cmdarg->pathcopy set by this function to a copy of the path of the cache entry
+ * @param cmdarg->mtime set by this function to the cached timestamp of the cache entry
  * @return 0 if successful, -1 if an error occurred
  */
 static enum command_state
 cache_artwork_get_impl(void *arg, int *retval)
 {
-#define Q_TMPL "SELECT a.format, a.data FROM artwork a WHERE a.type = %d AND a.persistentid = %" PRIi64 " AND a.max_w = %d AND a.max_h = %d;"
+#define Q_TMPL "SELECT a.format, a.data, a.filepath, a.db_timestamp FROM artwork a WHERE a.type = %d AND a.persistentid = %" PRIi64 " AND a.max_w = %d AND a.max_h = %d AND a.req_format = %d;"
   struct cache_arg *cmdarg = arg;
   sqlite3_stmt *stmt;
   char *query;
   int datalen;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, cmdarg->type, cmdarg->persistentid, cmdarg->max_w, cmdarg->max_h);
+  query = sqlite3_mprintf(Q_TMPL, cmdarg->type, cmdarg->persistentid, cmdarg->max_w, cmdarg->max_h, cmdarg->req_format);
   if (!query)
     {
       DPRINTF(E_LOG, L_CACHE, "Out of memory for query string\n");
@@ -1598,6 +1950,8 @@ cache_artwork_get_impl(void *arg, int *retval)
     }
 
   cmdarg->cached = 1;
+  cmdarg->pathcopy = safe_strdup((char *)sqlite3_column_text(stmt, 2));
+  cmdarg->mtime = sqlite3_column_int64(stmt, 3);
 
   ret = sqlite3_finalize(stmt);
   if (ret != SQLITE_OK)
@@ -1619,56 +1973,254 @@ cache_artwork_get_impl(void *arg, int *retval)
 #undef Q_TMPL
 }
 
+/*
+ * Checks if there is a cache entry for the given persistentid and maximum
+ * width/height, without reading the image
+ *
+ * @param cmdarg->cached set by this function to 0 if no cache entry exists, otherwise 1
+ * @return 0 if successful, -1 if an error occurred
+ */
 static enum command_state
-cache_artwork_stash_impl(void *arg, int *retval)
+cache_artwork_exists_impl(void *arg, int *retval)
 {
+#define Q_TMPL "SELECT COUNT(*) FROM artwork a WHERE a.type = %d AND a.persistentid = %" PRIi64 " AND a.max_w = %d AND a.max_h = %d AND a.req_format = %d;"
   struct cache_arg *cmdarg = arg;
+  sqlite3_stmt *stmt;
+  char *query;
+  int ret;
 
-  // Clear current stash
-  if (cache_stash.path)
-    {
-      free(cache_stash.path);
-      free(cache_stash.data);
-      memset(&cache_stash, 0, sizeof(struct cache_artwork_stash));
-    }
-
-  // If called with no evbuf then we are done, we just needed to clear the stash
-  if (!cmdarg->evbuf)
+  query = sqlite3_mprintf(Q_TMPL, cmdarg->type, cmdarg->persistentid, cmdarg->max_w, cmdarg->max_h, cmdarg->req_format);
+  if (!query)
     {
-      *retval = 0;
+      DPRINTF(E_LOG, L_CACHE, "Out of memory for query string\n");
+      *retval = -1;
       return COMMAND_END;
     }
 
-  cache_stash.size = evbuffer_get_length(cmdarg->evbuf);
-  cache_stash.data = malloc(cache_stash.size);
-  if (!cache_stash.data)
+  ret = sqlite3_prepare_v2(cmdarg->hdl, query, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_CACHE, "Out of memory for artwork stash data\n");
+      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(cmdarg->hdl));
+      sqlite3_free(query);
       *retval = -1;
       return COMMAND_END;
     }
 
-  cache_stash.path = strdup(cmdarg->path);
-  if (!cache_stash.path)
+  ret = sqlite3_step(stmt);
+  if (ret != SQLITE_ROW)
     {
-      DPRINTF(E_LOG, L_CACHE, "Out of memory for artwork stash path\n");
-      free(cache_stash.data);
+      DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(cmdarg->hdl));
+      sqlite3_finalize(stmt);
+      sqlite3_free(query);
       *retval = -1;
       return COMMAND_END;
     }
 
-  cache_stash.format = cmdarg->format;
+  cmdarg->cached = (sqlite3_column_int(stmt, 0) > 0);
 
-  *retval = evbuffer_copyout(cmdarg->evbuf, cache_stash.data, cache_stash.size);
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+
+  *retval = 0;
   return COMMAND_END;
+#undef Q_TMPL
 }
 
+/*
+ * Records that no artwork was found for the given persistentid, replacing any
+ * previous record. One row is added per directory that the items are in.
+ *
+ * @param cmdarg->sources the source classes that were tried
+ * @param cmdarg->mtime expiry time of the record
+ * @param cmdarg->dirs directories of the items
+ * @return 0 if successful, -1 if an error occurred
+ */
 static enum command_state
-cache_artwork_read_impl(void *arg, int *retval)
+cache_artwork_miss_add_impl(void *arg, int *retval)
 {
+#define Q_TMPL_DEL "DELETE FROM artwork_misses WHERE type = %d AND persistentid = %" PRIi64 ";"
+#define Q_TMPL_INS "INSERT INTO artwork_misses (id, type, persistentid, sources, dirpath, db_timestamp, expires) VALUES (NULL, %d, %" PRIi64 ", %d, '%q', %" PRIi64 ", %" PRIi64 ");"
   struct cache_arg *cmdarg = arg;
+  char *query;
+  char *errmsg;
+  time_t now;
+  int ret;
+  int i;
 
-  cmdarg->format = 0;
+  now = time(NULL);
+
+  sqlite3_exec(cmdarg->hdl, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+
+  query = sqlite3_mprintf(Q_TMPL_DEL, cmdarg->type, cmdarg->persistentid);
+  ret = sqlite3_exec(cmdarg->hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+
+  // With no directories (e.g. only streams) we still want a row for the lookup
+  for (i = 0; ret == SQLITE_OK && i < (cmdarg->ndirs > 0 ? cmdarg->ndirs : 1); i++)
+    {
+      query = sqlite3_mprintf(Q_TMPL_INS, cmdarg->type, cmdarg->persistentid, cmdarg->sources,
+			      cmdarg->ndirs > 0 ? cmdarg->dirs[i] : "", (int64_t)now, (int64_t)cmdarg->mtime);
+      ret = sqlite3_exec(cmdarg->hdl, query, NULL, NULL, &errmsg);
+      sqlite3_free(query);
+    }
+
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error recording artwork miss: %s\n", errmsg);
+      sqlite3_free(errmsg);
+      sqlite3_exec(cmdarg->hdl, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  sqlite3_exec(cmdarg->hdl, "COMMIT TRANSACTION;", NULL, NULL, NULL);
+
+  *retval = 0;
+  return COMMAND_END;
+#undef Q_TMPL_DEL
+#undef Q_TMPL_INS
+}
+
+/*
+ * Checks if there is an unexpired record of no artwork found for the given
+ * persistentid, where at least the given source classes were tried
+ *
+ * @param cmdarg->sources the source classes that must have been tried
+ * @param cmdarg->cached set by this function to 0 if no record exists, otherwise 1
+ * @return 0 if successful, -1 if an error occurred
+ */
+/*
+ * Removes the artwork misses of all items in the given directory
+ *
+ * @param cmdarg->pathcopy the directory
+ * @return 0 if successful, -1 if an error occurred
+ */
+static enum command_state
+cache_artwork_miss_delete_by_dir_impl(void *arg, int *retval)
+{
+#define Q_TMPL "DELETE FROM artwork_misses WHERE (type, persistentid) IN (SELECT type, persistentid FROM artwork_misses WHERE dirpath = '%q');"
+  struct cache_arg *cmdarg = arg;
+  char *query;
+  char *errmsg;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, cmdarg->pathcopy);
+
+  DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
+
+  ret = sqlite3_exec(cmdarg->hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  free(cmdarg->pathcopy);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  *retval = 0;
+  return COMMAND_END;
+#undef Q_TMPL
+}
+
+static enum command_state
+cache_artwork_miss_get_impl(void *arg, int *retval)
+{
+#define Q_TMPL "SELECT COUNT(*) FROM artwork_misses WHERE type = %d AND persistentid = %" PRIi64 " AND (sources & %d) = %d AND expires > %" PRIi64 ";"
+  struct cache_arg *cmdarg = arg;
+  sqlite3_stmt *stmt;
+  char *query;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, cmdarg->type, cmdarg->persistentid, cmdarg->sources, cmdarg->sources, (int64_t)time(NULL));
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory for query string\n");
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  ret = sqlite3_prepare_v2(cmdarg->hdl, query, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(cmdarg->hdl));
+      sqlite3_free(query);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  ret = sqlite3_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(cmdarg->hdl));
+      sqlite3_finalize(stmt);
+      sqlite3_free(query);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  cmdarg->cached = (sqlite3_column_int(stmt, 0) > 0);
+
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+
+  *retval = 0;
+  return COMMAND_END;
+#undef Q_TMPL
+}
+
+static enum command_state
+cache_artwork_stash_impl(void *arg, int *retval)
+{
+  struct cache_arg *cmdarg = arg;
+
+  // Clear current stash
+  if (cache_stash.path)
+    {
+      free(cache_stash.path);
+      free(cache_stash.data);
+      memset(&cache_stash, 0, sizeof(struct cache_artwork_stash));
+    }
+
+  // If called with no evbuf then we are done, we just needed to clear the stash
+  if (!cmdarg->evbuf)
+    {
+      *retval = 0;
+      return COMMAND_END;
+    }
+
+  cache_stash.size = evbuffer_get_length(cmdarg->evbuf);
+  cache_stash.data = malloc(cache_stash.size);
+  if (!cache_stash.data)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory for artwork stash data\n");
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  cache_stash.path = strdup(cmdarg->path);
+  if (!cache_stash.path)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory for artwork stash path\n");
+      free(cache_stash.data);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  cache_stash.format = cmdarg->format;
+
+  *retval = evbuffer_copyout(cmdarg->evbuf, cache_stash.data, cache_stash.size);
+  return COMMAND_END;
+}
+
+static enum command_state
+cache_artwork_read_impl(void *arg, int *retval)
+{
+  struct cache_arg *cmdarg = arg;
+
+  cmdarg->format = 0;
 
   if (!cache_stash.path || !cache_stash.data || (strcmp(cache_stash.path, cmdarg->path) != 0))
     {
@@ -1711,6 +2263,8 @@ cache(void *arg)
     }
 
   CHECK_NULL(L_CACHE, cache_daap_updateev = evtimer_new(evbase_cache, cache_daap_update_cb, NULL));
+  for (i = 0; i < ARRAY_SIZE(cache_daap_jobs); i++)
+    CHECK_NULL(L_CACHE, cache_daap_jobs[i].ev = evtimer_new(evbase_cache, cache_daap_job_complete_cb, &cache_daap_jobs[i]));
   CHECK_NULL(L_CACHE, cache_xcode_updateev = evtimer_new(evbase_cache, cache_xcode_update_cb, NULL));
   CHECK_NULL(L_CACHE, cache_xcode_prepareev = evtimer_new(evbase_cache, cache_xcode_prepare_cb, NULL));
   CHECK_ERR(L_CACHE, event_priority_set(cache_xcode_prepareev, 0));
@@ -1731,11 +2285,20 @@ cache(void *arg)
 
   listener_remove(cache_daap_listener_cb);
 
+  // Workers may still be building replies with the queries we are about to free
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&cache_daap_working_lck));
+  while (cache_daap_nworking > 0)
+    CHECK_ERR(L_CACHE, pthread_cond_wait(&cache_daap_working_cond, &cache_daap_working_lck));
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&cache_daap_working_lck));
+
   for (i = 0; i < ARRAY_SIZE(cache_xcode_jobs); i++)
     event_free(cache_xcode_jobs[i].ev);
   event_free(cache_xcode_prepareev);
   event_free(cache_xcode_updateev);
+  for (i = 0; i < ARRAY_SIZE(cache_daap_jobs); i++)
+    event_free(cache_daap_jobs[i].ev);
   event_free(cache_daap_updateev);
+  cache_daap_queries_free();
 
   db_perthread_deinit();
 
@@ -1757,13 +2320,20 @@ cache(void *arg)
 void
 cache_daap_suspend(void)
 {
-  cache_is_suspended = 1;
+  __atomic_store_n(&cache_is_suspended, true, __ATOMIC_SEQ_CST);
 }
 
 void
 cache_daap_resume(void)
 {
-  cache_is_suspended = 0;
+  __atomic_store_n(&cache_is_suspended, false, __ATOMIC_SEQ_CST);
+
+  if (!cache_is_initialized)
+    return;
+
+  // An update was requested or interrupted while we were suspended
+  if (__atomic_exchange_n(&cache_daap_update_pending, false, __ATOMIC_SEQ_CST))
+    commands_exec_async(cmdbase, cache_daap_update_resume, NULL);
 }
 
 int
@@ -1845,6 +2415,255 @@ cache_xcode_toggle(bool enable)
 }
 
 
+/* ------------------------- In-memory artwork cache ------------------------ */
+/*                                 Thread: any                                */
+
+static struct cache_artwork_mem_stripe *
+artwork_mem_stripe(uint32_t *bucket, int type, int64_t persistentid, int max_w, int max_h, int req_format)
+{
+  int64_t key[5] = { type, persistentid, max_w, max_h, req_format };
+  uint64_t hash;
+
+  hash = murmur_hash64(key, sizeof(key), 0);
+
+  *bucket = (hash >> 32) % CACHE_ARTWORK_MEM_BUCKETS;
+  return &cache_artwork_mem[hash % CACHE_ARTWORK_MEM_STRIPES];
+}
+
+// Must be called with the stripe lock held
+static struct cache_artwork_mem_entry **
+artwork_mem_find(struct cache_artwork_mem_stripe *stripe, uint32_t bucket, int type, int64_t persistentid, int max_w, int max_h, int req_format)
+{
+  struct cache_artwork_mem_entry **e;
+
+  for (e = &stripe->buckets[bucket]; *e; e = &(*e)->bucket_next)
+    {
+      if ((*e)->persistentid == persistentid && (*e)->type == type && (*e)->max_w == max_w && (*e)->max_h == max_h && (*e)->req_format == req_format)
+	return e;
+    }
+
+  return NULL;
+}
+
+static uint32_t
+artwork_mem_path_bucket(const char *path)
+{
+  return murmur_hash64(path, strlen(path), 0) % CACHE_ARTWORK_MEM_BUCKETS;
+}
+
+// Must be called with the stripe lock held
+static void
+artwork_mem_remove(struct cache_artwork_mem_stripe *stripe, struct cache_artwork_mem_entry *entry)
+{
+  struct cache_artwork_mem_entry **e;
+  uint32_t bucket;
+
+  artwork_mem_stripe(&bucket, entry->type, entry->persistentid, entry->max_w, entry->max_h, entry->req_format);
+
+  e = artwork_mem_find(stripe, bucket, entry->type, entry->persistentid, entry->max_w, entry->max_h, entry->req_format);
+  if (e)
+    *e = entry->bucket_next;
+
+  if (entry->path)
+    {
+      for (e = &stripe->path_buckets[artwork_mem_path_bucket(entry->path)]; *e && *e != entry; e = &(*e)->path_next)
+	;
+      if (*e)
+	*e = entry->path_next;
+    }
+
+  __atomic_sub_fetch(&cache_artwork_mem_nentries, 1, __ATOMIC_RELAXED);
+
+  TAILQ_REMOVE(&stripe->lru, entry, lru);
+  stripe->size -= entry->size;
+  stripe->stats.entries--;
+
+  free(entry->path);
+  free(entry->data);
+  free(entry);
+}
+
+static int
+artwork_mem_get(int type, int64_t persistentid, int max_w, int max_h, int req_format, int *format, struct evbuffer *evbuf)
+{
+  struct cache_artwork_mem_stripe *stripe;
+  struct cache_artwork_mem_entry **e;
+  uint32_t bucket;
+  int ret;
+
+  if (cache_artwork_mem_stripe_max == 0)
+    return -1;
+
+  stripe = artwork_mem_stripe(&bucket, type, persistentid, max_w, max_h, req_format);
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&stripe->lck));
+
+  e = artwork_mem_find(stripe, bucket, type, persistentid, max_w, max_h, req_format);
+  if (!e)
+    {
+      stripe->stats.misses++;
+      CHECK_ERR(L_CACHE, pthread_mutex_unlock(&stripe->lck));
+      return -1;
+    }
+
+  TAILQ_REMOVE(&stripe->lru, *e, lru);
+  TAILQ_INSERT_HEAD(&stripe->lru, *e, lru);
+
+  *format = (*e)->format;
+  ret = (*e)->size ? evbuffer_add(evbuf, (*e)->data, (*e)->size) : 0;
+  stripe->stats.hits++;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&stripe->lck));
+
+  return ret;
+}
+
+static void
+artwork_mem_add(int type, int64_t persistentid, int max_w, int max_h, int req_format, int format, const char *path, time_t timestamp, struct evbuffer *evbuf)
+{
+  struct cache_artwork_mem_stripe *stripe;
+  struct cache_artwork_mem_entry *entry;
+  struct cache_artwork_mem_entry **e;
+  uint32_t bucket;
+  size_t size;
+
+  size = evbuffer_get_length(evbuf);
+
+  // Don't let a single image take more than a quarter of a stripe
+  if (cache_artwork_mem_stripe_max == 0 || size > cache_artwork_mem_stripe_max / 4)
+    return;
+
+  CHECK_NULL(L_CACHE, entry = calloc(1, sizeof(struct cache_artwork_mem_entry)));
+  entry->type = type;
+  entry->persistentid = persistentid;
+  entry->max_w = max_w;
+  entry->max_h = max_h;
+  entry->req_format = req_format;
+  entry->format = format;
+  entry->path = safe_strdup(path);
+  entry->timestamp = timestamp;
+  entry->size = size;
+  if (size > 0)
+    {
+      CHECK_NULL(L_CACHE, entry->data = malloc(size));
+      evbuffer_copyout(evbuf, entry->data, size);
+    }
+
+  stripe = artwork_mem_stripe(&bucket, type, persistentid, max_w, max_h, req_format);
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&stripe->lck));
+
+  e = artwork_mem_find(stripe, bucket, type, persistentid, max_w, max_h, req_format);
+  if (e)
+    artwork_mem_remove(stripe, *e);
+
+  while (stripe->size + size > cache_artwork_mem_stripe_max && !TAILQ_EMPTY(&stripe->lru))
+    {
+      artwork_mem_remove(stripe, TAILQ_LAST(&stripe->lru, cache_artwork_mem_lru));
+      stripe->stats.evictions++;
+    }
+
+  entry->bucket_next = stripe->buckets[bucket];
+  stripe->buckets[bucket] = entry;
+  if (entry->path)
+    {
+      bucket = artwork_mem_path_bucket(entry->path);
+      entry->path_next = stripe->path_buckets[bucket];
+      stripe->path_buckets[bucket] = entry;
+    }
+  TAILQ_INSERT_HEAD(&stripe->lru, entry, lru);
+  __atomic_add_fetch(&cache_artwork_mem_nentries, 1, __ATOMIC_RELAXED);
+  stripe->size += size;
+  stripe->stats.entries++;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&stripe->lck));
+}
+
+// Mirrors the changes that cache_artwork_ping_impl(), cache_artwork_delete_by_path_impl()
+// and cache_artwork_purge_cruft_impl() make to the artwork table: entries for
+// path that are older than mtime are removed if del is set, the others get
+// their timestamp updated. If path is NULL entries are removed by timestamp.
+// Since the filescanner pings every file it sees, entries are found by path
+// through the path index of each stripe, and not by going through all of them.
+static void
+artwork_mem_expire(const char *path, time_t mtime, bool del)
+{
+  struct cache_artwork_mem_stripe *stripe;
+  struct cache_artwork_mem_entry *entry;
+  struct cache_artwork_mem_entry *next;
+  uint32_t path_bucket = 0;
+  time_t now;
+  int i;
+
+  if (cache_artwork_mem_stripe_max == 0 || __atomic_load_n(&cache_artwork_mem_nentries, __ATOMIC_RELAXED) == 0)
+    return;
+
+  if (path)
+    path_bucket = artwork_mem_path_bucket(path);
+
+  now = time(NULL);
+
+  for (i = 0; i < CACHE_ARTWORK_MEM_STRIPES; i++)
+    {
+      stripe = &cache_artwork_mem[i];
+
+      CHECK_ERR(L_CACHE, pthread_mutex_lock(&stripe->lck));
+
+      entry = path ? stripe->path_buckets[path_bucket] : TAILQ_FIRST(&stripe->lru);
+      for (; entry; entry = next)
+	{
+	  next = path ? entry->path_next : TAILQ_NEXT(entry, lru);
+
+	  if (path && strcmp(entry->path, path) != 0)
+	    continue;
+
+	  if (entry->timestamp < mtime)
+	    {
+	      if (del)
+		artwork_mem_remove(stripe, entry);
+	    }
+	  else if (path)
+	    entry->timestamp = now;
+	}
+
+      CHECK_ERR(L_CACHE, pthread_mutex_unlock(&stripe->lck));
+    }
+}
+
+static void
+artwork_mem_init(void)
+{
+  int i;
+
+  cache_artwork_mem_stripe_max = (size_t)cfg_getint(cfg_getsec(cfg, "general"), "cache_artwork_memory_size") * 1024 * 1024 / CACHE_ARTWORK_MEM_STRIPES;
+
+  for (i = 0; i < CACHE_ARTWORK_MEM_STRIPES; i++)
+    {
+      CHECK_ERR(L_CACHE, mutex_init(&cache_artwork_mem[i].lck));
+      TAILQ_INIT(&cache_artwork_mem[i].lru);
+    }
+}
+
+static void
+artwork_mem_deinit(void)
+{
+  struct cache_artwork_mem_stripe *stripe;
+  int i;
+
+  for (i = 0; i < CACHE_ARTWORK_MEM_STRIPES; i++)
+    {
+      stripe = &cache_artwork_mem[i];
+
+      while (!TAILQ_EMPTY(&stripe->lru))
+	artwork_mem_remove(stripe, TAILQ_FIRST(&stripe->lru));
+
+      CHECK_ERR(L_CACHE, pthread_mutex_destroy(&stripe->lck));
+    }
+
+  cache_artwork_mem_stripe_max = 0;
+}
+
+
 /* ---------------------------- Artwork cache API  -------------------------- */
 
 /*
@@ -1854,6 +2673,9 @@ cache_xcode_toggle(bool enable)
  * If the parameter "del" is greater than 0, all cache entries for the given path are deleted, if the file was
  * modified after the cached timestamp.
  *
+ * Recorded artwork misses for items in the same directory are deleted if the file was modified after the miss was
+ * recorded.
+ *
  * @param path the full path to the artwork file (could be an jpg/png image or a media file with embedded artwork)
  * @param mtime modified timestamp of the artwork file
  * @param del if > 0 cached entries for the given path are deleted if the cached timestamp (db_timestamp) is older than mtime
@@ -1879,6 +2701,8 @@ cache_artwork_ping(const char *path, time_t mtime, int del)
   cmdarg->mtime = mtime;
   cmdarg->del = del;
 
+  artwork_mem_expire(path, mtime, (del > 0));
+
   commands_exec_async(cmdbase, cache_artwork_ping_impl, cmdarg);
 }
 
@@ -1899,6 +2723,9 @@ cache_artwork_delete_by_path(const char *path)
   cmdarg.hdl = cache_artwork_hdl;
   cmdarg.path = path;
 
+  // All entries have a timestamp before now + 1
+  artwork_mem_expire(path, time(NULL) + 1, true);
+
   return commands_exec_sync(cmdbase, cache_artwork_delete_by_path_impl, NULL, &cmdarg);
 }
 
@@ -1919,6 +2746,8 @@ cache_artwork_purge_cruft(time_t ref)
   cmdarg.hdl = cache_artwork_hdl;
   cmdarg.mtime = ref;
 
+  artwork_mem_expire(NULL, ref, true);
+
   return commands_exec_sync(cmdbase, cache_artwork_purge_cruft_impl, NULL, &cmdarg);
 }
 
@@ -1929,15 +2758,17 @@ cache_artwork_purge_cruft(time_t ref)
  * @param persistentid persistent itemid, songalbumid or songartistid
  * @param max_w maximum image width
  * @param max_h maximum image height
+ * @param req_format the format that was requested, 0 for default
  * @param format ART_FMT_PNG for png, ART_FMT_JPEG for jpeg or 0 if no artwork available
  * @param filename the full path to the artwork file (could be an jpg/png image or a media file with embedded artwork) or empty if no artwork available
  * @param evbuf event buffer containing the (scaled) image
  * @return 0 if successful, -1 if an error occurred
  */
 int
-cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int format, char *filename, struct evbuffer *evbuf)
+cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int req_format, int format, char *filename, struct evbuffer *evbuf)
 {
   struct cache_arg cmdarg;
+  int ret;
 
   if (!cache_is_initialized)
     return -1;
@@ -1947,11 +2778,19 @@ cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int form
   cmdarg.persistentid = persistentid;
   cmdarg.max_w = max_w;
   cmdarg.max_h = max_h;
+  cmdarg.req_format = req_format;
   cmdarg.format = format;
   cmdarg.path = filename;
   cmdarg.evbuf = evbuf;
 
-  return commands_exec_sync(cmdbase, cache_artwork_add_impl, NULL, &cmdarg);
+  ret = commands_exec_sync(cmdbase, cache_artwork_add_impl, NULL, &cmdarg);
+  if (ret < 0)
+    return -1;
+
+  // Only now, so that the memory tier doesn't have entries the db doesn't have
+  artwork_mem_add(type, persistentid, max_w, max_h, req_format, format, filename, time(NULL), evbuf);
+
+  return 0;
 }
 
 /*
@@ -1963,13 +2802,14 @@ cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int form
  * @param persistentid persistent songalbumid or songartistid
  * @param max_w maximum image width
  * @param max_h maximum image height
+ * @param req_format requested format, 0 for default
  * @param cached set by this function to 0 if no cache entry exists, otherwise 1
  * @param format set by this function to the format of the cache entry
  * @param evbuf event buffer filled by this function with the scaled image
  * @return 0 if successful, -1 if an error occurred
  */
 int
-cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int *cached, int *format, struct evbuffer *evbuf)
+cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int req_format, int *cached, int *format, struct evbuffer *evbuf)
 {
   struct cache_arg cmdarg;
   int ret;
@@ -1981,18 +2821,164 @@ cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int *cac
       return 0;
     }
 
+  // Only the cache thread can read the db, but the memory tier can be read here
+  ret = artwork_mem_get(type, persistentid, max_w, max_h, req_format, format, evbuf);
+  if (ret == 0)
+    {
+      *cached = 1;
+      return 0;
+    }
+
   cmdarg.hdl = cache_artwork_hdl;
   cmdarg.type = type;
   cmdarg.persistentid = persistentid;
   cmdarg.max_w = max_w;
   cmdarg.max_h = max_h;
+  cmdarg.req_format = req_format;
   cmdarg.evbuf = evbuf;
+  cmdarg.pathcopy = NULL;
 
   ret = commands_exec_sync(cmdbase, cache_artwork_get_impl, NULL, &cmdarg);
 
   *format = cmdarg.format;
   *cached = cmdarg.cached;
 
+  if (ret == 0 && cmdarg.cached)
+    artwork_mem_add(type, persistentid, max_w, max_h, req_format, cmdarg.format, cmdarg.pathcopy, cmdarg.mtime, evbuf);
+
+  free(cmdarg.pathcopy);
+
+  return ret;
+}
+
+/*
+ * Check if there is a cached artwork image for the given persistentid and
+ * maximum width/height (a cached negative result also counts)
+ *
+ * @param persistentid persistent songalbumid or songartistid
+ * @param max_w maximum image width
+ * @param max_h maximum image height
+ * @param req_format requested format, 0 for default
+ * @param cached set by this function to 0 if no cache entry exists, otherwise 1
+ * @return 0 if successful, -1 if an error occurred
+ */
+int
+cache_artwork_exists(int type, int64_t persistentid, int max_w, int max_h, int req_format, int *cached)
+{
+  struct cache_arg cmdarg;
+  int ret;
+
+  *cached = 0;
+
+  if (!cache_is_initialized)
+    return 0;
+
+  cmdarg.hdl = cache_artwork_hdl;
+  cmdarg.type = type;
+  cmdarg.persistentid = persistentid;
+  cmdarg.max_w = max_w;
+  cmdarg.max_h = max_h;
+  cmdarg.req_format = req_format;
+  cmdarg.cached = 0;
+
+  ret = commands_exec_sync(cmdbase, cache_artwork_exists_impl, NULL, &cmdarg);
+
+  *cached = cmdarg.cached;
+
+  return ret;
+}
+
+/*
+ * Record that no artwork could be found for the given persistentid. The record
+ * is removed by cache_artwork_ping() if a file in one of the directories
+ * changes, by cache_artwork_miss_delete_by_dir() if a file is added to one of
+ * them, or when it expires.
+ *
+ * @param type individual or group artwork
+ * @param persistentid persistent itemid, songalbumid or songartistid
+ * @param sources CACHE_ARTWORK_MISS_* source classes that were tried
+ * @param expires time when the record expires
+ * @param dirs directories of the items that were searched
+ * @param ndirs number of directories
+ * @return 0 if successful, -1 if an error occurred
+ */
+int
+cache_artwork_miss_add(int type, int64_t persistentid, int sources, time_t expires, const char **dirs, int ndirs)
+{
+  struct cache_arg cmdarg;
+
+  if (!cache_is_initialized)
+    return -1;
+
+  cmdarg.hdl = cache_artwork_hdl;
+  cmdarg.type = type;
+  cmdarg.persistentid = persistentid;
+  cmdarg.sources = sources;
+  cmdarg.mtime = expires;
+  cmdarg.dirs = dirs;
+  cmdarg.ndirs = ndirs;
+
+  return commands_exec_sync(cmdbase, cache_artwork_miss_add_impl, NULL, &cmdarg);
+}
+
+/*
+ * Removes the records of no artwork found for items in the given directory,
+ * e.g. because a cover file was added. This doesn't depend on the mtime of the
+ * new file, since copies made with cp -p, rsync -a or unzip keep the original.
+ *
+ * @param dir the directory
+ */
+void
+cache_artwork_miss_delete_by_dir(const char *dir)
+{
+  struct cache_arg *cmdarg;
+
+  if (!cache_is_initialized)
+    return;
+
+  cmdarg = calloc(1, sizeof(struct cache_arg));
+  if (!cmdarg)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not allocate cache_arg\n");
+      return;
+    }
+
+  cmdarg->hdl = cache_artwork_hdl;
+  cmdarg->pathcopy = strdup(dir);
+
+  commands_exec_async(cmdbase, cache_artwork_miss_delete_by_dir_impl, cmdarg);
+}
+
+/*
+ * Check if there is a record of no artwork found for the given persistentid
+ *
+ * @param type individual or group artwork
+ * @param persistentid persistent itemid, songalbumid or songartistid
+ * @param sources CACHE_ARTWORK_MISS_* source classes that must have been tried
+ * @param cached set by this function to 0 if no record exists, otherwise 1
+ * @return 0 if successful, -1 if an error occurred
+ */
+int
+cache_artwork_miss_get(int type, int64_t persistentid, int sources, int *cached)
+{
+  struct cache_arg cmdarg;
+  int ret;
+
+  *cached = 0;
+
+  if (!cache_is_initialized)
+    return 0;
+
+  cmdarg.hdl = cache_artwork_hdl;
+  cmdarg.type = type;
+  cmdarg.persistentid = persistentid;
+  cmdarg.sources = sources;
+  cmdarg.cached = 0;
+
+  ret = commands_exec_sync(cmdbase, cache_artwork_miss_get_impl, NULL, &cmdarg);
+
+  *cached = cmdarg.cached;
+
   return ret;
 }
 
@@ -2047,6 +3033,33 @@ cache_artwork_read(struct evbuffer *evbuf, const char *path, int *format)
 }
 
 
+void
+cache_artwork_mem_stats_get(struct cache_artwork_mem_stats *stats)
+{
+  struct cache_artwork_mem_stripe *stripe;
+  int i;
+
+  memset(stats, 0, sizeof(struct cache_artwork_mem_stats));
+
+  stats->max_size = cache_artwork_mem_stripe_max * CACHE_ARTWORK_MEM_STRIPES;
+  if (stats->max_size == 0)
+    return;
+
+  for (i = 0; i < CACHE_ARTWORK_MEM_STRIPES; i++)
+    {
+      stripe = &cache_artwork_mem[i];
+
+      CHECK_ERR(L_CACHE, pthread_mutex_lock(&stripe->lck));
+      stats->hits += stripe->stats.hits;
+      stats->misses += stripe->stats.misses;
+      stats->evictions += stripe->stats.evictions;
+      stats->entries += stripe->stats.entries;
+      stats->size += stripe->size;
+      CHECK_ERR(L_CACHE, pthread_mutex_unlock(&stripe->lck));
+    }
+}
+
+
 /* --------------------------- Cache general API ---------------------------- */
 
 int
@@ -2059,6 +3072,8 @@ cache_init(void)
       return 0;
     }
 
+  artwork_mem_init();
+
   CHECK_NULL(L_CACHE, evbase_cache = event_base_new());
   CHECK_ERR(L_CACHE, event_base_priority_init(evbase_cache, 8));
   CHECK_NULL(L_CACHE, cmdbase = commands_base_new(evbase_cache, NULL));
@@ -2090,4 +3105,6 @@ cache_deinit(void)
     }
 
   event_base_free(evbase_cache);
+
+  artwork_mem_deinit();
 }
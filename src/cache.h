@@ -36,6 +36,20 @@ cache_xcode_toggle(bool enable);
 #define CACHE_ARTWORK_GROUP 0
 #define CACHE_ARTWORK_INDIVIDUAL 1
 
+// Classes of artwork sources tried before an artwork miss was recorded
+#define CACHE_ARTWORK_MISS_LOCAL  (1 << 0)
+#define CACHE_ARTWORK_MISS_ONLINE (1 << 1)
+
+struct cache_artwork_mem_stats
+{
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  int entries;
+  size_t size;
+  size_t max_size; // 0 if the memory cache is disabled
+};
+
 void
 cache_artwork_ping(const char *path, time_t mtime, int del);
 
@@ -46,10 +60,22 @@ int
 cache_artwork_purge_cruft(time_t ref);
 
 int
-cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int format, char *filename, struct evbuffer *evbuf);
+cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int req_format, int format, char *filename, struct evbuffer *evbuf);
+
+int
+cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int req_format, int *cached, int *format, struct evbuffer *evbuf);
 
 int
-cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int *cached, int *format, struct evbuffer *evbuf);
+cache_artwork_exists(int type, int64_t persistentid, int max_w, int max_h, int req_format, int *cached);
+
+int
+cache_artwork_miss_add(int type, int64_t persistentid, int sources, time_t expires, const char **dirs, int ndirs);
+
+int
+cache_artwork_miss_get(int type, int64_t persistentid, int sources, int *cached);
+
+void
+cache_artwork_miss_delete_by_dir(const char *dir);
 
 int
 cache_artwork_stash(struct evbuffer *evbuf, const char *path, int format);
@@ -57,6 +83,9 @@ cache_artwork_stash(struct evbuffer *evbuf, const char *path, int format);
 int
 cache_artwork_read(struct evbuffer *evbuf, const char *path, int *format);
 
+void
+cache_artwork_mem_stats_get(struct cache_artwork_mem_stats *stats);
+
 /* ------------------------------- Cache API  ------------------------------- */
 
 int
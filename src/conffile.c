@@ -47,6 +47,7 @@ static cfg_opt_t sec_general[] =
     CFG_STR("uid", "nobody", CFGF_NONE),
     CFG_STR("db_path", STATEDIR "/cache/" PACKAGE "/songs3.db", CFGF_NONE),
     CFG_STR("db_backup_path", NULL, CFGF_NONE),
+    CFG_BOOL("db_backup_compress", cfg_false, CFGF_NONE),
     CFG_STR("logfile", STATEDIR "/log/" PACKAGE ".log", CFGF_NONE),
     CFG_INT_CB("loglevel", E_LOG, CFGF_NONE, &cb_loglevel),
     CFG_STR("logformat", "default", CFGF_NONE),
@@ -59,6 +60,7 @@ static cfg_opt_t sec_general[] =
     CFG_STR("cache_dir", STATEDIR "/cache/" PACKAGE, CFGF_NONE),
     CFG_STR("cache_path", NULL, CFGF_DEPRECATED),
     CFG_INT("cache_daap_threshold", 1000, CFGF_NONE),
+    CFG_INT("cache_artwork_memory_size", 16, CFGF_NONE),
     CFG_BOOL("speaker_autoselect", cfg_false, CFGF_NONE),
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
     CFG_BOOL("high_resolution_clock", cfg_false, CFGF_NONE),
@@ -109,6 +111,7 @@ static cfg_opt_t sec_library[] =
     CFG_STR("name_unknown_composer", "Unknown composer", CFGF_NONE),
     CFG_STR_LIST("artwork_basenames", "{artwork,cover,Folder}", CFGF_NONE),
     CFG_BOOL("artwork_individual", cfg_false, CFGF_NONE),
+    CFG_INT_LIST("artwork_prerender_sizes", NULL, CFGF_NONE),
     CFG_STR_LIST("artwork_online_sources", NULL, CFGF_NONE),
     CFG_STR_LIST("filetypes_ignore", "{.db,.ini,.db-journal,.pdf,.metadata}", CFGF_NONE),
     CFG_STR_LIST("filepath_ignore", NULL, CFGF_NONE),
@@ -253,6 +256,9 @@ static cfg_opt_t sec_sqlite[] =
     CFG_INT("pragma_mmap_size_library", -1, CFGF_NONE),
     CFG_INT("pragma_mmap_size_cache", -1, CFGF_NONE),
     CFG_BOOL("vacuum", cfg_true, CFGF_NONE),
+    CFG_BOOL("profile", cfg_false, CFGF_NONE),
+    CFG_INT("profile_slow_ms", 200, CFGF_NONE),
+    CFG_INT("read_pool_size", 0, CFGF_NONE),
     CFG_END()
   };
 
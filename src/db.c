@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -33,6 +34,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <unicase.h>
 #include <unictype.h>
 #include <uninorm.h>
 #include <unistr.h>
@@ -41,6 +43,7 @@
 #include <assert.h>
 
 #include <sqlite3.h>
+#include <zlib.h>
 
 #include "conffile.h"
 #include "logger.h"
@@ -52,6 +55,7 @@
 #include "db_init.h"
 #include "db_upgrade.h"
 #include "rng.h"
+#include "worker.h"
 
 
 // Inotify cookies are uint32_t
@@ -63,6 +67,12 @@
 // Flags that we will only update column value if we have non-zero value (to avoid zeroing e.g. rating)
 #define DB_FLAG_NO_ZERO  (1 << 1)
 
+// Condition for the paths below a directory, which must be given twice as
+// argument, e.g. "/a/b" matches "/a/b/c" but not "/a/bc". Our LIKE is case
+// insensitive, so SQLite can't use an index for LIKE '%q/%%', but it can for
+// this range ('0' is the character after '/').
+#define DB_PATH_BELOW(col) "(" col " >= '%q/' AND " col " < '%q0')"
+
 // The two last columns of playlist_info are calculated fields, so all playlist retrieval functions must use this query
 #define Q_PL_SELECT "SELECT f.*, COUNT(pi.id), SUM(pi.filepath NOT NULL AND pi.filepath LIKE 'http%%')" \
                     " FROM playlists f LEFT JOIN playlistitems pi ON (f.id = pi.playlistid)"
@@ -96,6 +106,11 @@ enum fixup_type {
   DB_FIXUP_ALBUM_SORT,
   DB_FIXUP_ALBUM_ARTIST_SORT,
   DB_FIXUP_COMPOSER_SORT,
+  DB_FIXUP_TITLE_SORTKEY,
+  DB_FIXUP_ARTIST_SORTKEY,
+  DB_FIXUP_ALBUM_SORTKEY,
+  DB_FIXUP_ALBUM_ARTIST_SORTKEY,
+  DB_FIXUP_COMPOSER_SORTKEY,
   DB_FIXUP_TIME_MODIFIED,
   DB_FIXUP_SONGARTISTID,
   DB_FIXUP_SONGALBUMID,
@@ -111,6 +126,7 @@ struct db_unlock {
 struct db_statements
 {
   sqlite3_stmt *files_insert;
+  sqlite3_stmt *files_insert_batch; // Inserts DB_FILES_INSERT_BATCH rows, may be NULL
   sqlite3_stmt *files_update;
   sqlite3_stmt *files_ping;
 
@@ -121,6 +137,192 @@ struct db_statements
   sqlite3_stmt *queue_items_update;
 };
 
+// Number of rows inserted at a time by db_file_save_batch()
+#define DB_FILES_INSERT_BATCH 8
+
+/* Per-thread cache of prepared statements for constant queries with bound
+ * parameters. The address of the query string is the key, so only use it with
+ * string literals. */
+#define DB_STMT_CACHE_SIZE 32
+
+struct db_stmt_cache_entry
+{
+  const char *query;
+  sqlite3_stmt *stmt;
+};
+
+struct db_stmt_cache
+{
+  struct db_stmt_cache_entry entries[DB_STMT_CACHE_SIZE];
+  int next_evict;
+};
+
+/* In-memory order of the queue, see the queue section */
+#define DB_QUEUE_KEY_SPACING 1024
+
+struct db_queue_slot
+{
+  uint32_t id;
+  int64_t key;      // Sparse position key, saved as pos/shuffle_pos
+  bool dirty;       // Key not written to the queue table yet
+};
+
+// Entry of the hash index of the queue items, id 0 is an empty entry
+struct db_queue_index_entry
+{
+  uint32_t id;
+  uint32_t pos;
+  uint32_t shuffle_pos;
+  uint32_t version; // Queue version where the item last changed position
+};
+
+struct db_queue_dirty
+{
+  uint32_t count;
+  uint32_t size;
+  uint32_t *ids;
+};
+
+struct db_queue_order
+{
+  pthread_mutex_t lck;
+  bool loaded;
+  bool changed; // Changed in the current queue transaction
+  int version;  // Version of the current queue transaction
+
+  uint32_t count;
+  uint32_t size;
+  struct db_queue_slot *pos_slots;      // Ordered by pos
+  struct db_queue_slot *shuffle_slots;  // Ordered by shuffle_pos
+
+  uint32_t index_size;                  // Power of two, at least twice size
+  struct db_queue_index_entry *index;   // Hashed by item id
+
+  struct db_queue_dirty pos_dirty;      // Items with a dirty pos key
+  struct db_queue_dirty shuffle_dirty;  // Items with a dirty shuffle_pos key
+
+  uint32_t generation;           // Incremented on every change
+  uint32_t snapshot_generation;  // Generation of the published snapshot
+};
+
+// Read-only copy of the queue order for readers, replaced after changes
+struct db_queue_snapshot
+{
+  int refcount;
+  uint32_t count;
+  uint32_t *pos_ids;                   // Item ids ordered by pos
+  uint32_t *shuffle_ids;               // Item ids ordered by shuffle_pos
+  int64_t *pos_keys;                   // Stored pos keys ordered by pos
+  int64_t *shuffle_keys;               // Stored shuffle_pos keys ordered by shuffle_pos
+  uint32_t index_size;
+  struct db_queue_index_entry *index;  // Copy of the hash index
+};
+
+// Unfiltered library totals, see db_counters_get()
+struct db_counters {
+  pthread_mutex_t lck;
+  // The values are current if this equals db_counters_generation
+  uint32_t generation;
+  struct filecount_info fci;
+  uint32_t streams;
+  uint32_t playlists;
+};
+
+/* Backup job, see db_backup(). The backup is copied DB_BACKUP_STEP_PAGES pages
+ * at a time by a worker, so that other connections are only locked out briefly.
+ * If the db is locked the step is retried after a second, DB_BACKUP_RETRIES
+ * times in a row. */
+#define DB_BACKUP_STEP_PAGES 256
+#define DB_BACKUP_RETRIES 30
+
+struct db_backup_job {
+  pthread_mutex_t lck;
+  struct db_backup_status status;
+  sqlite3 *src;
+  sqlite3 *dst;
+  sqlite3_backup *backup;
+  char *path;      // Where the finished backup goes
+  char *tmp_path;  // What the backup is copied to while running
+  bool compress;
+  int retries;
+};
+
+/* Query profiler, see db_xprofile(). DB_PROFILE_TEMPLATES is the size of the
+ * hash table with stats by query template. */
+#define DB_PROFILE_TEMPLATES 1024
+#define DB_PROFILE_TEMPLATE_LEN 2048
+#define DB_PROFILE_ROWS_SLOTS 8
+#define DB_PROFILE_TRACE_MASK (SQLITE_TRACE_PROFILE | SQLITE_TRACE_ROW)
+
+struct db_profile {
+  pthread_mutex_t lck;
+  bool enabled;
+  int slow_ms;
+  struct db_query_stats *stats;
+  uint32_t *hashes;
+  int nstats;
+  uint64_t dropped; // Statements not counted because the table was full
+};
+
+struct db_profile_rows {
+  sqlite3_stmt *stmt;
+  uint64_t rows;
+};
+
+/* Pool of read-only connections, see db_reader_acquire(). A thread waits at most
+ * DB_READER_WAIT_MS for a connection, after that it uses its own. */
+#define DB_READER_WAIT_MS 100
+#define DB_READER_BUSY_TIMEOUT 5000
+
+struct db_reader_pool {
+  pthread_mutex_t lck;
+  pthread_cond_t cond;
+  int size;        // Max number of connections, 0 if the pool is disabled
+  int nopen;
+  int nidle;
+  sqlite3 **idle;
+  struct db_reader_pool_stats stats;
+};
+
+// The connection a thread has borrowed from the pool
+struct db_reader {
+  sqlite3 *conn;
+  int refcount;
+};
+
+/* Cache of smart playlist results, see smartpl_cache_get(). Entries are
+ * invalidated by the same generation as the library totals, which covers files
+ * being added, removed or rescanned (see db_counters_invalidate). Rules with
+ * ratings, play counts and the like also depend on gen_updates, which the
+ * update hook bumps for any update of files, so that playback is seen too.
+ * Results of rules relative to the current time are refreshed after
+ * DB_SMARTPL_REFRESH_SECS. The ordered item ids are kept for playlists with a
+ * limit of at most DB_SMARTPL_IDS_MAX. */
+#define DB_SMARTPL_CACHE_SIZE 64
+#define DB_SMARTPL_REFRESH_SECS 60
+#define DB_SMARTPL_IDS_MAX 5000
+
+struct smartpl_result {
+  int id;           // Playlist id, 0 if the entry is unused
+  uint32_t hash;    // Of the rule, so that an edited playlist is not matched
+  bool update_dep;
+  uint32_t gen_counters;
+  uint32_t gen_updates;
+  time_t expires;   // 0 if the result doesn't expire
+  time_t last_used;
+  uint32_t items;
+  uint32_t streams;
+  int *ids;
+  int nids;         // -1 if the ids are not kept
+};
+
+struct db_smartpl_cache {
+  pthread_mutex_t lck;
+  // Incremented atomically by db_update_hook_cb()
+  uint32_t gen_updates;
+  struct smartpl_result entries[DB_SMARTPL_CACHE_SIZE];
+};
+
 struct col_type_map {
   char *name;
   ssize_t offset;
@@ -152,6 +354,23 @@ struct query_clause {
   char *having;
   char *order;
   char *index;
+
+  // With keyset pagination the key columns are added to the select, and the
+  // page condition to the where of the main query (but not the count). Group
+  // queries are grouped by the key columns, so they come in index order.
+  char *keyset_select;
+  char *keyset_where;
+  char *keyset_group;
+  char *keyset_cond;
+};
+
+#define KEYSET_COLS_MAX 7
+
+struct keyset_clause {
+  enum query_type type;
+  enum sort_type sort;
+  int ncols;
+  const char *cols[KEYSET_COLS_MAX];
 };
 
 struct browse_clause {
@@ -232,6 +451,11 @@ static const struct col_type_map mfi_cols_map[] =
     { "usermark",           mfi_offsetof(usermark),           DB_TYPE_INT },
     { "scan_kind",          mfi_offsetof(scan_kind),          DB_TYPE_INT },
     { "lyrics",             mfi_offsetof(lyrics),             DB_TYPE_STRING },
+    { "title_sortkey",      mfi_offsetof(title_sortkey),      DB_TYPE_STRING, DB_FIXUP_TITLE_SORTKEY },
+    { "artist_sortkey",     mfi_offsetof(artist_sortkey),     DB_TYPE_STRING, DB_FIXUP_ARTIST_SORTKEY },
+    { "album_sortkey",      mfi_offsetof(album_sortkey),      DB_TYPE_STRING, DB_FIXUP_ALBUM_SORTKEY },
+    { "album_artist_sortkey", mfi_offsetof(album_artist_sortkey), DB_TYPE_STRING, DB_FIXUP_ALBUM_ARTIST_SORTKEY },
+    { "composer_sortkey",   mfi_offsetof(composer_sortkey),   DB_TYPE_STRING, DB_FIXUP_COMPOSER_SORTKEY },
   };
 
 /* This list must be kept in sync with
@@ -374,6 +598,11 @@ static const ssize_t dbmfi_cols_map[] =
     dbmfi_offsetof(usermark),
     dbmfi_offsetof(scan_kind),
     dbmfi_offsetof(lyrics),
+    dbmfi_offsetof(title_sortkey),
+    dbmfi_offsetof(artist_sortkey),
+    dbmfi_offsetof(album_sortkey),
+    dbmfi_offsetof(album_artist_sortkey),
+    dbmfi_offsetof(composer_sortkey),
   };
 
 /* This list must be kept in sync with
@@ -502,19 +731,19 @@ static const struct col_type_map wi_cols_map[] =
 static const char *sort_clause[] =
   {
     "",
-    "f.title_sort",
-    "f.album_sort, f.disc, f.track",
-    "f.album_artist_sort, f.album_sort, f.disc, f.track",
+    "f.title_sortkey",
+    "f.album_sortkey, f.album, f.disc, f.track",
+    "f.album_artist_sortkey, f.album_artist, f.album_sortkey, f.album, f.disc, f.track",
     "f.type, f.parent_id, f.special_id, f.title",
     "f.year",
     "f.genre",
-    "f.composer_sort",
+    "f.composer_sortkey",
     "f.disc",
     "f.track",
     "f.virtual_path COLLATE NOCASE",
     "pos",
     "shuffle_pos",
-    "f.date_released DESC, f.title_sort DESC",
+    "f.date_released DESC, f.title_sortkey DESC",
   };
 
 /* Browse clauses, used for SELECT, WHERE, GROUP BY and for default ORDER BY
@@ -524,10 +753,10 @@ static const char *sort_clause[] =
 static const struct browse_clause browse_clause[] =
   {
     { "",                                      "",                 "" },
-    { "f.album_artist, f.album_artist_sort",   "f.album_artist",   "f.album_artist_sort, f.album_artist" },
-    { "f.album, f.album_sort",                 "f.album",          "f.album_sort, f.album" },
+    { "f.album_artist, f.album_artist_sort",   "f.album_artist",   "f.album_artist_sortkey, f.album_artist" },
+    { "f.album, f.album_sort",                 "f.album",          "f.album_sortkey, f.album" },
     { "f.genre, f.genre",                      "f.genre",          "f.genre" },
-    { "f.composer, f.composer_sort",           "f.composer",       "f.composer_sort, f.composer" },
+    { "f.composer, f.composer_sort",           "f.composer",       "f.composer_sortkey, f.composer" },
     { "f.year, f.year",                        "f.year",           "f.year" },
     { "f.disc, f.disc",                        "f.disc",           "f.disc" },
     { "f.track, f.track",                      "f.track",          "f.track" },
@@ -536,6 +765,26 @@ static const struct browse_clause browse_clause[] =
   };
 
 
+/* Key columns for keyset pagination (I_CURSOR). They must give the same order
+ * as the sort clause and end with a unique column. Groups are paged by the sort
+ * key of the group and its persistentid, which are indexed in the groups table
+ * and the same for all the files of the group, so the page condition doesn't
+ * need the aggregates. Queries with sort types not listed here can't be paged
+ * by cursor.
+ */
+static const struct keyset_clause keyset_clause[] =
+  {
+    { Q_ITEMS,         S_NONE,   1, { "f.id" } },
+    { Q_ITEMS,         S_NAME,   2, { "f.title_sortkey", "f.id" } },
+    { Q_ITEMS,         S_ALBUM,  5, { "f.album_sortkey", "f.album", "f.disc", "f.track", "f.id" } },
+    { Q_ITEMS,         S_ARTIST, 7, { "f.album_artist_sortkey", "f.album_artist", "f.album_sortkey", "f.album", "f.disc", "f.track", "f.id" } },
+    { Q_GROUP_ALBUMS,  S_ALBUM,  2, { "g.sortkey", "g.persistentid" } },
+    { Q_GROUP_ALBUMS,  S_NAME,   2, { "g.sortkey", "g.persistentid" } },
+    { Q_GROUP_ARTISTS, S_ARTIST, 2, { "g.sortkey", "g.persistentid" } },
+    { Q_GROUP_ARTISTS, S_NAME,   2, { "g.sortkey", "g.persistentid" } },
+  };
+
+
 struct enum_label {
   int type;
   const char *label;
@@ -652,12 +901,39 @@ db_pl_type_label(enum pl_type pl_type)
 /* Shuffle RNG state */
 struct rng_ctx shuffle_rng;
 
+static struct db_queue_order db_queue_order = { .lck = PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_mutex_t db_queue_snapshot_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct db_queue_snapshot *db_queue_snapshot;
+// Snapshot of the queue enum that is being stepped by this thread
+static __thread struct db_queue_snapshot *queue_snapshot_stepping;
+
+static struct db_counters db_counters = { .lck = PTHREAD_MUTEX_INITIALIZER };
+// Incremented atomically by db_update_hook_cb() when files or playlists change
+static uint32_t db_counters_generation = 1;
+
+static struct db_backup_job db_backup_job = { .lck = PTHREAD_MUTEX_INITIALIZER };
+
+static struct db_profile db_profile = { .lck = PTHREAD_MUTEX_INITIALIZER };
+
+static struct db_reader_pool db_reader_pool = { .lck = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static struct db_smartpl_cache db_smartpl_cache = { .lck = PTHREAD_MUTEX_INITIALIZER, .gen_updates = 1 };
+
 static char *db_path;
 static char *db_sqlite_ext_path;
 static bool db_rating_updates;
+static bool db_search_index;
 
 static __thread sqlite3 *hdl;
 static __thread struct db_statements db_statements;
+static __thread struct db_stmt_cache db_stmt_cache;
+static __thread struct db_reader db_reader;
+static __thread struct db_profile_rows db_profile_rows_slots[DB_PROFILE_ROWS_SLOTS];
+
+// Totals for all threads, updated atomically
+static uint64_t db_stmt_cache_hits;
+static uint64_t db_stmt_cache_misses;
 
 
 /* Forward */
@@ -667,6 +943,15 @@ db_group_type_bypersistentid(int64_t persistentid);
 static int
 db_query_run(char *query, int free, short update_events);
 
+static int
+db_counters_get(struct filecount_info *fci, uint32_t *streams, uint32_t *playlists);
+
+static sqlite3 *
+db_reader_acquire(void);
+
+static void
+db_reader_release(void);
+
 
 char *
 db_escape_string(const char *str)
@@ -712,6 +997,53 @@ db_mprintf(const char *fmt, ...)
   return query;
 }
 
+// Columns in the files_fts search index, see db_init.c
+static const char *db_search_index_cols[] =
+  {
+    "title", "artist", "album", "album_artist", "composer", "genre",
+  };
+
+// Returns a filter that narrows a files query to the rows where dbcol contains
+// value, using the search index. It matches the same rows as the LIKE
+// '%value%' it is meant to accompany (with value taken literally, i.e. '%' and
+// '_' escaped), so callers should keep that as well. Only use it where the LIKE
+// is not negated: NOT (filter AND LIKE) would also match rows where dbcol is
+// NULL. If the index can't be used for the column or value, NULL is returned.
+char *
+db_search_filter(const char *dbcol, const char *value)
+{
+  const char *col;
+  const char *ptr;
+  int nchars;
+  int i;
+
+  if (!db_search_index || !dbcol || !value)
+    return NULL;
+
+  col = (strncmp(dbcol, "f.", 2) == 0) ? dbcol + 2 : dbcol;
+  for (i = 0; i < ARRAY_SIZE(db_search_index_cols); i++)
+    {
+      if (strcmp(col, db_search_index_cols[i]) == 0)
+	break;
+    }
+
+  if (i == ARRAY_SIZE(db_search_index_cols))
+    return NULL;
+
+  // The trigram tokenizer can't find anything with less than 3 (utf-8) chars
+  for (ptr = value, nchars = 0; *ptr && nchars < 3; ptr++)
+    {
+      if ((*ptr & 0xc0) != 0x80)
+	nchars++;
+    }
+
+  if (nchars < 3)
+    return NULL;
+
+  // The value is quoted as a FTS5 string, where " is escaped as ""
+  return db_mprintf("f.id IN (SELECT rowid FROM files_fts WHERE %s MATCH '\"' || replace(daap_fold('%q'), '\"', '\"\"') || '\"')", db_search_index_cols[i], value);
+}
+
 int
 db_snprintf(char *s, int n, const char *fmt, ...)
 {
@@ -782,6 +1114,11 @@ free_mfi(struct media_file_info *mfi, int content_only)
   free(mfi->album_artist_sort);
   free(mfi->virtual_path);
   free(mfi->lyrics);
+  free(mfi->title_sortkey);
+  free(mfi->artist_sortkey);
+  free(mfi->album_sortkey);
+  free(mfi->album_artist_sortkey);
+  free(mfi->composer_sortkey);
 
   if (!content_only)
     free(mfi);
@@ -847,6 +1184,7 @@ free_query_params(struct query_params *qp, int content_only)
   free(qp->having);
   free(qp->order);
   free(qp->group);
+  free(qp->cursor);
 
   if (!content_only)
     free(qp);
@@ -1268,6 +1606,37 @@ fixup_defaults(char **tag, enum fixup_type fixup, struct fixup_ctx *ctx)
     }
 }
 
+// Creates a key from the sort tag that sorts with memcmp() like the DAAP
+// collation in sqlext.c sorts the tag itself: case folded and normalized, and
+// with tags that don't start with a letter sorting last
+static void
+sort_key_create(char **sort_key, const char *sort_tag)
+{
+  uint8_t *folded;
+  ucs4_t uc;
+  size_t len;
+
+  free(*sort_key);
+  *sort_key = NULL;
+
+  if (!sort_tag || ((len = strlen(sort_tag)) == 0))
+    return;
+
+  if (u8_mbtouc(&uc, (uint8_t *)sort_tag, len) < 0)
+    return;
+
+  folded = u8_casefold((uint8_t *)sort_tag, len, NULL, UNINORM_NFD, NULL, &len);
+  if (!folded)
+    return;
+
+  CHECK_NULL(L_DB, *sort_key = malloc(len + 2));
+  (*sort_key)[0] = uc_is_alpha(uc) ? '0' : '1';
+  memcpy(*sort_key + 1, folded, len);
+  (*sort_key)[len + 1] = '\0';
+
+  free(folded);
+}
+
 static void
 fixup_sort_tags(char **tag, enum fixup_type fixup, struct fixup_ctx *ctx)
 {
@@ -1309,10 +1678,43 @@ fixup_sort_tags(char **tag, enum fixup_type fixup, struct fixup_ctx *ctx)
     }
 }
 
+static void
+fixup_sort_keys(char **tag, enum fixup_type fixup, struct fixup_ctx *ctx)
+{
+  if (!ctx->mfi)
+    return;
+
+  switch(fixup)
+    {
+      case DB_FIXUP_TITLE_SORTKEY:
+	sort_key_create(tag, ctx->mfi->title_sort);
+	break;
+
+      case DB_FIXUP_ARTIST_SORTKEY:
+	sort_key_create(tag, ctx->mfi->artist_sort);
+	break;
+
+      case DB_FIXUP_ALBUM_SORTKEY:
+	sort_key_create(tag, ctx->mfi->album_sort);
+	break;
+
+      case DB_FIXUP_ALBUM_ARTIST_SORTKEY:
+	sort_key_create(tag, ctx->mfi->album_artist_sort);
+	break;
+
+      case DB_FIXUP_COMPOSER_SORTKEY:
+	sort_key_create(tag, ctx->mfi->composer_sort);
+	break;
+
+      default:
+	break;
+    }
+}
+
 static void
 fixup_tags(struct fixup_ctx *ctx)
 {
-  void (*fixup_func[])(char **, enum fixup_type, struct fixup_ctx *) = { fixup_sanitize, fixup_defaults, fixup_sort_tags };
+  void (*fixup_func[])(char **, enum fixup_type, struct fixup_ctx *) = { fixup_sanitize, fixup_defaults, fixup_sort_tags, fixup_sort_keys };
   char **tag;
   int i;
   int j;
@@ -1373,15 +1775,15 @@ fixup_tags_qi(struct db_queue_item *qi)
   fixup_tags(&ctx);
 }
 
+// Binds starting at parameter n, returns the index of the next parameter
 static int
-bind_generic(sqlite3_stmt *stmt, void *data, const struct col_type_map *map, size_t map_size, int id)
+bind_generic_at(sqlite3_stmt *stmt, int n, void *data, const struct col_type_map *map, size_t map_size, int id)
 {
   char **strptr;
   char *ptr;
   int i;
-  int n;
 
-  for (i = 0, n = 1; i < map_size; i++)
+  for (i = 0; i < map_size; i++)
     {
       if (map[i].flag & DB_FLAG_NO_BIND)
 	continue;
@@ -1413,9 +1815,15 @@ bind_generic(sqlite3_stmt *stmt, void *data, const struct col_type_map *map, siz
 
   // This binds the final "WHERE id = ?" if it is an update
   if (id)
-    sqlite3_bind_int(stmt, n, id);
+    sqlite3_bind_int(stmt, n++, id);
 
-  return 0;
+  return n;
+}
+
+static int
+bind_generic(sqlite3_stmt *stmt, void *data, const struct col_type_map *map, size_t map_size, int id)
+{
+  return (bind_generic_at(stmt, 1, data, map, map_size, id) < 0) ? -1 : 0;
 }
 
 static int
@@ -1564,6 +1972,81 @@ db_statement_run(sqlite3_stmt *stmt, short update_events)
 }
 
 
+/* Returns a prepared statement for the query, ready for binding parameters.
+ * The statement must not be finalized, and it must be reset before the next
+ * call, either with db_stmt_cache_release() or by db_statement_run().
+ */
+static sqlite3_stmt *
+db_stmt_cache_get(const char *query)
+{
+  struct db_stmt_cache_entry *entry;
+  sqlite3_stmt *stmt;
+  int ret;
+  int i;
+
+  for (i = 0; i < DB_STMT_CACHE_SIZE; i++)
+    {
+      entry = &db_stmt_cache.entries[i];
+      if (entry->query == query)
+	{
+	  __atomic_add_fetch(&db_stmt_cache_hits, 1, __ATOMIC_RELAXED);
+	  return entry->stmt;
+	}
+      else if (!entry->query)
+	break;
+    }
+
+  __atomic_add_fetch(&db_stmt_cache_misses, 1, __ATOMIC_RELAXED);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement '%s': %s\n", query, sqlite3_errmsg(hdl));
+      return NULL;
+    }
+
+  // Cache is full, so replace the entries in round-robin order
+  if (i == DB_STMT_CACHE_SIZE)
+    {
+      i = db_stmt_cache.next_evict;
+      db_stmt_cache.next_evict = (i + 1) % DB_STMT_CACHE_SIZE;
+      sqlite3_finalize(db_stmt_cache.entries[i].stmt);
+    }
+
+  db_stmt_cache.entries[i].query = query;
+  db_stmt_cache.entries[i].stmt = stmt;
+
+  return stmt;
+}
+
+static void
+db_stmt_cache_release(sqlite3_stmt *stmt)
+{
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+}
+
+static void
+db_stmt_cache_clear(void)
+{
+  int i;
+
+  for (i = 0; i < DB_STMT_CACHE_SIZE; i++)
+    {
+      if (db_stmt_cache.entries[i].stmt)
+	sqlite3_finalize(db_stmt_cache.entries[i].stmt);
+    }
+
+  memset(&db_stmt_cache, 0, sizeof(struct db_stmt_cache));
+}
+
+void
+db_stmt_cache_stats(uint64_t *hits, uint64_t *misses)
+{
+  *hits = __atomic_load_n(&db_stmt_cache_hits, __ATOMIC_RELAXED);
+  *misses = __atomic_load_n(&db_stmt_cache_misses, __ATOMIC_RELAXED);
+}
+
 /* Modelled after sqlite3_exec() */
 static int
 db_exec(const char *query, char **errmsg)
@@ -1680,26 +2163,36 @@ db_hook_post_scan(void)
   DPRINTF(E_DBG, L_DB, "Done with post-scan DB maintenance\n");
 }
 
-void
-db_purge_cruft(time_t ref)
+/* Deletes the rows that were not touched by the scan that started at ref. The
+ * db_timestamp of rows seen by a scan is always >= ref, so with the scan
+ * indices the queries only visit the stale rows, not the whole library. A
+ * negative scan_kind means rows from all sources.
+ */
+static void
+purge_cruft(time_t ref, int scan_kind)
 {
-#define Q_TMPL "DELETE FROM directories WHERE id >= %d AND db_timestamp < %" PRIi64 ";"
-  int i;
-  int ret;
-  char *query;
-  char *queries_tmpl[4] =
+  struct purge_query {
+    const char *tmpl;
+    int arg;
+    short listener;
+  };
+  struct purge_query queries[] =
     {
-      "DELETE FROM playlistitems WHERE playlistid IN (SELECT p.id FROM playlists p WHERE p.type <> %d AND p.db_timestamp < %" PRIi64 ");",
-      "DELETE FROM playlistitems WHERE filepath IN (SELECT f.path FROM files f WHERE -1 <> %d AND f.db_timestamp < %" PRIi64 ");",
-      "DELETE FROM playlists WHERE type <> %d AND db_timestamp < %" PRIi64 ";",
-      "DELETE FROM files WHERE -1 <> %d AND db_timestamp < %" PRIi64 ";",
+      { "DELETE FROM playlistitems WHERE playlistid IN (SELECT p.id FROM playlists p WHERE p.type <> %d AND p.db_timestamp < %" PRIi64 " AND (%d < 0 OR p.scan_kind = %d));", PL_SPECIAL, 0 },
+      { "DELETE FROM playlistitems WHERE filepath IN (SELECT f.path FROM files f WHERE -1 <> %d AND f.db_timestamp < %" PRIi64 " AND (%d < 0 OR f.scan_kind = %d));", 0, 0 },
+      { "DELETE FROM playlists WHERE type <> %d AND db_timestamp < %" PRIi64 " AND (%d < 0 OR scan_kind = %d);", PL_SPECIAL, 0 },
+      { "DELETE FROM files WHERE -1 <> %d AND db_timestamp < %" PRIi64 " AND (%d < 0 OR scan_kind = %d);", 0, 0 },
+      { "DELETE FROM directories WHERE id >= %d AND db_timestamp < %" PRIi64 " AND (%d < 0 OR scan_kind = %d);", DIR_MAX, LISTENER_DATABASE },
     };
+  char *query;
+  int i;
+  int ret;
 
   db_transaction_begin();
 
-  for (i = 0; i < (sizeof(queries_tmpl) / sizeof(queries_tmpl[0])); i++)
+  for (i = 0; i < ARRAY_SIZE(queries); i++)
     {
-      query = sqlite3_mprintf(queries_tmpl[i], PL_SPECIAL, (int64_t)ref);
+      query = sqlite3_mprintf(queries[i].tmpl, queries[i].arg, (int64_t)ref, scan_kind, scan_kind);
       if (!query)
 	{
 	  DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
@@ -1709,103 +2202,48 @@ db_purge_cruft(time_t ref)
 
       DPRINTF(E_DBG, L_DB, "Running purge query '%s'\n", query);
 
-      ret = db_query_run(query, 1, 0);
+      ret = db_query_run(query, 1, queries[i].listener);
       if (ret == 0)
 	DPRINTF(E_DBG, L_DB, "Purged %d rows\n", sqlite3_changes(hdl));
     }
 
-  query = sqlite3_mprintf(Q_TMPL, DIR_MAX, (int64_t)ref);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      db_transaction_end();
-      return;
-    }
-
-  DPRINTF(E_DBG, L_DB, "Running purge query '%s'\n", query);
-
-  ret = db_query_run(query, 1, LISTENER_DATABASE);
-  if (ret == 0)
-    DPRINTF(E_DBG, L_DB, "Purged %d rows\n", sqlite3_changes(hdl));
-
   db_transaction_end();
+}
 
-#undef Q_TMPL
+void
+db_purge_cruft(time_t ref)
+{
+  purge_cruft(ref, -1);
 }
 
 void
 db_purge_cruft_bysource(time_t ref, enum scan_kind scan_kind)
 {
-#define Q_TMPL "DELETE FROM directories WHERE id >= %d AND db_timestamp < %" PRIi64 " AND scan_kind = %d;"
-  int i;
-  int ret;
-  char *query;
-  char *queries_tmpl[4] =
+  purge_cruft(ref, scan_kind);
+}
+
+void
+db_purge_all(void)
+{
+#define Q_TMPL_PL "DELETE FROM playlists WHERE type <> %d;"
+#define Q_TMPL_DIR "DELETE FROM directories WHERE id >= %d;"
+  char *queries[5] =
     {
-      "DELETE FROM playlistitems WHERE playlistid IN (SELECT p.id FROM playlists p WHERE p.type <> %d AND p.db_timestamp < %" PRIi64 " AND scan_kind = %d);",
-      "DELETE FROM playlistitems WHERE filepath IN (SELECT f.path FROM files f WHERE -1 <> %d AND f.db_timestamp < %" PRIi64 " AND scan_kind = %d);",
-      "DELETE FROM playlists WHERE type <> %d AND db_timestamp < %" PRIi64 " AND scan_kind = %d;",
-      "DELETE FROM files WHERE -1 <> %d AND db_timestamp < %" PRIi64 " AND scan_kind = %d;",
+      "DELETE FROM inotify;",
+      "DELETE FROM playlistitems;",
+      // Before files, so the group_stats triggers don't have anything to update
+      "DELETE FROM group_stats;",
+      "DELETE FROM files;",
+      "DELETE FROM groups;",
     };
+  char *errmsg;
+  char *query;
+  int i;
+  int ret;
 
-  db_transaction_begin();
-
-  for (i = 0; i < (sizeof(queries_tmpl) / sizeof(queries_tmpl[0])); i++)
+  for (i = 0; i < (sizeof(queries) / sizeof(queries[0])); i++)
     {
-      query = sqlite3_mprintf(queries_tmpl[i], PL_SPECIAL, (int64_t)ref, scan_kind);
-      if (!query)
-	{
-	  DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-	  db_transaction_end();
-	  return;
-	}
-
-      DPRINTF(E_DBG, L_DB, "Running purge query '%s'\n", query);
-
-      ret = db_query_run(query, 1, 0);
-      if (ret == 0)
-	DPRINTF(E_DBG, L_DB, "Purged %d rows\n", sqlite3_changes(hdl));
-    }
-
-  query = sqlite3_mprintf(Q_TMPL, DIR_MAX, (int64_t)ref, scan_kind);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      db_transaction_end();
-      return;
-    }
-
-  DPRINTF(E_DBG, L_DB, "Running purge query '%s'\n", query);
-
-  ret = db_query_run(query, 1, LISTENER_DATABASE);
-  if (ret == 0)
-    DPRINTF(E_DBG, L_DB, "Purged %d rows\n", sqlite3_changes(hdl));
-
-  db_transaction_end();
-
-#undef Q_TMPL
-}
-
-void
-db_purge_all(void)
-{
-#define Q_TMPL_PL "DELETE FROM playlists WHERE type <> %d;"
-#define Q_TMPL_DIR "DELETE FROM directories WHERE id >= %d;"
-  char *queries[4] =
-    {
-      "DELETE FROM inotify;",
-      "DELETE FROM playlistitems;",
-      "DELETE FROM files;",
-      "DELETE FROM groups;",
-    };
-  char *errmsg;
-  char *query;
-  int i;
-  int ret;
-
-  for (i = 0; i < (sizeof(queries) / sizeof(queries[0])); i++)
-    {
-      DPRINTF(E_DBG, L_DB, "Running purge query '%s'\n", queries[i]);
+      DPRINTF(E_DBG, L_DB, "Running purge query '%s'\n", queries[i]);
 
       ret = db_exec(queries[i], &errmsg);
       if (ret != SQLITE_OK)
@@ -1906,6 +2344,245 @@ db_get_one_int(const char *query)
 }
 
 
+/* Smart playlist cache */
+static uint32_t
+smartpl_hash(const char *query, const char *order, int limit)
+{
+  char *key;
+  uint32_t hash;
+
+  key = sqlite3_mprintf("%s|%s|%d", query, order ? order : "", limit);
+  if (!key)
+    return 0;
+
+  hash = djb_hash(key, strlen(key));
+  sqlite3_free(key);
+  return hash;
+}
+
+// Columns that are updated without invalidating the library totals
+static bool
+smartpl_is_update_dep(const char *clause)
+{
+  char *cols[] = { "rating", "play_count", "skip_count", "time_played", "time_skipped", "seek", "directory_id" };
+  int i;
+
+  if (!clause)
+    return false;
+
+  for (i = 0; i < ARRAY_SIZE(cols); i++)
+    {
+      if (strstr(clause, cols[i]))
+	return true;
+    }
+
+  return false;
+}
+
+static bool
+smartpl_is_timed(const char *clause)
+{
+  return clause && strstr(clause, "datetime(");
+}
+
+static void
+smartpl_result_free(struct smartpl_result *r)
+{
+  free(r->ids);
+  memset(r, 0, sizeof(struct smartpl_result));
+}
+
+// Must be called with the lock held
+static bool
+smartpl_result_valid(struct smartpl_result *r, uint32_t hash, time_t now)
+{
+  if (r->hash != hash)
+    return false;
+  if (r->gen_counters != __atomic_load_n(&db_counters_generation, __ATOMIC_RELAXED))
+    return false;
+  if (r->update_dep && r->gen_updates != __atomic_load_n(&db_smartpl_cache.gen_updates, __ATOMIC_RELAXED))
+    return false;
+
+  return (r->expires == 0 || now < r->expires);
+}
+
+static int
+smartpl_ids_fetch(struct smartpl_result *r, const char *query, const char *order, int limit)
+{
+  sqlite3_stmt *stmt;
+  char *q;
+  int ret;
+
+  q = sqlite3_mprintf("SELECT f.id FROM files f WHERE f.disabled = 0 AND %s %s%s LIMIT %d;",
+		      query, order ? "ORDER BY " : "", order ? order : "", limit);
+  if (!q)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  r->ids = calloc(limit, sizeof(int));
+  if (!r->ids)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for smart playlist ids\n");
+      sqlite3_free(q);
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", q);
+
+  ret = db_blocking_prepare_v2(q, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      sqlite3_free(q);
+      return -1;
+    }
+
+  r->nids = 0;
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW && r->nids < limit)
+    r->ids[r->nids++] = sqlite3_column_int(stmt, 0);
+
+  sqlite3_finalize(stmt);
+  sqlite3_free(q);
+
+  if (ret != SQLITE_DONE && ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Gets the item counts of a smart playlist, and a copy of its ordered item ids
+ * if ids is non-NULL and they are kept (otherwise *ids is set to NULL), from
+ * the cache. The rule is evaluated if there is no current result.
+ */
+static int
+smartpl_cache_get(uint32_t *nitems, uint32_t *nstreams, int **ids, int *nids, int id, const char *query, const char *order, int limit)
+{
+  struct smartpl_result result = { 0 };
+  struct smartpl_result *r;
+  struct smartpl_result *slot;
+  uint32_t hash;
+  time_t now;
+  int i;
+  int ret;
+
+  if (ids)
+    *ids = NULL;
+
+  now = time(NULL);
+  hash = smartpl_hash(query, order, limit);
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_smartpl_cache.lck));
+
+  for (i = 0, r = NULL; i < DB_SMARTPL_CACHE_SIZE; i++)
+    {
+      if (db_smartpl_cache.entries[i].id == id)
+	{
+	  r = &db_smartpl_cache.entries[i];
+	  break;
+	}
+    }
+
+  if (r && smartpl_result_valid(r, hash, now))
+    {
+      r->last_used = now;
+      *nitems = r->items;
+      if (nstreams)
+	*nstreams = r->streams;
+      if (ids && r->nids >= 0)
+	{
+	  *ids = malloc(r->nids * sizeof(int) + 1);
+	  if (*ids)
+	    memcpy(*ids, r->ids, r->nids * sizeof(int));
+	  *nids = r->nids;
+	}
+
+      CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl_cache.lck));
+      return 0;
+    }
+
+  // Read before evaluating, so a change while we are at it invalidates the result
+  result.gen_counters = __atomic_load_n(&db_counters_generation, __ATOMIC_RELAXED);
+  result.gen_updates = __atomic_load_n(&db_smartpl_cache.gen_updates, __ATOMIC_RELAXED);
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl_cache.lck));
+
+  DPRINTF(E_DBG, L_DB, "Evaluating smart playlist %d\n", id);
+
+  result.id = id;
+  result.hash = hash;
+  result.update_dep = smartpl_is_update_dep(query) || smartpl_is_update_dep(order);
+  if (smartpl_is_timed(query))
+    result.expires = now + DB_SMARTPL_REFRESH_SECS;
+  result.last_used = now;
+  result.nids = -1;
+
+  ret = db_files_get_count(&result.items, &result.streams, query);
+  if (ret < 0)
+    return -1;
+
+  // Random order must not be frozen, so the ids are only kept for a fixed order
+  if (query && limit > 0 && limit <= DB_SMARTPL_IDS_MAX && !(order && strcasestr(order, "random")))
+    {
+      ret = smartpl_ids_fetch(&result, query, order, limit);
+      if (ret < 0)
+	{
+	  free(result.ids);
+	  result.ids = NULL;
+	  result.nids = -1;
+	}
+    }
+
+  *nitems = result.items;
+  if (nstreams)
+    *nstreams = result.streams;
+  if (ids && result.nids >= 0)
+    {
+      *ids = malloc(result.nids * sizeof(int) + 1);
+      if (*ids)
+	memcpy(*ids, result.ids, result.nids * sizeof(int));
+      *nids = result.nids;
+    }
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_smartpl_cache.lck));
+
+  // Replace the playlist's entry, or an unused one, or the least recently used
+  for (i = 0, slot = NULL; i < DB_SMARTPL_CACHE_SIZE; i++)
+    {
+      r = &db_smartpl_cache.entries[i];
+      if (r->id == id)
+	{
+	  slot = r;
+	  break;
+	}
+      else if (!slot || (slot->id != 0 && (r->id == 0 || r->last_used < slot->last_used)))
+	slot = r;
+    }
+
+  smartpl_result_free(slot);
+  *slot = result;
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl_cache.lck));
+
+  return 0;
+}
+
+static void
+smartpl_cache_clear(void)
+{
+  int i;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_smartpl_cache.lck));
+  for (i = 0; i < DB_SMARTPL_CACHE_SIZE; i++)
+    smartpl_result_free(&db_smartpl_cache.entries[i]);
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl_cache.lck));
+}
+
+
 /* Transactions */
 void
 db_transaction_begin(void)
@@ -1972,119 +2649,417 @@ db_free_query_clause(struct query_clause *qc)
   sqlite3_free(qc->having);
   sqlite3_free(qc->order);
   sqlite3_free(qc->index);
+  sqlite3_free(qc->keyset_select);
+  sqlite3_free(qc->keyset_where);
+  sqlite3_free(qc->keyset_group);
+  sqlite3_free(qc->keyset_cond);
   free(qc);
 }
 
-// Builds the generic parts of the query. Parts that are specific to the query
-// type are in db_build_query_* implementations.
-static struct query_clause *
-db_build_query_clause(struct query_params *qp)
+// Listings that are only restricted by media kind are read from the aggregates
+// in group_stats, with the attributes that are the same for all tracks of the
+// group (e.g. the album name) taken from a representative file
+static bool
+db_build_query_group_stats_usable(struct query_params *qp)
 {
-  struct query_clause *qc;
-
-  qc = calloc(1, sizeof(struct query_clause));
-  if (!qc)
-    goto error;
-
-  if (qp->type & Q_F_BROWSE)
-    qc->group = sqlite3_mprintf("GROUP BY %s", browse_clause[qp->type & ~Q_F_BROWSE].group);
-  else if (qp->group)
-    qc->group = sqlite3_mprintf("GROUP BY %s", qp->group);
-  else
-    qc->group = sqlite3_mprintf("");
-
-  if (qp->filter && !qp->with_disabled)
-    qc->where = sqlite3_mprintf("WHERE f.disabled = 0 AND %s", qp->filter);
-  else if (!qp->with_disabled)
-    qc->where = sqlite3_mprintf("WHERE f.disabled = 0");
-  else if (qp->filter)
-    qc->where = sqlite3_mprintf("WHERE %s", qp->filter);
-  else
-    qc->where = sqlite3_mprintf("");
+  return qp->media_kind && !qp->filter && !qp->having && !qp->order && !qp->with_disabled;
+}
 
-  if (qp->having && (qp->type & (Q_GROUP_ALBUMS | Q_GROUP_ARTISTS)))
-    qc->having = sqlite3_mprintf("HAVING %s", qp->having);
-  else
-    qc->having = sqlite3_mprintf("");
+static const struct keyset_clause *
+keyset_clause_find(struct query_params *qp)
+{
+  int i;
 
-  if (qp->order)
-    qc->order = sqlite3_mprintf("ORDER BY %s", qp->order);
-  else if (qp->sort)
-    qc->order = sqlite3_mprintf("ORDER BY %s", sort_clause[qp->sort]);
-  else if (qp->type & Q_F_BROWSE)
-    qc->order = sqlite3_mprintf("ORDER BY %s", browse_clause[qp->type & ~Q_F_BROWSE].group);
-  else
-    qc->order = sqlite3_mprintf("");
+  if (qp->order || qp->id)
+    return NULL;
 
-  switch (qp->idx_type)
+  for (i = 0; i < ARRAY_SIZE(keyset_clause); i++)
     {
-      case I_FIRST:
-	if (qp->limit)
-	  qc->index = sqlite3_mprintf("LIMIT %d", qp->limit);
-	else
-	  qc->index = sqlite3_mprintf("");
-	break;
-
-      case I_LAST:
-	qc->index = sqlite3_mprintf("LIMIT -1 OFFSET %d", qp->results - qp->limit);
-	break;
-
-      case I_SUB:
-	if (qp->limit)
-	  qc->index = sqlite3_mprintf("LIMIT %d OFFSET %d", qp->limit, qp->offset);
-	else
-	  qc->index = sqlite3_mprintf("LIMIT -1 OFFSET %d", qp->offset);
-	break;
-
-      case I_NONE:
-	qc->index = sqlite3_mprintf("");
-	break;
+      if (keyset_clause[i].type == qp->type && keyset_clause[i].sort == qp->sort)
+	return &keyset_clause[i];
     }
 
-  if (!qc->where || !qc->index)
-    goto error;
-
-  return qc;
-
- error:
-  DPRINTF(E_LOG, L_DB, "Error building query clause\n");
-  db_free_query_clause(qc);
   return NULL;
 }
 
+/* Returns the key columns first to last (excl.) as a list for select, order and
+ * the page condition
+ */
 static char *
-db_build_query_check(struct query_params *qp, char *count, char *query)
+keyset_cols(const struct keyset_clause *ksc, int first, int last)
 {
-  if (!count || !query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      goto failed;
-    }
+  char *cols = NULL;
+  char *tmp;
+  int i;
 
-  qp->results = db_get_one_int(count);
-  if (qp->results < 0)
+  for (i = first; i < last; i++)
     {
-      DPRINTF(E_LOG, L_DB, "No results for count\n");
-      goto failed;
-    }
-
-  sqlite3_free(count);
+      tmp = sqlite3_mprintf("%s%s%s", cols ? cols : "", cols ? ", " : "", ksc->cols[i]);
 
-  return query;
+      sqlite3_free(cols);
+      cols = tmp;
+      if (!cols)
+	return NULL;
+    }
 
- failed:
-  sqlite3_free(count);
-  sqlite3_free(query);
-  return NULL;
+  return cols;
 }
 
+/* The cursor is the base64 encoded key of the last row of the previous page.
+ * Each value is encoded as "i<integer>;", "t<length>:<text>" or "n;" for NULL,
+ * so that the decoding is unambigious, and then added to the page condition as
+ * literals. Rows are ordered with NULLs first (the SQLite default), so:
+ *   (a, b) > (x, y)  ->  a > x OR (a = x AND b > y)
+ *   (a, b) > (NULL, y)  ->  a IS NOT NULL OR (a IS NULL AND b > y)
+ * If no value is NULL the row value comparison is used, since SQLite can walk
+ * an index with that. It gives the same result, because the comparison only
+ * becomes NULL (i.e. false) when a NULL column is reached with all preceding
+ * columns equal, and then the row sorts before the cursor.
+ */
 static char *
-db_build_query_items(struct query_params *qp, struct query_clause *qc)
-{
-  char *count;
-  char *query;
+keyset_condition(const struct keyset_clause *ksc, const char *cursor)
+{
+  char *values[KEYSET_COLS_MAX] = { NULL };
+  char *decoded;
+  char *cols = NULL;
+  char *list = NULL;
+  char *cond = NULL;
+  char *eq = NULL;
+  char *term;
+  char *tmp;
+  char *ptr;
+  char *end;
+  bool has_null = false;
+  long long intval;
+  long len;
+  int decoded_len;
+  int i;
+  int j;
 
-  if (qp->id == 0)
+  decoded = (char *)b64_decode(&decoded_len, cursor);
+  if (!decoded)
+    goto error;
+
+  ptr = decoded;
+  end = decoded + decoded_len;
+  for (i = 0; i < ksc->ncols && ptr < end; i++)
+    {
+      if (*ptr == 'i')
+	{
+	  intval = strtoll(ptr + 1, &ptr, 10);
+	  if (ptr >= end || *ptr != ';')
+	    goto error;
+	  ptr++;
+
+	  values[i] = sqlite3_mprintf("%lld", intval);
+	}
+      else if (*ptr == 't')
+	{
+	  len = strtol(ptr + 1, &ptr, 10);
+	  if (ptr >= end || *ptr != ':' || len < 0 || len > end - ptr - 1)
+	    goto error;
+	  ptr++;
+
+	  values[i] = sqlite3_mprintf("'%.*q'", (int)len, ptr);
+	  ptr += len;
+	}
+      else if (*ptr == 'n' && ptr + 1 < end && ptr[1] == ';')
+	{
+	  ptr += 2;
+
+	  values[i] = NULL;
+	  has_null = true;
+	  continue;
+	}
+      else
+	goto error;
+
+      if (!values[i])
+	goto error;
+    }
+
+  if (i != ksc->ncols || ptr != end)
+    goto error;
+
+  if (!has_null)
+    {
+      cols = keyset_cols(ksc, 0, ksc->ncols);
+      if (!cols)
+	goto error;
+
+      for (i = 0; i < ksc->ncols; i++)
+	{
+	  tmp = sqlite3_mprintf("%s%s%s", list ? list : "", list ? ", " : "", values[i]);
+	  sqlite3_free(list);
+	  list = tmp;
+	  if (!list)
+	    goto error;
+	}
+
+      cond = sqlite3_mprintf("(%s) > (%s)", cols, list);
+      goto out;
+    }
+
+  for (i = 0; i < ksc->ncols; i++)
+    {
+      sqlite3_free(cols);
+      cols = keyset_cols(ksc, i, i + 1);
+      if (!cols)
+	goto error;
+
+      if (values[i])
+	term = sqlite3_mprintf("%s%s%s > %s", eq ? eq : "", eq ? " AND " : "", cols, values[i]);
+      else
+	term = sqlite3_mprintf("%s%s%s IS NOT NULL", eq ? eq : "", eq ? " AND " : "", cols);
+      if (!term)
+	goto error;
+
+      ptr = sqlite3_mprintf("%s%s(%s)", cond ? cond : "", cond ? " OR " : "", term);
+      sqlite3_free(term);
+      sqlite3_free(cond);
+      cond = ptr;
+      if (!cond)
+	goto error;
+
+      if (values[i])
+	ptr = sqlite3_mprintf("%s%s%s = %s", eq ? eq : "", eq ? " AND " : "", cols, values[i]);
+      else
+	ptr = sqlite3_mprintf("%s%s%s IS NULL", eq ? eq : "", eq ? " AND " : "", cols);
+      sqlite3_free(eq);
+      eq = ptr;
+      if (!eq)
+	goto error;
+    }
+
+  tmp = sqlite3_mprintf("(%s)", cond);
+  sqlite3_free(cond);
+  cond = tmp;
+
+ out:
+  for (j = 0; j < ksc->ncols; j++)
+    sqlite3_free(values[j]);
+  sqlite3_free(cols);
+  sqlite3_free(list);
+  sqlite3_free(eq);
+  free(decoded);
+  return cond;
+
+ error:
+  DPRINTF(E_LOG, L_DB, "Invalid cursor '%s'\n", cursor);
+  sqlite3_free(cond);
+  cond = NULL;
+  goto out;
+}
+
+static int
+db_build_query_keyset(struct query_params *qp, struct query_clause *qc)
+{
+  const struct keyset_clause *ksc;
+  char *cols;
+  char *cond = NULL;
+
+  ksc = keyset_clause_find(qp);
+  if (!ksc)
+    {
+      DPRINTF(E_LOG, L_DB, "Query type %d with sort %d does not support paging by cursor\n", qp->type, qp->sort);
+      return -1;
+    }
+
+  if (qp->cursor)
+    {
+      cond = keyset_condition(ksc, qp->cursor);
+      if (!cond)
+	return -1;
+    }
+
+  cols = keyset_cols(ksc, 0, ksc->ncols);
+  if (!cols)
+    {
+      sqlite3_free(cond);
+      return -1;
+    }
+
+  sqlite3_free(qc->order);
+  qc->order = sqlite3_mprintf("ORDER BY %s", cols);
+  qc->keyset_select = sqlite3_mprintf(", %s", cols);
+  qc->keyset_group = sqlite3_mprintf("GROUP BY %s", cols);
+  sqlite3_free(cols);
+
+  if (cond)
+    qc->keyset_where = sqlite3_mprintf("%s %s %s", qc->where, qc->where[0] ? "AND" : "WHERE", cond);
+  else
+    qc->keyset_where = sqlite3_mprintf("%s", qc->where);
+
+  qc->keyset_cond = cond;
+
+  qp->keyset_ncols = ksc->ncols;
+
+  if (!qc->order || !qc->keyset_select || !qc->keyset_group || !qc->keyset_where)
+    return -1;
+
+  return 0;
+}
+
+/* Checks if the query can be paged by cursor, and if the cursor (if any) is
+ * valid for it. Lets callers tell invalid requests apart from query errors.
+ */
+int
+db_query_cursor_check(struct query_params *qp)
+{
+  const struct keyset_clause *ksc;
+  char *cond;
+
+  ksc = keyset_clause_find(qp);
+  if (!ksc)
+    return -1;
+
+  if (!qp->cursor)
+    return 0;
+
+  cond = keyset_condition(ksc, qp->cursor);
+  if (!cond)
+    return -1;
+
+  sqlite3_free(cond);
+  return 0;
+}
+
+// Builds the generic parts of the query. Parts that are specific to the query
+// type are in db_build_query_* implementations.
+static struct query_clause *
+db_build_query_clause(struct query_params *qp)
+{
+  struct query_clause *qc;
+  char *media_kind_filter = NULL;
+  const char *filter = qp->filter;
+
+  qc = calloc(1, sizeof(struct query_clause));
+  if (!qc)
+    goto error;
+
+  if (qp->type & Q_F_BROWSE)
+    qc->group = sqlite3_mprintf("GROUP BY %s", browse_clause[qp->type & ~Q_F_BROWSE].group);
+  else if (qp->group)
+    qc->group = sqlite3_mprintf("GROUP BY %s", qp->group);
+  else
+    qc->group = sqlite3_mprintf("");
+
+  if (qp->media_kind && qp->filter)
+    filter = media_kind_filter = sqlite3_mprintf("f.media_kind = %d AND %s", qp->media_kind, qp->filter);
+  else if (qp->media_kind)
+    filter = media_kind_filter = sqlite3_mprintf("f.media_kind = %d", qp->media_kind);
+
+  if (qp->media_kind && !media_kind_filter)
+    qc->where = NULL;
+  else if (filter && !qp->with_disabled)
+    qc->where = sqlite3_mprintf("WHERE f.disabled = 0 AND %s", filter);
+  else if (!qp->with_disabled)
+    qc->where = sqlite3_mprintf("WHERE f.disabled = 0");
+  else if (filter)
+    qc->where = sqlite3_mprintf("WHERE %s", filter);
+  else
+    qc->where = sqlite3_mprintf("");
+
+  sqlite3_free(media_kind_filter);
+
+  if (qp->having && (qp->type & (Q_GROUP_ALBUMS | Q_GROUP_ARTISTS)))
+    qc->having = sqlite3_mprintf("HAVING %s", qp->having);
+  else
+    qc->having = sqlite3_mprintf("");
+
+  if (qp->order)
+    qc->order = sqlite3_mprintf("ORDER BY %s", qp->order);
+  else if (qp->sort)
+    qc->order = sqlite3_mprintf("ORDER BY %s", sort_clause[qp->sort]);
+  else if (qp->type & Q_F_BROWSE)
+    qc->order = sqlite3_mprintf("ORDER BY %s", browse_clause[qp->type & ~Q_F_BROWSE].group);
+  else
+    qc->order = sqlite3_mprintf("");
+
+  switch (qp->idx_type)
+    {
+      case I_FIRST:
+	if (qp->limit)
+	  qc->index = sqlite3_mprintf("LIMIT %d", qp->limit);
+	else
+	  qc->index = sqlite3_mprintf("");
+	break;
+
+      case I_LAST:
+	qc->index = sqlite3_mprintf("LIMIT -1 OFFSET %d", qp->results - qp->limit);
+	break;
+
+      case I_SUB:
+	if (qp->limit)
+	  qc->index = sqlite3_mprintf("LIMIT %d OFFSET %d", qp->limit, qp->offset);
+	else
+	  qc->index = sqlite3_mprintf("LIMIT -1 OFFSET %d", qp->offset);
+	break;
+
+      case I_CURSOR:
+	if (qp->limit > 0)
+	  qc->index = sqlite3_mprintf("LIMIT %d", qp->limit);
+	else
+	  qc->index = sqlite3_mprintf("");
+	break;
+
+      case I_NONE:
+	qc->index = sqlite3_mprintf("");
+	break;
+    }
+
+  if (!qc->where || !qc->having || !qc->order || !qc->index)
+    goto error;
+
+  if (qp->idx_type == I_CURSOR && db_build_query_keyset(qp, qc) < 0)
+    goto error;
+
+  return qc;
+
+ error:
+  DPRINTF(E_LOG, L_DB, "Error building query clause\n");
+  db_free_query_clause(qc);
+  return NULL;
+}
+
+static char *
+db_build_query_check(struct query_params *qp, char *count, char *query)
+{
+  if (!count || !query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      goto failed;
+    }
+
+  qp->results = db_get_one_int(count);
+  if (qp->results < 0)
+    {
+      DPRINTF(E_LOG, L_DB, "No results for count\n");
+      goto failed;
+    }
+
+  sqlite3_free(count);
+
+  return query;
+
+ failed:
+  sqlite3_free(count);
+  sqlite3_free(query);
+  return NULL;
+}
+
+static char *
+db_build_query_items(struct query_params *qp, struct query_clause *qc)
+{
+  char *count;
+  char *query;
+
+  if (qp->id == 0 && qp->idx_type == I_CURSOR)
+    {
+      count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s;", qc->where);
+      query = sqlite3_mprintf("SELECT f.*%s FROM files f %s %s %s %s;", qc->keyset_select, qc->keyset_where, qc->group, qc->order, qc->index);
+    }
+  else if (qp->id == 0)
     {
       count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s;", qc->where);
       query = sqlite3_mprintf("SELECT f.* FROM files f %s %s %s %s;", qc->where, qc->group, qc->order, qc->index);
@@ -2143,6 +3118,62 @@ db_build_query_plitems_plain(struct query_params *qp, struct query_clause *qc)
   return db_build_query_check(qp, count, query);
 }
 
+// Lists the items of a smart playlist with a limit from the cached ids, so the
+// rule isn't evaluated against all of files. Returns NULL if the ids are not
+// available or the query has its own filter or sorting.
+static char *
+db_build_query_plitems_cached(struct query_params *qp, struct playlist_info *pli)
+{
+  struct query_clause *qc;
+  uint32_t nitems;
+  int *ids;
+  int nids;
+  char *idlist;
+  char *count;
+  char *query;
+  size_t len;
+  int i;
+
+  if (pli->query_limit == 0 || qp->filter || qp->media_kind || qp->having || qp->order || qp->sort != S_NONE || qp->with_disabled)
+    return NULL;
+  if (qp->idx_type != I_NONE && qp->idx_type != I_SUB)
+    return NULL;
+
+  smartpl_cache_get(&nitems, NULL, &ids, &nids, pli->id, pli->query, pli->query_order, pli->query_limit);
+  if (!ids)
+    return NULL;
+
+  // The list needs at most 11 chars per id, and "0" for an empty list
+  idlist = malloc(nids * 12 + 2);
+  if (!idlist)
+    {
+      free(ids);
+      return NULL;
+    }
+
+  strcpy(idlist, "0");
+  for (i = 0, len = 0; i < nids; i++)
+    len += sprintf(idlist + len, "%s%d", (i > 0) ? "," : "", ids[i]);
+
+  free(ids);
+
+  qc = db_build_query_clause(qp);
+  if (!qc)
+    {
+      free(idlist);
+      return NULL;
+    }
+
+  count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND f.id IN (%s);", qc->where, idlist);
+  query = sqlite3_mprintf("SELECT f.* FROM files f %s AND f.id IN (%s) %s%s %s;",
+			  qc->where, idlist, pli->query_order ? "ORDER BY " : "", pli->query_order ? pli->query_order : "", qc->index);
+
+  free(idlist);
+  db_free_query_clause(qc);
+
+  return db_build_query_check(qp, count, query);
+}
+
 static char *
 db_build_query_plitems_smart(struct query_params *qp, struct playlist_info *pli)
 {
@@ -2151,6 +3182,10 @@ db_build_query_plitems_smart(struct query_params *qp, struct playlist_info *pli)
   char *query;
   bool free_orderby = false;
 
+  query = db_build_query_plitems_cached(qp, pli);
+  if (query)
+    return query;
+
   if (pli->query_limit > 0)
     {
       if (qp->idx_type == I_SUB)
@@ -2238,21 +3273,47 @@ db_build_query_plitems(struct query_params *qp, struct query_clause *qc)
   return query;
 }
 
+static char *
+db_build_query_group_stats(struct query_params *qp, struct query_clause *qc, enum group_type type, const char *name_cols)
+{
+  char *count;
+  char *query;
+
+  count = sqlite3_mprintf("SELECT COUNT(*) FROM group_stats s WHERE s.type = %d AND s.media_kind = %d AND s.track_count > 0;",
+			  type, qp->media_kind);
+  query = sqlite3_mprintf("SELECT" \
+			  " g.id, g.persistentid, %s, s.track_count, s.album_count, f.album_artist, f.songartistid," \
+			  " s.song_length, s.data_kind, s.media_kind, s.year, s.date_released," \
+			  " s.time_added, s.time_played, s.seek%s " \
+			  "FROM group_stats s JOIN groups g ON g.type = s.type AND g.persistentid = s.persistentid" \
+			  " JOIN files f ON f.id = s.file_id " \
+			  "WHERE s.type = %d AND s.media_kind = %d AND s.track_count > 0%s%s %s %s;",
+			  name_cols, qc->keyset_select ? qc->keyset_select : "", type, qp->media_kind,
+			  qc->keyset_cond ? " AND " : "", qc->keyset_cond ? qc->keyset_cond : "", qc->order, qc->index);
+
+  return db_build_query_check(qp, count, query);
+}
+
 static char *
 db_build_query_group_albums(struct query_params *qp, struct query_clause *qc)
 {
   char *count;
   char *query;
 
+  if (db_build_query_group_stats_usable(qp))
+    return db_build_query_group_stats(qp, qc, G_ALBUMS, "f.album, f.album_sort");
+
   count = sqlite3_mprintf("SELECT COUNT(DISTINCT f.songalbumid) FROM files f %s;", qc->where);
   query = sqlite3_mprintf("SELECT" \
 			  " g.id, g.persistentid, f.album, f.album_sort, COUNT(f.id) AS track_count," \
 			  " 1 AS album_count, f.album_artist, f.songartistid," \
 			  " SUM(f.song_length) AS song_length, MIN(f.data_kind) AS data_kind, MIN(f.media_kind) AS media_kind," \
 			  " MAX(f.year) AS year, MAX(f.date_released) AS date_released," \
-			  " MAX(f.time_added) AS time_added, MAX(f.time_played) AS time_played, MAX(f.seek) AS seek " \
-			  "FROM files f JOIN groups g ON f.songalbumid = g.persistentid %s " \
-			  "GROUP BY f.songalbumid %s %s %s;", qc->where, qc->having, qc->order, qc->index);
+			  " MAX(f.time_added) AS time_added, MAX(f.time_played) AS time_played, MAX(f.seek) AS seek%s " \
+			  "FROM files f JOIN groups g ON g.type = %d AND f.songalbumid = g.persistentid %s " \
+			  "%s %s %s %s;",
+			  qc->keyset_select ? qc->keyset_select : "", G_ALBUMS, qc->keyset_where ? qc->keyset_where : qc->where,
+			  qc->keyset_group ? qc->keyset_group : "GROUP BY f.songalbumid", qc->having, qc->order, qc->index);
 
   return db_build_query_check(qp, count, query);
 }
@@ -2263,16 +3324,20 @@ db_build_query_group_artists(struct query_params *qp, struct query_clause *qc)
   char *count;
   char *query;
 
+  if (db_build_query_group_stats_usable(qp))
+    return db_build_query_group_stats(qp, qc, G_ARTISTS, "f.album_artist, f.album_artist_sort");
+
   count = sqlite3_mprintf("SELECT COUNT(DISTINCT f.songartistid) FROM files f %s;", qc->where);
   query = sqlite3_mprintf("SELECT" \
 			  " g.id, g.persistentid, f.album_artist, f.album_artist_sort, COUNT(f.id) AS track_count," \
 			  " COUNT(DISTINCT f.songalbumid) AS album_count, f.album_artist, f.songartistid," \
 			  " SUM(f.song_length) AS song_length, MIN(f.data_kind) AS data_kind, MIN(f.media_kind) AS media_kind," \
 			  " MAX(f.year) AS year, MAX(f.date_released) AS date_released," \
-			  " MAX(f.time_added) AS time_added, MAX(f.time_played) AS time_played, MAX(f.seek) AS seek " \
-			  "FROM files f JOIN groups g ON f.songartistid = g.persistentid %s " \
-			  "GROUP BY f.songartistid %s %s %s;",
-			  qc->where, qc->having, qc->order, qc->index);
+			  " MAX(f.time_added) AS time_added, MAX(f.time_played) AS time_played, MAX(f.seek) AS seek%s " \
+			  "FROM files f JOIN groups g ON g.type = %d AND f.songartistid = g.persistentid %s " \
+			  "%s %s %s %s;",
+			  qc->keyset_select ? qc->keyset_select : "", G_ARTISTS, qc->keyset_where ? qc->keyset_where : qc->where,
+			  qc->keyset_group ? qc->keyset_group : "GROUP BY f.songartistid", qc->having, qc->order, qc->index);
 
   return db_build_query_check(qp, count, query);
 }
@@ -2375,8 +3440,10 @@ db_build_query_count_items(struct query_params *qp, struct query_clause *qc)
   return query;
 }
 
-int
-db_query_start(struct query_params *qp)
+// The query is built with the thread's own connection, since that may involve
+// other queries, but the statement is prepared on conn if given
+static int
+query_start(struct query_params *qp, sqlite3 *conn)
 {
   struct query_clause *qc;
   sqlite3_stmt *stmt;
@@ -2445,10 +3512,14 @@ db_query_start(struct query_params *qp)
 
   DPRINTF(E_DBG, L_DB, "Starting query '%s'\n", query);
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  // Readers have a private cache, so they get SQLITE_BUSY, not SQLITE_LOCKED
+  if (conn)
+    ret = sqlite3_prepare_v2(conn, query, -1, &stmt, NULL);
+  else
+    ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(conn ? conn : hdl));
 
       sqlite3_free(query);
       return -1;
@@ -2461,14 +3532,96 @@ db_query_start(struct query_params *qp)
   return 0;
 }
 
-void
-db_query_end(struct query_params *qp)
+// Prepares the query on a read-only connection from the pool, if available
+int
+db_query_start(struct query_params *qp)
+{
+  sqlite3 *reader;
+  int ret;
+
+  qp->reader = NULL;
+
+  reader = db_reader_acquire();
+
+  ret = query_start(qp, reader);
+  if (ret < 0)
+    {
+      if (reader)
+	db_reader_release();
+      return -1;
+    }
+
+  qp->reader = reader;
+
+  return 0;
+}
+
+void
+db_query_end(struct query_params *qp)
 {
   if (!qp->stmt)
     return;
 
   sqlite3_finalize(qp->stmt);
   qp->stmt = NULL;
+
+  if (qp->reader)
+    db_reader_release();
+
+  qp->reader = NULL;
+}
+
+/* Returns the cursor for the page that follows the row that was fetched last,
+ * or NULL if the query isn't paged by cursor. Caller must free.
+ */
+char *
+db_query_cursor(struct query_params *qp)
+{
+  const char *text;
+  char *key = NULL;
+  char *tmp;
+  char *cursor;
+  int ncols;
+  int len;
+  int i;
+
+  if (!qp->stmt || qp->idx_type != I_CURSOR || qp->keyset_ncols <= 0)
+    return NULL;
+
+  ncols = sqlite3_data_count(qp->stmt);
+  if (ncols < qp->keyset_ncols)
+    return NULL;
+
+  for (i = ncols - qp->keyset_ncols; i < ncols; i++)
+    {
+      if (sqlite3_column_type(qp->stmt, i) == SQLITE_INTEGER)
+	{
+	  tmp = sqlite3_mprintf("%si%lld;", key ? key : "", sqlite3_column_int64(qp->stmt, i));
+	}
+      else if (sqlite3_column_type(qp->stmt, i) == SQLITE_NULL)
+	{
+	  tmp = sqlite3_mprintf("%sn;", key ? key : "");
+	}
+      else
+	{
+	  text = (const char *)sqlite3_column_text(qp->stmt, i);
+	  len = text ? sqlite3_column_bytes(qp->stmt, i) : 0;
+	  tmp = sqlite3_mprintf("%st%d:%.*s", key ? key : "", len, len, text ? text : "");
+	}
+
+      sqlite3_free(key);
+      key = tmp;
+      if (!key)
+	{
+	  DPRINTF(E_LOG, L_DB, "Out of memory for query cursor\n");
+	  return NULL;
+	}
+    }
+
+  cursor = b64_encode((uint8_t *)key, strlen(key));
+  sqlite3_free(key);
+
+  return cursor;
 }
 
 /*
@@ -2538,7 +3691,7 @@ db_query_fetch(void *item, struct query_params *qp, const ssize_t cols_map[], in
     }
   else if (ret != SQLITE_ROW)
     {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(sqlite3_db_handle(qp->stmt)));
       return -1;
     }
 
@@ -2581,6 +3734,60 @@ db_query_fetch_file(struct db_media_file_info *dbmfi, struct query_params *qp)
   return ret;
 }
 
+// Like db_query_fetch_file(), but integer columns are read directly from the
+// statement into their typed struct fields, so there is no string conversion
+// roundtrip. Strings are not copied, they point into the statement and are only
+// valid until the next fetch or db_query_end(). Do not free mfi content.
+int
+db_query_fetch_mfi(struct media_file_info *mfi, struct query_params *qp)
+{
+  int ncols;
+  int i;
+  int ret;
+
+  memset(mfi, 0, sizeof(struct media_file_info));
+
+  if ((qp->type != Q_ITEMS) && (qp->type != Q_PLITEMS) && (qp->type != Q_GROUP_ITEMS))
+    {
+      DPRINTF(E_LOG, L_DB, "Not an items, playlist or group items query!\n");
+      return -1;
+    }
+
+  if (!qp->stmt)
+    {
+      DPRINTF(E_LOG, L_DB, "Query not started!\n");
+      return -1;
+    }
+
+  ret = db_blocking_step(qp->stmt);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_DBG, L_DB, "End of query results\n");
+      return 1;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(sqlite3_db_handle(qp->stmt)));
+      return -1;
+    }
+
+  ncols = sqlite3_column_count(qp->stmt);
+
+  // We allow more cols in db than in map because the db may be a future schema
+  if (ncols < ARRAY_SIZE(mfi_cols_map))
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: database has fewer columns (%d) than mfi column map (%u)\n", ncols, ARRAY_SIZE(mfi_cols_map));
+      return -1;
+    }
+
+  for (i = 0; i < ARRAY_SIZE(mfi_cols_map); i++)
+    {
+      struct_field_from_statement(mfi, mfi_cols_map[i].offset, mfi_cols_map[i].type, qp->stmt, i, false, false);
+    }
+
+  return 0;
+}
+
 int
 db_query_fetch_pl(struct db_playlist_info *dbpli, struct query_params *qp)
 {
@@ -2588,6 +3795,7 @@ db_query_fetch_pl(struct db_playlist_info *dbpli, struct query_params *qp)
   char **strcol;
   uint32_t nitems;
   uint32_t nstreams;
+  int32_t limit;
   int type;
   int i;
   int ret;
@@ -2615,7 +3823,7 @@ db_query_fetch_pl(struct db_playlist_info *dbpli, struct query_params *qp)
     }
   else if (ret != SQLITE_ROW)
     {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(sqlite3_db_handle(qp->stmt)));	
       return -1;
     }
 
@@ -2638,7 +3846,10 @@ db_query_fetch_pl(struct db_playlist_info *dbpli, struct query_params *qp)
   type = sqlite3_column_int(qp->stmt, 2);
   if (type == PL_SPECIAL || type == PL_SMART)
     {
-      db_files_get_count(&nitems, &nstreams, dbpli->query);
+      if (!dbpli->query_limit || safe_atoi32(dbpli->query_limit, &limit) < 0)
+	limit = 0;
+
+      smartpl_cache_get(&nitems, &nstreams, NULL, NULL, sqlite3_column_int(qp->stmt, 0), dbpli->query, dbpli->query_order, limit);
       snprintf(qp->buf1, sizeof(qp->buf1), "%d", (int)nitems);
       snprintf(qp->buf2, sizeof(qp->buf2), "%d", (int)nstreams);
       dbpli->items = qp->buf1;
@@ -2715,7 +3926,7 @@ db_query_fetch_count(struct filecount_info *fci, struct query_params *qp)
     }
   else if (ret != SQLITE_ROW)
     {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(sqlite3_db_handle(qp->stmt)));
       return -1;
     }
 
@@ -2733,6 +3944,9 @@ db_filecount_get(struct filecount_info *fci, struct query_params *qp)
 {
   int ret;
 
+  if (qp->type == Q_COUNT_ITEMS && !qp->filter && !qp->media_kind && !qp->with_disabled)
+    return db_counters_get(fci, NULL, NULL);
+
   ret = db_query_start(qp);
   if (ret < 0)
     {
@@ -2775,7 +3989,7 @@ db_query_fetch_string(char **string, struct query_params *qp)
     }
   else if (ret != SQLITE_ROW)
     {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(sqlite3_db_handle(qp->stmt)));	
       return -1;
     }
 
@@ -2812,7 +4026,7 @@ db_query_fetch_string_sort(char **string, char **sortstring, struct query_params
     }
   else if (ret != SQLITE_ROW)
     {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(sqlite3_db_handle(qp->stmt)));
       return -1;
     }
 
@@ -2823,19 +4037,152 @@ db_query_fetch_string_sort(char **string, char **sortstring, struct query_params
 }
 
 
+/* Library totals
+ *
+ * Remotes poll the totals often, so they are cached instead of counting the
+ * files table every time. Files being added or removed, and any write to
+ * playlists, is seen by the update hook of the connection, which makes the
+ * cache stale. The hook can't tell which columns an update changed, so the
+ * file updates that can change the counted columns (disabled, song_length,
+ * songartistid, songalbumid, file_size and data_kind) invalidate the cache
+ * themselves, while e.g. play count updates leave it alone. The totals are
+ * then counted again on the next request.
+ */
+static inline void
+db_counters_invalidate(void)
+{
+  __atomic_add_fetch(&db_counters_generation, 1, __ATOMIC_RELAXED);
+}
+
+static void
+db_update_hook_cb(void *arg, int op, const char *dbname, const char *table, sqlite3_int64 rowid)
+{
+  if (strcmp(table, "files") == 0)
+    {
+      if (op == SQLITE_UPDATE)
+	__atomic_add_fetch(&db_smartpl_cache.gen_updates, 1, __ATOMIC_RELAXED);
+      else
+	db_counters_invalidate();
+    }
+  else if (strcmp(table, "playlists") == 0)
+    db_counters_invalidate();
+}
+
+static int
+db_counters_count(struct db_counters *counters)
+{
+#define Q_TMPL "SELECT COUNT(*), SUM(song_length), COUNT(DISTINCT songartistid), COUNT(DISTINCT songalbumid), SUM(file_size)," \
+               " SUM(data_kind = %d) FROM files f WHERE f.disabled = 0;"
+  sqlite3_stmt *stmt;
+  char *query;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, DATA_KIND_HTTP);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      sqlite3_finalize(stmt);
+      return -1;
+    }
+
+  counters->fci.count = sqlite3_column_int(stmt, 0);
+  counters->fci.length = sqlite3_column_int64(stmt, 1);
+  counters->fci.artist_count = sqlite3_column_int(stmt, 2);
+  counters->fci.album_count = sqlite3_column_int(stmt, 3);
+  counters->fci.file_size = sqlite3_column_int64(stmt, 4);
+  counters->streams = sqlite3_column_int(stmt, 5);
+
+  sqlite3_finalize(stmt);
+
+  ret = db_get_one_int("SELECT COUNT(*) FROM playlists p WHERE p.disabled = 0;");
+  if (ret < 0)
+    return -1;
+
+  counters->playlists = ret;
+
+  return 0;
+#undef Q_TMPL
+}
+
+// All arguments are optional
+static int
+db_counters_get(struct filecount_info *fci, uint32_t *streams, uint32_t *playlists)
+{
+  struct db_counters counters;
+  uint32_t generation;
+  int ret;
+
+  generation = __atomic_load_n(&db_counters_generation, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&db_counters.lck);
+  counters = db_counters;
+  pthread_mutex_unlock(&db_counters.lck);
+
+  if (counters.generation != generation)
+    {
+      ret = db_counters_count(&counters);
+      if (ret < 0)
+	return -1;
+
+      // Don't save the result if the library changed while we were counting
+      pthread_mutex_lock(&db_counters.lck);
+      if (generation == __atomic_load_n(&db_counters_generation, __ATOMIC_RELAXED))
+	{
+	  db_counters.generation = generation;
+	  db_counters.fci = counters.fci;
+	  db_counters.streams = counters.streams;
+	  db_counters.playlists = counters.playlists;
+	}
+      pthread_mutex_unlock(&db_counters.lck);
+    }
+
+  if (fci)
+    *fci = counters.fci;
+  if (streams)
+    *streams = counters.streams;
+  if (playlists)
+    *playlists = counters.playlists;
+
+  return 0;
+}
+
+
 /* Files */
 int
 db_files_get_count(uint32_t *nitems, uint32_t *nstreams, const char *filter)
 {
+  struct filecount_info fci;
   sqlite3_stmt *stmt = NULL;
   char *query = NULL;
   int ret;
 
-  if (!filter && !nstreams)
-    query = sqlite3_mprintf("SELECT COUNT(*) FROM files f WHERE f.disabled = 0;");
-  else if (!filter)
-    query = sqlite3_mprintf("SELECT COUNT(*), SUM(data_kind = %d) FROM files f WHERE f.disabled = 0;", DATA_KIND_HTTP);
-  else if (!nstreams)
+  if (!filter)
+    {
+      ret = db_counters_get(&fci, nstreams, NULL);
+      if (ret < 0)
+	return -1;
+
+      if (nitems)
+	*nitems = fci.count;
+      return 0;
+    }
+
+  if (!nstreams)
     query = sqlite3_mprintf("SELECT COUNT(*) FROM files f WHERE f.disabled = 0 AND %s;", filter);
   else
     query = sqlite3_mprintf("SELECT COUNT(*), SUM(data_kind = %d) FROM files f WHERE f.disabled = 0 AND %s;", DATA_KIND_HTTP, filter);
@@ -2963,40 +4310,52 @@ db_file_inc_playcount_bysongalbumid(int64_t id, bool only_unplayed)
 void
 db_file_inc_playcount(int id)
 {
-  char *filter;
+#define Q_TMPL "UPDATE files SET play_count = play_count + 1, time_played = ?, seek = 0 WHERE id = ?;"
+  // see db_file_inc_playcount_byfilter for a description of how the rating is calculated
+#define Q_TMPL_WITH_RATING \
+               "UPDATE files "\
+               " SET play_count = play_count + 1, time_played = ?, seek = 0, "\
+	       "     rating = CAST(((play_count + 1.0) / (play_count + skip_count + 2.0) * 100 * 0.75) + ((rating + ((100.0 - rating) / 2.0)) * 0.25) AS INT)" \
+               " WHERE id = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
 
-  filter = sqlite3_mprintf("id = %d", id);
+  stmt = db_stmt_cache_get(db_rating_updates ? Q_TMPL_WITH_RATING : Q_TMPL);
+  if (!stmt)
+    return;
 
-  db_file_inc_playcount_byfilter(filter);
-  sqlite3_free(filter);
+  sqlite3_bind_int64(stmt, 1, (int64_t)time(NULL));
+  sqlite3_bind_int(stmt, 2, id);
+
+  ret = db_statement_run(stmt, db_rating_updates ? LISTENER_RATING : 0);
+  if (ret >= 0)
+    db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+#undef Q_TMPL
+#undef Q_TMPL_WITH_RATING
 }
 
 void
 db_file_inc_skipcount(int id)
 {
-#define Q_TMPL "UPDATE files SET skip_count = skip_count + 1, time_skipped = %" PRIi64 " WHERE id = %d;"
-  // see db_file_inc_playcount for a description of how the rating is calculated
+#define Q_TMPL "UPDATE files SET skip_count = skip_count + 1, time_skipped = ? WHERE id = ?;"
+  // see db_file_inc_playcount_byfilter for a description of how the rating is calculated
 #define Q_TMPL_WITH_RATING \
                "UPDATE files "\
-               " SET skip_count = skip_count + 1, time_skipped = %" PRIi64 ", seek = 0, "\
+               " SET skip_count = skip_count + 1, time_skipped = ?, seek = 0, "\
 	       "     rating = CAST(((play_count + 1.0) / (play_count + skip_count + 2.0) * 100 * 0.75) + ((rating - (rating / 2.0)) * 0.25) AS INT)" \
-               " WHERE id = %d;"
-  char *query;
+               " WHERE id = ?;"
+  sqlite3_stmt *stmt;
   int ret;
 
-  if (db_rating_updates)
-    query = sqlite3_mprintf(Q_TMPL_WITH_RATING, (int64_t)time(NULL), id);
-  else
-    query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL), id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  stmt = db_stmt_cache_get(db_rating_updates ? Q_TMPL_WITH_RATING : Q_TMPL);
+  if (!stmt)
+    return;
 
-      return;
-    }
+  sqlite3_bind_int64(stmt, 1, (int64_t)time(NULL));
+  sqlite3_bind_int(stmt, 2, id);
 
-  ret = db_query_run(query, 1, db_rating_updates ? LISTENER_RATING : 0);
-  if (ret == 0)
+  ret = db_statement_run(stmt, db_rating_updates ? LISTENER_RATING : 0);
+  if (ret >= 0)
     db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
 #undef Q_TMPL
 #undef Q_TMPL_WITH_RATING
@@ -3026,34 +4385,46 @@ db_file_reset_playskip_count(int id)
 void
 db_file_ping(int id)
 {
-#define Q_TMPL "UPDATE files SET db_timestamp = %" PRIi64 ", disabled = 0 WHERE id = %d;"
-  char *query;
+#define Q_TMPL "UPDATE files SET db_timestamp = ?, disabled = 0 WHERE id = ?;"
+  sqlite3_stmt *stmt;
 
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL), id);
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return;
 
-  db_query_run(query, 1, 0);
+  sqlite3_bind_int64(stmt, 1, (int64_t)time(NULL));
+  sqlite3_bind_int(stmt, 2, id);
+
+  if (db_statement_run(stmt, 0) > 0)
+    db_counters_invalidate();
 #undef Q_TMPL
 }
 
 int
 db_file_ping_bypath(const char *path, time_t mtime_max)
 {
+  int ret;
+
   sqlite3_bind_int64(db_statements.files_ping, 1, (int64_t)time(NULL));
   sqlite3_bind_text(db_statements.files_ping, 2, path, -1, SQLITE_STATIC);
   sqlite3_bind_int64(db_statements.files_ping, 3, (int64_t)mtime_max);
 
-  return db_statement_run(db_statements.files_ping, 0);
+  ret = db_statement_run(db_statements.files_ping, 0);
+  if (ret > 0)
+    db_counters_invalidate();
+
+  return ret;
 }
 
 void
 db_file_ping_bymatch(const char *path, int isdir)
 {
-#define Q_TMPL_DIR "UPDATE files SET db_timestamp = %" PRIi64 " WHERE path LIKE '%q/%%';"
+#define Q_TMPL_DIR "UPDATE files SET db_timestamp = %" PRIi64 " WHERE " DB_PATH_BELOW("path") ";"
 #define Q_TMPL_NODIR "UPDATE files SET db_timestamp = %" PRIi64 " WHERE path LIKE '%q%%';"
   char *query;
 
   if (isdir)
-    query = sqlite3_mprintf(Q_TMPL_DIR, (int64_t)time(NULL), path);
+    query = sqlite3_mprintf(Q_TMPL_DIR, (int64_t)time(NULL), path, path);
   else
     query = sqlite3_mprintf(Q_TMPL_NODIR, (int64_t)time(NULL), path);
 
@@ -3065,30 +4436,16 @@ db_file_ping_bymatch(const char *path, int isdir)
 char *
 db_file_path_byid(int id)
 {
-#define Q_TMPL "SELECT f.path FROM files f WHERE f.id = %d;"
-  char *query;
+#define Q_TMPL "SELECT f.path FROM files f WHERE f.id = ?;"
   sqlite3_stmt *stmt;
   char *res;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return NULL;
-    }
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return NULL;
 
-      sqlite3_free(query);
-      return NULL;
-    }
+  sqlite3_bind_int(stmt, 1, id);
 
   ret = db_blocking_step(stmt);
   if (ret != SQLITE_ROW)
@@ -3098,8 +4455,7 @@ db_file_path_byid(int id)
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
+      db_stmt_cache_release(stmt);
       return NULL;
     }
 
@@ -3107,38 +4463,19 @@ db_file_path_byid(int id)
   if (res)
     res = strdup(res);
 
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
-
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
+  db_stmt_cache_release(stmt);
 
   return res;
 
 #undef Q_TMPL
 }
 
+// Steps a cached statement that selects a file id and releases it
 static int
-db_file_id_byquery(const char *query)
+db_file_id_bystmt(sqlite3_stmt *stmt)
 {
-  sqlite3_stmt *stmt;
   int ret;
 
-  if (!query)
-    return 0;
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-
-      return 0;
-    }
-
   ret = db_blocking_step(stmt);
   if (ret != SQLITE_ROW)
     {
@@ -3147,139 +4484,121 @@ db_file_id_byquery(const char *query)
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_finalize(stmt);
+      db_stmt_cache_release(stmt);
       return 0;
     }
 
   ret = sqlite3_column_int(stmt, 0);
 
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
-
-  sqlite3_finalize(stmt);
+  db_stmt_cache_release(stmt);
 
   return ret;
 }
 
-bool
-db_file_id_exists(int id)
+// Looks up a file id with a cached statement that has one text parameter
+static int
+db_file_id_bytext(const char *query, const char *value)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.id = %d;"
-  char *query;
-  int ret;
-
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return 0;
-    }
-
-  ret = db_file_id_byquery(query);
+  sqlite3_stmt *stmt;
 
-  sqlite3_free(query);
+  stmt = db_stmt_cache_get(query);
+  if (!stmt)
+    return 0;
 
-  return (id == ret);
+  sqlite3_bind_text(stmt, 1, value, -1, SQLITE_STATIC);
 
-#undef Q_TMPL
+  return db_file_id_bystmt(stmt);
 }
 
-int
-db_file_id_bypath(const char *path)
+static int
+db_file_id_byquery(const char *query)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.path = '%q';"
-  char *query;
+  sqlite3_stmt *stmt;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
   if (!query)
+    return 0;
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
 
       return 0;
     }
 
-  ret = db_file_id_byquery(query);
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_DBG, L_DB, "No results\n");
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-  sqlite3_free(query);
+      sqlite3_finalize(stmt);
+      return 0;
+    }
 
-  return ret;
+  ret = sqlite3_column_int(stmt, 0);
 
-#undef Q_TMPL
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  sqlite3_finalize(stmt);
+
+  return ret;
 }
 
-int
-db_file_id_byfile(const char *filename)
+bool
+db_file_id_exists(int id)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.fname = '%q';"
-  char *query;
-  int ret;
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.id = ?;"
+  sqlite3_stmt *stmt;
 
-  query = sqlite3_mprintf(Q_TMPL, filename);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return false;
 
-      return 0;
-    }
+  sqlite3_bind_int(stmt, 1, id);
 
-  ret = db_file_id_byquery(query);
+  return (id == db_file_id_bystmt(stmt));
 
-  sqlite3_free(query);
+#undef Q_TMPL
+}
 
-  return ret;
+int
+db_file_id_bypath(const char *path)
+{
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.path = ?;"
+  return db_file_id_bytext(Q_TMPL, path);
+#undef Q_TMPL
+}
 
+int
+db_file_id_byfile(const char *filename)
+{
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.fname = ?;"
+  return db_file_id_bytext(Q_TMPL, filename);
 #undef Q_TMPL
 }
 
 int
 db_file_id_byurl(const char *url)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.url = '%q';"
-  char *query;
-  int ret;
-
-  query = sqlite3_mprintf(Q_TMPL, url);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return 0;
-    }
-
-  ret = db_file_id_byquery(query);
-
-  sqlite3_free(query);
-
-  return ret;
-
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.url = ?;"
+  return db_file_id_bytext(Q_TMPL, url);
 #undef Q_TMPL
 }
 
 int
 db_file_id_byvirtualpath(const char *virtual_path)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.virtual_path = %Q;"
-  char *query;
-  int ret;
-
-  query = sqlite3_mprintf(Q_TMPL, virtual_path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return 0;
-    }
-
-  ret = db_file_id_byquery(query);
-
-  sqlite3_free(query);
-
-  return ret;
-
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.virtual_path = ?;"
+  return db_file_id_bytext(Q_TMPL, virtual_path);
 #undef Q_TMPL
 }
 
@@ -3481,11 +4800,125 @@ db_file_update(struct media_file_info *mfi)
   if (ret < 0)
     return -1;
 
+  db_counters_invalidate();
   library_update_trigger(LISTENER_DATABASE);
 
   return 0;
 }
 
+// Inserts the files with a single statement if there are DB_FILES_INSERT_BATCH
+// of them, otherwise (or if that fails) one by one. Returns the number added.
+static int
+db_file_insert_rows(struct media_file_info **mfis, int nmfis)
+{
+  sqlite3_stmt *stmt = db_statements.files_insert_batch;
+  int added = 0;
+  int ret;
+  int i;
+  int n;
+
+  if (stmt && nmfis == DB_FILES_INSERT_BATCH)
+    {
+      for (i = 0, n = 1; i < nmfis && n > 0; i++)
+	n = bind_generic_at(stmt, n, mfis[i], mfi_cols_map, ARRAY_SIZE(mfi_cols_map), 0);
+
+      ret = (n > 0) ? db_statement_run(stmt, 0) : -1;
+      if (ret == nmfis)
+	return nmfis;
+
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+
+      DPRINTF(E_DBG, L_DB, "Multi-row insert of files failed, inserting one by one\n");
+    }
+
+  for (i = 0; i < nmfis; i++)
+    {
+      ret = bind_mfi(db_statements.files_insert, mfis[i]);
+      if (ret < 0)
+	continue;
+
+      ret = db_statement_run(db_statements.files_insert, 0);
+      if (ret < 0)
+	continue;
+
+      added++;
+    }
+
+  return added;
+}
+
+/* Like db_file_add() or db_file_update() for each of the files, but within a
+ * single transaction (unless one is already open), and with new files inserted
+ * in groups. Returns the number of files saved. */
+int
+db_file_save_batch(struct media_file_info *mfis, int nmfis)
+{
+  struct media_file_info *insert[DB_FILES_INSERT_BATCH];
+  struct media_file_info *mfi;
+  bool own_transaction;
+  int64_t now;
+  int ninsert = 0;
+  int saved = 0;
+  int ret;
+  int i;
+
+  if (nmfis <= 0)
+    return 0;
+
+  own_transaction = sqlite3_get_autocommit(hdl);
+  if (own_transaction)
+    db_transaction_begin();
+
+  now = (int64_t)time(NULL);
+
+  for (i = 0; i < nmfis; i++)
+    {
+      mfi = &mfis[i];
+
+      mfi->db_timestamp = now;
+
+      if (mfi->id == 0 && mfi->time_added == 0)
+	mfi->time_added = mfi->db_timestamp;
+
+      fixup_tags_mfi(mfi);
+
+      if (mfi->id != 0)
+	{
+	  ret = bind_mfi(db_statements.files_update, mfi);
+	  if (ret == 0)
+	    ret = db_statement_run(db_statements.files_update, 0);
+	  if (ret >= 0)
+	    saved++;
+
+	  continue;
+	}
+
+      insert[ninsert++] = mfi;
+      if (ninsert == DB_FILES_INSERT_BATCH)
+	{
+	  saved += db_file_insert_rows(insert, ninsert);
+	  ninsert = 0;
+	}
+    }
+
+  saved += db_file_insert_rows(insert, ninsert);
+
+  if (own_transaction)
+    db_transaction_end();
+
+  if (saved > 0)
+    {
+      db_counters_invalidate();
+      library_update_trigger(LISTENER_DATABASE);
+    }
+
+  if (saved < nmfis)
+    DPRINTF(E_LOG, L_DB, "Could only save %d of %d files\n", saved, nmfis);
+
+  return saved;
+}
+
 void
 db_file_seek_update(int id, uint32_t seek)
 {
@@ -3539,13 +4972,14 @@ db_file_disable_bypath(const char *path, enum strip_type strip, uint32_t cookie)
   query = sqlite3_mprintf(Q_TMPL, path_striplen + 1, vpath_striplen + 1, disabled, path);
 
   db_query_run(query, 1, LISTENER_DATABASE);
+  db_counters_invalidate();
 #undef Q_TMPL
 }
 
 void
 db_file_disable_bymatch(const char *path, enum strip_type strip, uint32_t cookie)
 {
-#define Q_TMPL "UPDATE files SET path = substr(path, %d), virtual_path = substr(virtual_path, %d), disabled = %" PRIi64 " WHERE path LIKE '%q/%%';"
+#define Q_TMPL "UPDATE files SET path = substr(path, %d), virtual_path = substr(virtual_path, %d), disabled = %" PRIi64 " WHERE " DB_PATH_BELOW("path") ";"
   char *query;
   int64_t disabled;
   int path_striplen;
@@ -3556,9 +4990,10 @@ db_file_disable_bymatch(const char *path, enum strip_type strip, uint32_t cookie
   path_striplen = (strip == STRIP_PATH) ? strlen(path) : 0;
   vpath_striplen = (strip == STRIP_PATH) ? strlen("/file:") + path_striplen : 0;
 
-  query = sqlite3_mprintf(Q_TMPL, path_striplen + 1, vpath_striplen + 1, disabled, path);
+  query = sqlite3_mprintf(Q_TMPL, path_striplen + 1, vpath_striplen + 1, disabled, path, path);
 
   db_query_run(query, 1, LISTENER_DATABASE);
+  db_counters_invalidate();
 #undef Q_TMPL
 }
 
@@ -3580,6 +5015,7 @@ db_file_enable_bycookie(uint32_t cookie, const char *path, const char *filename)
     query = sqlite3_mprintf(Q_TMPL, path, path, (int64_t)cookie);
 
   ret = db_query_run(query, 1, LISTENER_DATABASE);
+  db_counters_invalidate();
 
   return ((ret < 0) ? -1 : sqlite3_changes(hdl));
 #undef Q_TMPL_UPDATE_FNAME
@@ -3606,14 +5042,7 @@ db_file_update_directoryid(const char *path, int dir_id)
 int
 db_pl_get_count(uint32_t *nitems)
 {
-  int ret = db_get_one_int("SELECT COUNT(*) FROM playlists p WHERE p.disabled = 0;");
-
-  if (ret < 0)
-    return -1;
-
-  *nitems = (uint32_t)ret;
-
-  return 0;
+  return db_counters_get(NULL, NULL, nitems);
 }
 
 void
@@ -3631,12 +5060,12 @@ db_pl_ping(int id)
 void
 db_pl_ping_bymatch(const char *path, int isdir)
 {
-#define Q_TMPL_DIR "UPDATE playlists SET db_timestamp = %" PRIi64 " WHERE path LIKE '%q/%%';"
+#define Q_TMPL_DIR "UPDATE playlists SET db_timestamp = %" PRIi64 " WHERE " DB_PATH_BELOW("path") ";"
 #define Q_TMPL_NODIR "UPDATE playlists SET db_timestamp = %" PRIi64 " WHERE path LIKE '%q%%';"
   char *query;
 
   if (isdir)
-    query = sqlite3_mprintf(Q_TMPL_DIR, (int64_t)time(NULL), path);
+    query = sqlite3_mprintf(Q_TMPL_DIR, (int64_t)time(NULL), path, path);
   else
     query = sqlite3_mprintf(Q_TMPL_NODIR, (int64_t)time(NULL), path);
 
@@ -3654,6 +5083,7 @@ db_pl_ping_items_bymatch(const char *path, int id)
   query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL), path, id);
 
   db_query_run(query, 1, 0);
+  db_counters_invalidate();
 #undef Q_TMPL
 }
 
@@ -3752,7 +5182,7 @@ db_pl_fetch_byquery(const char *query)
     }
 
   if (pli->type == PL_SPECIAL || pli->type == PL_SMART)
-    db_files_get_count(&pli->items, &pli->streams, pli->query);
+    smartpl_cache_get(&pli->items, &pli->streams, NULL, NULL, pli->id, pli->query, pli->query_order, pli->query_limit);
 
   return pli;
 }
@@ -4037,7 +5467,7 @@ db_pl_disable_bypath(const char *path, enum strip_type strip, uint32_t cookie)
 void
 db_pl_disable_bymatch(const char *path, enum strip_type strip, uint32_t cookie)
 {
-#define Q_TMPL "UPDATE playlists SET path = substr(path, %d), virtual_path = substr(virtual_path, %d), disabled = %" PRIi64 " WHERE path LIKE '%q/%%';"
+#define Q_TMPL "UPDATE playlists SET path = substr(path, %d), virtual_path = substr(virtual_path, %d), disabled = %" PRIi64 " WHERE " DB_PATH_BELOW("path") ";"
   char *query;
   int64_t disabled;
   int path_striplen;
@@ -4048,7 +5478,7 @@ db_pl_disable_bymatch(const char *path, enum strip_type strip, uint32_t cookie)
   path_striplen = (strip == STRIP_PATH) ? strlen(path) : 0;
   vpath_striplen = (strip == STRIP_PATH) ? strlen("/file:") + path_striplen : 0;
 
-  query = sqlite3_mprintf(Q_TMPL, path_striplen + 1, vpath_striplen + 1, disabled, path);
+  query = sqlite3_mprintf(Q_TMPL, path_striplen + 1, vpath_striplen + 1, disabled, path, path);
 
   db_query_run(query, 1, 0);
 #undef Q_TMPL
@@ -4077,8 +5507,11 @@ db_pl_enable_bycookie(uint32_t cookie, const char *path)
 int
 db_groups_cleanup()
 {
-#define Q_TMPL_ALBUM "DELETE FROM groups WHERE type = 1 AND NOT persistentid IN (SELECT songalbumid from files WHERE disabled = 0);"
-#define Q_TMPL_ARTIST "DELETE FROM groups WHERE type = 2 AND NOT persistentid IN (SELECT songartistid from files WHERE disabled = 0);"
+// group_stats holds the number of enabled tracks referencing each group, so
+// groups can be released without scanning the files table
+#define Q_TMPL_ALBUM "DELETE FROM groups WHERE type = 1 AND NOT persistentid IN (SELECT persistentid FROM group_stats WHERE type = 1 AND track_count > 0);"
+#define Q_TMPL_ARTIST "DELETE FROM groups WHERE type = 2 AND NOT persistentid IN (SELECT persistentid FROM group_stats WHERE type = 2 AND track_count > 0);"
+#define Q_TMPL_STATS "DELETE FROM group_stats WHERE track_count = 0;"
   int ret;
 
   db_transaction_begin();
@@ -4100,12 +5533,22 @@ db_groups_cleanup()
     }
 
   DPRINTF(E_DBG, L_DB, "Removed artist group-entries: %d\n", sqlite3_changes(hdl));
+
+  ret = db_query_run(Q_TMPL_STATS, 0, 0);
+  if (ret < 0)
+    {
+      db_transaction_rollback();
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Removed empty group stats: %d\n", sqlite3_changes(hdl));
   db_transaction_end();
 
   return 0;
 
 #undef Q_TMPL_ALBUM
 #undef Q_TMPL_ARTIST
+#undef Q_TMPL_STATS
 }
 
 static enum group_type
@@ -4218,6 +5661,29 @@ db_group_persistentid_byid(int id, int64_t *persistentid)
 #undef Q_TMPL
 }
 
+// Returns the id of the album group following the given group id, or 0 if none
+int
+db_group_album_next_id(int id)
+{
+#define Q_TMPL "SELECT IFNULL(MIN(g.id), 0) FROM groups g WHERE g.type = %d AND g.id > %d;"
+  char *query;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, G_ALBUMS, id);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  ret = db_get_one_int(query);
+
+  sqlite3_free(query);
+
+  return ret;
+#undef Q_TMPL
+}
+
 
 /* Directories */
 int
@@ -4450,10 +5916,10 @@ db_directory_update(struct directory_info *di)
 void
 db_directory_ping_bymatch(char *virtual_path)
 {
-#define Q_TMPL_DIR "UPDATE directories SET db_timestamp = %" PRIi64 " WHERE virtual_path = '%q' OR virtual_path LIKE '%q/%%';"
+#define Q_TMPL_DIR "UPDATE directories SET db_timestamp = %" PRIi64 " WHERE virtual_path = '%q' OR " DB_PATH_BELOW("virtual_path") ";"
   char *query;
 
-  query = sqlite3_mprintf(Q_TMPL_DIR, (int64_t)time(NULL), virtual_path, virtual_path);
+  query = sqlite3_mprintf(Q_TMPL_DIR, (int64_t)time(NULL), virtual_path, virtual_path, virtual_path);
 
   db_query_run(query, 1, 0);
 #undef Q_TMPL_DIR
@@ -4463,7 +5929,7 @@ void
 db_directory_disable_bymatch(const char *path, enum strip_type strip, uint32_t cookie)
 {
 #define Q_TMPL "UPDATE directories SET virtual_path = substr(virtual_path, %d)," \
-               " disabled = %" PRIi64 " WHERE virtual_path = '/file:%q' OR virtual_path LIKE '/file:%q/%%';"
+               " disabled = %" PRIi64 " WHERE virtual_path = '/file:%q' OR (virtual_path >= '/file:%q/' AND virtual_path < '/file:%q0');"
   char *query;
   int64_t disabled;
   int vpath_striplen;
@@ -4510,48 +5976,36 @@ db_directory_enable_bypath(char *path)
 }
 
 
-/* Remotes */
-static int
-db_pairing_delete_byremote(char *remote_id)
-{
-#define Q_TMPL "DELETE FROM pairings WHERE remote = '%q';"
-  char *query;
-
-  query = sqlite3_mprintf(Q_TMPL, remote_id);
-
-  return db_query_run(query, 1, 0);
-#undef Q_TMPL
-}
-
 int
-db_pairing_add(struct pairing_info *pi)
+db_directory_artwork_update(int id, const char *artwork_path)
 {
-#define Q_TMPL "INSERT INTO pairings (remote, name, guid) VALUES ('%q', '%q', '%q');"
+#define Q_TMPL "UPDATE directories SET artwork_path = %Q WHERE id = %d AND artwork_path IS NOT %Q;"
   char *query;
   int ret;
 
-  ret = db_pairing_delete_byremote(pi->remote_id);
-  if (ret < 0)
-    return ret;
+  // Rescans find the same artwork most of the time, and a write that doesn't
+  // change anything would still trigger the update hook
+  query = sqlite3_mprintf(Q_TMPL, artwork_path, id, artwork_path);
 
-  query = sqlite3_mprintf(Q_TMPL, pi->remote_id, pi->name, pi->guid);
+  ret = db_query_run(query, 1, 0);
 
-  return db_query_run(query, 1, 0);
+  return ((ret < 0) ? -1 : sqlite3_changes(hdl));
 #undef Q_TMPL
 }
 
 int
-db_pairing_fetch_byguid(struct pairing_info *pi)
+db_directory_artwork_bypath(char *out_path, size_t len, const char *path)
 {
-#define Q_TMPL "SELECT p.* FROM pairings p WHERE p.guid = '%q';"
+#define Q_TMPL "SELECT d.artwork_path FROM directories d WHERE d.path = '%q' AND d.artwork_path IS NOT NULL;"
   char *query;
   sqlite3_stmt *stmt;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, pi->guid);
+  query = sqlite3_mprintf(Q_TMPL, path);
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
       return -1;
     }
 
@@ -4561,15 +6015,15 @@ db_pairing_fetch_byguid(struct pairing_info *pi)
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_free(query);
       return -1;
     }
 
   ret = db_blocking_step(stmt);
   if (ret != SQLITE_ROW)
     {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_INFO, L_DB, "Pairing GUID %s not found\n", pi->guid);
-      else
+      if (ret != SQLITE_DONE)
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
       sqlite3_finalize(stmt);
@@ -4577,26 +6031,103 @@ db_pairing_fetch_byguid(struct pairing_info *pi)
       return -1;
     }
 
-  pi->remote_id = strdup((char *)sqlite3_column_text(stmt, 0));
-  pi->name = strdup((char *)sqlite3_column_text(stmt, 1));
-
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
+  snprintf(out_path, len, "%s", (char *)sqlite3_column_text(stmt, 0));
 
   sqlite3_finalize(stmt);
   sqlite3_free(query);
 
   return 0;
-
 #undef Q_TMPL
 }
 
-/* Spotify */
-void
-db_spotify_purge(void)
-{
+
+/* Remotes */
+static int
+db_pairing_delete_byremote(char *remote_id)
+{
+#define Q_TMPL "DELETE FROM pairings WHERE remote = '%q';"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, remote_id);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
+int
+db_pairing_add(struct pairing_info *pi)
+{
+#define Q_TMPL "INSERT INTO pairings (remote, name, guid) VALUES ('%q', '%q', '%q');"
+  char *query;
+  int ret;
+
+  ret = db_pairing_delete_byremote(pi->remote_id);
+  if (ret < 0)
+    return ret;
+
+  query = sqlite3_mprintf(Q_TMPL, pi->remote_id, pi->name, pi->guid);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
+int
+db_pairing_fetch_byguid(struct pairing_info *pi)
+{
+#define Q_TMPL "SELECT p.* FROM pairings p WHERE p.guid = '%q';"
+  char *query;
+  sqlite3_stmt *stmt;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, pi->guid);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "Pairing GUID %s not found\n", pi->guid);
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_finalize(stmt);
+      sqlite3_free(query);
+      return -1;
+    }
+
+  pi->remote_id = strdup((char *)sqlite3_column_text(stmt, 0));
+  pi->name = strdup((char *)sqlite3_column_text(stmt, 1));
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+/* Spotify */
+void
+db_spotify_purge(void)
+{
 #define Q_TMPL "UPDATE directories SET disabled = %" PRIi64 " WHERE virtual_path = '/spotify:' AND disabled <> %" PRIi64 ";"
   char *queries[4] =
     {
@@ -4870,1514 +6401,2870 @@ db_speaker_get(struct output_device *device, uint64_t id)
 /* Queue */
 
 /*
- * Start a new transaction for modifying the queue. Returns the new queue version for the following changes.
- * After finishing all queue modifications 'queue_transaction_end' needs to be called.
+ * In-memory queue order
+ *
+ * The order of the queue (normal and shuffled) is kept in memory, and that is
+ * what the queue functions use for positions. This means that inserting,
+ * moving, deleting or reshuffling only requires memmove's instead of updating
+ * the pos/shuffle_pos of every following row. A hash index of the items gives
+ * the positions and the queue version of an item by id. Changes update the
+ * index entries of the items that changed position, and only the dirty items
+ * are visited when the keys are written.
+ *
+ * In the queue table the pos and shuffle_pos columns hold sparse keys that
+ * only need to give the right order. New or moved items get a key between the
+ * keys of their neighbours, so only their rows need to be written. If there is
+ * no room between the neighbours, only a neighbourhood is respaced. The
+ * changed keys are written at the end of the queue transaction that changed
+ * them, so the stored keys are always consistent with the rows in the table.
+ *
+ * Queue enumerations see the actual (dense) positions, and the queue version
+ * where the position of an item last changed, via the SQL functions
+ * queue_pos() and queue_version().
+ *
+ * The lock must be held when using the queue_order_* functions. It is also held
+ * for the duration of queue transactions, so it must always be taken before
+ * starting a db transaction. The order and the rows of the queue table must
+ * change together, and writers are serialized by the db write lock anyway, so
+ * the lock only keeps them from waiting for each other in the middle of a
+ * transaction. Writers can wait for readers with the lock held,
+ * so readers must not take it while they may hold a read lock. Instead they
+ * use a snapshot of the order, which is published after each committed change
+ * (queue_order_publish) and reference counted, so the SQL functions look up
+ * positions in the snapshot of their statement without locking.
  */
-static int
-queue_transaction_begin()
-{
-  int queue_version = 0;
-
-  db_transaction_begin();
 
-  db_admin_getint(&queue_version, DB_ADMIN_QUEUE_VERSION);
-  queue_version++;
+/* Must be called with the lock held */
+static void
+queue_order_reset(void)
+{
+  free(db_queue_order.pos_slots);
+  free(db_queue_order.shuffle_slots);
+  free(db_queue_order.index);
+  free(db_queue_order.pos_dirty.ids);
+  free(db_queue_order.shuffle_dirty.ids);
 
-  return queue_version;
+  db_queue_order.pos_slots = NULL;
+  db_queue_order.shuffle_slots = NULL;
+  db_queue_order.size = 0;
+  db_queue_order.count = 0;
+  db_queue_order.index = NULL;
+  db_queue_order.index_size = 0;
+  memset(&db_queue_order.pos_dirty, 0, sizeof(struct db_queue_dirty));
+  memset(&db_queue_order.shuffle_dirty, 0, sizeof(struct db_queue_dirty));
+  db_queue_order.generation++;
+  db_queue_order.loaded = false;
 }
 
-/*
- * If retval == 0, updates the version of the queue in the admin table, commits the transaction
- * and notifies listener of LISTENER_QUEUE about the changes.
- * If retval < 0, rollsback the transaction.
- *
- * This function must be called after modifying the queue.
- *
- * @param retval 'retval' >= 0, if modifying the queue was successful or 'retval' < 0 if an error occurred
- * @param queue_version The new queue version, for the pending modifications
- */
-static void
-queue_transaction_end(int retval, int queue_version)
+static inline uint32_t
+queue_index_hash(uint32_t item_id, uint32_t index_size)
 {
-  int ret;
+  return (item_id * 2654435761U) & (index_size - 1);
+}
 
-  if (retval < 0)
-    goto error;
+static struct db_queue_index_entry *
+queue_index_find(struct db_queue_index_entry *index, uint32_t index_size, uint32_t item_id)
+{
+  uint32_t i;
 
-  ret = db_admin_setint(DB_ADMIN_QUEUE_VERSION, queue_version);
-  if (ret < 0)
-    goto error;
+  if (item_id == 0 || index_size == 0)
+    return NULL;
 
-  db_transaction_end();
-  listener_notify(LISTENER_QUEUE);
-  return;
+  for (i = queue_index_hash(item_id, index_size); index[i].id != 0; i = (i + 1) & (index_size - 1))
+    {
+      if (index[i].id == item_id)
+	return &index[i];
+    }
 
- error:
-  db_transaction_rollback();
+  return NULL;
 }
 
-static int
-queue_reshuffle(uint32_t item_id, int queue_version);
-
-static int
-queue_item_add(struct db_queue_item *qi)
+static struct db_queue_index_entry *
+queue_index_add(struct db_queue_index_entry *index, uint32_t index_size, uint32_t item_id)
 {
-  int ret;
+  uint32_t i;
 
-  fixup_tags_qi(qi);
+  for (i = queue_index_hash(item_id, index_size); index[i].id != 0 && index[i].id != item_id; i = (i + 1) & (index_size - 1))
+    ; /* EMPTY */
 
-  ret = bind_qi(db_statements.queue_items_insert, qi);
-  if (ret < 0)
-    return -1;
+  index[i].id = item_id;
 
-  // Do not update events here, only caller knows if more items will be added
-  ret = db_statement_run(db_statements.queue_items_insert, 0);
-  if (ret < 0)
-    return -1;
+  return &index[i];
+}
 
-  ret = (int)sqlite3_last_insert_rowid(hdl);
-  if (ret == 0)
+// Linear probing, so the entries after the removed one are moved back to where
+// a lookup will find them
+static void
+queue_index_remove(struct db_queue_index_entry *index, uint32_t index_size, struct db_queue_index_entry *entry)
+{
+  uint32_t mask = index_size - 1;
+  uint32_t hole = entry - index;
+  uint32_t home;
+  uint32_t i;
+
+  for (i = (hole + 1) & mask; index[i].id != 0; i = (i + 1) & mask)
     {
-      DPRINTF(E_LOG, L_DB, "Successful queue item insert but no last_insert_rowid!\n");
-      return -1;
+      home = queue_index_hash(index[i].id, index_size);
+
+      // Entry can only move back if its home is not in (hole, i]
+      if (((i - home) & mask) >= ((i - hole) & mask))
+	{
+	  index[hole] = index[i];
+	  hole = i;
+	}
     }
 
-  return ret;
+  memset(&index[hole], 0, sizeof(struct db_queue_index_entry));
 }
 
-static int
-queue_item_add_from_file(struct db_media_file_info *dbmfi, int pos, int shuffle_pos, int queue_version)
+static void
+queue_order_reserve(uint32_t count)
 {
-  struct db_queue_item qi;
-  int ret;
+  struct db_queue_index_entry *index;
+  uint32_t index_size;
+  uint32_t size;
+  uint32_t i;
 
-  // No allocations, just the struct content is copied
-  db_queue_item_from_dbmfi(&qi, dbmfi);
+  if (count <= db_queue_order.size)
+    return;
 
-  // No tag fixup, we can't touch the strings in qi, plus must assume dbmfi has proper tags
+  size = MAX(count, 2 * db_queue_order.size);
+  size = MAX(size, 64);
 
-  qi.pos = pos;
-  qi.shuffle_pos = shuffle_pos;
-  qi.queue_version = queue_version;
+  CHECK_NULL(L_DB, db_queue_order.pos_slots = realloc(db_queue_order.pos_slots, size * sizeof(struct db_queue_slot)));
+  CHECK_NULL(L_DB, db_queue_order.shuffle_slots = realloc(db_queue_order.shuffle_slots, size * sizeof(struct db_queue_slot)));
 
-  ret = bind_qi(db_statements.queue_items_insert, &qi);
-  if (ret < 0)
-    return -1;
+  db_queue_order.size = size;
 
-  // Do not update events here, only caller knows if more items will be added
-  ret = db_statement_run(db_statements.queue_items_insert, 0);
-  if (ret < 0)
-    return -1;
+  for (index_size = MAX(db_queue_order.index_size, 128); index_size < 2 * size; index_size *= 2)
+    ; /* EMPTY */
 
-  ret = (int)sqlite3_last_insert_rowid(hdl);
-  if (ret == 0)
+  if (index_size == db_queue_order.index_size)
+    return;
+
+  CHECK_NULL(L_DB, index = calloc(index_size, sizeof(struct db_queue_index_entry)));
+
+  for (i = 0; i < db_queue_order.index_size; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Successful queue item insert but no last_insert_rowid!\n");
-      return -1;
+      if (db_queue_order.index[i].id != 0)
+	*queue_index_add(index, index_size, db_queue_order.index[i].id) = db_queue_order.index[i];
     }
 
-  return ret;
+  free(db_queue_order.index);
+  db_queue_order.index = index;
+  db_queue_order.index_size = index_size;
 }
 
-static int
-queue_item_update(struct db_queue_item *qi)
+static inline struct db_queue_slot *
+queue_order_slots(char shuffle)
 {
-  int ret;
+  return shuffle ? db_queue_order.shuffle_slots : db_queue_order.pos_slots;
+}
 
-  fixup_tags_qi(qi);
+static inline struct db_queue_index_entry *
+queue_order_find(uint32_t item_id)
+{
+  return queue_index_find(db_queue_order.index, db_queue_order.index_size, item_id);
+}
 
-  ret = bind_qi(db_statements.queue_items_update, qi);
-  if (ret < 0)
-    return -1;
+static void
+queue_order_slot_dirty(char shuffle, uint32_t pos)
+{
+  struct db_queue_slot *slot = &queue_order_slots(shuffle)[pos];
+  struct db_queue_dirty *dirty = shuffle ? &db_queue_order.shuffle_dirty : &db_queue_order.pos_dirty;
 
-  // Do not update events here, only caller knows if more items will be updated
-  ret = db_statement_run(db_statements.queue_items_update, 0);
-  if (ret < 0)
-    return -1;
+  if (slot->dirty)
+    return;
 
-  return qi->id;
+  if (dirty->count == dirty->size)
+    {
+      dirty->size = MAX(64, 2 * dirty->size);
+      CHECK_NULL(L_DB, dirty->ids = realloc(dirty->ids, dirty->size * sizeof(uint32_t)));
+    }
+
+  slot->dirty = true;
+  dirty->ids[dirty->count++] = slot->id;
 }
 
-void
-db_queue_item_from_mfi(struct db_queue_item *qi, struct media_file_info *mfi)
+// Items in [from, to) changed position in the current queue transaction
+static void
+queue_order_touch(char shuffle, uint32_t from, uint32_t to)
 {
-  int i;
+  struct db_queue_slot *slots = queue_order_slots(shuffle);
+  struct db_queue_index_entry *entry;
+  uint32_t i;
 
-  memset(qi, 0, sizeof(struct db_queue_item));
-
-  for (i = 0; i < ARRAY_SIZE(qi_mfi_map); i++)
+  for (i = from; i < to; i++)
     {
-      if (qi_mfi_map[i].mfi_offset < 0)
+      entry = queue_order_find(slots[i].id);
+      if (!entry)
 	continue;
 
-      struct_field_from_field(qi, qi_cols_map[i].offset, qi_cols_map[i].type, mfi, qi_mfi_map[i].mfi_offset, true, false);
+      if (shuffle)
+	entry->shuffle_pos = i;
+      else
+	entry->pos = i;
+      entry->version = db_queue_order.version;
     }
 
-  if (!qi->file_id)
-    qi->file_id = DB_MEDIA_FILE_NON_PERSISTENT_ID;
+  db_queue_order.changed = true;
+  db_queue_order.generation++;
 }
 
-void
-db_queue_item_from_dbmfi(struct db_queue_item *qi, struct db_media_file_info *dbmfi)
+static void
+queue_order_rebalance(char shuffle)
 {
-  int i;
+  struct db_queue_slot *slots = queue_order_slots(shuffle);
+  uint32_t i;
 
-  memset(qi, 0, sizeof(struct db_queue_item));
+  DPRINTF(E_DBG, L_DB, "Respacing queue position keys of %" PRIu32 " items\n", db_queue_order.count);
 
-  for (i = 0; i < ARRAY_SIZE(qi_mfi_map); i++)
+  for (i = 0; i < db_queue_order.count; i++)
     {
-      if (qi_mfi_map[i].dbmfi_offset < 0)
-	continue;
-
-      struct_field_from_field(qi, qi_cols_map[i].offset, qi_cols_map[i].type, dbmfi, qi_mfi_map[i].dbmfi_offset, false, true);
+      slots[i].key = (int64_t)i * DB_QUEUE_KEY_SPACING;
+      queue_order_slot_dirty(shuffle, i);
     }
-
-  if (!qi->file_id)
-    qi->file_id = DB_MEDIA_FILE_NON_PERSISTENT_ID;
 }
 
-
-int
-db_queue_item_update(struct db_queue_item *qi)
+// Gives the items in [from, from + n) keys between the keys of their neighbours.
+// If there is no room between the neighbours, the range is widened until the
+// keys around it are sparse enough, so only that neighbourhood is respaced.
+static void
+queue_order_keys_assign(char shuffle, uint32_t from, uint32_t n)
 {
-  int queue_version;
-  int ret;
-
-  queue_version = queue_transaction_begin();
+  struct db_queue_slot *slots = queue_order_slots(shuffle);
+  int64_t min_step = 1;
+  int64_t prev = 0;
+  int64_t step = 0;
+  uint32_t width;
+  uint32_t i;
 
-  qi->queue_version = queue_version;
+  for (width = MAX(n, 1); from > 0 && from + n < db_queue_order.count; width *= 2)
+    {
+      prev = slots[from - 1].key;
+      step = (slots[from + n].key - prev) / (n + 1);
+      if (step >= min_step)
+	break;
 
-  ret = queue_item_update(qi);
+      i = MIN(width, from);
+      from -= i;
+      n = MIN(n + i + width, db_queue_order.count - from);
+      min_step = DB_QUEUE_KEY_SPACING / 8;
+    }
 
-  // MPD changes playlist version when metadata changes, also makes LISTENER_QUEUE
-  queue_transaction_end(ret, queue_version);
+  // Unless the loop found room between two neighbours, one end is open
+  if (from == 0 || from + n == db_queue_order.count)
+    {
+      step = DB_QUEUE_KEY_SPACING;
+      if (from + n < db_queue_order.count)
+	prev = slots[from + n].key - (int64_t)(n + 1) * step;
+      else if (from > 0)
+	prev = slots[from - 1].key;
+      else
+	prev = -step;
+    }
 
-  return ret;
+  for (i = 0; i < n; i++)
+    {
+      slots[from + i].key = prev + (int64_t)(i + 1) * step;
+      queue_order_slot_dirty(shuffle, from + i);
+    }
 }
 
-/*
- * Adds the files matching the given query to the queue after the item with the given item id
- *
- * The files table is queried with the given parameters and all found files are added after the
- * item with the given item id to the "normal" queue. They are appended to end of the shuffled queue
- * (assuming that the shuffled queue will get reshuffled after adding new items).
- *
- * The function returns -1 on failure (e. g. error reading from database) and if the given item id
- * does not exist. It wraps all database access in a transaction and performs a rollback if an error
- * occurs, leaving the queue in a consistent state.
- *
- * @param qp Query parameters for the files table
- * @param item_id Files are added after item with this id
- * @return 0 on success, -1 on failure
- */
-int
-db_queue_add_by_queryafteritemid(struct query_params *qp, uint32_t item_id)
+static int
+queue_order_load_list(const char *query, struct db_queue_slot *slots, uint32_t count)
 {
-  int pos;
+  sqlite3_stmt *stmt;
+  uint32_t i;
   int ret;
 
-  // Position of the first new item
-  pos = db_queue_get_pos(item_id, 0);
-  if (pos < 0)
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
     {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
       return -1;
     }
-  pos++;
 
-  ret = db_queue_add_by_query(qp, 0, 0, pos, NULL, NULL);
-  return ret;
+  for (i = 0; i < count && db_blocking_step(stmt) == SQLITE_ROW; i++)
+    {
+      slots[i].id = sqlite3_column_int(stmt, 0);
+      slots[i].key = sqlite3_column_int64(stmt, 1);
+      slots[i].dirty = false;
+    }
+
+  sqlite3_finalize(stmt);
+
+  if (i != count)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not load queue order, expected %" PRIu32 " items, got %" PRIu32 "\n", count, i);
+      return -1;
+    }
+
+  return 0;
 }
 
-int
-db_queue_add_start(struct db_queue_add_info *queue_add_info, int pos)
+static void
+queue_order_publish(void);
+
+static int
+queue_order_load(void)
 {
-  uint32_t queue_count;
+#define Q_TMPL_POS "SELECT id, pos FROM queue ORDER BY pos, id;"
+#define Q_TMPL_SHUFFLE "SELECT id, shuffle_pos FROM queue ORDER BY shuffle_pos, id;"
+  struct db_queue_index_entry *entry;
+  int queue_version = 0;
+  int count;
   int ret;
+  int i;
 
-  memset(queue_add_info, 0, sizeof(struct db_queue_add_info));
-  queue_add_info->queue_version = queue_transaction_begin();
+  if (db_queue_order.loaded)
+    return 0;
+
+  count = db_get_one_int("SELECT COUNT(*) FROM queue;");
+  if (count < 0)
+    return -1;
+
+  db_admin_getint(&queue_version, DB_ADMIN_QUEUE_VERSION);
+
+  queue_order_reserve(count);
+
+  ret = queue_order_load_list(Q_TMPL_POS, db_queue_order.pos_slots, count);
+  if (ret < 0)
+    goto error;
 
-  ret = db_queue_get_count(&queue_count);
+  ret = queue_order_load_list(Q_TMPL_SHUFFLE, db_queue_order.shuffle_slots, count);
   if (ret < 0)
+    goto error;
+
+  // We don't know what changed before we were started
+  for (i = 0; i < count; i++)
     {
-      ret = -1;
-      queue_transaction_end(ret, queue_add_info->queue_version);
-      return ret;
+      entry = queue_index_add(db_queue_order.index, db_queue_order.index_size, db_queue_order.pos_slots[i].id);
+      entry->pos = i;
+      entry->version = queue_version;
     }
 
-  queue_add_info->pos = queue_count;
-  queue_add_info->shuffle_pos = queue_count;
+  for (i = 0; i < count; i++)
+    {
+      entry = queue_order_find(db_queue_order.shuffle_slots[i].id);
+      if (!entry)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not load queue order, item %" PRIu32 " has no position\n", db_queue_order.shuffle_slots[i].id);
+	  goto error;
+	}
 
-  if (pos >= 0 && pos < queue_count)
-    queue_add_info->pos = pos;
+      entry->shuffle_pos = i;
+    }
 
-  queue_add_info->start_pos = queue_add_info->pos;
+  db_queue_order.count = count;
+  db_queue_order.generation++;
+  db_queue_order.loaded = true;
+
+  queue_order_publish();
+
+  DPRINTF(E_DBG, L_DB, "Loaded queue order with %d items\n", count);
 
   return 0;
+
+ error:
+  queue_order_reset();
+  return -1;
+#undef Q_TMPL_POS
+#undef Q_TMPL_SHUFFLE
 }
 
-int
-db_queue_add_end(struct db_queue_add_info *queue_add_info, char reshuffle, uint32_t item_id, int ret)
+static int
+queue_order_flush_list(const char *query, char shuffle)
 {
-  char *query;
+  struct db_queue_dirty *dirty = shuffle ? &db_queue_order.shuffle_dirty : &db_queue_order.pos_dirty;
+  struct db_queue_index_entry *entry;
+  struct db_queue_slot *slot;
+  sqlite3_stmt *stmt;
+  uint32_t i;
+  int ret;
 
-  if (ret < 0)
-    goto end;
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
 
-  // Update pos for all items from the given position
-  query = sqlite3_mprintf("UPDATE queue SET pos = pos + %d, queue_version = %d WHERE pos >= %d AND queue_version < %d;",
-                          queue_add_info->count, queue_add_info->queue_version, queue_add_info->start_pos, queue_add_info->queue_version);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end;
+  for (i = 0; i < dirty->count; i++)
+    {
+      // Skip items that were removed again, or listed twice
+      entry = queue_order_find(dirty->ids[i]);
+      if (!entry)
+	continue;
 
-  // Reshuffle after adding new items
-  if (reshuffle)
-    ret = queue_reshuffle(item_id, queue_add_info->queue_version);
+      slot = &queue_order_slots(shuffle)[shuffle ? entry->shuffle_pos : entry->pos];
+      if (!slot->dirty)
+	continue;
 
- end:
-  queue_transaction_end(ret, queue_add_info->queue_version);
-  return ret;
-}
+      sqlite3_bind_int64(stmt, 1, slot->key);
+      sqlite3_bind_int(stmt, 2, slot->id);
 
-int
-db_queue_add_next(struct db_queue_add_info *queue_add_info, struct db_queue_item *qi)
-{
-  int ret;
+      ret = db_blocking_step(stmt);
+      if (ret != SQLITE_DONE)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+	  sqlite3_finalize(stmt);
+	  return -1;
+	}
 
-  qi->pos = queue_add_info->pos;
-  qi->shuffle_pos = queue_add_info->shuffle_pos;
-  qi->queue_version = queue_add_info->queue_version;
+      sqlite3_reset(stmt);
 
-  ret = queue_item_add(qi);
-  if (ret < 0)
-    return ret;
+      slot->dirty = false;
+    }
 
-  queue_add_info->pos++;
-  queue_add_info->shuffle_pos++;
-  queue_add_info->count++;
+  sqlite3_finalize(stmt);
 
-  if (queue_add_info->new_item_id == 0)
-    queue_add_info->new_item_id = ret;
+  dirty->count = 0;
 
-  return ret;
+  return 0;
 }
 
-/*
- * Adds the files matching the given query to the queue
- *
- * The files table is queried with the given parameters and all found files are added to the end of the
- * "normal" queue and the shuffled queue.
- *
- * The function returns -1 on failure (e. g. error reading from database). It wraps all database access
- * in a transaction and performs a rollback if an error occurs, leaving the queue in a consistent state.
- *
- * @param qp Query parameters for the files table
- * @param reshuffle If 1 queue will be reshuffled after adding new items
- * @param item_id The base item id, all items after this will be reshuffled
- * @param position The position in the queue for the new queue item, -1 to add at end of queue
- * @param count If not NULL returns the number of items added to the queue
- * @param new_item_id If not NULL return the queue item id of the first new queue item
- * @return 0 on success, -1 on failure
- */
-int
-db_queue_add_by_query(struct query_params *qp, char reshuffle, uint32_t item_id, int position, int *count, int *new_item_id)
+// Writes the changed position keys to the queue table, must be called in the
+// queue transaction that changed them
+static int
+queue_order_flush(void)
 {
-  struct db_media_file_info dbmfi;
-  char *query;
-  int queue_version;
-  uint32_t queue_count;
-  int pos;
-  int shuffle_pos;
-  bool append_to_queue;
+#define Q_TMPL_POS "UPDATE queue SET pos = ? WHERE id = ?;"
+#define Q_TMPL_SHUFFLE "UPDATE queue SET shuffle_pos = ? WHERE id = ?;"
   int ret;
 
-  if (new_item_id)
-    *new_item_id = 0;
-  if (count)
-    *count = 0;
+  if (!db_queue_order.loaded || (db_queue_order.pos_dirty.count == 0 && db_queue_order.shuffle_dirty.count == 0))
+    return 0;
 
-  queue_version = queue_transaction_begin();
+  DPRINTF(E_DBG, L_DB, "Writing up to %" PRIu32 " queue position keys\n", db_queue_order.pos_dirty.count + db_queue_order.shuffle_dirty.count);
 
-  ret = db_queue_get_count(&queue_count);
+  ret = queue_order_flush_list(Q_TMPL_POS, 0);
   if (ret < 0)
-    {
-      ret = -1;
-      goto end_transaction;
-    }
+    goto error;
 
-  ret = db_query_start(qp);
+  ret = queue_order_flush_list(Q_TMPL_SHUFFLE, 1);
   if (ret < 0)
-    goto end_transaction;
+    goto error;
 
-  DPRINTF(E_DBG, L_DB, "Player queue query returned %d items\n", qp->results);
+  return 0;
 
-  if (qp->results == 0)
-    {
-      db_query_end(qp);
-      db_transaction_end();
-      return 0;
-    }
+ error:
+  DPRINTF(E_LOG, L_DB, "Could not write queue position keys\n");
+  return -1;
+#undef Q_TMPL_POS
+#undef Q_TMPL_SHUFFLE
+}
 
-  append_to_queue = (position < 0 || position > queue_count);
+static void
+queue_order_insert(uint32_t item_id, uint32_t pos, uint32_t shuffle_pos)
+{
+  struct db_queue_slot slot = { .id = item_id };
+  uint32_t count = db_queue_order.count;
 
-  if (append_to_queue)
-    {
-      pos = queue_count;
-      shuffle_pos = queue_count;
-    }
-  else
-    {
-      pos = position;
-      shuffle_pos = position;
+  queue_order_reserve(count + 1);
 
-      // Update pos for all items from the given position (make room for the new items in the queue)
-      query = sqlite3_mprintf("UPDATE queue SET pos = pos + %d, queue_version = %d WHERE pos >= %d;", qp->results, queue_version, pos);
-      ret = db_query_run(query, 1, 0);
-      if (ret < 0)
-	goto end_transaction;
+  pos = MIN(pos, count);
+  shuffle_pos = MIN(shuffle_pos, count);
 
-      // and similary update on shuffle_pos
-      query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos + %d, queue_version = %d WHERE shuffle_pos >= %d;", qp->results, queue_version, pos);
-      ret = db_query_run(query, 1, 0);
-      if (ret < 0)
-	goto end_transaction;
-    }
+  memmove(&db_queue_order.pos_slots[pos + 1], &db_queue_order.pos_slots[pos], (count - pos) * sizeof(struct db_queue_slot));
+  db_queue_order.pos_slots[pos] = slot;
 
-  while ((ret = db_query_fetch_file(&dbmfi, qp)) == 0)
-    {
-      ret = queue_item_add_from_file(&dbmfi, pos, shuffle_pos, queue_version);
+  memmove(&db_queue_order.shuffle_slots[shuffle_pos + 1], &db_queue_order.shuffle_slots[shuffle_pos], (count - shuffle_pos) * sizeof(struct db_queue_slot));
+  db_queue_order.shuffle_slots[shuffle_pos] = slot;
 
-      if (ret < 0)
-	{
-	  DPRINTF(E_DBG, L_DB, "Failed to add song id %s (%s)\n", dbmfi.id, dbmfi.title);
-	  break;
-	}
+  db_queue_order.count++;
 
-      DPRINTF(E_DBG, L_DB, "Added (pos=%d shuffle_pos=%d reshuffle=%d req position=%d) song id %s (%s) to queue with item id %d\n", pos, shuffle_pos, reshuffle, position, dbmfi.id, dbmfi.title, ret);
+  queue_index_add(db_queue_order.index, db_queue_order.index_size, item_id);
 
-      if (new_item_id && *new_item_id == 0)
-	*new_item_id = ret;
-      if (count)
-	(*count)++;
+  queue_order_touch(0, pos, db_queue_order.count);
+  queue_order_touch(1, shuffle_pos, db_queue_order.count);
 
-      pos++;
-      shuffle_pos++;
-    }
+  queue_order_keys_assign(0, pos, 1);
+  queue_order_keys_assign(1, shuffle_pos, 1);
+}
 
-  if (ret > 0)
-    ret = 0;
+// Drops the slots with id 0 from slots[first..], returns the new count
+static uint32_t
+queue_order_compact(char shuffle, uint32_t first)
+{
+  struct db_queue_slot *slots = queue_order_slots(shuffle);
+  uint32_t i;
+  uint32_t j;
 
-  db_query_end(qp);
+  for (i = first, j = first; i < db_queue_order.count; i++)
+    {
+      if (slots[i].id == 0)
+	continue;
 
-  if (ret < 0)
-    goto end_transaction;
+      if (i != j)
+	slots[j] = slots[i];
 
-  // Reshuffle after adding new items, if no queue position was specified - this
-  // case would indicate an 'add next' condition where if shuffling invalidates
-  // the tracks added to 'next'
-  if (append_to_queue && reshuffle)
-    {
-      ret = queue_reshuffle(item_id, queue_version);
+      j++;
     }
 
- end_transaction:
-  queue_transaction_end(ret, queue_version);
-
-  return ret;
+  return j;
 }
 
-static int
-queue_enum_start(struct query_params *qp)
+static void
+queue_order_remove(const uint32_t *remove, uint32_t nremove)
 {
-#define Q_TMPL "SELECT * FROM queue f WHERE %s ORDER BY %s;"
-  sqlite3_stmt *stmt;
-  char *query;
-  const char *orderby;
-  int ret;
+  struct db_queue_index_entry *entry;
+  uint32_t first_pos = db_queue_order.count;
+  uint32_t first_shuffle_pos = db_queue_order.count;
+  uint32_t count;
+  uint32_t i;
 
-  qp->stmt = NULL;
+  for (i = 0; i < nremove; i++)
+    {
+      entry = queue_order_find(remove[i]);
+      if (!entry)
+	continue;
 
-  if (qp->order)
-    orderby = qp->order;
-  else if (qp->sort)
-    orderby = sort_clause[qp->sort];
-  else
-    orderby = sort_clause[S_POS];
+      db_queue_order.pos_slots[entry->pos].id = 0;
+      db_queue_order.shuffle_slots[entry->shuffle_pos].id = 0;
+      first_pos = MIN(first_pos, entry->pos);
+      first_shuffle_pos = MIN(first_shuffle_pos, entry->shuffle_pos);
 
-  if (qp->filter)
-    query = sqlite3_mprintf(Q_TMPL, qp->filter, orderby);
-  else
-    query = sqlite3_mprintf(Q_TMPL, "1=1", orderby);
+      queue_index_remove(db_queue_order.index, db_queue_order.index_size, entry);
+    }
 
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  if (first_pos == db_queue_order.count)
+    return;
 
-      return -1;
-    }
+  count = queue_order_compact(0, first_pos);
+  queue_order_compact(1, first_shuffle_pos);
 
-  DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", query);
+  db_queue_order.count = count;
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+  queue_order_touch(0, first_pos, count);
+  queue_order_touch(1, first_shuffle_pos, count);
+}
 
-      sqlite3_free(query);
-      return -1;
-    }
+// Moves the items in [from, from + n) so the first ends up at position to
+static void
+queue_order_move(char shuffle, uint32_t from, uint32_t n, uint32_t to)
+{
+  struct db_queue_slot *slots = queue_order_slots(shuffle);
+  struct db_queue_slot *block;
 
-  sqlite3_free(query);
+  if (from == to || n == 0)
+    return;
 
-  qp->stmt = stmt;
+  CHECK_NULL(L_DB, block = malloc(n * sizeof(struct db_queue_slot)));
 
-  return 0;
+  memcpy(block, &slots[from], n * sizeof(struct db_queue_slot));
+  if (to < from)
+    memmove(&slots[to + n], &slots[to], (from - to) * sizeof(struct db_queue_slot));
+  else
+    memmove(&slots[from], &slots[from + n], (to - from) * sizeof(struct db_queue_slot));
+  memcpy(&slots[to], block, n * sizeof(struct db_queue_slot));
 
-#undef Q_TMPL
+  free(block);
+
+  queue_order_touch(shuffle, MIN(from, to), MAX(from, to) + n);
+  queue_order_keys_assign(shuffle, to, n);
 }
 
-static int
-queue_enum_fetch(struct query_params *qp, struct db_queue_item *qi, int must_strdup)
+// Sets pos and shuffle_pos of the queue item from the in-memory queue order
+static void
+queue_order_pos_set(struct db_queue_item *qi)
 {
-  int ret;
-  int i;
+  struct db_queue_index_entry *entry;
 
-  memset(qi, 0, sizeof(struct db_queue_item));
+  entry = queue_order_find(qi->id);
+  if (!entry)
+    return;
 
-  if (!qp->stmt)
-    {
-      DPRINTF(E_LOG, L_DB, "Queue enum not started!\n");
-      return -1;
-    }
+  qi->pos = entry->pos;
+  qi->shuffle_pos = entry->shuffle_pos;
+}
 
-  ret = db_blocking_step(qp->stmt);
-  if (ret == SQLITE_DONE)
-    {
-      DPRINTF(E_DBG, L_DB, "End of queue enum results\n");
-      return 0;
-    }
-  else if (ret != SQLITE_ROW)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
-      return -1;
-    }
+static void
+queue_snapshot_unref(struct db_queue_snapshot *snapshot)
+{
+  int refcount;
 
-  for (i = 0; i < ARRAY_SIZE(qi_cols_map); i++)
+  if (!snapshot)
+    return;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_queue_snapshot_lck));
+  refcount = --snapshot->refcount;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_snapshot_lck));
+
+  if (refcount > 0)
+    return;
+
+  free(snapshot->pos_ids);
+  free(snapshot->shuffle_ids);
+  free(snapshot->pos_keys);
+  free(snapshot->shuffle_keys);
+  free(snapshot->index);
+  free(snapshot);
+}
+
+// Replaces the published snapshot with one of the current order, if it changed.
+// Must be called with the lock held, after the changes were committed.
+static void
+queue_order_publish(void)
+{
+  struct db_queue_snapshot *snapshot;
+  struct db_queue_snapshot *old;
+  uint32_t count = db_queue_order.count;
+  uint32_t i;
+
+  if (!db_queue_order.loaded || (db_queue_snapshot && db_queue_order.snapshot_generation == db_queue_order.generation))
+    return;
+
+  CHECK_NULL(L_DB, snapshot = calloc(1, sizeof(struct db_queue_snapshot)));
+  CHECK_NULL(L_DB, snapshot->pos_ids = malloc(MAX(count, 1) * sizeof(uint32_t)));
+  CHECK_NULL(L_DB, snapshot->shuffle_ids = malloc(MAX(count, 1) * sizeof(uint32_t)));
+  CHECK_NULL(L_DB, snapshot->pos_keys = malloc(MAX(count, 1) * sizeof(int64_t)));
+  CHECK_NULL(L_DB, snapshot->shuffle_keys = malloc(MAX(count, 1) * sizeof(int64_t)));
+  CHECK_NULL(L_DB, snapshot->index = malloc(MAX(db_queue_order.index_size, 1) * sizeof(struct db_queue_index_entry)));
+
+  snapshot->refcount = 1;
+  snapshot->count = count;
+  snapshot->index_size = db_queue_order.index_size;
+
+  for (i = 0; i < count; i++)
     {
-      struct_field_from_statement(qi, qi_cols_map[i].offset, qi_cols_map[i].type, qp->stmt, i, must_strdup, false);
+      snapshot->pos_ids[i] = db_queue_order.pos_slots[i].id;
+      snapshot->shuffle_ids[i] = db_queue_order.shuffle_slots[i].id;
+      snapshot->pos_keys[i] = db_queue_order.pos_slots[i].key;
+      snapshot->shuffle_keys[i] = db_queue_order.shuffle_slots[i].key;
     }
 
-  return 0;
+  if (db_queue_order.index_size > 0)
+    memcpy(snapshot->index, db_queue_order.index, db_queue_order.index_size * sizeof(struct db_queue_index_entry));
+
+  db_queue_order.snapshot_generation = db_queue_order.generation;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_queue_snapshot_lck));
+  old = db_queue_snapshot;
+  db_queue_snapshot = snapshot;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_snapshot_lck));
+
+  queue_snapshot_unref(old);
 }
 
-int
-db_queue_enum_start(struct query_params *qp)
+// Returns a reference to the current snapshot, which must be released with
+// queue_snapshot_unref(), or NULL if the queue order could not be loaded
+static struct db_queue_snapshot *
+queue_snapshot_get(void)
 {
+  struct db_queue_snapshot *snapshot;
   int ret;
 
-  db_transaction_begin();
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_queue_snapshot_lck));
+  snapshot = db_queue_snapshot;
+  if (snapshot)
+    snapshot->refcount++;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_snapshot_lck));
+
+  if (snapshot)
+    return snapshot;
 
-  ret = queue_enum_start(qp);
+  // Nothing published yet, so the queue order was never loaded
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_queue_order.lck));
+  ret = queue_order_load();
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_order.lck));
 
   if (ret < 0)
-    db_transaction_rollback();
+    return NULL;
 
-  return ret;
-}
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_queue_snapshot_lck));
+  snapshot = db_queue_snapshot;
+  if (snapshot)
+    snapshot->refcount++;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_snapshot_lck));
 
-void
-db_queue_enum_end(struct query_params *qp)
-{
-  db_query_end(qp);
-  db_transaction_end();
+  return snapshot;
 }
 
-int
-db_queue_enum_fetch(struct query_params *qp, struct db_queue_item *qi)
+static inline struct db_queue_index_entry *
+queue_snapshot_find(struct db_queue_snapshot *snapshot, uint32_t item_id)
 {
-  return queue_enum_fetch(qp, qi, 0);
+  return queue_index_find(snapshot->index, snapshot->index_size, item_id);
 }
 
-int
-db_queue_get_pos(uint32_t item_id, char shuffle)
+/* SQL function queue_pos(id, shuffle), returns the position of the queue item
+ * in the normal or shuffled queue */
+static void
+db_queue_pos_xfunc(sqlite3_context *pv, int n, sqlite3_value **ppv)
 {
-#define Q_TMPL "SELECT pos FROM queue WHERE id = %d;"
-#define Q_TMPL_SHUFFLE "SELECT shuffle_pos FROM queue WHERE id = %d;"
+  struct db_queue_index_entry *entry = NULL;
 
-  char *query;
-  int pos;
+  if (queue_snapshot_stepping)
+    entry = queue_snapshot_find(queue_snapshot_stepping, sqlite3_value_int(ppv[0]));
 
-  if (shuffle)
-    query = sqlite3_mprintf(Q_TMPL_SHUFFLE, item_id);
+  if (entry)
+    sqlite3_result_int(pv, sqlite3_value_int(ppv[1]) ? entry->shuffle_pos : entry->pos);
   else
-    query = sqlite3_mprintf(Q_TMPL, item_id);
-
-  pos = db_get_one_int(query);
-
-  sqlite3_free(query);
-
-  return pos;
-
-#undef Q_TMPL
-#undef Q_TMPL_SHUFFLE
+    sqlite3_result_null(pv);
 }
 
-static int
-queue_fetch_byitemid(uint32_t item_id, struct db_queue_item *qi, int with_metadata)
+/* SQL function queue_version(id, queue_version), returns the queue version
+ * where the item was changed, taking position changes into account */
+static void
+db_queue_version_xfunc(sqlite3_context *pv, int n, sqlite3_value **ppv)
 {
-  struct query_params qp;
-  int ret;
+  struct db_queue_index_entry *entry;
+  int queue_version;
 
-  memset(&qp, 0, sizeof(struct query_params));
-  qp.filter = sqlite3_mprintf("id = %d", item_id);
+  queue_version = sqlite3_value_int(ppv[1]);
 
-  ret = queue_enum_start(&qp);
-  if (ret < 0)
+  if (queue_snapshot_stepping)
     {
-      sqlite3_free(qp.filter);
-      return -1;
+      entry = queue_snapshot_find(queue_snapshot_stepping, sqlite3_value_int(ppv[0]));
+      if (entry)
+	queue_version = MAX(queue_version, entry->version);
     }
 
-  ret = queue_enum_fetch(&qp, qi, with_metadata);
-  db_query_end(&qp);
-  sqlite3_free(qp.filter);
-  return ret;
+  sqlite3_result_int(pv, queue_version);
 }
 
-struct db_queue_item *
-db_queue_fetch_byitemid(uint32_t item_id)
+/*
+ * Start a new transaction for modifying the queue. Returns the new queue version for the following changes,
+ * or -1 if the queue could not be loaded (in which case the transaction is not started).
+ * After finishing all queue modifications 'queue_transaction_end' needs to be called.
+ */
+static int
+queue_transaction_begin()
 {
-  struct db_queue_item *qi;
+  int queue_version = 0;
   int ret;
 
-  qi = calloc(1, sizeof(struct db_queue_item));
-  if (!qi)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for queue_item\n");
-      return NULL;
-    }
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_queue_order.lck));
 
   db_transaction_begin();
-  ret = queue_fetch_byitemid(item_id, qi, 1);
-  db_transaction_end();
 
+  ret = queue_order_load();
   if (ret < 0)
     {
-      free_queue_item(qi, 0);
-      DPRINTF(E_LOG, L_DB, "Error fetching queue item by item id\n");
-      return NULL;
-    }
-  else if (qi->id == 0)
-    {
-      // No item found
-      free_queue_item(qi, 0);
-      return NULL;
+      db_transaction_rollback();
+      CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_order.lck));
+      return -1;
     }
 
-  return qi;
+  db_admin_getint(&queue_version, DB_ADMIN_QUEUE_VERSION);
+  queue_version++;
+
+  db_queue_order.version = queue_version;
+  db_queue_order.changed = false;
+
+  return queue_version;
 }
 
-struct db_queue_item *
-db_queue_fetch_byfileid(uint32_t file_id)
+/*
+ * If retval == 0, updates the version of the queue in the admin table, commits the transaction
+ * and notifies listener of LISTENER_QUEUE about the changes.
+ * If retval < 0, rollsback the transaction. If the in-memory queue order was changed it does not
+ * match the queue table any more, so it is reloaded from the table.
+ *
+ * This function must be called after modifying the queue.
+ *
+ * @param retval 'retval' >= 0, if modifying the queue was successful or 'retval' < 0 if an error occurred
+ * @param queue_version The new queue version, for the pending modifications
+ */
+static void
+queue_transaction_end(int retval, int queue_version)
 {
-  struct db_queue_item *qi;
-  struct query_params qp;
   int ret;
 
-  memset(&qp, 0, sizeof(struct query_params));
-  qi = calloc(1, sizeof(struct db_queue_item));
-  if (!qi)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for queue_item\n");
-      return NULL;
-    }
-
-  db_transaction_begin();
+  if (retval < 0)
+    goto error;
 
-  qp.filter = sqlite3_mprintf("file_id = %d", file_id);
+  ret = queue_order_flush();
+  if (ret < 0)
+    goto error;
 
-  ret = queue_enum_start(&qp);
+  ret = db_admin_setint(DB_ADMIN_QUEUE_VERSION, queue_version);
   if (ret < 0)
-    {
-      sqlite3_free(qp.filter);
-      db_transaction_end();
-      free_queue_item(qi, 0);
-      DPRINTF(E_LOG, L_DB, "Error fetching queue item by file id\n");
-      return NULL;
-    }
+    goto error;
 
-  ret = queue_enum_fetch(&qp, qi, 1);
-  db_query_end(&qp);
-  sqlite3_free(qp.filter);
   db_transaction_end();
 
-  if (ret < 0)
-    {
-      free_queue_item(qi, 0);
-      DPRINTF(E_LOG, L_DB, "Error fetching queue item by file id\n");
-      return NULL;
-    }
-  else if (qi->id == 0)
-    {
-      // No item found
-      free_queue_item(qi, 0);
-      return NULL;
-    }
+  queue_order_publish();
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_order.lck));
 
-  return qi;
+  listener_notify(LISTENER_QUEUE);
+  return;
+
+ error:
+  db_transaction_rollback();
+
+  if (db_queue_order.changed)
+    queue_order_reset();
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_order.lck));
+}
+
+/*
+ * Ends a queue transaction where nothing was changed
+ */
+static void
+queue_transaction_cancel()
+{
+  db_transaction_end();
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_order.lck));
 }
 
 static int
-queue_fetch_bypos(uint32_t pos, char shuffle, struct db_queue_item *qi, int with_metadata)
+queue_reshuffle(uint32_t item_id, int queue_version);
+
+static int
+queue_item_add(struct db_queue_item *qi)
 {
-  struct query_params qp;
   int ret;
 
-  memset(&qp, 0, sizeof(struct query_params));
-  if (shuffle)
-    qp.filter = sqlite3_mprintf("shuffle_pos = %d", pos);
-  else
-    qp.filter = sqlite3_mprintf("pos = %d", pos);
+  fixup_tags_qi(qi);
 
-  ret = queue_enum_start(&qp);
+  ret = bind_qi(db_statements.queue_items_insert, qi);
+  if (ret < 0)
+    return -1;
+
+  // Do not update events here, only caller knows if more items will be added
+  ret = db_statement_run(db_statements.queue_items_insert, 0);
   if (ret < 0)
+    return -1;
+
+  ret = (int)sqlite3_last_insert_rowid(hdl);
+  if (ret == 0)
     {
-      sqlite3_free(qp.filter);
+      DPRINTF(E_LOG, L_DB, "Successful queue item insert but no last_insert_rowid!\n");
       return -1;
     }
 
-  ret = queue_enum_fetch(&qp, qi, with_metadata);
-  db_query_end(&qp);
-  sqlite3_free(qp.filter);
+  queue_order_insert(ret, qi->pos, qi->shuffle_pos);
+
   return ret;
 }
 
-struct db_queue_item *
-db_queue_fetch_bypos(uint32_t pos, char shuffle)
+static int
+queue_item_add_from_file(struct db_media_file_info *dbmfi, int pos, int shuffle_pos, int queue_version)
 {
-  struct db_queue_item *qi;
+  struct db_queue_item qi;
   int ret;
 
-  qi = calloc(1, sizeof(struct db_queue_item));
-  if (!qi)
-    {
-      DPRINTF(E_LOG, L_MAIN, "Out of memory for queue_item\n");
-      return NULL;
-    }
+  // No allocations, just the struct content is copied
+  db_queue_item_from_dbmfi(&qi, dbmfi);
 
-  db_transaction_begin();
-  ret = queue_fetch_bypos(pos, shuffle, qi, 1);
-  db_transaction_end();
+  // No tag fixup, we can't touch the strings in qi, plus must assume dbmfi has proper tags
+
+  qi.pos = pos;
+  qi.shuffle_pos = shuffle_pos;
+  qi.queue_version = queue_version;
 
+  ret = bind_qi(db_statements.queue_items_insert, &qi);
   if (ret < 0)
+    return -1;
+
+  // Do not update events here, only caller knows if more items will be added
+  ret = db_statement_run(db_statements.queue_items_insert, 0);
+  if (ret < 0)
+    return -1;
+
+  ret = (int)sqlite3_last_insert_rowid(hdl);
+  if (ret == 0)
     {
-      free_queue_item(qi, 0);
-      DPRINTF(E_LOG, L_DB, "Error fetching queue item by pos id\n");
-      return NULL;
-    }
-  else if (qi->id == 0)
-    {
-      // No item found
-      free_queue_item(qi, 0);
-      return NULL;
+      DPRINTF(E_LOG, L_DB, "Successful queue item insert but no last_insert_rowid!\n");
+      return -1;
     }
 
-  return qi;
+  queue_order_insert(ret, pos, shuffle_pos);
+
+  return ret;
 }
 
 static int
-queue_fetch_byposrelativetoitem(int pos, uint32_t item_id, char shuffle, struct db_queue_item *qi, int with_metadata)
+queue_item_update(struct db_queue_item *qi)
 {
-  int pos_absolute;
+  struct db_queue_index_entry *entry;
   int ret;
 
-  DPRINTF(E_DBG, L_DB, "Fetch by pos: pos (%d) relative to item with id (%d)\n", pos, item_id);
+  fixup_tags_qi(qi);
 
-  pos_absolute = db_queue_get_pos(item_id, shuffle);
-  if (pos_absolute < 0)
+  ret = bind_qi(db_statements.queue_items_update, qi);
+  if (ret < 0)
+    return -1;
+
+  // Do not update events here, only caller knows if more items will be updated
+  ret = db_statement_run(db_statements.queue_items_update, 0);
+  if (ret < 0)
+    return -1;
+
+  // The update wrote qi's pos/shuffle_pos over the keys
+  entry = queue_order_find(qi->id);
+  if (entry)
     {
-      return -1;
+      queue_order_slot_dirty(0, entry->pos);
+      queue_order_slot_dirty(1, entry->shuffle_pos);
     }
 
-  DPRINTF(E_DBG, L_DB, "Fetch by pos: item (%d) has absolute pos %d\n", item_id, pos_absolute);
+  return qi->id;
+}
 
-  pos_absolute += pos;
+void
+db_queue_item_from_mfi(struct db_queue_item *qi, struct media_file_info *mfi)
+{
+  int i;
 
-  ret = queue_fetch_bypos(pos_absolute, shuffle, qi, with_metadata);
+  memset(qi, 0, sizeof(struct db_queue_item));
 
-  if (ret < 0)
-    DPRINTF(E_LOG, L_DB, "Error fetching item by pos: pos (%d) relative to item with id (%d)\n", pos, item_id);
-  else
-    DPRINTF(E_DBG, L_DB, "Fetch by pos: fetched item (id=%d, pos=%d, file-id=%d)\n", qi->id, qi->pos, qi->file_id);
+  for (i = 0; i < ARRAY_SIZE(qi_mfi_map); i++)
+    {
+      if (qi_mfi_map[i].mfi_offset < 0)
+	continue;
 
-  return ret;
+      struct_field_from_field(qi, qi_cols_map[i].offset, qi_cols_map[i].type, mfi, qi_mfi_map[i].mfi_offset, true, false);
+    }
+
+  if (!qi->file_id)
+    qi->file_id = DB_MEDIA_FILE_NON_PERSISTENT_ID;
 }
 
-struct db_queue_item *
-db_queue_fetch_byposrelativetoitem(int pos, uint32_t item_id, char shuffle)
+void
+db_queue_item_from_dbmfi(struct db_queue_item *qi, struct db_media_file_info *dbmfi)
 {
-  struct db_queue_item *qi;
-  int ret;
+  int i;
 
-  DPRINTF(E_DBG, L_DB, "Fetch by pos: pos (%d) relative to item with id (%d)\n", pos, item_id);
+  memset(qi, 0, sizeof(struct db_queue_item));
 
-  qi = calloc(1, sizeof(struct db_queue_item));
-  if (!qi)
+  for (i = 0; i < ARRAY_SIZE(qi_mfi_map); i++)
     {
-      DPRINTF(E_LOG, L_MAIN, "Out of memory for queue_item\n");
-      return NULL;
+      if (qi_mfi_map[i].dbmfi_offset < 0)
+	continue;
+
+      struct_field_from_field(qi, qi_cols_map[i].offset, qi_cols_map[i].type, dbmfi, qi_mfi_map[i].dbmfi_offset, false, true);
     }
 
-  db_transaction_begin();
+  if (!qi->file_id)
+    qi->file_id = DB_MEDIA_FILE_NON_PERSISTENT_ID;
+}
 
-  ret = queue_fetch_byposrelativetoitem(pos, item_id, shuffle, qi, 1);
 
-  db_transaction_end();
+int
+db_queue_item_update(struct db_queue_item *qi)
+{
+  int queue_version;
+  int ret;
 
-  if (ret < 0)
-    {
-      free_queue_item(qi, 0);
-      DPRINTF(E_LOG, L_DB, "Error fetching queue item by pos relative to item id\n");
-      return NULL;
-    }
-  else if (qi->id == 0)
-    {
-      // No item found
-      free_queue_item(qi, 0);
-      return NULL;
-    }
+  queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
 
-  DPRINTF(E_DBG, L_DB, "Fetch by pos: fetched item (id=%d, pos=%d, file-id=%d)\n", qi->id, qi->pos, qi->file_id);
+  qi->queue_version = queue_version;
 
-  return qi;
+  ret = queue_item_update(qi);
+
+  // MPD changes playlist version when metadata changes, also makes LISTENER_QUEUE
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
 }
 
-struct db_queue_item *
-db_queue_fetch_next(uint32_t item_id, char shuffle)
+/*
+ * Adds the files matching the given query to the queue after the item with the given item id
+ *
+ * The files table is queried with the given parameters and all found files are added after the
+ * item with the given item id to the "normal" queue. They are appended to end of the shuffled queue
+ * (assuming that the shuffled queue will get reshuffled after adding new items).
+ *
+ * The function returns -1 on failure (e. g. error reading from database) and if the given item id
+ * does not exist. It wraps all database access in a transaction and performs a rollback if an error
+ * occurs, leaving the queue in a consistent state.
+ *
+ * @param qp Query parameters for the files table
+ * @param item_id Files are added after item with this id
+ * @return 0 on success, -1 on failure
+ */
+int
+db_queue_add_by_queryafteritemid(struct query_params *qp, uint32_t item_id)
 {
-  return db_queue_fetch_byposrelativetoitem(1, item_id, shuffle);
+  int pos;
+  int ret;
+
+  // Position of the first new item
+  pos = db_queue_get_pos(item_id, 0);
+  if (pos < 0)
+    {
+      return -1;
+    }
+  pos++;
+
+  ret = db_queue_add_by_query(qp, 0, 0, pos, NULL, NULL);
+  return ret;
 }
 
-struct db_queue_item *
-db_queue_fetch_prev(uint32_t item_id, char shuffle)
+int
+db_queue_add_start(struct db_queue_add_info *queue_add_info, int pos)
 {
-  return db_queue_fetch_byposrelativetoitem(-1, item_id, shuffle);
+  uint32_t queue_count;
+
+  memset(queue_add_info, 0, sizeof(struct db_queue_add_info));
+  queue_add_info->queue_version = queue_transaction_begin();
+  if (queue_add_info->queue_version < 0)
+    return -1;
+
+  queue_count = db_queue_order.count;
+
+  queue_add_info->pos = queue_count;
+  queue_add_info->shuffle_pos = queue_count;
+
+  if (pos >= 0 && pos < queue_count)
+    queue_add_info->pos = pos;
+
+  queue_add_info->start_pos = queue_add_info->pos;
+
+  return 0;
 }
 
-static int
-queue_fix_pos(enum sort_type sort, int queue_version)
+int
+db_queue_add_end(struct db_queue_add_info *queue_add_info, char reshuffle, uint32_t item_id, int ret)
 {
-#define Q_TMPL "UPDATE queue SET %q = %d, queue_version = %d WHERE id = %d and %q <> %d;"
+  if (ret < 0)
+    goto end;
 
-  struct query_params qp;
-  struct db_queue_item queue_item;
-  char *query;
-  int pos;
+  // The in-memory order was already updated by db_queue_add_next()
+
+  // Reshuffle after adding new items
+  if (reshuffle)
+    ret = queue_reshuffle(item_id, queue_add_info->queue_version);
+
+ end:
+  queue_transaction_end(ret, queue_add_info->queue_version);
+  return ret;
+}
+
+int
+db_queue_add_next(struct db_queue_add_info *queue_add_info, struct db_queue_item *qi)
+{
   int ret;
 
-  memset(&qp, 0, sizeof(struct query_params));
-  qp.sort = sort;
+  qi->pos = queue_add_info->pos;
+  qi->shuffle_pos = queue_add_info->shuffle_pos;
+  qi->queue_version = queue_add_info->queue_version;
 
-  ret = queue_enum_start(&qp);
+  ret = queue_item_add(qi);
   if (ret < 0)
-    {
-      return -1;
-    }
-
-  pos = 0;
-  while ((ret = queue_enum_fetch(&qp, &queue_item, 0)) == 0 && (queue_item.id > 0))
-    {
-      if (queue_item.pos != pos)
-        {
-	  if (sort == S_SHUFFLE_POS)
-	    query = sqlite3_mprintf(Q_TMPL, "shuffle_pos", pos, queue_version, queue_item.id, "shuffle_pos", pos);
-	  else
-	    query = sqlite3_mprintf(Q_TMPL, "pos", pos, queue_version, queue_item.id, "pos", pos);
+    return ret;
 
-	  ret = db_query_run(query, 1, 0);
-	  if (ret < 0)
-	    {
-	      DPRINTF(E_LOG, L_DB, "Failed to update item with item-id: %d\n", queue_item.id);
-	      break;
-	    }
-	}
+  queue_add_info->pos++;
+  queue_add_info->shuffle_pos++;
+  queue_add_info->count++;
 
-      pos++;
-    }
+  if (queue_add_info->new_item_id == 0)
+    queue_add_info->new_item_id = ret;
 
-  db_query_end(&qp);
   return ret;
-
-#undef Q_TMPL
 }
 
 /*
- * Remove files that are disabled or non existent in the library and repair ordering of
- * the queue (shuffle and normal)
+ * Adds the files matching the given query to the queue
+ *
+ * The files table is queried with the given parameters and all found files are added to the end of the
+ * "normal" queue and the shuffled queue.
+ *
+ * The function returns -1 on failure (e. g. error reading from database). It wraps all database access
+ * in a transaction and performs a rollback if an error occurs, leaving the queue in a consistent state.
+ *
+ * @param qp Query parameters for the files table
+ * @param reshuffle If 1 queue will be reshuffled after adding new items
+ * @param item_id The base item id, all items after this will be reshuffled
+ * @param position The position in the queue for the new queue item, -1 to add at end of queue
+ * @param count If not NULL returns the number of items added to the queue
+ * @param new_item_id If not NULL return the queue item id of the first new queue item
+ * @return 0 on success, -1 on failure
  */
 int
-db_queue_cleanup()
+db_queue_add_by_query(struct query_params *qp, char reshuffle, uint32_t item_id, int position, int *count, int *new_item_id)
 {
-#define Q_TMPL "DELETE FROM queue WHERE NOT file_id IN (SELECT id from files WHERE disabled = 0);"
-
+  struct db_media_file_info dbmfi;
   int queue_version;
-  int deleted;
+  uint32_t queue_count;
+  int pos;
+  int shuffle_pos;
+  bool append_to_queue;
   int ret;
 
+  if (new_item_id)
+    *new_item_id = 0;
+  if (count)
+    *count = 0;
+
   queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
 
-  ret = db_query_run(Q_TMPL, 0, 0);
+  queue_count = db_queue_order.count;
+
+  ret = db_query_start(qp);
   if (ret < 0)
     goto end_transaction;
 
-  deleted = sqlite3_changes(hdl);
-  if (deleted <= 0)
+  DPRINTF(E_DBG, L_DB, "Player queue query returned %d items\n", qp->results);
+
+  if (qp->results == 0)
     {
-      // Nothing to do
-      db_transaction_end();
+      db_query_end(qp);
+      queue_transaction_cancel();
       return 0;
     }
 
-  // Update position of normal queue
-  ret = queue_fix_pos(S_POS, queue_version);
-  if (ret < 0)
-    goto end_transaction;
+  append_to_queue = (position < 0 || position > queue_count);
 
-  // Update position of shuffle queue
-  ret = queue_fix_pos(S_SHUFFLE_POS, queue_version);
+  if (append_to_queue)
+    {
+      pos = queue_count;
+      shuffle_pos = queue_count;
+    }
+  else
+    {
+      // Following items are moved by the in-memory order when the new items are inserted
+      pos = position;
+      shuffle_pos = position;
+    }
+
+  while ((ret = db_query_fetch_file(&dbmfi, qp)) == 0)
+    {
+      ret = queue_item_add_from_file(&dbmfi, pos, shuffle_pos, queue_version);
+
+      if (ret < 0)
+	{
+	  DPRINTF(E_DBG, L_DB, "Failed to add song id %s (%s)\n", dbmfi.id, dbmfi.title);
+	  break;
+	}
+
+      DPRINTF(E_DBG, L_DB, "Added (pos=%d shuffle_pos=%d reshuffle=%d req position=%d) song id %s (%s) to queue with item id %d\n", pos, shuffle_pos, reshuffle, position, dbmfi.id, dbmfi.title, ret);
+
+      if (new_item_id && *new_item_id == 0)
+	*new_item_id = ret;
+      if (count)
+	(*count)++;
+
+      pos++;
+      shuffle_pos++;
+    }
+
+  if (ret > 0)
+    ret = 0;
+
+  db_query_end(qp);
+
+  if (ret < 0)
+    goto end_transaction;
+
+  // Reshuffle after adding new items, if no queue position was specified - this
+  // case would indicate an 'add next' condition where if shuffling invalidates
+  // the tracks added to 'next'
+  if (append_to_queue && reshuffle)
+    {
+      ret = queue_reshuffle(item_id, queue_version);
+    }
+
+ end_transaction:
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
+/* The columns of the queue table, but with the actual positions from the
+ * in-memory order instead of the position keys. The keys follow as pos_key and
+ * shuffle_key, after the columns that queue_enum_fetch() reads. */
+static char *
+queue_enum_columns(void)
+{
+  char *cols = NULL;
+  char *col;
+  char *tmp;
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(qi_cols_map); i++)
+    {
+      if (qi_cols_map[i].offset == qi_offsetof(pos))
+	col = sqlite3_mprintf("queue_pos(q.id, 0) AS pos");
+      else if (qi_cols_map[i].offset == qi_offsetof(shuffle_pos))
+	col = sqlite3_mprintf("queue_pos(q.id, 1) AS shuffle_pos");
+      else if (qi_cols_map[i].offset == qi_offsetof(queue_version))
+	col = sqlite3_mprintf("queue_version(q.id, q.queue_version) AS queue_version");
+      else
+	col = sqlite3_mprintf("q.%s", qi_cols_map[i].name);
+
+      tmp = sqlite3_mprintf("%s%s%s", cols ? cols : "", cols ? ", " : "", col);
+      sqlite3_free(col);
+      sqlite3_free(cols);
+      cols = tmp;
+    }
+
+  tmp = sqlite3_mprintf("%s, q.pos AS pos_key, q.shuffle_pos AS shuffle_key", cols);
+  sqlite3_free(cols);
+
+  return tmp;
+}
+
+/* Condition for the items at position offset to offset + limit of the normal
+ * or shuffled queue. The stored keys are in the same
+ * order as the positions and indexed, so only the rows in the window are read,
+ * instead of comparing queue_pos() of every row. */
+static char *
+queue_enum_window(struct db_queue_snapshot *snapshot, bool shuffle, int offset, int limit)
+{
+  int64_t *keys = shuffle ? snapshot->shuffle_keys : snapshot->pos_keys;
+  uint32_t last;
+
+  if (offset < 0)
+    offset = 0;
+
+  if (offset >= snapshot->count || limit <= 0)
+    return sqlite3_mprintf("0");
+
+  if (limit < snapshot->count - offset)
+    last = offset + limit - 1;
+  else
+    last = snapshot->count - 1;
+
+  return sqlite3_mprintf("f.%s BETWEEN %" PRIi64 " AND %" PRIi64, shuffle ? "shuffle_key" : "pos_key", keys[offset], keys[last]);
+}
+
+static int
+queue_enum_start(struct query_params *qp)
+{
+#define Q_TMPL "SELECT * FROM (SELECT %s FROM queue q) f WHERE %s AND %s ORDER BY %s;"
+  sqlite3_stmt *stmt;
+  char *cols;
+  char *window;
+  char *query;
+  const char *orderby;
+  int ret;
+
+  qp->stmt = NULL;
+  qp->reader = NULL;
+
+  // Positions are read from the snapshot of the in-memory order
+  qp->queue_snapshot = queue_snapshot_get();
+  if (!qp->queue_snapshot)
+    return -1;
+
+  cols = queue_enum_columns();
+  if (!cols)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      goto error;
+    }
+
+  // The keys give the same order as the positions, but from the index
+  if (qp->order)
+    orderby = qp->order;
+  else if (qp->sort == S_SHUFFLE_POS)
+    orderby = "f.shuffle_key";
+  else if (qp->sort && qp->sort != S_POS)
+    orderby = sort_clause[qp->sort];
+  else
+    orderby = "f.pos_key";
+
+  if (qp->idx_type == I_SUB)
+    window = queue_enum_window(qp->queue_snapshot, (qp->sort == S_SHUFFLE_POS), qp->offset, qp->limit);
+  else
+    window = sqlite3_mprintf("1=1");
+
+  if (window)
+    query = sqlite3_mprintf(Q_TMPL, cols, qp->filter ? qp->filter : "1=1", window, orderby);
+  else
+    query = NULL;
+
+  sqlite3_free(window);
+  sqlite3_free(cols);
+
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      goto error;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_free(query);
+      goto error;
+    }
+
+  sqlite3_free(query);
+
+  qp->stmt = stmt;
+
+  return 0;
+
+ error:
+  queue_snapshot_unref(qp->queue_snapshot);
+  qp->queue_snapshot = NULL;
+  return -1;
+
+#undef Q_TMPL
+}
+
+static void
+queue_enum_end(struct query_params *qp)
+{
+  db_query_end(qp);
+
+  queue_snapshot_unref(qp->queue_snapshot);
+  qp->queue_snapshot = NULL;
+}
+
+static int
+queue_enum_fetch(struct query_params *qp, struct db_queue_item *qi, int must_strdup)
+{
+  struct db_queue_snapshot *stepping;
+  int ret;
+  int i;
+
+  memset(qi, 0, sizeof(struct db_queue_item));
+
+  if (!qp->stmt)
+    {
+      DPRINTF(E_LOG, L_DB, "Queue enum not started!\n");
+      return -1;
+    }
+
+  // For queue_pos() and queue_version(), restored since enums can be nested
+  stepping = queue_snapshot_stepping;
+  queue_snapshot_stepping = qp->queue_snapshot;
+  ret = db_blocking_step(qp->stmt);
+  queue_snapshot_stepping = stepping;
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_DBG, L_DB, "End of queue enum results\n");
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  for (i = 0; i < ARRAY_SIZE(qi_cols_map); i++)
+    {
+      struct_field_from_statement(qi, qi_cols_map[i].offset, qi_cols_map[i].type, qp->stmt, i, must_strdup, false);
+    }
+
+  return 0;
+}
+
+int
+db_queue_enum_start(struct query_params *qp)
+{
+  return queue_enum_start(qp);
+}
+
+void
+db_queue_enum_end(struct query_params *qp)
+{
+  queue_enum_end(qp);
+}
+
+int
+db_queue_enum_fetch(struct query_params *qp, struct db_queue_item *qi)
+{
+  return queue_enum_fetch(qp, qi, 0);
+}
+
+static int
+queue_get_pos(uint32_t item_id, char shuffle)
+{
+  struct db_queue_index_entry *entry;
+
+  entry = queue_order_find(item_id);
+  if (!entry)
+    {
+      DPRINTF(E_INFO, L_DB, "Queue item with id %" PRIu32 " not found\n", item_id);
+      return -1;
+    }
+
+  return shuffle ? entry->shuffle_pos : entry->pos;
+}
+
+int
+db_queue_get_pos(uint32_t item_id, char shuffle)
+{
+  struct db_queue_snapshot *snapshot;
+  struct db_queue_index_entry *entry;
+  int pos = -1;
+
+  snapshot = queue_snapshot_get();
+  if (!snapshot)
+    return -1;
+
+  entry = queue_snapshot_find(snapshot, item_id);
+  if (entry)
+    pos = shuffle ? entry->shuffle_pos : entry->pos;
+  else
+    DPRINTF(E_INFO, L_DB, "Queue item with id %" PRIu32 " not found\n", item_id);
+
+  queue_snapshot_unref(snapshot);
+
+  return pos;
+}
+
+static int
+queue_fetch_byitemid(uint32_t item_id, struct db_queue_item *qi, int with_metadata)
+{
+#define Q_TMPL "SELECT * FROM queue f WHERE id = ?;"
+  struct query_params qp;
+  int ret;
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.stmt = db_stmt_cache_get(Q_TMPL);
+  if (!qp.stmt)
+    return -1;
+
+  sqlite3_bind_int(qp.stmt, 1, item_id);
+
+  ret = queue_enum_fetch(&qp, qi, with_metadata);
+  db_stmt_cache_release(qp.stmt);
+
+  queue_order_pos_set(qi);
+
+  return ret;
+#undef Q_TMPL
+}
+
+// Looks up the item at pos in the snapshot, returns 0 if there is no item at pos
+static uint32_t
+queue_snapshot_item_at(struct db_queue_snapshot *snapshot, uint32_t pos, char shuffle, int *item_pos, int *item_shuffle_pos)
+{
+  struct db_queue_index_entry *entry;
+
+  if (pos >= snapshot->count)
+    return 0;
+
+  entry = queue_snapshot_find(snapshot, shuffle ? snapshot->shuffle_ids[pos] : snapshot->pos_ids[pos]);
+  if (!entry)
+    return 0;
+
+  *item_pos = entry->pos;
+  *item_shuffle_pos = entry->shuffle_pos;
+
+  return entry->id;
+}
+
+// Reads the row of a queue item with the positions the caller looked up in a
+// snapshot of the order
+static struct db_queue_item *
+queue_fetch_row(uint32_t item_id, int pos, int shuffle_pos)
+{
+#define Q_TMPL "SELECT * FROM queue f WHERE id = ?;"
+  struct query_params qp;
+  struct db_queue_item *qi;
+  int ret;
+
+  qi = calloc(1, sizeof(struct db_queue_item));
+  if (!qi)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for queue_item\n");
+      return NULL;
+    }
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.stmt = db_stmt_cache_get(Q_TMPL);
+  if (!qp.stmt)
+    {
+      free_queue_item(qi, 0);
+      return NULL;
+    }
+
+  sqlite3_bind_int(qp.stmt, 1, item_id);
+
+  ret = queue_enum_fetch(&qp, qi, 1);
+  db_stmt_cache_release(qp.stmt);
+
+  if (ret < 0)
+    {
+      free_queue_item(qi, 0);
+      DPRINTF(E_LOG, L_DB, "Error fetching queue item by item id\n");
+      return NULL;
+    }
+  else if (qi->id == 0)
+    {
+      // Removed since the lookup
+      free_queue_item(qi, 0);
+      return NULL;
+    }
+
+  qi->pos = pos;
+  qi->shuffle_pos = shuffle_pos;
+
+  return qi;
+#undef Q_TMPL
+}
+
+struct db_queue_item *
+db_queue_fetch_byitemid(uint32_t item_id)
+{
+  struct db_queue_snapshot *snapshot;
+  struct db_queue_index_entry *entry;
+  int pos = 0;
+  int shuffle_pos = 0;
+
+  snapshot = queue_snapshot_get();
+  if (!snapshot)
+    {
+      DPRINTF(E_LOG, L_DB, "Error fetching queue item by item id\n");
+      return NULL;
+    }
+
+  entry = queue_snapshot_find(snapshot, item_id);
+  if (entry)
+    {
+      pos = entry->pos;
+      shuffle_pos = entry->shuffle_pos;
+    }
+
+  queue_snapshot_unref(snapshot);
+
+  if (!entry)
+    {
+      // No item found
+      return NULL;
+    }
+
+  return queue_fetch_row(item_id, pos, shuffle_pos);
+}
+
+struct db_queue_item *
+db_queue_fetch_byfileid(uint32_t file_id)
+{
+  struct db_queue_item *qi;
+  struct query_params qp;
+  int ret;
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qi = calloc(1, sizeof(struct db_queue_item));
+  if (!qi)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for queue_item\n");
+      return NULL;
+    }
+
+  qp.filter = sqlite3_mprintf("file_id = %d", file_id);
+
+  ret = queue_enum_start(&qp);
+  if (ret < 0)
+    {
+      sqlite3_free(qp.filter);
+      free_queue_item(qi, 0);
+      DPRINTF(E_LOG, L_DB, "Error fetching queue item by file id\n");
+      return NULL;
+    }
+
+  ret = queue_enum_fetch(&qp, qi, 1);
+  queue_enum_end(&qp);
+  sqlite3_free(qp.filter);
+
+  if (ret < 0)
+    {
+      free_queue_item(qi, 0);
+      DPRINTF(E_LOG, L_DB, "Error fetching queue item by file id\n");
+      return NULL;
+    }
+  else if (qi->id == 0)
+    {
+      // No item found
+      free_queue_item(qi, 0);
+      return NULL;
+    }
+
+  return qi;
+}
+
+static int
+queue_fetch_bypos(uint32_t pos, char shuffle, struct db_queue_item *qi, int with_metadata)
+{
+  uint32_t item_id;
+
+  if (pos >= db_queue_order.count)
+    {
+      // No item found
+      memset(qi, 0, sizeof(struct db_queue_item));
+      return 0;
+    }
+
+  item_id = queue_order_slots(shuffle)[pos].id;
+
+  return queue_fetch_byitemid(item_id, qi, with_metadata);
+}
+
+struct db_queue_item *
+db_queue_fetch_bypos(uint32_t pos, char shuffle)
+{
+  struct db_queue_snapshot *snapshot;
+  uint32_t item_id;
+  int item_pos;
+  int item_shuffle_pos;
+
+  snapshot = queue_snapshot_get();
+  if (!snapshot)
+    {
+      DPRINTF(E_LOG, L_DB, "Error fetching queue item by pos id\n");
+      return NULL;
+    }
+
+  item_id = queue_snapshot_item_at(snapshot, pos, shuffle, &item_pos, &item_shuffle_pos);
+  queue_snapshot_unref(snapshot);
+
+  if (item_id == 0)
+    {
+      // No item found
+      return NULL;
+    }
+
+  return queue_fetch_row(item_id, item_pos, item_shuffle_pos);
+}
+
+static int
+queue_fetch_byposrelativetoitem(int pos, uint32_t item_id, char shuffle, struct db_queue_item *qi, int with_metadata)
+{
+  int pos_absolute;
+  int ret;
+
+  DPRINTF(E_DBG, L_DB, "Fetch by pos: pos (%d) relative to item with id (%d)\n", pos, item_id);
+
+  pos_absolute = queue_get_pos(item_id, shuffle);
+  if (pos_absolute < 0)
+    {
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Fetch by pos: item (%d) has absolute pos %d\n", item_id, pos_absolute);
+
+  pos_absolute += pos;
+  if (pos_absolute < 0)
+    {
+      // No item found
+      memset(qi, 0, sizeof(struct db_queue_item));
+      return 0;
+    }
+
+  ret = queue_fetch_bypos(pos_absolute, shuffle, qi, with_metadata);
+
+  if (ret < 0)
+    DPRINTF(E_LOG, L_DB, "Error fetching item by pos: pos (%d) relative to item with id (%d)\n", pos, item_id);
+  else
+    DPRINTF(E_DBG, L_DB, "Fetch by pos: fetched item (id=%d, pos=%d, file-id=%d)\n", qi->id, qi->pos, qi->file_id);
+
+  return ret;
+}
+
+struct db_queue_item *
+db_queue_fetch_byposrelativetoitem(int pos, uint32_t item_id, char shuffle)
+{
+  struct db_queue_snapshot *snapshot;
+  struct db_queue_index_entry *entry;
+  struct db_queue_item *qi;
+  uint32_t found_id = 0;
+  int found_pos;
+  int found_shuffle_pos;
+  int pos_absolute;
+  int ret = -1;
+
+  DPRINTF(E_DBG, L_DB, "Fetch by pos: pos (%d) relative to item with id (%d)\n", pos, item_id);
+
+  snapshot = queue_snapshot_get();
+  if (snapshot)
+    {
+      entry = queue_snapshot_find(snapshot, item_id);
+      if (entry)
+	{
+	  pos_absolute = (shuffle ? entry->shuffle_pos : entry->pos) + pos;
+	  if (pos_absolute >= 0)
+	    found_id = queue_snapshot_item_at(snapshot, pos_absolute, shuffle, &found_pos, &found_shuffle_pos);
+	  ret = 0;
+	}
+      else
+	DPRINTF(E_INFO, L_DB, "Queue item with id %" PRIu32 " not found\n", item_id);
+
+      queue_snapshot_unref(snapshot);
+    }
+
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DB, "Error fetching queue item by pos relative to item id\n");
+      return NULL;
+    }
+  else if (found_id == 0)
+    {
+      // No item found
+      return NULL;
+    }
+
+  qi = queue_fetch_row(found_id, found_pos, found_shuffle_pos);
+  if (qi)
+    DPRINTF(E_DBG, L_DB, "Fetch by pos: fetched item (id=%d, pos=%d, file-id=%d)\n", qi->id, qi->pos, qi->file_id);
+
+  return qi;
+}
+
+struct db_queue_item *
+db_queue_fetch_next(uint32_t item_id, char shuffle)
+{
+  return db_queue_fetch_byposrelativetoitem(1, item_id, shuffle);
+}
+
+struct db_queue_item *
+db_queue_fetch_prev(uint32_t item_id, char shuffle)
+{
+  return db_queue_fetch_byposrelativetoitem(-1, item_id, shuffle);
+}
+
+/*
+ * Deletes the queue items with the given ids from the queue table and the in-memory order. The
+ * positions of the following items are written behind. Note that item_ids will be sorted.
+ */
+static int
+queue_delete_items(uint32_t *item_ids, uint32_t nitems)
+{
+#define Q_TMPL "DELETE FROM queue WHERE id = ?;"
+  sqlite3_stmt *stmt;
+  uint32_t i;
+  int ret;
+
+  if (nitems == 0)
+    return 0;
+
+  stmt = db_stmt_cache_get(Q_TMPL);
+  if (!stmt)
+    return -1;
+
+  for (i = 0; i < nitems; i++)
+    {
+      sqlite3_bind_int(stmt, 1, item_ids[i]);
+
+      ret = db_statement_run(stmt, 0);
+      if (ret < 0)
+	break;
+    }
+
+  db_stmt_cache_release(stmt);
+
+  if (i != nitems)
+    return -1;
+
+  queue_order_remove(item_ids, nitems);
+
+  return 0;
+#undef Q_TMPL
+}
+
+/*
+ * Remove files that are disabled or non existent in the library and repair ordering of
+ * the queue (shuffle and normal)
+ */
+int
+db_queue_cleanup()
+{
+#define Q_TMPL "SELECT id FROM queue WHERE NOT file_id IN (SELECT id from files WHERE disabled = 0);"
+  sqlite3_stmt *stmt;
+  uint32_t *item_ids = NULL;
+  uint32_t nitems = 0;
+  int queue_version;
+  int ret;
+
+  queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
+
+  ret = db_blocking_prepare_v2(Q_TMPL, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      ret = -1;
+      goto end_transaction;
+    }
+
+  // The order can't have more items than the queue table
+  CHECK_NULL(L_DB, item_ids = malloc(MAX(db_queue_order.count, 1) * sizeof(uint32_t)));
+
+  while (nitems < db_queue_order.count && (ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    item_ids[nitems++] = sqlite3_column_int(stmt, 0);
+
+  sqlite3_finalize(stmt);
+
+  if (nitems == 0)
+    {
+      // Nothing to do
+      free(item_ids);
+      queue_transaction_cancel();
+      return 0;
+    }
+
+  ret = queue_delete_items(item_ids, nitems);
+
+ end_transaction:
+  free(item_ids);
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+
+#undef Q_TMPL
+}
+
+/*
+ * Removes all items from the queue except the item give by 'keep_item_id' (if 'keep_item_id' > 0).
+ *
+ * @param keep_item_id item-id (e. g. the now playing item) to be left in the queue
+ */
+int
+db_queue_clear(uint32_t keep_item_id)
+{
+  int queue_version;
+  char *query;
+  bool keep;
+  int ret;
+
+  queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
+
+  query = sqlite3_mprintf("DELETE FROM queue where id <> %d;", keep_item_id);
+  ret = db_query_run(query, 1, 0);
+
+  keep = (keep_item_id && queue_order_find(keep_item_id));
+
+  if (ret == 0 && keep)
+    {
+      query = sqlite3_mprintf("UPDATE queue SET pos = 0, shuffle_pos = 0, queue_version = %d where id = %d;", queue_version, keep_item_id);
+      ret = db_query_run(query, 1, 0);
+    }
+
+  if (ret == 0)
+    {
+      db_queue_order.count = 0;
+      db_queue_order.pos_dirty.count = 0;
+      db_queue_order.shuffle_dirty.count = 0;
+      if (db_queue_order.index)
+	memset(db_queue_order.index, 0, db_queue_order.index_size * sizeof(struct db_queue_index_entry));
+      if (keep)
+	{
+	  db_queue_order.pos_slots[0] = (struct db_queue_slot){ .id = keep_item_id };
+	  db_queue_order.shuffle_slots[0] = db_queue_order.pos_slots[0];
+	  db_queue_order.count = 1;
+	  queue_index_add(db_queue_order.index, db_queue_order.index_size, keep_item_id);
+	}
+      queue_order_touch(0, 0, db_queue_order.count);
+      queue_order_touch(1, 0, db_queue_order.count);
+    }
+
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
+int
+db_queue_delete_byitemid(uint32_t item_id)
+{
+  int queue_version;
+  int ret;
+
+  queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
+
+  if (!queue_order_find(item_id))
+    {
+      queue_transaction_cancel();
+      return 0;
+    }
+
+  ret = queue_delete_items(&item_id, 1);
+
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
+int
+db_queue_delete_bypos(uint32_t pos, int count)
+{
+  int queue_version;
+  uint32_t *item_ids;
+  int i;
+  int ret;
+
+  queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
+
+  if (pos >= db_queue_order.count || count <= 0)
+    {
+      queue_transaction_cancel();
+      return 0;
+    }
+
+  count = MIN(count, db_queue_order.count - pos);
+
+  CHECK_NULL(L_DB, item_ids = malloc(count * sizeof(uint32_t)));
+  for (i = 0; i < count; i++)
+    item_ids[i] = db_queue_order.pos_slots[pos + i].id;
+
+  ret = queue_delete_items(item_ids, count);
+
+  free(item_ids);
+
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
+int
+db_queue_delete_byposrelativetoitem(uint32_t pos, uint32_t item_id, char shuffle)
+{
+  int queue_version;
+  struct db_queue_item queue_item;
+  uint32_t delete_id;
+  int ret;
+
+  queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
+
+  ret = queue_fetch_byposrelativetoitem(pos, item_id, shuffle, &queue_item, 0);
+  if (ret < 0)
+    goto end_transaction;
+
+  if (queue_item.id == 0)
+    {
+      // No item found
+      queue_transaction_cancel();
+      return 0;
+    }
+
+  delete_id = queue_item.id;
+  ret = queue_delete_items(&delete_id, 1);
+
+ end_transaction:
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
+/*
+ * Moves the queue item with the given id to the given position (zero-based).
+ *
+ * @param item_id Queue item id
+ * @param pos_to target position in the queue (zero-based)
+ * @þaram shuffle If 1 move item in the shuffle queue
+ * @return 0 on success, -1 on failure
+ */
+int
+db_queue_move_byitemid(uint32_t item_id, int pos_to, char shuffle)
+{
+  int queue_version;
+  int pos_from;
+  int ret = 0;
+
+  queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
+
+  // Find item with the given item_id
+  pos_from = queue_get_pos(item_id, shuffle);
+  if (pos_from < 0 || pos_to < 0)
+    {
+      ret = -1;
+      goto end_transaction;
+    }
+
+  pos_to = MIN(pos_to, db_queue_order.count - 1);
+
+  queue_order_move(shuffle, pos_from, 1, pos_to);
+
+ end_transaction:
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
+/*
+ * Moves the queue item at the given position to the given position (zero-based).
+ *
+ * @param pos_from Position of the queue item to move
+ * @param pos_to target position in the queue (zero-based)
+ * @return 0 on success, -1 on failure
+ */
+int
+db_queue_move_bypos(int pos_from, int pos_to)
+{
+  int queue_version;
+
+  queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
+
+  // Find item to move
+  if (pos_from < 0 || pos_from >= db_queue_order.count || pos_to < 0)
+    {
+      queue_transaction_cancel();
+      return 0;
+    }
+
+  pos_to = MIN(pos_to, db_queue_order.count - 1);
+
+  queue_order_move(0, pos_from, 1, pos_to);
+
+  queue_transaction_end(0, queue_version);
+
+  return 0;
+}
+
+int
+db_queue_move_bypos_range(int range_begin, int range_end, int pos_to)
+{
+  int queue_version;
+  int count;
+  int ret = 0;
+
+  queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
+
+  count = range_end - range_begin;
+  if (range_begin < 0 || count <= 0 || pos_to < 0 || range_end > db_queue_order.count || pos_to + count > db_queue_order.count)
+    {
+      DPRINTF(E_LOG, L_DB, "Invalid range for queue move: %d-%d to %d\n", range_begin, range_end, pos_to);
+      ret = -1;
+      goto end_transaction;
+    }
+
+  queue_order_move(0, range_begin, count, pos_to);
+
+ end_transaction:
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
+/*
+ * Moves the queue item at the given position to the given target position. The positions
+ * are relavtive to the given base item (item id).
+ *
+ * @param from_pos Relative position of the queue item to the base item
+ * @param to_offset Target position relative to the base item
+ * @param item_id The base item id (normaly the now playing item)
+ * @return 0 on success, -1 on failure
+ */
+int
+db_queue_move_byposrelativetoitem(uint32_t from_pos, uint32_t to_offset, uint32_t item_id, char shuffle)
+{
+  int queue_version;
+  int pos_base;
+  int pos_move_from;
+  int pos_move_to;
+
+  queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
+
+  DPRINTF(E_DBG, L_DB, "Move by pos: from %d offset %d relative to item (%d)\n", from_pos, to_offset, item_id);
+
+  // Find item with the given item_id
+  pos_base = queue_get_pos(item_id, shuffle);
+  if (pos_base < 0)
+    {
+      queue_transaction_cancel();
+      return 0;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Move by pos: base item (id=%d, pos=%d)\n", item_id, pos_base);
+
+  // Calculate the position of the item to move
+  pos_move_from = pos_base + from_pos;
+
+  // Calculate the position where to move the item to
+  pos_move_to = pos_base + to_offset;
+
+  if (pos_move_to < pos_move_from)
+    {
+      /*
+       * Moving an item to a previous position seems to send an offset incremented by one
+       */
+      pos_move_to++;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Move by pos: absolute pos: move from %d to %d\n", pos_move_from, pos_move_to);
+
+  // Find item to move
+  if (pos_move_from < 0 || pos_move_from >= db_queue_order.count || pos_move_to < 0)
+    {
+      queue_transaction_cancel();
+      return 0;
+    }
+
+  pos_move_to = MIN(pos_move_to, db_queue_order.count - 1);
+
+  queue_order_move(shuffle, pos_move_from, 1, pos_move_to);
+
+  queue_transaction_end(0, queue_version);
+
+  return 0;
+}
+
+/*
+ * Reshuffles the shuffle queue
+ *
+ * If the given item_id is 0, the whole shuffle queue is reshuffled, otherwise the
+ * queue is reshuffled after the item with the given id (excluding this item).
+ *
+ * @param item_id The base item, after this item the queue is reshuffled
+ * @return 0 on success, -1 on failure
+ */
+static int
+queue_reshuffle(uint32_t item_id, int queue_version)
+{
+  uint32_t count;
+  int *order;
+  int pos;
+  int len;
+  int i;
+
+  DPRINTF(E_DBG, L_DB, "Reshuffle queue after item with item-id: %d\n", item_id);
+
+  pos = 0;
+  if (item_id > 0)
+    {
+      pos = queue_get_pos(item_id, 0);
+      if (pos < 0)
+	return -1;
+
+      pos++; // Do not reshuffle the base item
+    }
+
+  count = db_queue_order.count;
+  len = count - pos;
+
+  DPRINTF(E_DBG, L_DB, "Reshuffle %d items off %" PRIu32 " total items, starting from pos %d\n", len, count, pos);
+
+  // Reset the shuffled order, then shuffle the part after the base item
+  for (i = 0; i < count; i++)
+    db_queue_order.shuffle_slots[i].id = db_queue_order.pos_slots[i].id;
+
+  if (len > 0)
+    {
+      CHECK_NULL(L_DB, order = malloc(len * sizeof(int)));
+      for (i = 0; i < len; i++)
+	{
+	  order[i] = i + pos;
+	}
+
+      rng_shuffle_int(&shuffle_rng, order, len);
+
+      for (i = 0; i < len; i++)
+	{
+	  db_queue_order.shuffle_slots[i + pos].id = db_queue_order.pos_slots[order[i]].id;
+	}
+
+      free(order);
+    }
+
+  queue_order_touch(1, 0, count);
+  queue_order_rebalance(1);
+
+  return 0;
+}
+
+/*
+ * Reshuffles the shuffle queue
+ *
+ * If the given item_id is 0, the whole shuffle queue is reshuffled, otherwise the
+ * queue is reshuffled after the item with the given id (excluding this item).
+ *
+ * @param item_id The base item, after this item the queue is reshuffled
+ * @return 0 on success, -1 on failure
+ */
+int
+db_queue_reshuffle(uint32_t item_id)
+{
+  int queue_version;
+  int ret;
+
+  queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
+
+  ret = queue_reshuffle(item_id, queue_version);
+
+  queue_transaction_end(ret, queue_version);
+
+  return ret;
+}
+
+/*
+ * Increment queue version (triggers queue change event)
+ */
+int
+db_queue_inc_version()
+{
+  int queue_version;
+
+  queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
+
+  queue_transaction_end(0, queue_version);
+
+  return 0;
+}
+
+int
+db_queue_get_count(uint32_t *nitems)
+{
+  struct db_queue_snapshot *snapshot;
+
+  snapshot = queue_snapshot_get();
+  if (!snapshot)
+    return -1;
+
+  *nitems = snapshot->count;
+  queue_snapshot_unref(snapshot);
+
+  return 0;
+}
+
+
+/* Inotify */
+int
+db_watch_clear(void)
+{
+  return db_query_run("DELETE FROM inotify;", 0, 0);
+}
+
+int
+db_watch_add(struct watch_info *wi)
+{
+#define Q_TMPL "INSERT INTO inotify (wd, cookie, path) VALUES (%d, 0, '%q');"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, wi->wd, wi->path);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
+int
+db_watch_delete_bywd(uint32_t wd)
+{
+#define Q_TMPL "DELETE FROM inotify WHERE wd = %d;"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, wd);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
 
- end_transaction:
-  queue_transaction_end(ret, queue_version);
+int
+db_watch_delete_bypath(const char *path)
+{
+#define Q_TMPL "DELETE FROM inotify WHERE path = '%q';"
+  char *query;
 
-  return ret;
+  query = sqlite3_mprintf(Q_TMPL, path);
 
+  return db_query_run(query, 1, 0);
 #undef Q_TMPL
 }
 
-/*
- * Removes all items from the queue except the item give by 'keep_item_id' (if 'keep_item_id' > 0).
- *
- * @param keep_item_id item-id (e. g. the now playing item) to be left in the queue
- */
 int
-db_queue_clear(uint32_t keep_item_id)
+db_watch_delete_bymatch(const char *path)
 {
-  int queue_version;
+#define Q_TMPL "DELETE FROM inotify WHERE " DB_PATH_BELOW("path") ";"
   char *query;
-  int ret;
 
-  queue_version = queue_transaction_begin();
+  query = sqlite3_mprintf(Q_TMPL, path, path);
 
-  query = sqlite3_mprintf("DELETE FROM queue where id <> %d;", keep_item_id);
-  ret = db_query_run(query, 1, 0);
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
 
-  if (ret == 0 && keep_item_id)
-    {
-      query = sqlite3_mprintf("UPDATE queue SET pos = 0, shuffle_pos = 0, queue_version = %d where id = %d;", queue_version, keep_item_id);
-      ret = db_query_run(query, 1, 0);
-    }
+int
+db_watch_delete_bycookie(uint32_t cookie)
+{
+#define Q_TMPL "DELETE FROM inotify WHERE cookie = %" PRIi64 ";"
+  char *query;
 
-  queue_transaction_end(ret, queue_version);
+  if (cookie == 0)
+    return -1;
 
-  return ret;
+  query = sqlite3_mprintf(Q_TMPL, (int64_t)cookie);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
 }
 
 static int
-queue_delete_item(struct db_queue_item *qi, int queue_version)
+db_watch_get_byquery(struct watch_info *wi, char *query)
 {
-  char *query;
+  sqlite3_stmt *stmt;
+  int64_t cookie;
+  int ncols;
+  int i;
   int ret;
 
-  // Remove item with the given item_id
-  query = sqlite3_mprintf("DELETE FROM queue where id = %d;", qi->id);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
     {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
       return -1;
     }
 
-  // Update pos for all items after the item with given item_id
-  query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, qi->pos);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
     {
+      sqlite3_finalize(stmt);
+      sqlite3_free(query);
       return -1;
     }
 
-  // Update shuffle_pos for all items after the item with given item_id
-  query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos - 1, queue_version = %d WHERE shuffle_pos > %d;", queue_version, qi->shuffle_pos);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
+  ncols = sqlite3_column_count(stmt);
+
+  if (ncols < ARRAY_SIZE(wi_cols_map))
     {
+      DPRINTF(E_LOG, L_DB, "BUG: database has fewer columns (%d) than wi column map (%u)\n", ncols, ARRAY_SIZE(wi_cols_map));
+
+      sqlite3_finalize(stmt);
+      sqlite3_free(query);
       return -1;
     }
 
+  for (i = 0; i < ARRAY_SIZE(wi_cols_map); i++)
+    {
+      struct_field_from_statement(wi, wi_cols_map[i].offset, wi_cols_map[i].type, stmt, i, true, false);
+
+      if (wi_cols_map[i].offset == wi_offsetof(cookie))
+	{
+	  cookie = sqlite3_column_int64(stmt, i);
+	  wi->cookie = (cookie == INOTIFY_FAKE_COOKIE) ? 0 : cookie;
+	}
+    }
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+
   return 0;
 }
 
 int
-db_queue_delete_byitemid(uint32_t item_id)
+db_watch_get_bywd(struct watch_info *wi, int wd)
 {
-  int queue_version;
-  struct db_queue_item queue_item;
-  int ret;
-
-  queue_version = queue_transaction_begin();
-
-  ret = queue_fetch_byitemid(item_id, &queue_item, 0);
-
-  if (ret < 0)
-    goto end_transaction;
+#define Q_TMPL "SELECT * FROM inotify WHERE wd = %d;"
+  char *query;
 
-  if (queue_item.id == 0)
+  query = sqlite3_mprintf(Q_TMPL, wd);
+  if (!query)
     {
-      db_transaction_end();
-      return 0;
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
     }
 
-  ret = queue_delete_item(&queue_item, queue_version);
-
- end_transaction:
-  queue_transaction_end(ret, queue_version);
-
-  return ret;
+  return db_watch_get_byquery(wi, query);
+#undef Q_TMPL
 }
 
 int
-db_queue_delete_bypos(uint32_t pos, int count)
+db_watch_get_bypath(struct watch_info *wi, const char *path)
 {
-  int queue_version;
+#define Q_TMPL "SELECT * FROM inotify WHERE path = '%q';"
   char *query;
-  int to_pos;
-  int ret;
-
-  queue_version = queue_transaction_begin();
-
-  // Remove item with the given item_id
-  to_pos = pos + count;
-  query = sqlite3_mprintf("DELETE FROM queue where pos >= %d AND pos < %d;", pos, to_pos);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  ret = queue_fix_pos(S_POS, queue_version);
-  if (ret < 0)
-    goto end_transaction;
-
-  ret = queue_fix_pos(S_SHUFFLE_POS, queue_version);
 
- end_transaction:
-  queue_transaction_end(ret, queue_version);
+  query = sqlite3_mprintf(Q_TMPL, path);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
 
-  return ret;
+  return db_watch_get_byquery(wi, query);
+#undef Q_TMPL
 }
 
-int
-db_queue_delete_byposrelativetoitem(uint32_t pos, uint32_t item_id, char shuffle)
+void
+db_watch_mark_bypath(const char *path, enum strip_type strip, uint32_t cookie)
 {
-  int queue_version;
-  struct db_queue_item queue_item;
-  int ret;
-
-  queue_version = queue_transaction_begin();
-
-  ret = queue_fetch_byposrelativetoitem(pos, item_id, shuffle, &queue_item, 0);
-  if (ret < 0)
-    goto end_transaction;
+#define Q_TMPL "UPDATE inotify SET path = substr(path, %d), cookie = %" PRIi64 " WHERE path = '%q';"
+  char *query;
+  int64_t disabled;
+  int path_striplen;
 
-  if (queue_item.id == 0)
-    {
-      // No item found
-      db_transaction_end();
-      return 0;
-    }
+  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
 
-  ret = queue_delete_item(&queue_item, queue_version);
+  path_striplen = (strip == STRIP_PATH) ? strlen(path) : 0;
 
- end_transaction:
-  queue_transaction_end(ret, queue_version);
+  query = sqlite3_mprintf(Q_TMPL, path_striplen + 1, disabled, path);
 
-  return ret;
+  db_query_run(query, 1, 0);
+#undef Q_TMPL
 }
 
-/*
- * Moves the queue item with the given id to the given position (zero-based).
- *
- * @param item_id Queue item id
- * @param pos_to target position in the queue (zero-based)
- * @þaram shuffle If 1 move item in the shuffle queue
- * @return 0 on success, -1 on failure
- */
-int
-db_queue_move_byitemid(uint32_t item_id, int pos_to, char shuffle)
+void
+db_watch_mark_bymatch(const char *path, enum strip_type strip, uint32_t cookie)
 {
-  int queue_version;
+#define Q_TMPL "UPDATE inotify SET path = substr(path, %d), cookie = %" PRIi64 " WHERE " DB_PATH_BELOW("path") ";"
   char *query;
-  int pos_from;
-  int ret;
-
-  queue_version = queue_transaction_begin();
-
-  // Find item with the given item_id
-  pos_from = db_queue_get_pos(item_id, shuffle);
-  if (pos_from < 0)
-    {
-      ret = -1;
-      goto end_transaction;
-    }
+  int64_t disabled;
+  int path_striplen;
 
-  // Update pos for all items after the item with given item_id
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos - 1, queue_version = %d WHERE shuffle_pos > %d;", queue_version, pos_from);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, pos_from);
+  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
 
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
+  path_striplen = (strip == STRIP_PATH) ? strlen(path) : 0;
 
-  // Update pos for all items from the given pos_to
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos + 1, queue_version = %d WHERE shuffle_pos >= %d;", queue_version, pos_to);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos + 1, queue_version = %d WHERE pos >= %d;", queue_version, pos_to);
+  query = sqlite3_mprintf(Q_TMPL, path_striplen + 1, disabled, path, path);
 
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
+  db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
 
-  // Update item with the given item_id
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = %d, queue_version = %d where id = %d;", pos_to, queue_version, item_id);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = %d, queue_version = %d where id = %d;", pos_to, queue_version, item_id);
+void
+db_watch_move_bycookie(uint32_t cookie, const char *path)
+{
+#define Q_TMPL "UPDATE inotify SET path = '%q' || path, cookie = 0 WHERE cookie = %" PRIi64 ";"
+  char *query;
 
-  ret = db_query_run(query, 1, 0);
+  if (cookie == 0)
+    return;
 
- end_transaction:
-  queue_transaction_end(ret, queue_version);
+  query = sqlite3_mprintf(Q_TMPL, path, (int64_t)cookie);
 
-  return ret;
+  db_query_run(query, 1, 0);
+#undef Q_TMPL
 }
 
-/*
- * Moves the queue item at the given position to the given position (zero-based).
- *
- * @param pos_from Position of the queue item to move
- * @param pos_to target position in the queue (zero-based)
- * @return 0 on success, -1 on failure
- */
 int
-db_queue_move_bypos(int pos_from, int pos_to)
+db_watch_cookie_known(uint32_t cookie)
 {
-  int queue_version;
-  struct db_queue_item queue_item;
+#define Q_TMPL "SELECT COUNT(*) FROM inotify WHERE cookie = %" PRIi64 ";"
   char *query;
   int ret;
 
-  queue_version = queue_transaction_begin();
-
-  // Find item to move
-  ret = queue_fetch_bypos(pos_from, 0, &queue_item, 0);
-  if (ret < 0)
-    goto end_transaction;
+  if (cookie == 0)
+    return 0;
 
-  if (queue_item.id == 0)
+  query = sqlite3_mprintf(Q_TMPL, (int64_t)cookie);
+  if (!query)
     {
-      db_transaction_end();
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
       return 0;
     }
 
-  // Update pos for all items after the item with given position
-  query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, queue_item.pos);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update pos for all items from the given pos_to
-  query = sqlite3_mprintf("UPDATE queue SET pos = pos + 1, queue_version = %d WHERE pos >= %d;", queue_version, pos_to);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
+  ret = db_get_one_int(query);
 
-  // Update item with the given item_id
-  query = sqlite3_mprintf("UPDATE queue SET pos = %d, queue_version = %d where id = %d;", pos_to, queue_version, queue_item.id);
-  ret = db_query_run(query, 1, 0);
+  sqlite3_free(query);
 
- end_transaction:
-  queue_transaction_end(ret, queue_version);
+  return (ret > 0);
 
-  return ret;
+#undef Q_TMPL
 }
 
 int
-db_queue_move_bypos_range(int range_begin, int range_end, int pos_to)
+db_watch_enum_start(struct watch_enum *we)
 {
-#define Q_TMPL "UPDATE queue SET pos = CASE WHEN pos < %d THEN pos + %d ELSE pos - %d END, queue_version = %d WHERE pos >= %d AND pos < %d;"
-  int queue_version;
+#define Q_MATCH_TMPL "SELECT wd FROM inotify WHERE " DB_PATH_BELOW("path") ";"
+#define Q_COOKIE_TMPL "SELECT wd FROM inotify WHERE cookie = %" PRIi64 ";"
+  sqlite3_stmt *stmt;
   char *query;
-  int count;
-  int update_begin;
-  int update_end;
   int ret;
-  int cut_off;
-  int offset_up;
-  int offset_down;
 
-  queue_version = queue_transaction_begin();
+  we->stmt = NULL;
 
-  count = range_end - range_begin;
-  update_begin = MIN(range_begin, pos_to);
-  update_end = MAX(range_begin + count, pos_to + count);
+  if (we->match)
+    query = sqlite3_mprintf(Q_MATCH_TMPL, we->match, we->match);
+  else if (we->cookie != 0)
+    query = sqlite3_mprintf(Q_COOKIE_TMPL, we->cookie);
+  else
+    {
+      DPRINTF(E_LOG, L_DB, "Could not start enum, no parameter given\n");
+      return -1;
+    }
 
-  if (range_begin < pos_to)
+  if (!query)
     {
-      cut_off = range_begin + count;
-      offset_up = pos_to - range_begin;
-      offset_down = count;
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return -1;
     }
-  else
+
+  DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
     {
-      cut_off = range_begin;
-      offset_up = count;
-      offset_down = range_begin - pos_to;
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_free(query);
+      return -1;
     }
 
-  query = sqlite3_mprintf(Q_TMPL, cut_off, offset_up, offset_down, queue_version, update_begin, update_end);
-  ret = db_query_run(query, 1, 0);
+  sqlite3_free(query);
 
-  queue_transaction_end(ret, queue_version);
+  we->stmt = stmt;
 
-  return ret;
-#undef Q_TMPL
+  return 0;
+
+#undef Q_MATCH_TMPL
+#undef Q_COOKIE_TMPL
 }
 
-/*
- * Moves the queue item at the given position to the given target position. The positions
- * are relavtive to the given base item (item id).
- *
- * @param from_pos Relative position of the queue item to the base item
- * @param to_offset Target position relative to the base item
- * @param item_id The base item id (normaly the now playing item)
- * @return 0 on success, -1 on failure
- */
-int
-db_queue_move_byposrelativetoitem(uint32_t from_pos, uint32_t to_offset, uint32_t item_id, char shuffle)
+void
+db_watch_enum_end(struct watch_enum *we)
 {
-  int queue_version;
-  struct db_queue_item queue_item;
-  char *query;
-  int pos_move_from;
-  int pos_move_to;
-  int ret;
+  if (!we->stmt)
+    return;
 
-  queue_version = queue_transaction_begin();
+  sqlite3_finalize(we->stmt);
+  we->stmt = NULL;
+}
 
-  DPRINTF(E_DBG, L_DB, "Move by pos: from %d offset %d relative to item (%d)\n", from_pos, to_offset, item_id);
+int
+db_watch_enum_fetchwd(struct watch_enum *we, uint32_t *wd)
+{
+  int ret;
 
-  // Find item with the given item_id
-  ret = queue_fetch_byitemid(item_id, &queue_item, 0);
-  if (ret < 0)
-    goto end_transaction;
+  *wd = 0;
 
-  DPRINTF(E_DBG, L_DB, "Move by pos: base item (id=%d, pos=%d, file-id=%d)\n", queue_item.id, queue_item.pos, queue_item.file_id);
+  if (!we->stmt)
+    {
+      DPRINTF(E_LOG, L_DB, "Watch enum not started!\n");
+      return -1;
+    }
 
-  if (queue_item.id == 0)
+  ret = db_blocking_step(we->stmt);
+  if (ret == SQLITE_DONE)
     {
-      db_transaction_end();
+      DPRINTF(E_DBG, L_DB, "End of watch enum results\n");
       return 0;
     }
-
-  // Calculate the position of the item to move
-  if (shuffle)
-    pos_move_from = queue_item.shuffle_pos + from_pos;
-  else
-    pos_move_from = queue_item.pos + from_pos;
-
-  // Calculate the position where to move the item to
-  if (shuffle)
-    pos_move_to = queue_item.shuffle_pos + to_offset;
-  else
-    pos_move_to = queue_item.pos + to_offset;
-
-  if (pos_move_to < pos_move_from)
+  else if (ret != SQLITE_ROW)
     {
-      /*
-       * Moving an item to a previous position seems to send an offset incremented by one
-       */
-      pos_move_to++;
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
+      return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Move by pos: absolute pos: move from %d to %d\n", pos_move_from, pos_move_to);
+  *wd = (uint32_t)sqlite3_column_int(we->stmt, 0);
 
-  // Find item to move
-  ret = queue_fetch_bypos(pos_move_from, shuffle, &queue_item, 0);
-  if (ret < 0)
-    goto end_transaction;
+  return 0;
+}
 
-  DPRINTF(E_DBG, L_DB, "Move by pos: move item (id=%d, pos=%d, file-id=%d)\n", queue_item.id, queue_item.pos, queue_item.file_id);
 
-  if (queue_item.id == 0)
-    {
-      db_transaction_end();
-      return 0;
-    }
+/* Query profiler
+ *
+ * If enabled in the config, the trace callback aggregates the statements that
+ * are run by their template, which is the SQL with literals replaced by '?'.
+ * Statements taking longer than the slow threshold are logged together with
+ * their query plan.
+ */
 
-  // Update pos for all items after the item with given position
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos - 1, queue_version = %d WHERE shuffle_pos > %d;", queue_version, queue_item.shuffle_pos);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, queue_item.pos);
+// Replaces string and numeric literals in sql with '?', lists of literals are
+// collapsed to a single '?'. Returns the length of the result.
+static size_t
+db_profile_template(char *buf, size_t size, const char *sql)
+{
+  const char *p = sql;
+  size_t len = 0;
+  size_t mark;
+  bool ident = false;
 
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
+  while (*p && len + 1 < size)
+    {
+      if (*p == '\'' || (!ident && isdigit((unsigned char)*p)))
+	{
+	  if (*p == '\'')
+	    {
+	      for (p++; *p; p++)
+		{
+		  if (*p == '\'' && *(p + 1) == '\'')
+		    p++;
+		  else if (*p == '\'')
+		    break;
+		}
+	      if (*p)
+		p++;
+	    }
+	  else
+	    {
+	      while (isalnum((unsigned char)*p) || *p == '.')
+		p++;
+	    }
 
-  // Update pos for all items from the given pos_to
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos + 1, queue_version = %d WHERE shuffle_pos >= %d;", queue_version, pos_move_to);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos + 1, queue_version = %d WHERE pos >= %d;", queue_version, pos_move_to);
+	  // Part of a list, like "?, ?", so drop the separator instead
+	  mark = len;
+	  while (mark > 0 && buf[mark - 1] == ' ')
+	    mark--;
+	  if (mark > 1 && buf[mark - 1] == ',' && buf[mark - 2] == '?')
+	    {
+	      len = mark - 1;
+	      continue;
+	    }
 
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
+	  buf[len++] = '?';
+	  ident = false;
+	  continue;
+	}
 
-  // Update item with the given item_id
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = %d, queue_version = %d where id = %d;", pos_move_to, queue_version, queue_item.id);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = %d, queue_version = %d where id = %d;", pos_move_to, queue_version, queue_item.id);
+      ident = (isalnum((unsigned char)*p) || *p == '_');
+      buf[len++] = *p++;
+    }
 
-  ret = db_query_run(query, 1, 0);
+  buf[len] = '\0';
+  return len;
+}
 
- end_transaction:
-  queue_transaction_end(ret, queue_version);
+static unsigned int
+db_profile_bucket(int64_t ms)
+{
+  unsigned int bucket = 0;
 
-  return ret;
+  while (ms > 0 && bucket < DB_QUERY_STATS_BUCKETS - 1)
+    {
+      ms >>= 1;
+      bucket++;
+    }
+
+  return bucket;
 }
 
-/*
- * Reshuffles the shuffle queue
- *
- * If the given item_id is 0, the whole shuffle queue is reshuffled, otherwise the
- * queue is reshuffled after the item with the given id (excluding this item).
- *
- * @param item_id The base item, after this item the queue is reshuffled
- * @return 0 on success, -1 on failure
- */
-static int
-queue_reshuffle(uint32_t item_id, int queue_version)
+// Per thread count of rows returned by the statements that are being stepped
+static uint64_t
+db_profile_rows_count(sqlite3_stmt *stmt, bool take)
 {
-  char *query;
-  int pos;
-  uint32_t count;
-  struct db_queue_item queue_item;
-  int *shuffle_pos = NULL;
-  int len;
+  struct db_profile_rows *slot = NULL;
+  uint64_t rows;
   int i;
-  struct query_params qp = { 0 };
-  int ret;
 
-  DPRINTF(E_DBG, L_DB, "Reshuffle queue after item with item-id: %d\n", item_id);
+  for (i = 0; i < DB_PROFILE_ROWS_SLOTS; i++)
+    {
+      if (db_profile_rows_slots[i].stmt == stmt)
+	{
+	  slot = &db_profile_rows_slots[i];
+	  break;
+	}
+      else if (!slot && !db_profile_rows_slots[i].stmt)
+	slot = &db_profile_rows_slots[i];
+    }
 
-  // Reset the shuffled order and mark all items as changed
-  query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = pos, queue_version = %d;", queue_version);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto error;
+  if (!slot)
+    return 0;
 
-  pos = 0;
-  if (item_id > 0)
+  if (take)
     {
-      pos = db_queue_get_pos(item_id, 0);
-      if (pos < 0)
-	goto error;
-
-      pos++; // Do not reshuffle the base item
+      rows = (slot->stmt == stmt) ? slot->rows : 0;
+      slot->stmt = NULL;
+      slot->rows = 0;
+      return rows;
     }
 
-  ret = db_queue_get_count(&count);
-  if (ret < 0)
-    goto error;
+  slot->stmt = stmt;
+  slot->rows++;
+  return slot->rows;
+}
 
-  len = count - pos;
+static void
+db_profile_add(sqlite3_stmt *stmt, int64_t ns)
+{
+  struct db_query_stats *stats;
+  char query[DB_PROFILE_TEMPLATE_LEN];
+  uint32_t hash;
+  uint32_t i;
+  size_t len;
 
-  DPRINTF(E_DBG, L_DB, "Reshuffle %d items off %" PRIu32 " total items, starting from pos %d\n", len, count, pos);
+  len = db_profile_template(query, sizeof(query), sqlite3_sql(stmt));
+  hash = djb_hash(query, len);
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_profile.lck));
 
-  CHECK_NULL(L_DB, shuffle_pos = malloc(len * sizeof(int)));
-  for (i = 0; i < len; i++)
+  for (i = hash % DB_PROFILE_TEMPLATES; db_profile.stats[i].query; i = (i + 1) % DB_PROFILE_TEMPLATES)
     {
-      shuffle_pos[i] = i + pos;
+      if (db_profile.hashes[i] == hash && strcmp(db_profile.stats[i].query, query) == 0)
+	break;
     }
 
-  rng_shuffle_int(&shuffle_rng, shuffle_pos, len);
-
-  qp.filter = sqlite3_mprintf("pos >= %d", pos);
-
-  ret = queue_enum_start(&qp);
-  if (ret < 0)
-    goto error;
-
-  i = 0;
-  while ((ret = queue_enum_fetch(&qp, &queue_item, 0)) == 0 && (queue_item.id > 0) && (i < len))
+  stats = &db_profile.stats[i];
+  if (!stats->query)
     {
-      query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = %d where id = %d;", shuffle_pos[i], queue_item.id);
-      ret = db_query_run(query, 1, 0);
-      if (ret < 0)
+      // Keep some room, so the probing above stays short
+      if (db_profile.nstats >= DB_PROFILE_TEMPLATES * 3 / 4)
 	{
-	  DPRINTF(E_LOG, L_DB, "Failed to delete item with item-id: %d\n", queue_item.id);
-	  break;
+	  db_profile.dropped++;
+	  goto out;
 	}
 
-      i++;
+      CHECK_NULL(L_DB, stats->query = strdup(query));
+      db_profile.hashes[i] = hash;
+      db_profile.nstats++;
     }
 
-  db_query_end(&qp);
-
-  if (ret < 0)
-    goto error;
-
-  sqlite3_free(qp.filter);
-  free(shuffle_pos);
-  return 0;
+  stats->count++;
+  stats->rows += db_profile_rows_count(stmt, true);
+  stats->total_us += ns / 1000;
+  stats->max_us = MAX(stats->max_us, ns / 1000);
+  stats->fullscan_steps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+  stats->sorts += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+  stats->autoindexes += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+  stats->histogram[db_profile_bucket(ns / 1000000)]++;
 
- error:
-  sqlite3_free(qp.filter);
-  free(shuffle_pos);
-  return -1;
+ out:
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_profile.lck));
 }
 
-/*
- * Reshuffles the shuffle queue
- *
- * If the given item_id is 0, the whole shuffle queue is reshuffled, otherwise the
- * queue is reshuffled after the item with the given id (excluding this item).
- *
- * @param item_id The base item, after this item the queue is reshuffled
- * @return 0 on success, -1 on failure
- */
-int
-db_queue_reshuffle(uint32_t item_id)
+static int
+db_xprofile(unsigned int trace_type, void *notused, void *ptr, void *ptr_data)
 {
-  int queue_version;
+  sqlite3_stmt *pstmt;
+  sqlite3 *conn;
+  int64_t ms = 0;
+  sqlite3_stmt *stmt;
+  const char *pquery;
+  char *query;
+  int log_level;
   int ret;
 
-  queue_version = queue_transaction_begin();
+  pstmt = ptr;
+  // The statement may have run on a pooled reader connection, not on hdl
+  conn = sqlite3_db_handle(pstmt);
 
-  ret = queue_reshuffle(item_id, queue_version);
+  if (trace_type == SQLITE_TRACE_ROW)
+    {
+      db_profile_rows_count(pstmt, false);
+      return 0;
+    }
+  else if (trace_type != SQLITE_TRACE_PROFILE)
+    return 0;
 
-  queue_transaction_end(ret, queue_version);
+  db_profile_add(pstmt, *((int64_t *) ptr_data));
 
-  return ret;
-}
+  pquery = sqlite3_sql(pstmt);
+  ms = *((int64_t *) ptr_data) / 1000000;
+
+  if (ms >= db_profile.slow_ms)
+    log_level = E_LOG;
+  else if (ms > 10)
+    log_level = E_DBG;
+  else
+    log_level = E_SPAM;
+
+  if (log_level > logger_severity())
+    return 0;
+
+  DPRINTF(log_level, L_DBPERF, "SQL PROFILE query: %s\n", pquery);
+  DPRINTF(log_level, L_DBPERF, "SQL PROFILE time: %" PRIi64 " ms\n", ms);
 
-/*
- * Increment queue version (triggers queue change event)
- */
-int
-db_queue_inc_version()
-{
-  int queue_version;
+  if ((strncmp(pquery, "SELECT", 6) != 0)
+       && (strncmp(pquery, "UPDATE", 6) != 0)
+       && (strncmp(pquery, "DELETE", 6) != 0))
+      return 0;
 
-  queue_version = queue_transaction_begin();
-  queue_transaction_end(0, queue_version);
+  /* Disable profiling callback */
+  sqlite3_trace_v2(conn, 0, NULL, NULL);
 
-  return 0;
-}
+  query = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", pquery);
+  if (!query)
+    {
+      DPRINTF(log_level, L_DBPERF, "Query plan: Out of memory\n");
 
-int
-db_queue_get_count(uint32_t *nitems)
-{
-  int ret = db_get_one_int("SELECT COUNT(*) FROM queue;");
+      goto out;
+    }
 
-  if (ret < 0)
-    return -1;
+  ret = sqlite3_prepare_v2(conn, query, -1, &stmt, NULL);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(log_level, L_DBPERF, "Query plan: Could not prepare statement: %s\n", sqlite3_errmsg(conn));
 
-  *nitems = (uint32_t)ret;
+      goto out;
+    }
 
-  return 0;
-}
+  DPRINTF(log_level, L_DBPERF, "Query plan:\n");
 
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+      DPRINTF(log_level, L_DBPERF, "(%d,%d,%d) %s\n",
+	      sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2),
+	      sqlite3_column_text(stmt, 3));
+    }
 
-/* Inotify */
-int
-db_watch_clear(void)
-{
-  return db_query_run("DELETE FROM inotify;", 0, 0);
-}
+  if (ret != SQLITE_DONE)
+    DPRINTF(log_level, L_DBPERF, "Query plan: Could not step: %s\n", sqlite3_errmsg(conn));
 
-int
-db_watch_add(struct watch_info *wi)
-{
-#define Q_TMPL "INSERT INTO inotify (wd, cookie, path) VALUES (%d, 0, '%q');"
-  char *query;
+  sqlite3_finalize(stmt);
 
-  query = sqlite3_mprintf(Q_TMPL, wi->wd, wi->path);
+ out:
+  /* Reenable profiling callback */
+  sqlite3_trace_v2(conn, DB_PROFILE_TRACE_MASK, db_xprofile, NULL);
 
-  return db_query_run(query, 1, 0);
-#undef Q_TMPL
+  return 0;
 }
 
 int
-db_watch_delete_bywd(uint32_t wd)
+db_query_stats_get(struct db_query_stats **stats, int *nstats, uint64_t *dropped)
 {
-#define Q_TMPL "DELETE FROM inotify WHERE wd = %d;"
-  char *query;
+  int i;
+  int n;
 
-  query = sqlite3_mprintf(Q_TMPL, wd);
+  *stats = NULL;
+  *nstats = 0;
+  *dropped = 0;
 
-  return db_query_run(query, 1, 0);
-#undef Q_TMPL
-}
+  if (!db_profile.enabled)
+    return -1;
 
-int
-db_watch_delete_bypath(const char *path)
-{
-#define Q_TMPL "DELETE FROM inotify WHERE path = '%q';"
-  char *query;
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_profile.lck));
 
-  query = sqlite3_mprintf(Q_TMPL, path);
+  if (db_profile.nstats > 0)
+    CHECK_NULL(L_DB, *stats = calloc(db_profile.nstats, sizeof(struct db_query_stats)));
 
-  return db_query_run(query, 1, 0);
-#undef Q_TMPL
-}
+  for (i = 0, n = 0; i < DB_PROFILE_TEMPLATES && n < db_profile.nstats; i++)
+    {
+      if (!db_profile.stats[i].query)
+	continue;
 
-int
-db_watch_delete_bymatch(const char *path)
-{
-#define Q_TMPL "DELETE FROM inotify WHERE path LIKE '%q/%%';"
-  char *query;
+      (*stats)[n] = db_profile.stats[i];
+      CHECK_NULL(L_DB, (*stats)[n].query = strdup(db_profile.stats[i].query));
+      n++;
+    }
 
-  query = sqlite3_mprintf(Q_TMPL, path);
+  *nstats = n;
+  *dropped = db_profile.dropped;
 
-  return db_query_run(query, 1, 0);
-#undef Q_TMPL
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_profile.lck));
+
+  return 0;
 }
 
-int
-db_watch_delete_bycookie(uint32_t cookie)
+void
+db_query_stats_free(struct db_query_stats *stats, int nstats)
 {
-#define Q_TMPL "DELETE FROM inotify WHERE cookie = %" PRIi64 ";"
-  char *query;
-
-  if (cookie == 0)
-    return -1;
+  int i;
 
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)cookie);
+  for (i = 0; i < nstats; i++)
+    free(stats[i].query);
 
-  return db_query_run(query, 1, 0);
-#undef Q_TMPL
+  free(stats);
 }
 
 static int
-db_watch_get_byquery(struct watch_info *wi, char *query)
+db_pragma_get_cache_size()
 {
   sqlite3_stmt *stmt;
-  int64_t cookie;
-  int ncols;
-  int i;
+  char *query = "PRAGMA cache_size;";
   int ret;
 
   DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
@@ -6386,774 +9273,954 @@ db_watch_get_byquery(struct watch_info *wi, char *query)
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-      return -1;
+      return 0;
     }
 
   ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
+  if (ret == SQLITE_DONE)
     {
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
-      return -1;
+      DPRINTF(E_DBG, L_DB, "End of query results\n");
+      return 0;
     }
-
-  ncols = sqlite3_column_count(stmt);
-
-  if (ncols < ARRAY_SIZE(wi_cols_map))
+  else if (ret != SQLITE_ROW)
     {
-      DPRINTF(E_LOG, L_DB, "BUG: database has fewer columns (%d) than wi column map (%u)\n", ncols, ARRAY_SIZE(wi_cols_map));
-
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
       return -1;
     }
 
-  for (i = 0; i < ARRAY_SIZE(wi_cols_map); i++)
-    {
-      struct_field_from_statement(wi, wi_cols_map[i].offset, wi_cols_map[i].type, stmt, i, true, false);
-
-      if (wi_cols_map[i].offset == wi_offsetof(cookie))
-	{
-	  cookie = sqlite3_column_int64(stmt, i);
-	  wi->cookie = (cookie == INOTIFY_FAKE_COOKIE) ? 0 : cookie;
-	}
-    }
-
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
+  ret = sqlite3_column_int(stmt, 0);
 
   sqlite3_finalize(stmt);
-  sqlite3_free(query);
-
-  return 0;
+  return ret;
 }
 
-int
-db_watch_get_bywd(struct watch_info *wi, int wd)
+static int
+db_pragma_set_cache_size(int pages)
 {
-#define Q_TMPL "SELECT * FROM inotify WHERE wd = %d;"
+#define Q_TMPL "PRAGMA cache_size=%d;"
+  sqlite3_stmt *stmt;
   char *query;
+  int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, wd);
-  if (!query)
+  query = sqlite3_mprintf(Q_TMPL, pages);
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_free(query);
+      return 0;
     }
 
-  return db_watch_get_byquery(wi, query);
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+  return 0;
 #undef Q_TMPL
 }
 
-int
-db_watch_get_bypath(struct watch_info *wi, const char *path)
+static char *
+db_pragma_set_journal_mode(char *mode)
 {
-#define Q_TMPL "SELECT * FROM inotify WHERE path = '%q';"
+#define Q_TMPL "PRAGMA journal_mode=%s;"
+  sqlite3_stmt *stmt;
   char *query;
+  int ret;
+  char *new_mode;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
+  query = sqlite3_mprintf(Q_TMPL, mode);
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_free(query);
+      return NULL;
     }
 
-  return db_watch_get_byquery(wi, query);
+  ret = db_blocking_step(stmt);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_DBG, L_DB, "End of query results\n");
+      sqlite3_free(query);
+      return NULL;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      sqlite3_free(query);
+      return NULL;
+    }
+
+  new_mode = (char *) sqlite3_column_text(stmt, 0);
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+  return new_mode;
 #undef Q_TMPL
 }
 
-void
-db_watch_mark_bypath(const char *path, enum strip_type strip, uint32_t cookie)
+static int
+db_pragma_get_synchronous()
 {
-#define Q_TMPL "UPDATE inotify SET path = substr(path, %d), cookie = %" PRIi64 " WHERE path = '%q';"
-  char *query;
-  int64_t disabled;
-  int path_striplen;
+  sqlite3_stmt *stmt;
+  char *query = "PRAGMA synchronous;";
+  int ret;
 
-  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
-  path_striplen = (strip == STRIP_PATH) ? strlen(path) : 0;
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return 0;
+    }
 
-  query = sqlite3_mprintf(Q_TMPL, path_striplen + 1, disabled, path);
+  ret = db_blocking_step(stmt);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_DBG, L_DB, "End of query results\n");
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
 
-  db_query_run(query, 1, 0);
-#undef Q_TMPL
+  ret = sqlite3_column_int(stmt, 0);
+
+  sqlite3_finalize(stmt);
+  return ret;
 }
 
-void
-db_watch_mark_bymatch(const char *path, enum strip_type strip, uint32_t cookie)
+static int
+db_pragma_set_synchronous(int synchronous)
 {
-#define Q_TMPL "UPDATE inotify SET path = substr(path, %d), cookie = %" PRIi64 " WHERE path LIKE '%q/%%';"
+#define Q_TMPL "PRAGMA synchronous=%d;"
+  sqlite3_stmt *stmt;
   char *query;
-  int64_t disabled;
-  int path_striplen;
+  int ret;
 
-  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
+  query = sqlite3_mprintf(Q_TMPL, synchronous);
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
-  path_striplen = (strip == STRIP_PATH) ? strlen(path) : 0;
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
 
-  query = sqlite3_mprintf(Q_TMPL, path_striplen + 1, disabled, path);
+      sqlite3_free(query);
+      return 0;
+    }
 
-  db_query_run(query, 1, 0);
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+  return 0;
 #undef Q_TMPL
 }
 
-void
-db_watch_move_bycookie(uint32_t cookie, const char *path)
+static int
+db_pragma_get_mmap_size()
 {
-#define Q_TMPL "UPDATE inotify SET path = '%q' || path, cookie = 0 WHERE cookie = %" PRIi64 ";"
-  char *query;
+  sqlite3_stmt *stmt;
+  char *query = "PRAGMA mmap_size;";
+  int ret;
 
-  if (cookie == 0)
-    return;
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
-  query = sqlite3_mprintf(Q_TMPL, path, (int64_t)cookie);
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return 0;
+    }
 
-  db_query_run(query, 1, 0);
-#undef Q_TMPL
+  ret = db_blocking_step(stmt);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_DBG, L_DB, "End of query results\n");
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  ret = sqlite3_column_int(stmt, 0);
+
+  sqlite3_finalize(stmt);
+  return ret;
 }
 
-int
-db_watch_cookie_known(uint32_t cookie)
+static int
+db_pragma_set_mmap_size(int mmap_size)
 {
-#define Q_TMPL "SELECT COUNT(*) FROM inotify WHERE cookie = %" PRIi64 ";"
+#define Q_TMPL "PRAGMA mmap_size=%d;"
+  sqlite3_stmt *stmt;
   char *query;
   int ret;
 
-  if (cookie == 0)
-    return 0;
+  query = sqlite3_mprintf(Q_TMPL, mmap_size);
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)cookie);
-  if (!query)
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
 
+      sqlite3_free(query);
       return 0;
     }
 
-  ret = db_get_one_int(query);
-
+  sqlite3_finalize(stmt);
   sqlite3_free(query);
+  return 0;
+#undef Q_TMPL
+}
 
-  return (ret > 0);
+// Used by the schema upgrade to create the sort keys of existing files
+static void
+db_sortkey_xfunc(sqlite3_context *pv, int n, sqlite3_value **ppv)
+{
+  char *sort_key = NULL;
 
-#undef Q_TMPL
+  sort_key_create(&sort_key, (const char *)sqlite3_value_text(ppv[0]));
+  if (sort_key)
+    sqlite3_result_text(pv, sort_key, -1, free);
+  else
+    sqlite3_result_null(pv);
 }
 
-int
-db_watch_enum_start(struct watch_enum *we)
+/* Opens hdl, if reader is true as one of the read-only connections of the reader
+ * pool. These don't use the shared cache, so in WAL mode they read from a
+ * snapshot and are not held up by the transactions of the other threads. */
+static int
+db_open(bool reader)
 {
-#define Q_MATCH_TMPL "SELECT wd FROM inotify WHERE path LIKE '%q/%%';"
-#define Q_COOKIE_TMPL "SELECT wd FROM inotify WHERE cookie = %" PRIi64 ";"
-  sqlite3_stmt *stmt;
-  char *query;
+  char *errmsg;
+  int flags;
   int ret;
+  int cache_size;
+  char *journal_mode;
+  int synchronous;
+  int mmap_size;
 
-  we->stmt = NULL;
-
-  if (we->match)
-    query = sqlite3_mprintf(Q_MATCH_TMPL, we->match);
-  else if (we->cookie != 0)
-    query = sqlite3_mprintf(Q_COOKIE_TMPL, we->cookie);
+  if (reader)
+    flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_PRIVATECACHE;
   else
+    flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+
+  ret = sqlite3_open_v2(db_path, &hdl, flags, NULL);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Could not start enum, no parameter given\n");
+      DPRINTF(E_LOG, L_DB, "Could not open '%s': %s\n", db_path, sqlite3_errmsg(hdl));
+
+      sqlite3_close(hdl);
       return -1;
     }
 
-  if (!query)
+  ret = sqlite3_enable_load_extension(hdl, 1);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Could not enable extension loading\n");
 
+      sqlite3_close(hdl);
       return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  ret = sqlite3_load_extension(hdl, db_sqlite_ext_path, NULL, &errmsg);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      DPRINTF(E_LOG, L_DB, "Could not load SQLite extension: %s\n", errmsg);
 
-      sqlite3_free(query);
+      sqlite3_free(errmsg);
+      sqlite3_close(hdl);
       return -1;
     }
 
-  sqlite3_free(query);
+  ret = sqlite3_enable_load_extension(hdl, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not disable extension loading\n");
 
-  we->stmt = stmt;
+      sqlite3_close(hdl);
+      return -1;
+    }
 
-  return 0;
+  ret = sqlite3_create_function(hdl, "daap_sortkey", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, db_sortkey_xfunc, NULL, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not create daap_sortkey function: %s\n", sqlite3_errmsg(hdl));
 
-#undef Q_MATCH_TMPL
-#undef Q_COOKIE_TMPL
-}
+      sqlite3_close(hdl);
+      return -1;
+    }
 
-void
-db_watch_enum_end(struct watch_enum *we)
-{
-  if (!we->stmt)
-    return;
+  ret = sqlite3_create_function(hdl, "queue_pos", 2, SQLITE_UTF8, NULL, db_queue_pos_xfunc, NULL, NULL);
+  if (ret == SQLITE_OK)
+    ret = sqlite3_create_function(hdl, "queue_version", 2, SQLITE_UTF8, NULL, db_queue_version_xfunc, NULL, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not create queue functions: %s\n", sqlite3_errmsg(hdl));
 
-  sqlite3_finalize(we->stmt);
-  we->stmt = NULL;
-}
+      sqlite3_close(hdl);
+      return -1;
+    }
 
-int
-db_watch_enum_fetchwd(struct watch_enum *we, uint32_t *wd)
-{
-  int ret;
+  if (reader)
+    sqlite3_busy_timeout(hdl, DB_READER_BUSY_TIMEOUT);
+  else
+    sqlite3_update_hook(hdl, db_update_hook_cb, NULL);
 
-  *wd = 0;
+  if (db_profile.enabled)
+    sqlite3_trace_v2(hdl, DB_PROFILE_TRACE_MASK, db_xprofile, NULL);
 
-  if (!we->stmt)
+  cache_size = cfg_getint(cfg_getsec(cfg, "sqlite"), "pragma_cache_size_library");
+  if (cache_size > -1)
     {
-      DPRINTF(E_LOG, L_DB, "Watch enum not started!\n");
-      return -1;
+      db_pragma_set_cache_size(cache_size);
+      cache_size = db_pragma_get_cache_size();
+      DPRINTF(E_DBG, L_DB, "Database cache size in pages: %d\n", cache_size);
     }
 
-  ret = db_blocking_step(we->stmt);
-  if (ret == SQLITE_DONE)
+  journal_mode = cfg_getstr(cfg_getsec(cfg, "sqlite"), "pragma_journal_mode");
+  if (journal_mode && !reader)
     {
-      DPRINTF(E_DBG, L_DB, "End of watch enum results\n");
-      return 0;
+      journal_mode = db_pragma_set_journal_mode(journal_mode);
+      DPRINTF(E_DBG, L_DB, "Database journal mode: %s\n", journal_mode);
     }
-  else if (ret != SQLITE_ROW)
+
+  synchronous = cfg_getint(cfg_getsec(cfg, "sqlite"), "pragma_synchronous");
+  if (synchronous > -1)
     {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
-      return -1;
+      db_pragma_set_synchronous(synchronous);
+      synchronous = db_pragma_get_synchronous();
+      DPRINTF(E_DBG, L_DB, "Database synchronous: %d\n", synchronous);
     }
 
-  *wd = (uint32_t)sqlite3_column_int(we->stmt, 0);
+  mmap_size = cfg_getint(cfg_getsec(cfg, "sqlite"), "pragma_mmap_size_library");
+  if (mmap_size > -1)
+    {
+      db_pragma_set_mmap_size(mmap_size);
+      mmap_size = db_pragma_get_mmap_size();
+      DPRINTF(E_DBG, L_DB, "Database mmap_size: %d\n", mmap_size);
+    }
 
   return 0;
 }
 
-
-#ifdef DB_PROFILE
-static int
-db_xprofile(unsigned int trace_type, void *notused, void *ptr, void *ptr_data)
+// The statement inserts nrows rows, returns NULL if that takes too many parameters
+static sqlite3_stmt *
+db_statements_prepare_insert(const struct col_type_map *map, size_t map_size, const char *table, int nrows)
 {
-  sqlite3_stmt *pstmt;
-  int64_t ms = 0;
-  sqlite3_stmt *stmt;
-  const char *pquery;
   char *query;
-  int log_level;
+  char *rowsstr;
+  char *tmp;
+  char keystr[2048];
+  char valstr[1024];
+  sqlite3_stmt *stmt;
+  int ncols = 0;
   int ret;
+  int i;
 
-  if (trace_type != SQLITE_TRACE_PROFILE)
-    return 0;
+  memset(keystr, 0, sizeof(keystr));
+  memset(valstr, 0, sizeof(valstr));
+  for (i = 0; i < map_size; i++)
+    {
+      if (map[i].flag & DB_FLAG_NO_BIND)
+	continue;
 
-  pstmt = ptr;
-  pquery = sqlite3_sql(pstmt);
-  ms = *((int64_t *) ptr_data) / 1000000;
+      CHECK_ERR(L_DB, safe_snprintf_cat(keystr, sizeof(keystr), "%s, ", map[i].name));
+      CHECK_ERR(L_DB, safe_snprintf_cat(valstr, sizeof(valstr), "?, "));
+      ncols++;
+    }
 
-  if (ms > 1000)
-    log_level = E_LOG;
-  else if (ms > 500)
-    log_level = E_WARN;
-  else if (ms > 10)
-    log_level = E_DBG;
-  else
-    log_level = E_SPAM;
+  if (ncols * nrows > sqlite3_limit(hdl, SQLITE_LIMIT_VARIABLE_NUMBER, -1))
+    {
+      DPRINTF(E_DBG, L_DB, "Too many parameters for inserting %d rows into %s\n", nrows, table);
+      return NULL;
+    }
 
-  if (log_level > logger_severity())
-    return 0;
+  // Terminate at the ending ", "
+  *(strrchr(keystr, ',')) = '\0';
+  *(strrchr(valstr, ',')) = '\0';
 
-  DPRINTF(log_level, L_DBPERF, "SQL PROFILE query: %s\n", pquery);
-  DPRINTF(log_level, L_DBPERF, "SQL PROFILE time: %" PRIi64 " ms\n", ms);
+  CHECK_NULL(L_DB, rowsstr = db_mprintf("(%s)", valstr));
+  for (i = 1; i < nrows; i++)
+    {
+      CHECK_NULL(L_DB, tmp = db_mprintf("%s, (%s)", rowsstr, valstr));
+      free(rowsstr);
+      rowsstr = tmp;
+    }
 
-  if ((strncmp(pquery, "SELECT", 6) != 0)
-       && (strncmp(pquery, "UPDATE", 6) != 0)
-       && (strncmp(pquery, "DELETE", 6) != 0))
-      return 0;
+  CHECK_NULL(L_DB, query = db_mprintf("INSERT INTO %s (%s) VALUES %s;", table, keystr, rowsstr));
+  free(rowsstr);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_FATAL, L_DB, "Could not prepare statement '%s': %s\n", query, sqlite3_errmsg(hdl));
+      free(query);
+      return NULL;
+    }
+
+  free(query);
+
+  return stmt;
+}
 
-  /* Disable profiling callback */
-  sqlite3_trace_v2(hdl, 0, NULL, NULL);
+static sqlite3_stmt *
+db_statements_prepare_update(const struct col_type_map *map, size_t map_size, const char *table)
+{
+  char *query;
+  char keystr[2048];
+  sqlite3_stmt *stmt;
+  int ret;
+  int i;
 
-  query = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", pquery);
-  if (!query)
+  memset(keystr, 0, sizeof(keystr));
+  for (i = 0; i < map_size; i++)
     {
-      DPRINTF(log_level, L_DBPERF, "Query plan: Out of memory\n");
+      if (map[i].flag & DB_FLAG_NO_BIND)
+	continue;
 
-      goto out;
+      if (map[i].flag & DB_FLAG_NO_ZERO)
+	CHECK_ERR(L_DB, safe_snprintf_cat(keystr, sizeof(keystr), "%s = daap_no_zero(?, %s), ", map[i].name, map[i].name));
+      else
+	CHECK_ERR(L_DB, safe_snprintf_cat(keystr, sizeof(keystr), "%s = ?, ", map[i].name));
     }
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  sqlite3_free(query);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(log_level, L_DBPERF, "Query plan: Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-
-      goto out;
-    }
+  // Terminate at the ending ", "
+  *(strrchr(keystr, ',')) = '\0';
 
-  DPRINTF(log_level, L_DBPERF, "Query plan:\n");
+  CHECK_NULL(L_DB, query = db_mprintf("UPDATE %s SET %s WHERE %s = ?;", table, keystr, map[0].name));
 
-  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(log_level, L_DBPERF, "(%d,%d,%d) %s\n",
-	      sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2),
-	      sqlite3_column_text(stmt, 3));
+      DPRINTF(E_FATAL, L_DB, "Could not prepare statement '%s': %s\n", query, sqlite3_errmsg(hdl));
+      free(query);
+      return NULL;
     }
 
-  if (ret != SQLITE_DONE)
-    DPRINTF(log_level, L_DBPERF, "Query plan: Could not step: %s\n", sqlite3_errmsg(hdl));
-
-  sqlite3_finalize(stmt);
-
- out:
-  /* Reenable profiling callback */
-  sqlite3_trace_v2(hdl, SQLITE_TRACE_PROFILE, db_xprofile, NULL);
+  free(query);
 
-  return 0;
+  return stmt;
 }
-#endif
 
-static int
-db_pragma_get_cache_size()
+static sqlite3_stmt *
+db_statements_prepare_ping(const char *table)
 {
+  char *query;
   sqlite3_stmt *stmt;
-  char *query = "PRAGMA cache_size;";
   int ret;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  // The last param will be the file mtime. We must not update if the mtime is
+  // newer or equal than the current db_timestamp, since the file may have been
+  // modified and must be rescanned.
+  CHECK_NULL(L_DB, query = db_mprintf("UPDATE %s SET db_timestamp = ?, disabled = 0 WHERE path = ? AND db_timestamp > ?;", table));
 
   ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-      return 0;
-    }
-
-  ret = db_blocking_step(stmt);
-  if (ret == SQLITE_DONE)
-    {
-      DPRINTF(E_DBG, L_DB, "End of query results\n");
-      return 0;
-    }
-  else if (ret != SQLITE_ROW)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
-      return -1;
+      DPRINTF(E_FATAL, L_DB, "Could not prepare statement '%s': %s\n", query, sqlite3_errmsg(hdl));
+      free(query);
+      return NULL;
     }
 
-  ret = sqlite3_column_int(stmt, 0);
+  free(query);
 
-  sqlite3_finalize(stmt);
-  return ret;
+  return stmt;
 }
 
 static int
-db_pragma_set_cache_size(int pages)
+db_statements_prepare(void)
 {
-#define Q_TMPL "PRAGMA cache_size=%d;"
-  sqlite3_stmt *stmt;
-  char *query;
-  int ret;
+  db_statements.files_insert = db_statements_prepare_insert(mfi_cols_map, ARRAY_SIZE(mfi_cols_map), "files", 1);
+  db_statements.files_insert_batch = db_statements_prepare_insert(mfi_cols_map, ARRAY_SIZE(mfi_cols_map), "files", DB_FILES_INSERT_BATCH);
+  db_statements.files_update = db_statements_prepare_update(mfi_cols_map, ARRAY_SIZE(mfi_cols_map), "files");
+  db_statements.files_ping   = db_statements_prepare_ping("files");
 
-  query = sqlite3_mprintf(Q_TMPL, pages);
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  db_statements.playlists_insert = db_statements_prepare_insert(pli_cols_map, ARRAY_SIZE(pli_cols_map), "playlists", 1);
+  db_statements.playlists_update = db_statements_prepare_update(pli_cols_map, ARRAY_SIZE(pli_cols_map), "playlists");
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+  db_statements.queue_items_insert = db_statements_prepare_insert(qi_cols_map, ARRAY_SIZE(qi_cols_map), "queue", 1);
+  db_statements.queue_items_update = db_statements_prepare_update(qi_cols_map, ARRAY_SIZE(qi_cols_map), "queue");
 
-      sqlite3_free(query);
-      return 0;
-    }
+  if ( !db_statements.files_insert || !db_statements.files_update || !db_statements.files_ping
+       || !db_statements.playlists_insert || !db_statements.playlists_update
+       || !db_statements.queue_items_insert || !db_statements.queue_items_update
+     )
+    return -1;
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
   return 0;
-#undef Q_TMPL
 }
 
-static char *
-db_pragma_set_journal_mode(char *mode)
+static void
+db_statements_finalize(void)
 {
-#define Q_TMPL "PRAGMA journal_mode=%s;"
-  sqlite3_stmt *stmt;
-  char *query;
-  int ret;
-  char *new_mode;
+  sqlite3_finalize(db_statements.files_insert);
+  sqlite3_finalize(db_statements.files_insert_batch);
+  sqlite3_finalize(db_statements.files_update);
+  sqlite3_finalize(db_statements.files_ping);
+  sqlite3_finalize(db_statements.playlists_insert);
+  sqlite3_finalize(db_statements.playlists_update);
+  sqlite3_finalize(db_statements.queue_items_insert);
+  sqlite3_finalize(db_statements.queue_items_update);
 
-  query = sqlite3_mprintf(Q_TMPL, mode);
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  memset(&db_statements, 0, sizeof(struct db_statements));
+}
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+/* Reader pool */
 
-      sqlite3_free(query);
-      return NULL;
-    }
+static sqlite3 *
+db_reader_open(void)
+{
+  sqlite3 *writer = hdl;
+  sqlite3 *conn;
+  int ret;
 
-  ret = db_blocking_step(stmt);
-  if (ret == SQLITE_DONE)
-    {
-      DPRINTF(E_DBG, L_DB, "End of query results\n");
-      sqlite3_free(query);
-      return NULL;
-    }
-  else if (ret != SQLITE_ROW)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
-      sqlite3_free(query);
-      return NULL;
-    }
+  hdl = NULL;
 
-  new_mode = (char *) sqlite3_column_text(stmt, 0);
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
-  return new_mode;
-#undef Q_TMPL
+  ret = db_open(true);
+  conn = (ret == 0) ? hdl : NULL;
+
+  hdl = writer;
+
+  return conn;
 }
 
-static int
-db_pragma_get_synchronous()
+/* Borrows a read-only connection from the pool for the calling thread, or the
+ * one it already has. Returns NULL if the thread should use its own connection,
+ * i.e. if the pool is disabled, if no connection became available in time, or
+ * if the thread is in a transaction (since its changes would not be seen).
+ * Since a thread holds at most one connection there can be no deadlock. */
+static sqlite3 *
+db_reader_acquire(void)
 {
-  sqlite3_stmt *stmt;
-  char *query = "PRAGMA synchronous;";
-  int ret;
+  struct timespec wait = { 0, DB_READER_WAIT_MS * 1000000L };
+  struct timespec start;
+  struct timespec end;
+  struct timespec deadline;
+  sqlite3 *conn = NULL;
+  bool open_new = false;
+  uint64_t wait_us;
+  int ret = 0;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  if (db_reader_pool.size == 0 || !hdl || !sqlite3_get_autocommit(hdl))
+    return NULL;
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
+  if (db_reader.conn)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-      return 0;
+      db_reader.refcount++;
+      return db_reader.conn;
     }
 
-  ret = db_blocking_step(stmt);
-  if (ret == SQLITE_DONE)
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_reader_pool.lck));
+
+  if (db_reader_pool.nidle == 0 && db_reader_pool.nopen >= db_reader_pool.size)
     {
-      DPRINTF(E_DBG, L_DB, "End of query results\n");
-      return 0;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      deadline = timespec_reltoabs(wait);
+
+      while (db_reader_pool.nidle == 0 && db_reader_pool.nopen >= db_reader_pool.size && ret != ETIMEDOUT)
+	ret = pthread_cond_timedwait(&db_reader_pool.cond, &db_reader_pool.lck, &deadline);
+
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      end = timespec_sub(end, start);
+      wait_us = end.tv_sec * 1000000ULL + end.tv_nsec / 1000;
+
+      db_reader_pool.stats.waits++;
+      db_reader_pool.stats.wait_us_total += wait_us;
+      db_reader_pool.stats.wait_us_max = MAX(db_reader_pool.stats.wait_us_max, wait_us);
     }
-  else if (ret != SQLITE_ROW)
+
+  if (db_reader_pool.nidle > 0)
+    conn = db_reader_pool.idle[--db_reader_pool.nidle];
+  else if (db_reader_pool.nopen < db_reader_pool.size)
     {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
-      return -1;
+      db_reader_pool.nopen++;
+      open_new = true;
     }
 
-  ret = sqlite3_column_int(stmt, 0);
-
-  sqlite3_finalize(stmt);
-  return ret;
-}
-
-static int
-db_pragma_set_synchronous(int synchronous)
-{
-#define Q_TMPL "PRAGMA synchronous=%d;"
-  sqlite3_stmt *stmt;
-  char *query;
-  int ret;
+  if (conn || open_new)
+    db_reader_pool.stats.borrows++;
+  else
+    db_reader_pool.stats.fallbacks++;
 
-  query = sqlite3_mprintf(Q_TMPL, synchronous);
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_reader_pool.lck));
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
+  if (open_new)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      conn = db_reader_open();
+      if (!conn)
+	{
+	  CHECK_ERR(L_DB, pthread_mutex_lock(&db_reader_pool.lck));
+	  db_reader_pool.nopen--;
+	  CHECK_ERR(L_DB, pthread_cond_signal(&db_reader_pool.cond));
+	  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_reader_pool.lck));
+	  return NULL;
+	}
 
-      sqlite3_free(query);
-      return 0;
+      DPRINTF(E_DBG, L_DB, "Opened read-only connection %d of %d\n", db_reader_pool.nopen, db_reader_pool.size);
     }
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
-  return 0;
-#undef Q_TMPL
+  if (!conn)
+    return NULL;
+
+  db_reader.conn = conn;
+  db_reader.refcount = 1;
+
+  return conn;
+}
+
+static void
+db_reader_release(void)
+{
+  if (!db_reader.conn || --db_reader.refcount > 0)
+    return;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_reader_pool.lck));
+  db_reader_pool.idle[db_reader_pool.nidle++] = db_reader.conn;
+  CHECK_ERR(L_DB, pthread_cond_signal(&db_reader_pool.cond));
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_reader_pool.lck));
+
+  db_reader.conn = NULL;
 }
 
+// The reader connections only see a snapshot if the db is in WAL mode
 static int
-db_pragma_get_mmap_size()
+db_reader_pool_init(void)
 {
+  const char *journal_mode;
   sqlite3_stmt *stmt;
-  char *query = "PRAGMA mmap_size;";
   int ret;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  if (db_reader_pool.size <= 0)
+    return 0;
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  ret = db_blocking_prepare_v2("PRAGMA journal_mode=WAL;", -1, &stmt, NULL);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-      return 0;
+      return -1;
     }
 
   ret = db_blocking_step(stmt);
-  if (ret == SQLITE_DONE)
-    {
-      DPRINTF(E_DBG, L_DB, "End of query results\n");
-      return 0;
-    }
-  else if (ret != SQLITE_ROW)
+  journal_mode = (ret == SQLITE_ROW) ? (const char *)sqlite3_column_text(stmt, 0) : NULL;
+  ret = (journal_mode && strcasecmp(journal_mode, "wal") == 0) ? 0 : -1;
+
+  sqlite3_finalize(stmt);
+
+  if (ret < 0)
     {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      DPRINTF(E_LOG, L_DB, "Could not switch database to WAL journal mode, reader pool disabled\n");
       return -1;
     }
 
-  ret = sqlite3_column_int(stmt, 0);
+  CHECK_NULL(L_DB, db_reader_pool.idle = calloc(db_reader_pool.size, sizeof(sqlite3 *)));
 
-  sqlite3_finalize(stmt);
-  return ret;
+  DPRINTF(E_INFO, L_DB, "Using up to %d read-only database connections\n", db_reader_pool.size);
+
+  return 0;
 }
 
-static int
-db_pragma_set_mmap_size(int mmap_size)
+/* Closes a connection, our statements on it must have been finalized. The
+ * search index has statements of its own, which it finalizes when it is
+ * disconnected, i.e. by sqlite3_close() or when the last of our statements
+ * that use it is finalized. The connection's statements can therefore not just
+ * be finalized here, since that frees some of them twice. If statements were
+ * left (a query that was never ended), the connection is closed when they are
+ * finalized. */
+static void
+db_conn_close(sqlite3 *conn)
 {
-#define Q_TMPL "PRAGMA mmap_size=%d;"
-  sqlite3_stmt *stmt;
-  char *query;
-  int ret;
+  if (sqlite3_close(conn) != SQLITE_BUSY)
+    return;
+
+  DPRINTF(E_WARN, L_DB, "Closing database connection with statements that were not finalized\n");
+
+  sqlite3_close_v2(conn);
+}
+
+static void
+db_reader_pool_deinit(void)
+{
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_reader_pool.lck));
+
+  if (db_reader_pool.nopen > db_reader_pool.nidle)
+    DPRINTF(E_WARN, L_DB, "Read-only database connections still in use at exit\n");
+
+  while (db_reader_pool.nidle > 0)
+    db_conn_close(db_reader_pool.idle[--db_reader_pool.nidle]);
+
+  free(db_reader_pool.idle);
+  db_reader_pool.idle = NULL;
+  db_reader_pool.nopen = 0;
+  db_reader_pool.size = 0;
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_reader_pool.lck));
+}
+
+void
+db_reader_pool_stats_get(struct db_reader_pool_stats *stats)
+{
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_reader_pool.lck));
 
-  query = sqlite3_mprintf(Q_TMPL, mmap_size);
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  *stats = db_reader_pool.stats;
+  stats->size = db_reader_pool.size;
+  stats->open = db_reader_pool.nopen;
+  stats->in_use = db_reader_pool.nopen - db_reader_pool.nidle;
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_reader_pool.lck));
+}
 
-      sqlite3_free(query);
-      return 0;
-    }
+/* Backup */
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
-  return 0;
-#undef Q_TMPL
+// Must be called with the lock held
+static void
+backup_job_cleanup(struct db_backup_job *job)
+{
+  if (job->backup)
+    sqlite3_backup_finish(job->backup);
+  if (job->dst)
+    sqlite3_close(job->dst);
+  if (job->src)
+    sqlite3_close(job->src);
+  if (job->tmp_path)
+    unlink(job->tmp_path);
+
+  free(job->path);
+  free(job->tmp_path);
+
+  job->backup = NULL;
+  job->dst = NULL;
+  job->src = NULL;
+  job->path = NULL;
+  job->tmp_path = NULL;
 }
 
 static int
-db_open(void)
+backup_compress(const char *src_path, const char *dst_path)
 {
-  char *errmsg;
-  int ret;
-  int cache_size;
-  char *journal_mode;
-  int synchronous;
-  int mmap_size;
+  unsigned char buf[65536];
+  FILE *fp;
+  gzFile gz;
+  size_t len;
+  int ret = 0;
 
-  ret = sqlite3_open(db_path, &hdl);
-  if (ret != SQLITE_OK)
+  fp = fopen(src_path, "rb");
+  if (!fp)
     {
-      DPRINTF(E_LOG, L_DB, "Could not open '%s': %s\n", db_path, sqlite3_errmsg(hdl));
-
-      sqlite3_close(hdl);
+      DPRINTF(E_LOG, L_DB, "Could not open '%s' for compression: %s\n", src_path, strerror(errno));
       return -1;
     }
 
-  ret = sqlite3_enable_load_extension(hdl, 1);
-  if (ret != SQLITE_OK)
+  gz = gzopen(dst_path, "wb");
+  if (!gz)
     {
-      DPRINTF(E_LOG, L_DB, "Could not enable extension loading\n");
-
-      sqlite3_close(hdl);
+      DPRINTF(E_LOG, L_DB, "Could not create compressed backup '%s'\n", dst_path);
+      fclose(fp);
       return -1;
     }
 
-  ret = sqlite3_load_extension(hdl, db_sqlite_ext_path, NULL, &errmsg);
-  if (ret != SQLITE_OK)
+  while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
     {
-      DPRINTF(E_LOG, L_DB, "Could not load SQLite extension: %s\n", errmsg);
-
-      sqlite3_free(errmsg);
-      sqlite3_close(hdl);
-      return -1;
+      if (gzwrite(gz, buf, len) != (int)len)
+	{
+	  ret = -1;
+	  break;
+	}
     }
 
-  ret = sqlite3_enable_load_extension(hdl, 0);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not disable extension loading\n");
+  if (ferror(fp))
+    ret = -1;
 
-      sqlite3_close(hdl);
-      return -1;
-    }
+  if (gzclose(gz) != Z_OK)
+    ret = -1;
 
-#ifdef DB_PROFILE
-  sqlite3_trace_v2(hdl, SQLITE_TRACE_PROFILE, db_xprofile, NULL);
-#endif
+  fclose(fp);
 
-  cache_size = cfg_getint(cfg_getsec(cfg, "sqlite"), "pragma_cache_size_library");
-  if (cache_size > -1)
+  if (ret < 0)
     {
-      db_pragma_set_cache_size(cache_size);
-      cache_size = db_pragma_get_cache_size();
-      DPRINTF(E_DBG, L_DB, "Database cache size in pages: %d\n", cache_size);
+      DPRINTF(E_LOG, L_DB, "Error writing compressed backup '%s'\n", dst_path);
+      unlink(dst_path);
     }
 
-  journal_mode = cfg_getstr(cfg_getsec(cfg, "sqlite"), "pragma_journal_mode");
-  if (journal_mode)
-    {
-      journal_mode = db_pragma_set_journal_mode(journal_mode);
-      DPRINTF(E_DBG, L_DB, "Database journal mode: %s\n", journal_mode);
-    }
+  return ret;
+}
 
-  synchronous = cfg_getint(cfg_getsec(cfg, "sqlite"), "pragma_synchronous");
-  if (synchronous > -1)
+// Must be called with the lock held, the job must be running
+static int
+backup_job_complete(struct db_backup_job *job)
+{
+  int ret;
+
+  sqlite3_backup_finish(job->backup);
+  job->backup = NULL;
+
+  ret = sqlite3_close(job->dst);
+  job->dst = NULL;
+  if (ret != SQLITE_OK)
     {
-      db_pragma_set_synchronous(synchronous);
-      synchronous = db_pragma_get_synchronous();
-      DPRINTF(E_DBG, L_DB, "Database synchronous: %d\n", synchronous);
+      DPRINTF(E_LOG, L_DB, "Failed to close backup '%s': %s\n", job->tmp_path, sqlite3_errstr(ret));
+      return -1;
     }
 
-  mmap_size = cfg_getint(cfg_getsec(cfg, "sqlite"), "pragma_mmap_size_library");
-  if (mmap_size > -1)
+  if (job->compress)
+    return backup_compress(job->tmp_path, job->path);
+
+  ret = rename(job->tmp_path, job->path);
+  if (ret < 0)
     {
-      db_pragma_set_mmap_size(mmap_size);
-      mmap_size = db_pragma_get_mmap_size();
-      DPRINTF(E_DBG, L_DB, "Database mmap_size: %d\n", mmap_size);
+      DPRINTF(E_LOG, L_DB, "Failed to move backup '%s' to '%s': %s\n", job->tmp_path, job->path, strerror(errno));
+      return -1;
     }
 
   return 0;
 }
 
-static sqlite3_stmt *
-db_statements_prepare_insert(const struct col_type_map *map, size_t map_size, const char *table)
+static void
+backup_step_cb(void *arg)
 {
-  char *query;
-  char keystr[2048];
-  char valstr[1024];
-  sqlite3_stmt *stmt;
+  struct db_backup_job *job = &db_backup_job;
+  enum db_backup_state state;
+  int delay;
   int ret;
-  int i;
 
-  memset(keystr, 0, sizeof(keystr));
-  memset(valstr, 0, sizeof(valstr));
-  for (i = 0; i < map_size; i++)
-    {
-      if (map[i].flag & DB_FLAG_NO_BIND)
-	continue;
+  CHECK_ERR(L_DB, pthread_mutex_lock(&job->lck));
 
-      CHECK_ERR(L_DB, safe_snprintf_cat(keystr, sizeof(keystr), "%s, ", map[i].name));
-      CHECK_ERR(L_DB, safe_snprintf_cat(valstr, sizeof(valstr), "?, "));
+  if (job->status.state != DB_BACKUP_RUNNING)
+    {
+      CHECK_ERR(L_DB, pthread_mutex_unlock(&job->lck));
+      return;
     }
 
-  // Terminate at the ending ", "
-  *(strrchr(keystr, ',')) = '\0';
-  *(strrchr(valstr, ',')) = '\0';
+  ret = sqlite3_backup_step(job->backup, DB_BACKUP_STEP_PAGES);
 
-  CHECK_NULL(L_DB, query = db_mprintf("INSERT INTO %s (%s) VALUES (%s);", table, keystr, valstr));
+  job->status.pages_total = sqlite3_backup_pagecount(job->backup);
+  job->status.pages_remaining = sqlite3_backup_remaining(job->backup);
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
+  if (ret == SQLITE_OK || ret == SQLITE_BUSY || ret == SQLITE_LOCKED)
     {
-      DPRINTF(E_FATAL, L_DB, "Could not prepare statement '%s': %s\n", query, sqlite3_errmsg(hdl));
-      free(query);
-      return NULL;
-    }
-
-  free(query);
+      if (ret == SQLITE_OK)
+	{
+	  job->retries = 0;
+	  delay = 0;
+	}
+      else if (job->retries++ < DB_BACKUP_RETRIES)
+	{
+	  DPRINTF(E_DBG, L_DB, "Backup step could not get lock, retrying\n");
+	  delay = 1;
+	}
+      else
+	{
+	  DPRINTF(E_LOG, L_DB, "Backup failed, database locked for too long\n");
+	  goto fail;
+	}
 
-  return stmt;
-}
+      CHECK_ERR(L_DB, pthread_mutex_unlock(&job->lck));
 
-static sqlite3_stmt *
-db_statements_prepare_update(const struct col_type_map *map, size_t map_size, const char *table)
-{
-  char *query;
-  char keystr[2048];
-  sqlite3_stmt *stmt;
-  int ret;
-  int i;
+      // Give other tasks a go before the next step
+      worker_execute(backup_step_cb, NULL, 0, delay);
+      return;
+    }
 
-  memset(keystr, 0, sizeof(keystr));
-  for (i = 0; i < map_size; i++)
+  if (ret != SQLITE_DONE)
     {
-      if (map[i].flag & DB_FLAG_NO_BIND)
-	continue;
-
-      if (map[i].flag & DB_FLAG_NO_ZERO)
-	CHECK_ERR(L_DB, safe_snprintf_cat(keystr, sizeof(keystr), "%s = daap_no_zero(?, %s), ", map[i].name, map[i].name));
-      else
-	CHECK_ERR(L_DB, safe_snprintf_cat(keystr, sizeof(keystr), "%s = ?, ", map[i].name));
+      DPRINTF(E_LOG, L_DB, "Failed to complete backup '%s': %s (%d)\n", job->path, sqlite3_errstr(ret), ret);
+      goto fail;
     }
 
-  // Terminate at the ending ", "
-  *(strrchr(keystr, ',')) = '\0';
+  ret = backup_job_complete(job);
+  if (ret < 0)
+    goto fail;
 
-  CHECK_NULL(L_DB, query = db_mprintf("UPDATE %s SET %s WHERE %s = ?;", table, keystr, map[0].name));
+  DPRINTF(E_INFO, L_DB, "Backup complete to '%s' (%d pages)\n", job->path, job->status.pages_total);
+  state = DB_BACKUP_DONE;
+  goto end;
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_FATAL, L_DB, "Could not prepare statement '%s': %s\n", query, sqlite3_errmsg(hdl));
-      free(query);
-      return NULL;
-    }
+ fail:
+  state = DB_BACKUP_FAILED;
 
-  free(query);
+ end:
+  backup_job_cleanup(job);
+  job->status.state = state;
+  job->status.finished = time(NULL);
 
-  return stmt;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&job->lck));
+
+  listener_notify(LISTENER_BACKUP);
 }
 
-static sqlite3_stmt *
-db_statements_prepare_ping(const char *table)
+// Must be called with the lock held
+static int
+backup_job_start(struct db_backup_job *job, const char *backup_path, bool compress)
 {
-  char *query;
-  sqlite3_stmt *stmt;
   int ret;
 
-  // The last param will be the file mtime. We must not update if the mtime is
-  // newer or equal than the current db_timestamp, since the file may have been
-  // modified and must be rescanned.
-  CHECK_NULL(L_DB, query = db_mprintf("UPDATE %s SET db_timestamp = ?, disabled = 0 WHERE path = ? AND db_timestamp > ?;", table));
+  job->compress = compress;
+  if (compress)
+    job->path = safe_asprintf("%s.gz", backup_path);
+  else
+    job->path = strdup(backup_path);
+  job->tmp_path = safe_asprintf("%s.tmp", backup_path);
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  // The source gets its own connection, since the steps may run in any of the
+  // worker threads. It shares the cache with the other connections, so their
+  // changes are applied to the backup instead of making it restart.
+  ret = sqlite3_open(db_path, &job->src);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_FATAL, L_DB, "Could not prepare statement '%s': %s\n", query, sqlite3_errmsg(hdl));
-      free(query);
-      return NULL;
+      DPRINTF(E_LOG, L_DB, "Could not open database for backup: %s\n", sqlite3_errmsg(job->src));
+      goto error;
     }
 
-  free(query);
-
-  return stmt;
-}
+  unlink(job->tmp_path);
 
-static int
-db_statements_prepare(void)
-{
-  db_statements.files_insert = db_statements_prepare_insert(mfi_cols_map, ARRAY_SIZE(mfi_cols_map), "files");
-  db_statements.files_update = db_statements_prepare_update(mfi_cols_map, ARRAY_SIZE(mfi_cols_map), "files");
-  db_statements.files_ping   = db_statements_prepare_ping("files");
+  ret = sqlite3_open(job->tmp_path, &job->dst);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_WARN, L_DB, "Failed to create backup '%s': %s\n", job->tmp_path, sqlite3_errmsg(job->dst));
+      goto error;
+    }
 
-  db_statements.playlists_insert = db_statements_prepare_insert(pli_cols_map, ARRAY_SIZE(pli_cols_map), "playlists");
-  db_statements.playlists_update = db_statements_prepare_update(pli_cols_map, ARRAY_SIZE(pli_cols_map), "playlists");
+  job->backup = sqlite3_backup_init(job->dst, "main", job->src, "main");
+  if (!job->backup)
+    {
+      DPRINTF(E_WARN, L_DB, "Failed to initiate backup '%s': %s\n", job->tmp_path, sqlite3_errmsg(job->dst));
+      goto error;
+    }
 
-  db_statements.queue_items_insert = db_statements_prepare_insert(qi_cols_map, ARRAY_SIZE(qi_cols_map), "queue");
-  db_statements.queue_items_update = db_statements_prepare_update(qi_cols_map, ARRAY_SIZE(qi_cols_map), "queue");
+  job->retries = 0;
+  job->status.state = DB_BACKUP_RUNNING;
+  job->status.pages_total = 0;
+  job->status.pages_remaining = 0;
+  job->status.started = time(NULL);
+  job->status.finished = 0;
 
-  if ( !db_statements.files_insert || !db_statements.files_update || !db_statements.files_ping
-       || !db_statements.playlists_insert || !db_statements.playlists_update
-       || !db_statements.queue_items_insert || !db_statements.queue_items_update
-     )
-    return -1;
+  worker_execute(backup_step_cb, NULL, 0, 0);
 
   return 0;
+
+ error:
+  backup_job_cleanup(job);
+  return -1;
 }
 
-// Returns -2 if backup not enabled in config
+// Starts a backup in the background, unless one is already running. Returns -2
+// if backup not enabled in config.
 int
 db_backup(void)
 {
-  int ret;
-  sqlite3 *backup_hdl;
-  sqlite3_backup *backup;
+  struct db_backup_job *job = &db_backup_job;
   const char *backup_path;
+  bool compress;
+  int ret;
 
   char resolved_bp[PATH_MAX];
   char resolved_dbp[PATH_MAX];
@@ -7165,53 +10232,65 @@ db_backup(void)
       return -2;
     }
 
-  if (realpath(db_path, resolved_dbp) == NULL || realpath(backup_path, resolved_bp) == NULL)
+  compress = cfg_getbool(cfg_getsec(cfg, "general"), "db_backup_compress");
+
+  if (realpath(db_path, resolved_dbp) == NULL)
     {
-      DPRINTF(E_LOG, L_DB, "Failed to resolve real path of db/backup path: %s\n", strerror(errno));
+      DPRINTF(E_LOG, L_DB, "Failed to resolve real path of db path: %s\n", strerror(errno));
       return -1;
     }
 
-  if (strcmp(resolved_bp, resolved_dbp) == 0)
+  // The backup itself may not exist yet
+  if (realpath(backup_path, resolved_bp) == NULL)
+    {
+      if (errno != ENOENT)
+	{
+	  DPRINTF(E_LOG, L_DB, "Failed to resolve real path of backup path: %s\n", strerror(errno));
+	  return -1;
+	}
+    }
+  else if (strcmp(resolved_bp, resolved_dbp) == 0)
     {
       DPRINTF(E_LOG, L_DB, "Backup path same as main db path, ignoring\n");
       return -2;
     }
 
-  DPRINTF(E_INFO, L_DB, "Backup starting...\n");
+  CHECK_ERR(L_DB, pthread_mutex_lock(&job->lck));
 
-  ret = sqlite3_open(backup_path, &backup_hdl);
-  if (ret != SQLITE_OK)
+  if (job->status.state == DB_BACKUP_RUNNING)
     {
-      DPRINTF(E_WARN, L_DB, "Failed to create backup '%s': %s\n", backup_path, sqlite3_errmsg(backup_hdl));
-      return -1;
+      DPRINTF(E_INFO, L_DB, "Backup already running, %d of %d pages remaining\n", job->status.pages_remaining, job->status.pages_total);
+      CHECK_ERR(L_DB, pthread_mutex_unlock(&job->lck));
+      return 0;
     }
 
-  backup = sqlite3_backup_init(backup_hdl, "main", hdl, "main");
-  if (!backup)
-    {
-      DPRINTF(E_WARN, L_DB, "Failed to initiate backup '%s': %s\n", backup_path, sqlite3_errmsg(backup_hdl));
-      sqlite3_close(backup_hdl);
-      return -1;
-    }
+  DPRINTF(E_INFO, L_DB, "Backup starting...\n");
 
-  ret = sqlite3_backup_step(backup, -1);
-  sqlite3_backup_finish(backup);
-  sqlite3_close(backup_hdl);
+  ret = backup_job_start(job, backup_path, compress);
 
-  if (ret == SQLITE_DONE || ret == SQLITE_OK)
-    DPRINTF(E_INFO, L_DB, "Backup complete to '%s'\n", backup_path);
-  else
-    DPRINTF(E_WARN, L_DB, "Failed to complete backup '%s': %s (%d)\n", backup_path, sqlite3_errstr(ret), ret);
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&job->lck));
+
+  if (ret < 0)
+    return -1;
 
+  listener_notify(LISTENER_BACKUP);
   return 0;
 }
 
+void
+db_backup_status_get(struct db_backup_status *status)
+{
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_backup_job.lck));
+  *status = db_backup_job.status;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_backup_job.lck));
+}
+
 int
 db_perthread_init(void)
 {
   int ret;
 
-  ret = db_open();
+  ret = db_open(false);
   if (ret < 0)
     return -1;
 
@@ -7220,10 +10299,13 @@ db_perthread_init(void)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statements\n");
 
+      db_statements_finalize();
       sqlite3_close(hdl);
       return -1;
     }
 
+  memset(&db_stmt_cache, 0, sizeof(struct db_stmt_cache));
+
   return 0;
 }
 
@@ -7232,14 +10314,32 @@ db_perthread_deinit(void)
 {
   sqlite3_stmt *stmt;
 
+  // A query that was not ended still holds a connection from the pool
+  if (db_reader.conn)
+    {
+      DPRINTF(E_WARN, L_DB, "Thread exits with a read-only connection, returning it to the pool\n");
+
+      // Ends the read transaction. The statements can't be finalized here,
+      // since that could include those of the search index, see
+      // db_conn_close().
+      stmt = NULL;
+      while ((stmt = sqlite3_next_stmt(db_reader.conn, stmt)))
+	{
+	  if (sqlite3_stmt_busy(stmt))
+	    sqlite3_reset(stmt);
+	}
+
+      db_reader.refcount = 1;
+      db_reader_release();
+    }
+
   if (!hdl)
     return;
 
-  /* Tear down anything that's in flight */
-  while ((stmt = sqlite3_next_stmt(hdl, 0)))
-    sqlite3_finalize(stmt);
+  db_stmt_cache_clear();
+  db_statements_finalize();
 
-  sqlite3_close(hdl);
+  db_conn_close(hdl);
 }
 
 
@@ -7379,6 +10479,7 @@ db_check_version(void)
 int
 db_init(char *sqlite_ext_path)
 {
+  const char *journal_mode;
   uint32_t files;
   uint32_t pls;
   int ret;
@@ -7397,6 +10498,26 @@ db_init(char *sqlite_ext_path)
   db_sqlite_ext_path = sqlite_ext_path;
   db_rating_updates = cfg_getbool(cfg_getsec(cfg, "library"), "rating_updates");
 
+  db_reader_pool.size = cfg_getint(cfg_getsec(cfg, "sqlite"), "read_pool_size");
+  journal_mode = cfg_getstr(cfg_getsec(cfg, "sqlite"), "pragma_journal_mode");
+  if (db_reader_pool.size > 0 && journal_mode && strcasecmp(journal_mode, "wal") != 0)
+    {
+      DPRINTF(E_LOG, L_DB, "Reader pool requires journal mode WAL, but '%s' is configured, disabling pool\n", journal_mode);
+      db_reader_pool.size = 0;
+    }
+
+  db_profile.enabled = cfg_getbool(cfg_getsec(cfg, "sqlite"), "profile");
+  db_profile.slow_ms = cfg_getint(cfg_getsec(cfg, "sqlite"), "profile_slow_ms");
+#ifdef DB_PROFILE
+  db_profile.enabled = true;
+#endif
+  if (db_profile.enabled)
+    {
+      DPRINTF(E_INFO, L_DB, "Query profiling enabled, logging queries slower than %d ms\n", db_profile.slow_ms);
+      CHECK_NULL(L_DB, db_profile.stats = calloc(DB_PROFILE_TEMPLATES, sizeof(struct db_query_stats)));
+      CHECK_NULL(L_DB, db_profile.hashes = calloc(DB_PROFILE_TEMPLATES, sizeof(uint32_t)));
+    }
+
   DPRINTF(E_INFO, L_DB, "Configured to use database file '%s'\n", db_path);
 
   ret = sqlite3_config(SQLITE_CONFIG_MULTITHREAD);
@@ -7421,7 +10542,7 @@ db_init(char *sqlite_ext_path)
       goto error;
     }
 
-  ret = db_open();
+  ret = db_open(false);
   if (ret < 0)
     {
       DPRINTF(E_FATAL, L_DB, "Could not open database\n");
@@ -7449,6 +10570,16 @@ db_init(char *sqlite_ext_path)
 	}
     }
 
+  ret = db_init_search_index(hdl);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_DB, "Search index not available (requires SQLite 3.34 with FTS5), searching will be slow\n");
+
+  db_search_index = (ret == 0);
+
+  ret = db_reader_pool_init();
+  if (ret < 0)
+    db_reader_pool.size = 0;
+
   db_set_cfg_names();
 
   CHECK_ERR(L_DB, db_files_get_count(&files, NULL, NULL));
@@ -7471,5 +10602,29 @@ db_init(char *sqlite_ext_path)
 void
 db_deinit(void)
 {
+  int i;
+
+  queue_order_reset();
+  queue_snapshot_unref(db_queue_snapshot);
+  db_queue_snapshot = NULL;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_backup_job.lck));
+  backup_job_cleanup(&db_backup_job);
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_backup_job.lck));
+
+  db_reader_pool_deinit();
+
+  smartpl_cache_clear();
+
+  if (db_profile.stats)
+    {
+      for (i = 0; i < DB_PROFILE_TEMPLATES; i++)
+	free(db_profile.stats[i].query);
+      free(db_profile.stats);
+      free(db_profile.hashes);
+      db_profile.stats = NULL;
+      db_profile.hashes = NULL;
+    }
+
   sqlite3_shutdown();
 }
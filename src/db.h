@@ -13,7 +13,8 @@ enum index_type {
   I_NONE,
   I_FIRST,
   I_LAST,
-  I_SUB
+  I_SUB,
+  I_CURSOR, // Keyset pagination, see db_query_cursor()
 };
 
 // Keep in sync with sort_clause[]
@@ -80,6 +81,18 @@ enum query_type {
 /* Magic id for media_file_info objects that are not stored in the files database table */
 #define DB_MEDIA_FILE_NON_PERSISTENT_ID 9999999
 
+/* Keep in sync with media_kind_labels[] */
+enum media_kind {
+  MEDIA_KIND_MUSIC = 1,
+  MEDIA_KIND_MOVIE = 2,
+  MEDIA_KIND_PODCAST = 4,
+  MEDIA_KIND_AUDIOBOOK = 8,
+  MEDIA_KIND_MUSICVIDEO = 32,
+  MEDIA_KIND_TVSHOW = 64,
+};
+
+#define MEDIA_KIND_ALL USHRT_MAX
+
 struct query_params {
   /* Query parameters, filled in by caller */
   enum query_type type;
@@ -96,6 +109,13 @@ struct query_params {
 
   char *filter;
 
+  // If set, only items of this media kind. Unlike the same condition in the
+  // filter, this lets album and artist queries use the group_stats table.
+  enum media_kind media_kind;
+
+  // With I_CURSOR: the cursor of the previous page, NULL for the first page
+  char *cursor;
+
   int with_disabled;
 
   /* Query results, filled in by query_start */
@@ -105,6 +125,9 @@ struct query_params {
   void *stmt;
   char buf1[32];
   char buf2[32];
+  int keyset_ncols;
+  void *queue_snapshot;
+  void *reader;
 };
 
 struct pairing_info {
@@ -113,18 +136,6 @@ struct pairing_info {
   char *guid;
 };
 
-/* Keep in sync with media_kind_labels[] */
-enum media_kind {
-  MEDIA_KIND_MUSIC = 1,
-  MEDIA_KIND_MOVIE = 2,
-  MEDIA_KIND_PODCAST = 4,
-  MEDIA_KIND_AUDIOBOOK = 8,
-  MEDIA_KIND_MUSICVIDEO = 32,
-  MEDIA_KIND_TVSHOW = 64,
-};
-
-#define MEDIA_KIND_ALL USHRT_MAX
-
 const char *
 db_media_kind_label(enum media_kind media_kind);
 
@@ -250,6 +261,13 @@ struct media_file_info {
 
   uint32_t scan_kind; /* Identifies the library_source that created/updates this item */
   char *lyrics;
+
+  /* Derived from the sort tags, so that ORDER BY can use plain memcmp() */
+  char *title_sortkey;
+  char *artist_sortkey;
+  char *album_sortkey;
+  char *album_artist_sortkey;
+  char *composer_sortkey;
 };
 
 #define mfi_offsetof(field) offsetof(struct media_file_info, field)
@@ -425,6 +443,11 @@ struct db_media_file_info {
   char *usermark;
   char *scan_kind;
   char *lyrics;
+  char *title_sortkey;
+  char *artist_sortkey;
+  char *album_sortkey;
+  char *album_artist_sortkey;
+  char *composer_sortkey;
 };
 
 #define dbmfi_offsetof(field) offsetof(struct db_media_file_info, field)
@@ -577,6 +600,9 @@ struct db_queue_add_info
 char *
 db_escape_string(const char *str); // TODO Remove this, use db_mprintf instead
 
+char *
+db_search_filter(const char *dbcol, const char *value);
+
 char *
 db_mprintf(const char *fmt, ...);
 
@@ -634,9 +660,18 @@ db_query_start(struct query_params *qp);
 void
 db_query_end(struct query_params *qp);
 
+char *
+db_query_cursor(struct query_params *qp);
+
+int
+db_query_cursor_check(struct query_params *qp);
+
 int
 db_query_fetch_file(struct db_media_file_info *dbmfi, struct query_params *qp);
 
+int
+db_query_fetch_mfi(struct media_file_info *mfi, struct query_params *qp); // Do not free mfi content
+
 int
 db_query_fetch_pl(struct db_playlist_info *dbpli, struct query_params *qp);
 
@@ -716,6 +751,9 @@ db_file_add(struct media_file_info *mfi);
 int
 db_file_update(struct media_file_info *mfi);
 
+int
+db_file_save_batch(struct media_file_info *mfis, int nmfis);
+
 void
 db_file_seek_update(int id, uint32_t seek);
 
@@ -802,6 +840,9 @@ db_groups_cleanup();
 int
 db_group_persistentid_byid(int id, int64_t *persistentid);
 
+int
+db_group_album_next_id(int id);
+
 
 /* Directories */
 int
@@ -837,6 +878,16 @@ db_directory_enable_bycookie(uint32_t cookie, const char *path);
 int
 db_directory_enable_bypath(char *path);
 
+// Sets the artwork file found in the directory by the scanner, "" if none.
+// Returns 1 if that changed the artwork of the directory, 0 if not.
+int
+db_directory_artwork_update(int id, const char *artwork_path);
+
+// Gets the artwork file of the directory, which is "" if it has none. Returns
+// -1 if unknown, e.g. if the directory hasn't been scanned.
+int
+db_directory_artwork_bypath(char *out_path, size_t len, const char *path);
+
 /* Remotes */
 int
 db_pairing_add(struct pairing_info *pi);
@@ -908,6 +959,9 @@ db_queue_add_end(struct db_queue_add_info *queue_add_info, char reshuffle, uint3
 int
 db_queue_add_next(struct db_queue_add_info *queue_add_info, struct db_queue_item *qi);
 
+// With idx_type I_SUB, only the items at position offset to offset + limit of
+// the queue (shuffled if sort is S_SHUFFLE_POS) are enumerated, and the filter
+// applies to those.
 int
 db_queue_enum_start(struct query_params *qp);
 
@@ -1020,15 +1074,78 @@ db_watch_enum_end(struct watch_enum *we);
 int
 db_watch_enum_fetchwd(struct watch_enum *we, uint32_t *wd);
 
+// Stats of a query template, see db_query_stats_get()
+#define DB_QUERY_STATS_BUCKETS 12
+
+struct db_query_stats
+{
+  char *query;
+  uint64_t count;
+  uint64_t rows;
+  uint64_t total_us;
+  uint64_t max_us;
+  uint64_t fullscan_steps;
+  uint64_t sorts;
+  uint64_t autoindexes;
+  // Number of runs by duration, bucket 0 is < 1 ms, bucket n is < 2^n ms
+  // and the last bucket has the rest
+  uint64_t histogram[DB_QUERY_STATS_BUCKETS];
+};
+
+struct db_reader_pool_stats
+{
+  int size;
+  int open;
+  int in_use;
+  uint64_t borrows;
+  uint64_t waits;
+  uint64_t wait_us_total;
+  uint64_t wait_us_max;
+  uint64_t fallbacks; // Times a thread had to use its own connection
+};
+
+enum db_backup_state
+{
+  DB_BACKUP_IDLE = 0,
+  DB_BACKUP_RUNNING,
+  DB_BACKUP_DONE,
+  DB_BACKUP_FAILED,
+};
+
+struct db_backup_status
+{
+  enum db_backup_state state;
+  int pages_total;
+  int pages_remaining;
+  time_t started;
+  time_t finished;
+};
+
 int
 db_backup(void);
 
+void
+db_backup_status_get(struct db_backup_status *status);
+
 int
 db_perthread_init(void);
 
 void
 db_perthread_deinit(void);
 
+void
+db_stmt_cache_stats(uint64_t *hits, uint64_t *misses);
+
+// Returns -1 if query profiling is not enabled in config
+int
+db_query_stats_get(struct db_query_stats **stats, int *nstats, uint64_t *dropped);
+
+void
+db_query_stats_free(struct db_query_stats *stats, int nstats);
+
+void
+db_reader_pool_stats_get(struct db_reader_pool_stats *stats);
+
 int
 db_init(char *sqlite_ext_path);
 
@@ -24,6 +24,7 @@
 
 #include "db_init.h"
 #include "logger.h"
+#include "misc.h"
 
 
 #define T_ADMIN						\
@@ -99,7 +100,12 @@
   "   channels           INTEGER DEFAULT 0,"		\
   "   usermark           INTEGER DEFAULT 0,"		\
   "   scan_kind          INTEGER DEFAULT 0,"		\
-  "   lyrics             TEXT DEFAULT NULL COLLATE DAAP"		\
+  "   lyrics             TEXT DEFAULT NULL COLLATE DAAP,"		\
+  "   title_sortkey      VARCHAR(1024) DEFAULT NULL,"		\
+  "   artist_sortkey     VARCHAR(1024) DEFAULT NULL,"		\
+  "   album_sortkey      VARCHAR(1024) DEFAULT NULL,"		\
+  "   album_artist_sortkey VARCHAR(1024) DEFAULT NULL,"		\
+  "   composer_sortkey   VARCHAR(1024) DEFAULT NULL"		\
   ");"
 
 #define T_PL					\
@@ -136,9 +142,31 @@
   "   type           INTEGER NOT NULL,"					\
   "   name           VARCHAR(1024) NOT NULL COLLATE DAAP,"		\
   "   persistentid   INTEGER NOT NULL,"					\
+  "   sortkey        VARCHAR(1024) DEFAULT NULL,"			\
   "CONSTRAINT groups_type_unique_persistentid UNIQUE (type, persistentid)" \
   ");"
 
+/* Aggregates of the enabled files in an album or artist group, per media kind,
+ * maintained by the trg_group_stats_* triggers */
+#define T_GROUP_STATS							\
+  "CREATE TABLE IF NOT EXISTS group_stats ("				\
+  "   id             INTEGER PRIMARY KEY NOT NULL,"			\
+  "   type           INTEGER NOT NULL,"					\
+  "   media_kind     INTEGER NOT NULL,"					\
+  "   persistentid   INTEGER NOT NULL,"					\
+  "   file_id        INTEGER DEFAULT NULL,"				\
+  "   track_count    INTEGER DEFAULT 0,"				\
+  "   album_count    INTEGER DEFAULT 0,"				\
+  "   song_length    INTEGER DEFAULT 0,"				\
+  "   data_kind      INTEGER DEFAULT 0,"				\
+  "   year           INTEGER DEFAULT 0,"				\
+  "   date_released  INTEGER DEFAULT 0,"				\
+  "   time_added     INTEGER DEFAULT 0,"				\
+  "   time_played    INTEGER DEFAULT 0,"				\
+  "   seek           INTEGER DEFAULT 0,"				\
+  "CONSTRAINT group_stats_unique UNIQUE (type, media_kind, persistentid)" \
+  ");"
+
 #define T_PAIRINGS					\
   "CREATE TABLE IF NOT EXISTS pairings("		\
   "   remote         VARCHAR(64) PRIMARY KEY NOT NULL,"	\
@@ -172,7 +200,8 @@
   "   disabled            INTEGER DEFAULT 0,"			\
   "   parent_id           INTEGER DEFAULT 0,"			\
   "   path                VARCHAR(4096) DEFAULT NULL,"		\
-  "   scan_kind           INTEGER DEFAULT 0"			\
+  "   scan_kind           INTEGER DEFAULT 0,"			\
+  "   artwork_path        VARCHAR(4096) DEFAULT NULL"		\
   ");"
 
 #define T_QUEUE								\
@@ -273,6 +302,7 @@ static const struct db_init_query db_init_table_queries[] =
     { T_PL,        "create table playlists" },
     { T_PLITEMS,   "create table playlistitems" },
     { T_GROUPS,    "create table groups" },
+    { T_GROUP_STATS, "create table group_stats" },
     { T_PAIRINGS,  "create table pairings" },
     { T_SPEAKERS,  "create table speakers" },
     { T_INOTIFY,   "create table inotify" },
@@ -308,7 +338,7 @@ static const struct db_init_query db_init_table_queries[] =
 
 /* Used by Q_GROUP_ALBUMS */
 #define I_SONGALBUMID				\
-  "CREATE INDEX IF NOT EXISTS idx_sali ON files(songalbumid, disabled, media_kind, album_sort, disc, track);"
+  "CREATE INDEX IF NOT EXISTS idx_sali ON files(songalbumid, disabled, media_kind, album_sortkey, disc, track);"
 
 /* Used by Q_GROUP_ARTISTS */
 #define I_STATEMKINDSARI				\
@@ -317,17 +347,17 @@ static const struct db_init_query db_init_table_queries[] =
 #define I_STATEMKINDSALI				\
   "CREATE INDEX IF NOT EXISTS idx_state_mkind_sali ON files(disabled, media_kind, songalbumid);"
 
-/* Used by Q_BROWSE_ALBUM */
+/* Used by Q_BROWSE_ALBUM and for items sorted by S_ALBUM */
 #define I_ALBUM					\
-  "CREATE INDEX IF NOT EXISTS idx_album ON files(disabled, album_sort, album, media_kind);"
+  "CREATE INDEX IF NOT EXISTS idx_album ON files(disabled, album_sortkey, album, disc, track, media_kind);"
 
-/* Used by Q_BROWSE_ARTIST */
+/* Used by Q_BROWSE_ARTIST and for items sorted by S_ARTIST */
 #define I_ALBUMARTIST				\
-  "CREATE INDEX IF NOT EXISTS idx_albumartist ON files(disabled, album_artist_sort, album_artist, media_kind);"
+  "CREATE INDEX IF NOT EXISTS idx_albumartist ON files(disabled, album_artist_sortkey, album_artist, album_sortkey, album, disc, track, media_kind);"
 
 /* Used by Q_BROWSE_COMPOSERS */
 #define I_COMPOSER				\
-  "CREATE INDEX IF NOT EXISTS idx_composer ON files(disabled, composer_sort, composer, media_kind);"
+  "CREATE INDEX IF NOT EXISTS idx_composer ON files(disabled, composer_sortkey, composer, media_kind);"
 
 /* Used by Q_BROWSE_GENRES */
 #define I_GENRE					\
@@ -335,7 +365,7 @@ static const struct db_init_query db_init_table_queries[] =
 
 /* Used by Q_PLITEMS for smart playlists */
 #define I_TITLE					\
-  "CREATE INDEX IF NOT EXISTS idx_title ON files(disabled, title_sort, media_kind);"
+  "CREATE INDEX IF NOT EXISTS idx_title ON files(disabled, title_sortkey, media_kind);"
 
 #define I_FILELIST					\
   "CREATE INDEX IF NOT EXISTS idx_filelist ON files(disabled, virtual_path, time_modified);"
@@ -364,6 +394,9 @@ static const struct db_init_query db_init_table_queries[] =
 #define I_GRP_PERSIST				\
   "CREATE INDEX IF NOT EXISTS idx_grp_persist ON groups(persistentid);"
 
+#define I_GRP_SORTKEY				\
+  "CREATE INDEX IF NOT EXISTS idx_grp_sortkey ON groups(type, sortkey, persistentid);"
+
 #define I_PAIRING				\
   "CREATE INDEX IF NOT EXISTS idx_pairingguid ON pairings(guid);"
 
@@ -373,6 +406,19 @@ static const struct db_init_query db_init_table_queries[] =
 #define I_DIR_PARENT				\
   "CREATE INDEX IF NOT EXISTS idx_dir_parentid ON directories(parent_id);"
 
+#define I_DIR_PATH				\
+  "CREATE INDEX IF NOT EXISTS idx_dir_path ON directories(path);"
+
+/* Used by the purge after a scan to visit only the rows the scan didn't touch */
+#define I_FILE_SCAN				\
+  "CREATE INDEX IF NOT EXISTS idx_file_scan ON files(db_timestamp, scan_kind);"
+
+#define I_PL_SCAN				\
+  "CREATE INDEX IF NOT EXISTS idx_pl_scan ON playlists(db_timestamp, scan_kind);"
+
+#define I_DIR_SCAN				\
+  "CREATE INDEX IF NOT EXISTS idx_dir_scan ON directories(db_timestamp, scan_kind);"
+
 #define I_QUEUE_POS				\
   "CREATE INDEX IF NOT EXISTS idx_queue_pos ON queue(pos);"
 
@@ -405,11 +451,17 @@ static const struct db_init_query db_init_index_queries[] =
     { I_PLITEMID,  "create playlist id index" },
 
     { I_GRP_PERSIST, "create groups persistentid index" },
+    { I_GRP_SORTKEY, "create groups sortkey index" },
 
     { I_PAIRING,   "create pairing guid index" },
 
     { I_DIR_VPATH,   "create directories disabled_virtualpath index" },
     { I_DIR_PARENT,  "create directories parentid index" },
+    { I_DIR_PATH,    "create directories path index" },
+
+    { I_FILE_SCAN,  "create file scan index" },
+    { I_PL_SCAN,    "create playlist scan index" },
+    { I_DIR_SCAN,   "create directories scan index" },
 
     { I_QUEUE_POS,  "create queue pos index" },
     { I_QUEUE_SHUFFLEPOS,  "create queue shuffle pos index" },
@@ -418,27 +470,204 @@ static const struct db_init_query db_init_index_queries[] =
 
 /* Triggers must be prefixed with trg_ for db_drop_triggers() to id them */
 
+/* The sort key of a group is the one of the file that was last added to it or
+ * changed, groups are paged by it (see keyset_clause in db.c) */
 #define TRG_GROUPS_INSERT										\
   "CREATE TRIGGER trg_groups_insert AFTER INSERT ON files FOR EACH ROW"					\
   " BEGIN"												\
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (1, NEW.album, NEW.songalbumid);"	\
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (2, NEW.album_artist, NEW.songartistid);"	\
+  "   UPDATE groups SET sortkey = NEW.album_sortkey"							\
+  "     WHERE type = 1 AND persistentid = NEW.songalbumid AND sortkey IS NOT NEW.album_sortkey;"	\
+  "   UPDATE groups SET sortkey = NEW.album_artist_sortkey"						\
+  "     WHERE type = 2 AND persistentid = NEW.songartistid AND sortkey IS NOT NEW.album_artist_sortkey;"	\
   " END;"
 
 #define TRG_GROUPS_UPDATE										\
-  "CREATE TRIGGER trg_groups_update AFTER UPDATE OF songartistid, songalbumid ON files FOR EACH ROW"	\
+  "CREATE TRIGGER trg_groups_update AFTER UPDATE OF songartistid, songalbumid, album_sortkey, album_artist_sortkey ON files FOR EACH ROW"	\
   " BEGIN"												\
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (1, NEW.album, NEW.songalbumid);"	\
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (2, NEW.album_artist, NEW.songartistid);"	\
+  "   UPDATE groups SET sortkey = NEW.album_sortkey"							\
+  "     WHERE type = 1 AND persistentid = NEW.songalbumid AND sortkey IS NOT NEW.album_sortkey;"	\
+  "   UPDATE groups SET sortkey = NEW.album_artist_sortkey"						\
+  "     WHERE type = 2 AND persistentid = NEW.songartistid AND sortkey IS NOT NEW.album_artist_sortkey;"	\
+  " END;"
+
+/* The group_stats triggers take out the contribution of the old row and add
+ * the new one. Sums are adjusted directly, while min/max values and the
+ * representative file are only looked up again if the old row held them. The
+ * lookups exclude the row itself, so they also work for the AFTER UPDATE case.
+ * Updates that don't move the file to another group (e.g. time_played after
+ * playback) only adjust the values, without the count lookups.
+ * R is OLD or NEW, T the group type and ID the files column with its id.
+ */
+#define GROUP_STATS_FILES(R, ID)									\
+  " FROM files WHERE " ID " = " R "." ID " AND disabled = 0 AND media_kind = " R ".media_kind AND id <> " R ".id"
+
+#define GROUP_STATS_ALBUMS(R)										\
+  " NOT EXISTS (SELECT 1" GROUP_STATS_FILES(R, "songalbumid") " AND songartistid = " R ".songartistid)"
+
+#define GROUP_STATS_REMOVE(T, ID, ALBUM_COUNT)								\
+  "   UPDATE group_stats SET"										\
+  "     track_count = track_count - 1,"									\
+  "     album_count = " ALBUM_COUNT ","									\
+  "     song_length = song_length - OLD.song_length,"							\
+  "     file_id = CASE WHEN file_id <> OLD.id THEN file_id ELSE (SELECT MAX(id)" GROUP_STATS_FILES("OLD", ID) ") END,"	\
+  "     data_kind = CASE WHEN OLD.data_kind > data_kind THEN data_kind ELSE IFNULL((SELECT MIN(data_kind)" GROUP_STATS_FILES("OLD", ID) "), 0) END,"	\
+  "     year = CASE WHEN OLD.year < year THEN year ELSE IFNULL((SELECT MAX(year)" GROUP_STATS_FILES("OLD", ID) "), 0) END,"	\
+  "     date_released = CASE WHEN OLD.date_released < date_released THEN date_released ELSE IFNULL((SELECT MAX(date_released)" GROUP_STATS_FILES("OLD", ID) "), 0) END,"	\
+  "     time_added = CASE WHEN OLD.time_added < time_added THEN time_added ELSE IFNULL((SELECT MAX(time_added)" GROUP_STATS_FILES("OLD", ID) "), 0) END,"	\
+  "     time_played = CASE WHEN OLD.time_played < time_played THEN time_played ELSE IFNULL((SELECT MAX(time_played)" GROUP_STATS_FILES("OLD", ID) "), 0) END,"	\
+  "     seek = CASE WHEN OLD.seek < seek THEN seek ELSE IFNULL((SELECT MAX(seek)" GROUP_STATS_FILES("OLD", ID) "), 0) END"	\
+  "   WHERE type = " T " AND media_kind = OLD.media_kind AND persistentid = OLD." ID " AND OLD.disabled = 0;"
+
+#define GROUP_STATS_ADD(T, ID, ALBUM_COUNT)								\
+  "   INSERT OR IGNORE INTO group_stats (type, media_kind, persistentid)"				\
+  "     SELECT " T ", NEW.media_kind, NEW." ID " WHERE NEW.disabled = 0;"				\
+  "   UPDATE group_stats SET"										\
+  "     track_count = track_count + 1,"									\
+  "     album_count = " ALBUM_COUNT ","									\
+  "     song_length = song_length + NEW.song_length,"							\
+  "     file_id = CASE WHEN track_count > 0 THEN file_id ELSE NEW.id END,"				\
+  "     data_kind = CASE WHEN track_count > 0 AND data_kind < NEW.data_kind THEN data_kind ELSE NEW.data_kind END,"	\
+  "     year = MAX(year, NEW.year),"									\
+  "     date_released = MAX(date_released, NEW.date_released),"						\
+  "     time_added = MAX(time_added, NEW.time_added),"							\
+  "     time_played = MAX(time_played, NEW.time_played),"						\
+  "     seek = MAX(seek, NEW.seek)"									\
+  "   WHERE type = " T " AND media_kind = NEW.media_kind AND persistentid = NEW." ID " AND NEW.disabled = 0;"
+
+#define GROUP_STATS_MAX(C, ID)										\
+  "CASE WHEN NEW." C " >= " C " THEN NEW." C " WHEN OLD." C " < " C " THEN " C				\
+  " ELSE MAX(NEW." C ", IFNULL((SELECT MAX(" C ")" GROUP_STATS_FILES("NEW", ID) "), 0)) END"
+
+#define GROUP_STATS_VALUES(T, ID)									\
+  "   UPDATE group_stats SET"										\
+  "     song_length = song_length - OLD.song_length + NEW.song_length,"				\
+  "     data_kind = CASE WHEN NEW.data_kind <= data_kind THEN NEW.data_kind WHEN OLD.data_kind > data_kind THEN data_kind"	\
+  "       ELSE MIN(NEW.data_kind, IFNULL((SELECT MIN(data_kind)" GROUP_STATS_FILES("NEW", ID) "), NEW.data_kind)) END,"	\
+  "     year = " GROUP_STATS_MAX("year", ID) ","							\
+  "     date_released = " GROUP_STATS_MAX("date_released", ID) ","					\
+  "     time_added = " GROUP_STATS_MAX("time_added", ID) ","						\
+  "     time_played = " GROUP_STATS_MAX("time_played", ID) ","						\
+  "     seek = " GROUP_STATS_MAX("seek", ID)								\
+  "   WHERE type = " T " AND media_kind = NEW.media_kind AND persistentid = NEW." ID ";"
+
+#define TRG_GROUP_STATS_INSERT										\
+  "CREATE TRIGGER trg_group_stats_insert AFTER INSERT ON files FOR EACH ROW WHEN NEW.disabled = 0"	\
+  " BEGIN"												\
+  GROUP_STATS_ADD("1", "songalbumid", "1")								\
+  GROUP_STATS_ADD("2", "songartistid", "album_count +" GROUP_STATS_ALBUMS("NEW"))			\
+  " END;"
+
+#define TRG_GROUP_STATS_DELETE										\
+  "CREATE TRIGGER trg_group_stats_delete AFTER DELETE ON files FOR EACH ROW WHEN OLD.disabled = 0"	\
+  " BEGIN"												\
+  GROUP_STATS_REMOVE("1", "songalbumid", "album_count")							\
+  GROUP_STATS_REMOVE("2", "songartistid", "album_count -" GROUP_STATS_ALBUMS("OLD"))			\
+  " END;"
+
+#define TRG_GROUP_STATS_UPDATE										\
+  "CREATE TRIGGER trg_group_stats_update AFTER UPDATE OF disabled, media_kind, songalbumid, songartistid ON files FOR EACH ROW"	\
+  " WHEN (OLD.disabled = 0 OR NEW.disabled = 0) AND (OLD.disabled <> NEW.disabled"			\
+  "   OR OLD.media_kind <> NEW.media_kind OR OLD.songalbumid <> NEW.songalbumid OR OLD.songartistid <> NEW.songartistid)"	\
+  " BEGIN"												\
+  GROUP_STATS_REMOVE("1", "songalbumid", "album_count")							\
+  GROUP_STATS_REMOVE("2", "songartistid", "album_count -" GROUP_STATS_ALBUMS("OLD"))			\
+  GROUP_STATS_ADD("1", "songalbumid", "1")								\
+  GROUP_STATS_ADD("2", "songartistid", "album_count +" GROUP_STATS_ALBUMS("NEW"))			\
+  " END;"
+
+#define TRG_GROUP_STATS_VALUES										\
+  "CREATE TRIGGER trg_group_stats_values AFTER UPDATE OF"						\
+  " song_length, data_kind, year, date_released, time_added, time_played, seek ON files FOR EACH ROW"	\
+  " WHEN OLD.disabled = 0 AND NEW.disabled = 0 AND OLD.media_kind = NEW.media_kind"			\
+  "   AND OLD.songalbumid = NEW.songalbumid AND OLD.songartistid = NEW.songartistid"			\
+  "   AND (OLD.song_length <> NEW.song_length OR OLD.data_kind <> NEW.data_kind OR OLD.year <> NEW.year"	\
+  "   OR OLD.date_released <> NEW.date_released OR OLD.time_added <> NEW.time_added"			\
+  "   OR OLD.time_played <> NEW.time_played OR OLD.seek <> NEW.seek)"					\
+  " BEGIN"												\
+  GROUP_STATS_VALUES("1", "songalbumid")								\
+  GROUP_STATS_VALUES("2", "songartistid")								\
   " END;"
 
 static const struct db_init_query db_init_trigger_queries[] =
   {
     { TRG_GROUPS_INSERT,           "create trigger trg_groups_insert" },
     { TRG_GROUPS_UPDATE,           "create trigger trg_groups_update" },
+    { TRG_GROUP_STATS_INSERT,      "create trigger trg_group_stats_insert" },
+    { TRG_GROUP_STATS_DELETE,      "create trigger trg_group_stats_delete" },
+    { TRG_GROUP_STATS_UPDATE,      "create trigger trg_group_stats_update" },
+    { TRG_GROUP_STATS_VALUES,      "create trigger trg_group_stats_values" },
   };
 
 
+/* The search index is a contentless FTS5 table with the trigram tokenizer. The
+ * values are folded with daap_fold() from our sqlite extension, so that a
+ * phrase match gives the same result as our case and diacritics insensitive
+ * LIKE '%...%'. The index is optional, since it requires SQLite 3.34 with FTS5,
+ * so it is not part of the schema version, but maintained by
+ * db_init_search_index(). */
+
+#define T_FILES_FTS							\
+  "CREATE VIRTUAL TABLE IF NOT EXISTS files_fts USING fts5("		\
+  "   title, artist, album, album_artist, composer, genre,"		\
+  "   content='', tokenize='trigram'"					\
+  ");"
+
+#define Q_FILES_FTS_CHECK						\
+  "SELECT COUNT(*) FROM files_fts WHERE rowid = 0;"
+
+#define Q_FILES_FTS_CLEAR						\
+  "INSERT INTO files_fts (files_fts) VALUES ('delete-all');"
+
+#define Q_FILES_FTS_FILL						\
+  "INSERT INTO files_fts (rowid, title, artist, album, album_artist, composer, genre)"	\
+  "  SELECT id, daap_fold(title), daap_fold(artist), daap_fold(album), daap_fold(album_artist), daap_fold(composer), daap_fold(genre) FROM files;"
+
+#define TRG_FILES_FTS_INSERT						\
+  "CREATE TRIGGER IF NOT EXISTS trg_files_fts_insert AFTER INSERT ON files FOR EACH ROW"	\
+  " BEGIN"								\
+  "   INSERT INTO files_fts (rowid, title, artist, album, album_artist, composer, genre)"	\
+  "     VALUES (NEW.id, daap_fold(NEW.title), daap_fold(NEW.artist), daap_fold(NEW.album), daap_fold(NEW.album_artist), daap_fold(NEW.composer), daap_fold(NEW.genre));"	\
+  " END;"
+
+#define TRG_FILES_FTS_DELETE						\
+  "CREATE TRIGGER IF NOT EXISTS trg_files_fts_delete AFTER DELETE ON files FOR EACH ROW"	\
+  " BEGIN"								\
+  "   INSERT INTO files_fts (files_fts, rowid, title, artist, album, album_artist, composer, genre)"	\
+  "     VALUES ('delete', OLD.id, daap_fold(OLD.title), daap_fold(OLD.artist), daap_fold(OLD.album), daap_fold(OLD.album_artist), daap_fold(OLD.composer), daap_fold(OLD.genre));"	\
+  " END;"
+
+#define TRG_FILES_FTS_UPDATE						\
+  "CREATE TRIGGER IF NOT EXISTS trg_files_fts_update AFTER UPDATE OF title, artist, album, album_artist, composer, genre ON files FOR EACH ROW"	\
+  " BEGIN"								\
+  "   INSERT INTO files_fts (files_fts, rowid, title, artist, album, album_artist, composer, genre)"	\
+  "     VALUES ('delete', OLD.id, daap_fold(OLD.title), daap_fold(OLD.artist), daap_fold(OLD.album), daap_fold(OLD.album_artist), daap_fold(OLD.composer), daap_fold(OLD.genre));"	\
+  "   INSERT INTO files_fts (rowid, title, artist, album, album_artist, composer, genre)"	\
+  "     VALUES (NEW.id, daap_fold(NEW.title), daap_fold(NEW.artist), daap_fold(NEW.album), daap_fold(NEW.album_artist), daap_fold(NEW.composer), daap_fold(NEW.genre));"	\
+  " END;"
+
+#define Q_FILES_FTS_TRG_COUNT						\
+  "SELECT COUNT(*) FROM sqlite_master WHERE type = 'trigger' AND name IN ('trg_files_fts_insert', 'trg_files_fts_delete', 'trg_files_fts_update');"
+
+#define Q_FILES_FTS_TRG_DROP						\
+  "DROP TRIGGER IF EXISTS trg_files_fts_insert;"			\
+  "DROP TRIGGER IF EXISTS trg_files_fts_delete;"			\
+  "DROP TRIGGER IF EXISTS trg_files_fts_update;"
+
+static const struct db_init_query db_init_search_index_queries[] =
+  {
+    { T_FILES_FTS,          "create table files_fts" },
+    { Q_FILES_FTS_CHECK,    "check files_fts" },
+    { Q_FILES_FTS_CLEAR,    "clear files_fts" },
+    { Q_FILES_FTS_FILL,     "fill files_fts" },
+    { TRG_FILES_FTS_INSERT, "create trigger trg_files_fts_insert" },
+    { TRG_FILES_FTS_DELETE, "create trigger trg_files_fts_delete" },
+    { TRG_FILES_FTS_UPDATE, "create trigger trg_files_fts_update" },
+  };
+
 int
 db_init_indices(sqlite3 *hdl)
 {
@@ -550,3 +779,87 @@ db_init_tables(sqlite3 *hdl)
   return ret;
 }
 
+
+static int
+search_index_triggers_count(sqlite3 *hdl)
+{
+  sqlite3_stmt *stmt;
+  int ret;
+
+  ret = sqlite3_prepare_v2(hdl, Q_FILES_FTS_TRG_COUNT, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    return -1;
+
+  ret = sqlite3_step(stmt);
+  if (ret == SQLITE_ROW)
+    ret = sqlite3_column_int(stmt, 0);
+  else
+    ret = -1;
+
+  sqlite3_finalize(stmt);
+  return ret;
+}
+
+/* Creates and fills the search index if it doesn't exist or if the triggers
+ * that keep it updated are missing (e.g. because they were dropped by a schema
+ * upgrade). Returns -1 if SQLite doesn't support the index, in which case any
+ * leftover triggers are dropped, so that changes to files don't fail. */
+int
+db_init_search_index(sqlite3 *hdl)
+{
+  char *errmsg;
+  int i;
+  int ret;
+
+  // Index is in place if all three triggers exist
+  ret = search_index_triggers_count(hdl);
+  if (ret == 3)
+    {
+      ret = sqlite3_exec(hdl, Q_FILES_FTS_CHECK, NULL, NULL, &errmsg);
+      if (ret == SQLITE_OK)
+	return 0;
+
+      DPRINTF(E_LOG, L_DB, "Search index is not usable: %s\n", errmsg);
+      sqlite3_free(errmsg);
+      goto error;
+    }
+
+  DPRINTF(E_LOG, L_DB, "Building search index, this may take some time...\n");
+
+  ret = sqlite3_exec(hdl, "BEGIN TRANSACTION;", NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "DB error while running 'BEGIN TRANSACTION': %s\n", errmsg);
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  for (i = 0; i < ARRAY_SIZE(db_init_search_index_queries); i++)
+    {
+      DPRINTF(E_DBG, L_DB, "DB init search index query: %s\n", db_init_search_index_queries[i].desc);
+
+      ret = sqlite3_exec(hdl, db_init_search_index_queries[i].query, NULL, NULL, &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not %s: %s\n", db_init_search_index_queries[i].desc, errmsg);
+	  sqlite3_free(errmsg);
+	  sqlite3_exec(hdl, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
+	  goto error;
+	}
+    }
+
+  ret = sqlite3_exec(hdl, "COMMIT TRANSACTION;", NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "DB error while running 'COMMIT TRANSACTION': %s\n", errmsg);
+      sqlite3_free(errmsg);
+      sqlite3_exec(hdl, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
+      goto error;
+    }
+
+  return 0;
+
+ error:
+  sqlite3_exec(hdl, Q_FILES_FTS_TRG_DROP, NULL, NULL, NULL);
+  return -1;
+}
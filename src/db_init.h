@@ -26,7 +26,7 @@
  * is a major upgrade. In other words minor version upgrades permit downgrading
  * the server after the database was upgraded. */
 #define SCHEMA_VERSION_MAJOR 22
-#define SCHEMA_VERSION_MINOR 3
+#define SCHEMA_VERSION_MINOR 10
 
 int
 db_init_indices(sqlite3 *hdl);
@@ -37,4 +37,7 @@ db_init_triggers(sqlite3 *hdl);
 int
 db_init_tables(sqlite3 *hdl);
 
+int
+db_init_search_index(sqlite3 *hdl);
+
 #endif /* SRC_DB_INIT_H_ */
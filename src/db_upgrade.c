@@ -1284,6 +1284,200 @@ static const struct db_upgrade_query db_upgrade_v2203_queries[] =
   };
 
 
+/* ---------------------------- 22.03 -> 22.04 ------------------------------ */
+
+#define U_v2204_ALTER_FILES_ADD_TITLE_SORTKEY \
+  "ALTER TABLE files ADD COLUMN title_sortkey VARCHAR(1024) DEFAULT NULL;"
+#define U_v2204_ALTER_FILES_ADD_ARTIST_SORTKEY \
+  "ALTER TABLE files ADD COLUMN artist_sortkey VARCHAR(1024) DEFAULT NULL;"
+#define U_v2204_ALTER_FILES_ADD_ALBUM_SORTKEY \
+  "ALTER TABLE files ADD COLUMN album_sortkey VARCHAR(1024) DEFAULT NULL;"
+#define U_v2204_ALTER_FILES_ADD_ALBUM_ARTIST_SORTKEY \
+  "ALTER TABLE files ADD COLUMN album_artist_sortkey VARCHAR(1024) DEFAULT NULL;"
+#define U_v2204_ALTER_FILES_ADD_COMPOSER_SORTKEY \
+  "ALTER TABLE files ADD COLUMN composer_sortkey VARCHAR(1024) DEFAULT NULL;"
+
+// daap_sortkey() is registered by db.c
+#define U_v2204_FILES_SET_SORTKEYS \
+  "UPDATE files SET title_sortkey = daap_sortkey(title_sort), artist_sortkey = daap_sortkey(artist_sort)," \
+  " album_sortkey = daap_sortkey(album_sort), album_artist_sortkey = daap_sortkey(album_artist_sort)," \
+  " composer_sortkey = daap_sortkey(composer_sort);"
+
+#define U_v2204_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2204_SCVER_MINOR                    \
+  "UPDATE admin SET value = '04' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2204_queries[] =
+  {
+    { U_v2204_ALTER_FILES_ADD_TITLE_SORTKEY, "alter table files add column title_sortkey" },
+    { U_v2204_ALTER_FILES_ADD_ARTIST_SORTKEY, "alter table files add column artist_sortkey" },
+    { U_v2204_ALTER_FILES_ADD_ALBUM_SORTKEY, "alter table files add column album_sortkey" },
+    { U_v2204_ALTER_FILES_ADD_ALBUM_ARTIST_SORTKEY, "alter table files add column album_artist_sortkey" },
+    { U_v2204_ALTER_FILES_ADD_COMPOSER_SORTKEY, "alter table files add column composer_sortkey" },
+    { U_v2204_FILES_SET_SORTKEYS, "update table files set sort keys" },
+
+    { U_v2204_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2204_SCVER_MINOR,    "set schema_version_minor to 04" },
+  };
+
+
+/* ---------------------------- 22.04 -> 22.05 ------------------------------ */
+
+#define U_v2205_CREATE_TABLE_GROUP_STATS \
+  "CREATE TABLE IF NOT EXISTS group_stats ("				\
+  "   id             INTEGER PRIMARY KEY NOT NULL,"			\
+  "   type           INTEGER NOT NULL,"					\
+  "   media_kind     INTEGER NOT NULL,"					\
+  "   persistentid   INTEGER NOT NULL,"					\
+  "   file_id        INTEGER DEFAULT NULL,"				\
+  "   track_count    INTEGER DEFAULT 0,"				\
+  "   album_count    INTEGER DEFAULT 0,"				\
+  "   song_length    INTEGER DEFAULT 0,"				\
+  "   data_kind      INTEGER DEFAULT 0,"				\
+  "   year           INTEGER DEFAULT 0,"				\
+  "   date_released  INTEGER DEFAULT 0,"				\
+  "   time_added     INTEGER DEFAULT 0,"				\
+  "   time_played    INTEGER DEFAULT 0,"				\
+  "   seek           INTEGER DEFAULT 0,"				\
+  "CONSTRAINT group_stats_unique UNIQUE (type, media_kind, persistentid)" \
+  ");"
+
+// After this the table is maintained by the triggers, which are created after the upgrade
+#define U_v2205_GROUP_STATS_ALBUMS \
+  "INSERT INTO group_stats (type, media_kind, persistentid, file_id, track_count, album_count, song_length," \
+  " data_kind, year, date_released, time_added, time_played, seek)" \
+  " SELECT 1, media_kind, songalbumid, MAX(id), COUNT(id), 1, SUM(song_length), MIN(data_kind), MAX(year)," \
+  " MAX(date_released), MAX(time_added), MAX(time_played), MAX(seek)" \
+  " FROM files WHERE disabled = 0 GROUP BY media_kind, songalbumid;"
+#define U_v2205_GROUP_STATS_ARTISTS \
+  "INSERT INTO group_stats (type, media_kind, persistentid, file_id, track_count, album_count, song_length," \
+  " data_kind, year, date_released, time_added, time_played, seek)" \
+  " SELECT 2, media_kind, songartistid, MAX(id), COUNT(id), COUNT(DISTINCT songalbumid), SUM(song_length), MIN(data_kind), MAX(year)," \
+  " MAX(date_released), MAX(time_added), MAX(time_played), MAX(seek)" \
+  " FROM files WHERE disabled = 0 GROUP BY media_kind, songartistid;"
+
+#define U_v2205_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2205_SCVER_MINOR                    \
+  "UPDATE admin SET value = '05' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2205_queries[] =
+  {
+    { U_v2205_CREATE_TABLE_GROUP_STATS, "create table group_stats" },
+    { U_v2205_GROUP_STATS_ALBUMS, "fill album group_stats" },
+    { U_v2205_GROUP_STATS_ARTISTS, "fill artist group_stats" },
+
+    { U_v2205_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2205_SCVER_MINOR,    "set schema_version_minor to 05" },
+  };
+
+
+/* ---------------------------- 22.05 -> 22.06 ------------------------------ */
+
+// Only bumps the version so the new purge indices are created
+
+#define U_v2206_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2206_SCVER_MINOR                    \
+  "UPDATE admin SET value = '06' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2206_queries[] =
+  {
+    { U_v2206_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2206_SCVER_MINOR,    "set schema_version_minor to 06" },
+  };
+
+
+/* ---------------------------- 22.06 -> 22.07 ------------------------------ */
+
+// NULL means the directory hasn't been scanned for artwork yet
+#define U_v2207_ALTER_DIRECTORIES_ADD_ARTWORK_PATH \
+  "ALTER TABLE directories ADD COLUMN artwork_path VARCHAR(4096) DEFAULT NULL;"
+
+#define U_v2207_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2207_SCVER_MINOR                    \
+  "UPDATE admin SET value = '07' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2207_queries[] =
+  {
+    { U_v2207_ALTER_DIRECTORIES_ADD_ARTWORK_PATH, "alter table directories add column artwork_path" },
+
+    { U_v2207_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2207_SCVER_MINOR,    "set schema_version_minor to 07" },
+  };
+
+
+/* ---------------------------- 22.07 -> 22.08 ------------------------------ */
+
+#define U_v2208_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2208_SCVER_MINOR                    \
+  "UPDATE admin SET value = '08' WHERE key = 'schema_version_minor';"
+
+// This upgrade just changes triggers (will be done automatically by db_drop...)
+static const struct db_upgrade_query db_upgrade_v2208_queries[] =
+  {
+    { U_v2208_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2208_SCVER_MINOR,    "set schema_version_minor to 08" },
+  };
+
+
+/* ---------------------------- 22.08 -> 22.09 ------------------------------ */
+
+#define U_v2209_ALTER_GROUPS_ADD_SORTKEY \
+  "ALTER TABLE groups ADD COLUMN sortkey VARCHAR(1024) DEFAULT NULL;"
+
+// The indices are dropped during the upgrade, so the keys are collected in a
+// table with a primary key first instead of looking up the files of each group
+#define U_v2209_CREATE_TABLE_GROUP_SORTKEYS \
+  "CREATE TEMP TABLE group_sortkeys (type INTEGER, persistentid INTEGER, sortkey, PRIMARY KEY (type, persistentid));"
+#define U_v2209_GROUP_SORTKEYS_ALBUMS \
+  "INSERT INTO group_sortkeys SELECT 1, songalbumid, MIN(album_sortkey) FROM files GROUP BY songalbumid;"
+#define U_v2209_GROUP_SORTKEYS_ARTISTS \
+  "INSERT INTO group_sortkeys SELECT 2, songartistid, MIN(album_artist_sortkey) FROM files GROUP BY songartistid;"
+#define U_v2209_GROUPS_SET_SORTKEY \
+  "UPDATE groups SET sortkey = (SELECT k.sortkey FROM group_sortkeys k WHERE k.type = groups.type AND k.persistentid = groups.persistentid);"
+#define U_v2209_DROP_TABLE_GROUP_SORTKEYS \
+  "DROP TABLE group_sortkeys;"
+
+#define U_v2209_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2209_SCVER_MINOR                    \
+  "UPDATE admin SET value = '09' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2209_queries[] =
+  {
+    { U_v2209_ALTER_GROUPS_ADD_SORTKEY, "alter table groups add column sortkey" },
+    { U_v2209_CREATE_TABLE_GROUP_SORTKEYS, "create temp table group_sortkeys" },
+    { U_v2209_GROUP_SORTKEYS_ALBUMS, "fill album group_sortkeys" },
+    { U_v2209_GROUP_SORTKEYS_ARTISTS, "fill artist group_sortkeys" },
+    { U_v2209_GROUPS_SET_SORTKEY, "update table groups set sortkey" },
+    { U_v2209_DROP_TABLE_GROUP_SORTKEYS, "drop temp table group_sortkeys" },
+
+    { U_v2209_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2209_SCVER_MINOR,    "set schema_version_minor to 09" },
+  };
+
+
+/* ---------------------------- 22.09 -> 22.10 ------------------------------ */
+
+// Only bumps the version so the album and album artist indices are recreated
+// with the columns of the S_ALBUM and S_ARTIST sorts
+
+#define U_v2210_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '22' WHERE key = 'schema_version_major';"
+#define U_v2210_SCVER_MINOR                    \
+  "UPDATE admin SET value = '10' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2210_queries[] =
+  {
+    { U_v2210_SCVER_MAJOR,    "set schema_version_major to 22" },
+    { U_v2210_SCVER_MINOR,    "set schema_version_minor to 10" },
+  };
+
+
 /* -------------------------- Main upgrade handler -------------------------- */
 
 int
@@ -1515,6 +1709,55 @@ db_upgrade(sqlite3 *hdl, int db_ver)
       if (ret < 0)
 	return -1;
 
+      /* FALLTHROUGH */
+
+    case 2203:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2204_queries, ARRAY_SIZE(db_upgrade_v2204_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2204:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2205_queries, ARRAY_SIZE(db_upgrade_v2205_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2205:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2206_queries, ARRAY_SIZE(db_upgrade_v2206_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2206:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2207_queries, ARRAY_SIZE(db_upgrade_v2207_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2207:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2208_queries, ARRAY_SIZE(db_upgrade_v2208_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2208:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2209_queries, ARRAY_SIZE(db_upgrade_v2209_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2209:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2210_queries, ARRAY_SIZE(db_upgrade_v2210_queries));
+      if (ret < 0)
+	return -1;
+
       /* Last case statement is the only one that ends with a break statement! */
       break;
 
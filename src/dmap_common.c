@@ -27,6 +27,7 @@
 #include "misc.h"
 #include "logger.h"
 #include "dmap_common.h"
+#include "parse_cache.h"
 #include "parsers/daap_parser.h"
 
 /* gperf static hash, dmap_fields.gperf */
@@ -213,7 +214,7 @@ dmap_add_string(struct evbuffer *evbuf, const char *tag, const char *str)
 }
 
 void
-dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int32_t intval)
+dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int64_t intval)
 {
   union {
     int32_t v_i32;
@@ -363,11 +364,12 @@ dmap_error_make(struct evbuffer *evbuf, const char *container, const char *errms
 }
 
 int
-dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags)
+dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct media_file_info *mfi, const struct dmap_field **meta, int nmeta, int sort_tags)
 {
   const struct dmap_field_map *dfm;
   const struct dmap_field *df;
-  char **strval;
+  char *strval;
+  int64_t intval;
   int32_t val;
   int want_mikd;
   int want_asdk;
@@ -434,21 +436,35 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 
       DPRINTF(E_SPAM, L_DAAP, "Investigating %s\n", df->desc);
 
-      strval = (char **) ((char *)dbmfi + dfm->mfi_offset);
+      switch (dfm->mfi_type)
+	{
+	  case DMAP_MFI_STRING:
+	    strval = *(char **) ((char *)mfi + dfm->mfi_offset);
+	    if (!strval || (*strval == '\0'))
+	      continue;
+
+	    /* Here's one exception ... codectype (ascd) is actually an integer */
+	    if (dfm == &dfm_dmap_ascd)
+	      {
+		dmap_add_literal(song, df->tag, strval, 4);
+		continue;
+	      }
+
+	    dmap_add_field(song, df, strval, 0);
+	    break;
 
-      if (!(*strval) || (**strval == '\0'))
-	continue;
+	  case DMAP_MFI_UINT32:
+	    intval = *(uint32_t *) ((char *)mfi + dfm->mfi_offset);
+	    dmap_add_field(song, df, NULL, intval);
+	    break;
 
-      /* Here's one exception ... codectype (ascd) is actually an integer */
-      if (dfm == &dfm_dmap_ascd)
-	{
-	  dmap_add_literal(song, df->tag, *strval, 4);
-	  continue;
+	  case DMAP_MFI_INT64:
+	    intval = *(int64_t *) ((char *)mfi + dfm->mfi_offset);
+	    dmap_add_field(song, df, NULL, intval);
+	    break;
 	}
 
-      dmap_add_field(song, df, *strval, 0);
-
-      DPRINTF(E_SPAM, L_DAAP, "Done with meta tag %s (%s)\n", df->desc, *strval);
+      DPRINTF(E_SPAM, L_DAAP, "Done with meta tag %s\n", df->desc);
     }
 
   /* Required for artwork in iTunes, set songartworkcount (asac) = 1 */
@@ -460,13 +476,13 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 
   if (sort_tags)
     {
-      dmap_add_string(song, "assn", dbmfi->title_sort);
-      dmap_add_string(song, "assa", dbmfi->artist_sort);
-      dmap_add_string(song, "assu", dbmfi->album_sort);
-      dmap_add_string(song, "assl", dbmfi->album_artist_sort);
+      dmap_add_string(song, "assn", mfi->title_sort);
+      dmap_add_string(song, "assa", mfi->artist_sort);
+      dmap_add_string(song, "assu", mfi->album_sort);
+      dmap_add_string(song, "assl", mfi->album_artist_sort);
 
-      if (dbmfi->composer_sort)
-	dmap_add_string(song, "assc", dbmfi->composer_sort);
+      if (mfi->composer_sort)
+	dmap_add_string(song, "assc", mfi->composer_sort);
     }
 
   val = 0;
@@ -481,17 +497,11 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
   if (want_mikd)
     {
       /* dmap.itemkind must come first */
-      ret = safe_atoi32(dbmfi->item_kind, &val);
-      if (ret < 0)
-	val = 2; /* music by default */
-      dmap_add_char(songlist, "mikd", val);
+      dmap_add_char(songlist, "mikd", mfi->item_kind);
     }
   if (want_asdk)
     {
-      ret = safe_atoi32(dbmfi->data_kind, &val);
-      if (ret < 0)
-	val = 0;
-      dmap_add_char(songlist, "asdk", val);
+      dmap_add_char(songlist, "asdk", mfi->data_kind);
     }
 
   ret = evbuffer_add_buffer(songlist, song);
@@ -584,10 +594,14 @@ char *
 dmap_query_parse_sql(const char *dmap_query)
 {
   struct daap_result result;
+  struct parse_cache_sql sql;
 
   if (!dmap_query)
     return NULL;
 
+  if (parse_cache_get(&sql, PARSE_CACHE_DAAP, dmap_query) == 0)
+    return sql.where;
+
   DPRINTF(E_SPAM, L_DAAP, "Parse DMAP query input '%s'\n", dmap_query);
 
   if (daap_lex_parse(&result, dmap_query) != 0)
@@ -598,5 +612,8 @@ dmap_query_parse_sql(const char *dmap_query)
 
   DPRINTF(E_SPAM, L_DAAP, "Parse DMAP query output '%s'\n", result.str);
 
+  sql.where = result.str;
+  parse_cache_add(PARSE_CACHE_DAAP, dmap_query, &sql);
+
   return safe_strdup(result.str);
 }
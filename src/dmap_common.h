@@ -23,10 +23,19 @@ enum dmap_type
     DMAP_TYPE_LIST    = 0x0c,
   };
 
+// How the field at mfi_offset is stored in struct media_file_info
+enum dmap_mfi_type
+  {
+    DMAP_MFI_STRING,
+    DMAP_MFI_UINT32,
+    DMAP_MFI_INT64,
+  };
+
 struct dmap_field_map {
   ssize_t mfi_offset;
   ssize_t pli_offset;
   ssize_t gri_offset;
+  enum dmap_mfi_type mfi_type;
 };
 
 struct dmap_field {
@@ -73,13 +82,13 @@ void
 dmap_add_string(struct evbuffer *evbuf, const char *tag, const char *str);
 
 void
-dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int32_t intval);
+dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int64_t intval);
 
 void
 dmap_error_make(struct evbuffer *evbuf, const char *container, const char *errmsg);
 
 int
-dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags);
+dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct media_file_info *mfi, const struct dmap_field **meta, int nmeta, int sort_tags);
 
 int
 dmap_encode_queue_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_queue_item *queue_item);
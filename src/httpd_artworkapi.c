@@ -31,13 +31,14 @@
 #include "artwork.h"
 
 static int
-request_process(struct httpd_request *hreq, uint32_t *max_w, uint32_t *max_h)
+request_process(struct httpd_request *hreq, uint32_t *max_w, uint32_t *max_h, int *format)
 {
   const char *param;
   int ret;
 
   *max_w = 0;
   *max_h = 0;
+  *format = artwork_format_negotiate(httpd_header_find(hreq->in_headers, "Accept"));
 
   param = httpd_query_value_find(hreq->query, "maxwidth");
   if (param)
@@ -65,9 +66,14 @@ response_process(struct httpd_request *hreq, int format)
     httpd_header_add(hreq->out_headers, "Content-Type", "image/png");
   else if (format == ART_FMT_JPEG)
     httpd_header_add(hreq->out_headers, "Content-Type", "image/jpeg");
+  else if (format == ART_FMT_WEBP)
+    httpd_header_add(hreq->out_headers, "Content-Type", "image/webp");
   else
     return HTTP_NOCONTENT;
 
+  // The format depends on what the client accepts
+  httpd_header_add(hreq->out_headers, "Vary", "Accept");
+
   return HTTP_OK;
 }
 
@@ -77,9 +83,10 @@ artworkapi_reply_nowplaying(struct httpd_request *hreq)
   struct player_status status;
   uint32_t max_w;
   uint32_t max_h;
+  int format;
   int ret;
 
-  ret = request_process(hreq, &max_w, &max_h);
+  ret = request_process(hreq, &max_w, &max_h, &format);
   if (ret != 0)
     return ret;
 
@@ -87,7 +94,7 @@ artworkapi_reply_nowplaying(struct httpd_request *hreq)
   if (status.status == PLAY_STOPPED)
     return HTTP_NOTFOUND;
 
-  ret = artwork_get_by_queue_item_id(hreq->out_body, status.item_id, max_w, max_h, 0);
+  ret = artwork_get_by_queue_item_id(hreq->out_body, status.item_id, max_w, max_h, format);
 
   return response_process(hreq, ret);
 }
@@ -98,9 +105,10 @@ artworkapi_reply_item(struct httpd_request *hreq)
   uint32_t max_w;
   uint32_t max_h;
   uint32_t id;
+  int format;
   int ret;
 
-  ret = request_process(hreq, &max_w, &max_h);
+  ret = request_process(hreq, &max_w, &max_h, &format);
   if (ret != 0)
     return ret;
 
@@ -108,7 +116,7 @@ artworkapi_reply_item(struct httpd_request *hreq)
   if (ret != 0)
     return HTTP_BADREQUEST;
 
-  ret = artwork_get_by_file_id(hreq->out_body, id, max_w, max_h, 0);
+  ret = artwork_get_by_file_id(hreq->out_body, id, max_w, max_h, format);
 
   return response_process(hreq, ret);
 }
@@ -119,9 +127,10 @@ artworkapi_reply_group(struct httpd_request *hreq)
   uint32_t max_w;
   uint32_t max_h;
   uint32_t id;
+  int format;
   int ret;
 
-  ret = request_process(hreq, &max_w, &max_h);
+  ret = request_process(hreq, &max_w, &max_h, &format);
   if (ret != 0)
     return ret;
 
@@ -129,7 +138,7 @@ artworkapi_reply_group(struct httpd_request *hreq)
   if (ret != 0)
     return HTTP_BADREQUEST;
 
-  ret = artwork_get_by_group_id(hreq->out_body, id, max_w, max_h, 0);
+  ret = artwork_get_by_group_id(hreq->out_body, id, max_w, max_h, format);
 
   return response_process(hreq, ret);
 }
@@ -1187,7 +1187,7 @@ static enum daap_reply_result
 daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 {
   struct query_params qp;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   struct evbuffer *song;
   struct evbuffer *songlist;
   struct daap_session *s;
@@ -1199,9 +1199,8 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
   size_t len;
   enum transcode_profile spk_profile;
   enum transcode_profile profile;
-  struct transcode_metadata_string xcode_metadata;
+  struct transcode_metadata xcode_metadata;
   struct media_quality quality = { 0 };
-  uint32_t len_ms;
   int nmeta = 0;
   int sort_headers;
   int nsongs;
@@ -1276,39 +1275,37 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
   DPRINTF(E_DBG, L_DAAP, "Speaker check of '%s' (codecs '%s') returned %d\n", hreq->user_agent, accept_codecs, spk_profile);
 
   nsongs = 0;
-  while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
+  while ((ret = db_query_fetch_mfi(&mfi, &qp)) == 0)
     {
       nsongs++;
 
       // Not sure if the is_remote path is really needed. Note that if you
       // change the below you might need to do the same in rsp_reply_playlist()
-      profile = s->is_remote ? XCODE_WAV : transcode_needed(hreq->user_agent, accept_codecs, dbmfi.codectype);
+      profile = s->is_remote ? XCODE_WAV : transcode_needed(hreq->user_agent, accept_codecs, mfi.codectype);
       if (profile == XCODE_UNKNOWN)
 	{
-	  DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", dbmfi.fname);
+	  DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", mfi.fname);
 	}
       else if (profile != XCODE_NONE)
 	{
 	  if (spk_profile != XCODE_NONE)
 	    profile = spk_profile;
 
-	  if (safe_atou32(dbmfi.song_length, &len_ms) < 0)
-	    len_ms = 3 * 60 * 1000; // just a fallback default
-
-	  safe_atoi32(dbmfi.samplerate, &quality.sample_rate);
-	  safe_atoi32(dbmfi.bits_per_sample, &quality.bits_per_sample);
-	  safe_atoi32(dbmfi.channels, &quality.channels);
+	  quality.sample_rate = mfi.samplerate;
+	  quality.bits_per_sample = mfi.bits_per_sample;
+	  quality.channels = mfi.channels;
 	  quality.bit_rate = cfg_getint(cfg_getsec(cfg, "streaming"), "bit_rate");
 
-	  transcode_metadata_strings_set(&xcode_metadata, profile, &quality, len_ms);
-	  dbmfi.type        = xcode_metadata.type;
-	  dbmfi.codectype   = xcode_metadata.codectype;
-	  dbmfi.description = xcode_metadata.description;
-	  dbmfi.file_size   = xcode_metadata.file_size;
-	  dbmfi.bitrate     = xcode_metadata.bitrate;
+	  // 3 minutes is just a fallback default
+	  transcode_metadata_set(&xcode_metadata, profile, &quality, mfi.song_length ? mfi.song_length : 3 * 60 * 1000);
+	  mfi.type        = xcode_metadata.type;
+	  mfi.codectype   = xcode_metadata.codectype;
+	  mfi.description = xcode_metadata.description;
+	  mfi.file_size   = xcode_metadata.file_size;
+	  mfi.bitrate     = xcode_metadata.bitrate;
 	}
 
-      ret = dmap_encode_file_metadata(songlist, song, &dbmfi, meta, nmeta, sort_headers);
+      ret = dmap_encode_file_metadata(songlist, song, &mfi, meta, nmeta, sort_headers);
       if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_DAAP, "Failed to encode song metadata\n");
@@ -1319,7 +1316,7 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 
       if (sort_headers)
 	{
-	  ret = daap_sort_build(sctx, dbmfi.title_sort);
+	  ret = daap_sort_build(sctx, mfi.title_sort);
 	  if (ret < 0)
 	    {
 	      DPRINTF(E_LOG, L_DAAP, "Could not add sort header to DAAP song list reply\n");
@@ -1992,6 +1989,7 @@ daap_reply_extra_data(struct httpd_request *hreq)
   int id;
   int max_w;
   int max_h;
+  int format;
   int ret;
 
   if (!hreq->backend)
@@ -2033,10 +2031,12 @@ daap_reply_extra_data(struct httpd_request *hreq)
       max_h = 0;
     }
 
+  format = artwork_format_negotiate(httpd_header_find(hreq->in_headers, "Accept"));
+
   if (strcmp(hreq->path_parts[2], "groups") == 0)
-    ret = artwork_get_by_group_id(hreq->out_body, id, max_w, max_h, 0);
+    ret = artwork_get_by_group_id(hreq->out_body, id, max_w, max_h, format);
   else if (strcmp(hreq->path_parts[2], "items") == 0)
-    ret = artwork_get_by_file_id(hreq->out_body, id, max_w, max_h, 0);
+    ret = artwork_get_by_file_id(hreq->out_body, id, max_w, max_h, format);
 
   len = evbuffer_get_length(hreq->out_body);
 
@@ -2050,6 +2050,10 @@ daap_reply_extra_data(struct httpd_request *hreq)
 	ctype = "image/jpeg";
 	break;
 
+      case ART_FMT_WEBP:
+	ctype = "image/webp";
+	break;
+
       default:
 	if (len > 0)
 	  evbuffer_drain(hreq->out_body, len);
@@ -2059,6 +2063,7 @@ daap_reply_extra_data(struct httpd_request *hreq)
 
   httpd_header_remove(hreq->out_headers, "Content-Type");
   httpd_header_add(hreq->out_headers, "Content-Type", ctype);
+  httpd_header_add(hreq->out_headers, "Vary", "Accept");
   snprintf(clen, sizeof(clen), "%ld", (long)len);
   httpd_header_add(hreq->out_headers, "Content-Length", clen);
 
@@ -41,6 +41,7 @@
 #include <time.h>
 
 #include "httpd_internal.h"
+#include "cache.h"
 #include "conffile.h"
 #include "db.h"
 #ifdef LASTFM
@@ -51,6 +52,7 @@
 #include "logger.h"
 #include "misc.h"
 #include "misc_json.h"
+#include "parse_cache.h"
 #include "player.h"
 #include "remote_pairing.h"
 #include "settings.h"
@@ -129,9 +131,8 @@ safe_json_add_int_from_string(json_object *obj, const char *key, const char *val
 }
 
 static inline void
-safe_json_add_time_from_string(json_object *obj, const char *key, const char *value)
+safe_json_add_time(json_object *obj, const char *key, uint32_t value)
 {
-  uint32_t tmp;
   time_t timestamp;
   struct tm tm;
   char result[32];
@@ -139,31 +140,38 @@ safe_json_add_time_from_string(json_object *obj, const char *key, const char *va
   if (!value)
     return;
 
-  if (safe_atou32(value, &tmp) != 0)
+  timestamp = value;
+  if (gmtime_r(&timestamp, &tm) == NULL)
     {
-      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to uint32_t: %s\n", value);
+      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to gmtime: %" PRIu32 "\n", value);
       return;
     }
 
-  if (!tmp)
+  strftime(result, sizeof(result), "%FT%TZ", &tm);
+
+  json_object_object_add(obj, key, json_object_new_string(result));
+}
+
+static inline void
+safe_json_add_time_from_string(json_object *obj, const char *key, const char *value)
+{
+  uint32_t tmp;
+
+  if (!value)
     return;
 
-  timestamp = tmp;
-  if (gmtime_r(&timestamp, &tm) == NULL)
+  if (safe_atou32(value, &tmp) != 0)
     {
-      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to gmtime: %s\n", value);
+      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to uint32_t: %s\n", value);
       return;
     }
 
-  strftime(result, sizeof(result), "%FT%TZ", &tm);
-
-  json_object_object_add(obj, key, json_object_new_string(result));
+  safe_json_add_time(obj, key, tmp);
 }
 
 static inline void
-safe_json_add_date_from_string(json_object *obj, const char *key, const char *value)
+safe_json_add_date(json_object *obj, const char *key, int64_t value)
 {
-  int64_t tmp;
   time_t timestamp;
   struct tm tm;
   char result[32];
@@ -171,25 +179,33 @@ safe_json_add_date_from_string(json_object *obj, const char *key, const char *va
   if (!value)
     return;
 
-  if (safe_atoi64(value, &tmp) != 0)
+  timestamp = value;
+  if (localtime_r(&timestamp, &tm) == NULL)
     {
-      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to int64_t: %s\n", value);
+      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to localtime: %" PRIi64 "\n", value);
       return;
     }
 
-  if (!tmp)
+  strftime(result, sizeof(result), "%F", &tm);
+
+  json_object_object_add(obj, key, json_object_new_string(result));
+}
+
+static inline void
+safe_json_add_date_from_string(json_object *obj, const char *key, const char *value)
+{
+  int64_t tmp;
+
+  if (!value)
     return;
 
-  timestamp = tmp;
-  if (localtime_r(&timestamp, &tm) == NULL)
+  if (safe_atoi64(value, &tmp) != 0)
     {
-      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to localtime: %s\n", value);
+      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to int64_t: %s\n", value);
       return;
     }
 
-  strftime(result, sizeof(result), "%F", &tm);
-
-  json_object_object_add(obj, key, json_object_new_string(result));
+  safe_json_add_date(obj, key, tmp);
 }
 
 static json_object *
@@ -285,69 +301,63 @@ album_to_json(struct db_group_info *dbgri)
 }
 
 static json_object *
-track_to_json(struct db_media_file_info *dbmfi)
+track_to_json(struct media_file_info *mfi)
 {
   json_object *item;
   char uri[100];
   char artwork_url[100];
-  int intval;
   int ret;
 
   item = json_object_new_object();
 
-  safe_json_add_int_from_string(item, "id", dbmfi->id);
-  safe_json_add_string(item, "title", dbmfi->title);
-  safe_json_add_string(item, "title_sort", dbmfi->title_sort);
-  safe_json_add_string(item, "artist", dbmfi->artist);
-  safe_json_add_string(item, "artist_sort", dbmfi->artist_sort);
-  safe_json_add_string(item, "album", dbmfi->album);
-  safe_json_add_string(item, "album_sort", dbmfi->album_sort);
-  safe_json_add_string(item, "album_id", dbmfi->songalbumid);
-  safe_json_add_string(item, "album_artist", dbmfi->album_artist);
-  safe_json_add_string(item, "album_artist_sort", dbmfi->album_artist_sort);
-  safe_json_add_string(item, "album_artist_id", dbmfi->songartistid);
-  safe_json_add_string(item, "composer", dbmfi->composer);
-  safe_json_add_string(item, "genre", dbmfi->genre);
-  safe_json_add_string(item, "comment", dbmfi->comment);
-  safe_json_add_int_from_string(item, "year", dbmfi->year);
-  safe_json_add_int_from_string(item, "track_number", dbmfi->track);
-  safe_json_add_int_from_string(item, "disc_number", dbmfi->disc);
-  safe_json_add_int_from_string(item, "length_ms", dbmfi->song_length);
-
-  safe_json_add_int_from_string(item, "rating", dbmfi->rating);
-  safe_json_add_int_from_string(item, "play_count", dbmfi->play_count);
-  safe_json_add_int_from_string(item, "skip_count", dbmfi->skip_count);
-  safe_json_add_time_from_string(item, "time_played", dbmfi->time_played);
-  safe_json_add_time_from_string(item, "time_skipped", dbmfi->time_skipped);
-  safe_json_add_time_from_string(item, "time_added", dbmfi->time_added);
-  safe_json_add_date_from_string(item, "date_released", dbmfi->date_released);
-  safe_json_add_int_from_string(item, "seek_ms", dbmfi->seek);
-
-  safe_json_add_string(item, "type", dbmfi->type);
-  safe_json_add_int_from_string(item, "samplerate", dbmfi->samplerate);
-  safe_json_add_int_from_string(item, "bitrate", dbmfi->bitrate);
-  safe_json_add_int_from_string(item, "channels", dbmfi->channels);
-  safe_json_add_int_from_string(item, "usermark", dbmfi->usermark);
-
-  ret = safe_atoi32(dbmfi->media_kind, &intval);
-  if (ret == 0)
-    safe_json_add_string(item, "media_kind", db_media_kind_label(intval));
-
-  ret = safe_atoi32(dbmfi->data_kind, &intval);
-  if (ret == 0)
-    safe_json_add_string(item, "data_kind", db_data_kind_label(intval));
-
-  safe_json_add_string(item, "path", dbmfi->path);
-
-  ret = snprintf(uri, sizeof(uri), "library:track:%s", dbmfi->id);
+  json_object_object_add(item, "id", json_object_new_int(mfi->id));
+  safe_json_add_string(item, "title", mfi->title);
+  safe_json_add_string(item, "title_sort", mfi->title_sort);
+  safe_json_add_string(item, "artist", mfi->artist);
+  safe_json_add_string(item, "artist_sort", mfi->artist_sort);
+  safe_json_add_string(item, "album", mfi->album);
+  safe_json_add_string(item, "album_sort", mfi->album_sort);
+  safe_json_add_string_from_int64(item, "album_id", mfi->songalbumid);
+  safe_json_add_string(item, "album_artist", mfi->album_artist);
+  safe_json_add_string(item, "album_artist_sort", mfi->album_artist_sort);
+  safe_json_add_string_from_int64(item, "album_artist_id", mfi->songartistid);
+  safe_json_add_string(item, "composer", mfi->composer);
+  safe_json_add_string(item, "genre", mfi->genre);
+  safe_json_add_string(item, "comment", mfi->comment);
+  json_object_object_add(item, "year", json_object_new_int(mfi->year));
+  json_object_object_add(item, "track_number", json_object_new_int(mfi->track));
+  json_object_object_add(item, "disc_number", json_object_new_int(mfi->disc));
+  json_object_object_add(item, "length_ms", json_object_new_int(mfi->song_length));
+
+  json_object_object_add(item, "rating", json_object_new_int(mfi->rating));
+  json_object_object_add(item, "play_count", json_object_new_int(mfi->play_count));
+  json_object_object_add(item, "skip_count", json_object_new_int(mfi->skip_count));
+  safe_json_add_time(item, "time_played", mfi->time_played);
+  safe_json_add_time(item, "time_skipped", mfi->time_skipped);
+  safe_json_add_time(item, "time_added", mfi->time_added);
+  safe_json_add_date(item, "date_released", mfi->date_released);
+  json_object_object_add(item, "seek_ms", json_object_new_int(mfi->seek));
+
+  safe_json_add_string(item, "type", mfi->type);
+  json_object_object_add(item, "samplerate", json_object_new_int(mfi->samplerate));
+  json_object_object_add(item, "bitrate", json_object_new_int(mfi->bitrate));
+  json_object_object_add(item, "channels", json_object_new_int(mfi->channels));
+  json_object_object_add(item, "usermark", json_object_new_int(mfi->usermark));
+
+  safe_json_add_string(item, "media_kind", db_media_kind_label(mfi->media_kind));
+  safe_json_add_string(item, "data_kind", db_data_kind_label(mfi->data_kind));
+
+  safe_json_add_string(item, "path", mfi->path);
+
+  ret = snprintf(uri, sizeof(uri), "library:track:%" PRIu32, mfi->id);
   if (ret < sizeof(uri))
     json_object_object_add(item, "uri", json_object_new_string(uri));
 
-  ret = snprintf(artwork_url, sizeof(artwork_url), "/artwork/item/%s", dbmfi->id);
+  ret = snprintf(artwork_url, sizeof(artwork_url), "/artwork/item/%" PRIu32, mfi->id);
   if (ret < sizeof(artwork_url))
     json_object_object_add(item, "artwork_url", json_object_new_string(artwork_url));
 
-  safe_json_add_string(item, "lyrics", dbmfi->lyrics);
+  safe_json_add_string(item, "lyrics", mfi->lyrics);
   return item;
 }
 
@@ -452,19 +462,23 @@ directory_to_json(struct directory_info *directory_info)
 
 
 static int
-fetch_tracks(struct query_params *query_params, json_object *items, int *total)
+fetch_tracks(struct query_params *query_params, json_object *items, int *total, char **next_cursor)
 {
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   json_object *item;
+  int nrows = 0;
   int ret;
 
   ret = db_query_start(query_params);
   if (ret < 0)
     goto error;
 
-  while ((ret = db_query_fetch_file(&dbmfi, query_params)) == 0)
+  while ((ret = db_query_fetch_mfi(&mfi, query_params)) == 0)
     {
-      item = track_to_json(&dbmfi);
+      if (next_cursor && ++nrows == query_params->limit)
+	*next_cursor = db_query_cursor(query_params);
+
+      item = track_to_json(&mfi);
       if (!item)
 	{
 	  ret = -1;
@@ -484,10 +498,11 @@ fetch_tracks(struct query_params *query_params, json_object *items, int *total)
 }
 
 static int
-fetch_artists(struct query_params *query_params, json_object *items, int *total)
+fetch_artists(struct query_params *query_params, json_object *items, int *total, char **next_cursor)
 {
   struct db_group_info dbgri;
   json_object *item;
+  int nrows = 0;
   int ret = 0;
 
   ret = db_query_start(query_params);
@@ -496,6 +511,9 @@ fetch_artists(struct query_params *query_params, json_object *items, int *total)
 
   while ((ret = db_query_fetch_group(&dbgri, query_params)) == 0)
     {
+      if (next_cursor && ++nrows == query_params->limit)
+	*next_cursor = db_query_cursor(query_params);
+
       /* Don't add item if no name (eg blank album name) */
       if (strlen(dbgri.itemname) == 0)
 	continue;
@@ -553,10 +571,11 @@ fetch_artist(bool *notfound, const char *artist_id)
 }
 
 static int
-fetch_albums(struct query_params *query_params, json_object *items, int *total)
+fetch_albums(struct query_params *query_params, json_object *items, int *total, char **next_cursor)
 {
   struct db_group_info dbgri;
   json_object *item;
+  int nrows = 0;
   int ret = 0;
 
   ret = db_query_start(query_params);
@@ -565,6 +584,9 @@ fetch_albums(struct query_params *query_params, json_object *items, int *total)
 
   while ((ret = db_query_fetch_group(&dbgri, query_params)) == 0)
     {
+      if (next_cursor && ++nrows == query_params->limit)
+	*next_cursor = db_query_cursor(query_params);
+
       /* Don't add item if no name (eg blank album name) */
       if (strlen(dbgri.itemname) == 0)
 	continue;
@@ -784,6 +806,42 @@ query_params_limit_set(struct query_params *query_params, struct httpd_request *
   return 0;
 }
 
+/* Keyset pagination for queries that support it (see db_query_cursor), must be
+ * called after query_params_limit_set() and after type, sort and order are set.
+ * The first page is requested with an empty cursor, the following with the
+ * "next_cursor" of the previous reply. Returns -2 if the cursor can't be used,
+ * which is a bad request.
+ */
+static int
+query_params_cursor_set(struct query_params *query_params, struct httpd_request *hreq)
+{
+  const char *param;
+
+  param = httpd_query_value_find(hreq->query, "cursor");
+  if (!param)
+    return 0;
+
+  if (query_params->idx_type != I_SUB || query_params->offset != 0)
+    {
+      DPRINTF(E_LOG, L_WEB, "Query parameter 'cursor' requires 'limit' and can't be combined with 'offset'\n");
+      return -2;
+    }
+
+  query_params->idx_type = I_CURSOR;
+  if (*param != '\0')
+    query_params->cursor = strdup(param);
+
+  if (db_query_cursor_check(query_params) < 0)
+    {
+      DPRINTF(E_LOG, L_WEB, "Query parameter 'cursor' is invalid or not supported for this query\n");
+      free(query_params->cursor);
+      query_params->cursor = NULL;
+      return -2;
+    }
+
+  return 0;
+}
+
 /* --------------------------- REPLY HANDLERS ------------------------------- */
 
 /*
@@ -2723,10 +2781,10 @@ jsonapi_reply_queue(struct httpd_request *hreq)
 	      end_pos = start_pos + 1;
 	    }
 
-	  if (query_params.sort == S_SHUFFLE_POS)
-	    query_params.filter = db_mprintf("shuffle_pos >= %d AND shuffle_pos < %d", start_pos, end_pos);
-	  else
-	    query_params.filter = db_mprintf("pos >= %d AND pos < %d", start_pos, end_pos);
+	  // Positions in the shuffled queue if sort is S_SHUFFLE_POS
+	  query_params.idx_type = I_SUB;
+	  query_params.offset = start_pos;
+	  query_params.limit = end_pos - start_pos;
 	}
     }
 
@@ -2940,6 +2998,7 @@ jsonapi_reply_library_artists(struct httpd_request *hreq)
   enum media_kind media_kind;
   json_object *reply;
   json_object *items;
+  char *next_cursor = NULL;
   int total;
   int ret = 0;
 
@@ -2970,28 +3029,32 @@ jsonapi_reply_library_artists(struct httpd_request *hreq)
 
   query_params.type = Q_GROUP_ARTISTS;
   query_params.sort = S_ARTIST;
+  query_params.media_kind = media_kind;
 
-  if (media_kind)
-    query_params.filter = db_mprintf("(f.media_kind = %d)", media_kind);
+  ret = query_params_cursor_set(&query_params, hreq);
+  if (ret < 0)
+    goto error;
 
-  ret = fetch_artists(&query_params, items, &total);
+  ret = fetch_artists(&query_params, items, &total, &next_cursor);
   if (ret < 0)
     goto error;
 
   json_object_object_add(reply, "total", json_object_new_int(total));
   json_object_object_add(reply, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(reply, "limit", json_object_new_int(query_params.limit));
+  safe_json_add_string(reply, "next_cursor", next_cursor);
 
   ret = evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply));
   if (ret < 0)
     DPRINTF(E_LOG, L_WEB, "browse: Couldn't add artists to response buffer.\n");
 
  error:
+  free(next_cursor);
   free_query_params(&query_params, 1);
   jparse_free(reply);
 
   if (ret < 0)
-    return HTTP_INTERNAL;
+    return (ret == -2) ? HTTP_BADREQUEST : HTTP_INTERNAL;
 
   return HTTP_OK;
 }
@@ -3036,6 +3099,7 @@ jsonapi_reply_library_artist_albums(struct httpd_request *hreq)
   const char *artist_id;
   json_object *reply;
   json_object *items;
+  char *next_cursor = NULL;
   int total;
   int ret = 0;
 
@@ -3056,10 +3120,16 @@ jsonapi_reply_library_artist_albums(struct httpd_request *hreq)
 
   query_params.type = Q_GROUP_ALBUMS;
   query_params.sort = S_ALBUM;
+
+  ret = query_params_cursor_set(&query_params, hreq);
+  if (ret < 0)
+    goto error;
+
   query_params.filter = db_mprintf("(f.songartistid = %q)", artist_id);
 
-  ret = fetch_albums(&query_params, items, &total);
+  ret = fetch_albums(&query_params, items, &total, &next_cursor);
   free(query_params.filter);
+  free(query_params.cursor);
 
   if (ret < 0)
     goto error;
@@ -3067,16 +3137,18 @@ jsonapi_reply_library_artist_albums(struct httpd_request *hreq)
   json_object_object_add(reply, "total", json_object_new_int(total));
   json_object_object_add(reply, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(reply, "limit", json_object_new_int(query_params.limit));
+  safe_json_add_string(reply, "next_cursor", next_cursor);
 
   ret = evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply));
   if (ret < 0)
     DPRINTF(E_LOG, L_WEB, "browse: Couldn't add albums to response buffer.\n");
 
  error:
+  free(next_cursor);
   jparse_free(reply);
 
   if (ret < 0)
-    return HTTP_INTERNAL;
+    return (ret == -2) ? HTTP_BADREQUEST : HTTP_INTERNAL;
 
   return HTTP_OK;
 }
@@ -3089,6 +3161,7 @@ jsonapi_reply_library_albums(struct httpd_request *hreq)
   enum media_kind media_kind;
   json_object *reply;
   json_object *items;
+  char *next_cursor = NULL;
   int total;
   int ret = 0;
 
@@ -3119,28 +3192,32 @@ jsonapi_reply_library_albums(struct httpd_request *hreq)
 
   query_params.type = Q_GROUP_ALBUMS;
   query_params.sort = S_ALBUM;
+  query_params.media_kind = media_kind;
 
-  if (media_kind)
-    query_params.filter = db_mprintf("(f.media_kind = %d)", media_kind);
+  ret = query_params_cursor_set(&query_params, hreq);
+  if (ret < 0)
+    goto error;
 
-  ret = fetch_albums(&query_params, items, &total);
+  ret = fetch_albums(&query_params, items, &total, &next_cursor);
   if (ret < 0)
     goto error;
 
   json_object_object_add(reply, "total", json_object_new_int(total));
   json_object_object_add(reply, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(reply, "limit", json_object_new_int(query_params.limit));
+  safe_json_add_string(reply, "next_cursor", next_cursor);
 
   ret = evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply));
   if (ret < 0)
     DPRINTF(E_LOG, L_WEB, "browse: Couldn't add albums to response buffer.\n");
 
  error:
+  free(next_cursor);
   free_query_params(&query_params, 1);
   jparse_free(reply);
 
   if (ret < 0)
-    return HTTP_INTERNAL;
+    return (ret == -2) ? HTTP_BADREQUEST : HTTP_INTERNAL;
 
   return HTTP_OK;
 }
@@ -3185,6 +3262,7 @@ jsonapi_reply_library_album_tracks(struct httpd_request *hreq)
   const char *album_id;
   json_object *reply;
   json_object *items;
+  char *next_cursor = NULL;
   int total;
   int ret = 0;
 
@@ -3205,10 +3283,16 @@ jsonapi_reply_library_album_tracks(struct httpd_request *hreq)
 
   query_params.type = Q_ITEMS;
   query_params.sort = S_ALBUM;
+
+  ret = query_params_cursor_set(&query_params, hreq);
+  if (ret < 0)
+    goto error;
+
   query_params.filter = db_mprintf("(f.songalbumid = %q)", album_id);
 
-  ret = fetch_tracks(&query_params, items, &total);
+  ret = fetch_tracks(&query_params, items, &total, &next_cursor);
   free(query_params.filter);
+  free(query_params.cursor);
 
   if (ret < 0)
     goto error;
@@ -3216,16 +3300,18 @@ jsonapi_reply_library_album_tracks(struct httpd_request *hreq)
   json_object_object_add(reply, "total", json_object_new_int(total));
   json_object_object_add(reply, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(reply, "limit", json_object_new_int(query_params.limit));
+  safe_json_add_string(reply, "next_cursor", next_cursor);
 
   ret = evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply));
   if (ret < 0)
     DPRINTF(E_LOG, L_WEB, "browse: Couldn't add tracks to response buffer.\n");
 
  error:
+  free(next_cursor);
   jparse_free(reply);
 
   if (ret < 0)
-    return HTTP_INTERNAL;
+    return (ret == -2) ? HTTP_BADREQUEST : HTTP_INTERNAL;
 
   return HTTP_OK;
 }
@@ -3267,7 +3353,7 @@ jsonapi_reply_library_tracks_get_byid(struct httpd_request *hreq)
 {
   struct query_params query_params;
   const char *track_id;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   json_object *reply = NULL;
   int ret = 0;
   bool notfound = false;
@@ -3286,7 +3372,7 @@ jsonapi_reply_library_tracks_get_byid(struct httpd_request *hreq)
   if (ret < 0)
     goto error;
 
-  ret = db_query_fetch_file(&dbmfi, &query_params);
+  ret = db_query_fetch_mfi(&mfi, &query_params);
   if (ret < 0)
     goto error;
   else if (ret == 1)
@@ -3297,7 +3383,7 @@ jsonapi_reply_library_tracks_get_byid(struct httpd_request *hreq)
       goto error;
     }
 
-  reply = track_to_json(&dbmfi);
+  reply = track_to_json(&mfi);
 
   ret = evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(reply));
   if (ret < 0)
@@ -3683,7 +3769,7 @@ jsonapi_reply_library_playlist_tracks(struct httpd_request *hreq)
   query_params.type = Q_PLITEMS;
   query_params.id = playlist_id;
 
-  ret = fetch_tracks(&query_params, items, &total);
+  ret = fetch_tracks(&query_params, items, &total, NULL);
   if (ret < 0)
     goto error;
 
@@ -4126,7 +4212,7 @@ jsonapi_reply_library_files(struct httpd_request *hreq)
   query_params.sort = S_VPATH;
   query_params.filter = db_mprintf("(f.directory_id = %d)", directory_id);
 
-  ret = fetch_tracks(&query_params, tracks_items, &total);
+  ret = fetch_tracks(&query_params, tracks_items, &total, NULL);
   free(query_params.filter);
 
   if (ret < 0)
@@ -4195,12 +4281,61 @@ jsonapi_reply_library_add(struct httpd_request *hreq)
   return HTTP_OK;
 }
 
+// Escapes the LIKE wildcards '%' and '_' (and the escape char) with '\', so a
+// search for "a_b" matches the literal text, like the search index does.
+// Returns a new string that must be used with ESCAPE '\'.
+static char *
+search_like_escape(const char *param_query)
+{
+  char *escaped;
+  char *ptr;
+
+  CHECK_NULL(L_WEB, escaped = malloc(2 * strlen(param_query) + 1));
+
+  for (ptr = escaped; *param_query; param_query++)
+    {
+      if (*param_query == '%' || *param_query == '_' || *param_query == '\\')
+	*ptr++ = '\\';
+      *ptr++ = *param_query;
+    }
+  *ptr = '\0';
+
+  return escaped;
+}
+
+// Returns "dbcol LIKE '%query%'" (plus media kind), narrowed down by the
+// search index if it can be used
+static char *
+search_filter(const char *dbcol, const char *param_query, enum media_kind media_kind)
+{
+  char *index_filter;
+  char *like;
+  char *filter;
+
+  index_filter = db_search_filter(dbcol, param_query);
+  like = search_like_escape(param_query);
+
+  if (index_filter && media_kind)
+    filter = db_mprintf("(%s AND %s LIKE '%%%q%%' ESCAPE '\\' AND f.media_kind = %d)", index_filter, dbcol, like, media_kind);
+  else if (index_filter)
+    filter = db_mprintf("(%s AND %s LIKE '%%%q%%' ESCAPE '\\')", index_filter, dbcol, like);
+  else if (media_kind)
+    filter = db_mprintf("(%s LIKE '%%%q%%' ESCAPE '\\' AND f.media_kind = %d)", dbcol, like, media_kind);
+  else
+    filter = db_mprintf("(%s LIKE '%%%q%%' ESCAPE '\\')", dbcol, like);
+
+  free(like);
+  free(index_filter);
+  return filter;
+}
+
 static int
 search_tracks(json_object *reply, struct httpd_request *hreq, const char *param_query, struct smartpl *smartpl_expression, enum media_kind media_kind)
 {
   json_object *type;
   json_object *items;
   struct query_params query_params;
+  char *next_cursor = NULL;
   int total;
   int ret;
 
@@ -4220,10 +4355,7 @@ search_tracks(json_object *reply, struct httpd_request *hreq, const char *param_
 
   if (param_query)
     {
-      if (media_kind)
-	query_params.filter = db_mprintf("(f.title LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.title LIKE '%%%q%%')", param_query);
+      query_params.filter = search_filter("f.title", param_query, media_kind);
     }
   else
     {
@@ -4232,21 +4364,35 @@ search_tracks(json_object *reply, struct httpd_request *hreq, const char *param_
 
       if (smartpl_expression->limit > 0)
 	{
+	  // The limit of the expression isn't a page size, so no cursor
+	  if (httpd_query_value_find(hreq->query, "cursor"))
+	    {
+	      DPRINTF(E_LOG, L_WEB, "Query parameter 'cursor' can't be combined with an expression with a limit\n");
+	      ret = -2;
+	      goto out;
+	    }
+
 	  query_params.idx_type = I_SUB;
 	  query_params.limit = smartpl_expression->limit;
 	  query_params.offset = 0;
 	}
     }
 
-  ret = fetch_tracks(&query_params, items, &total);
+  ret = query_params_cursor_set(&query_params, hreq);
+  if (ret < 0)
+    goto out;
+
+  ret = fetch_tracks(&query_params, items, &total, &next_cursor);
   if (ret < 0)
     goto out;
 
   json_object_object_add(type, "total", json_object_new_int(total));
   json_object_object_add(type, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(type, "limit", json_object_new_int(query_params.limit));
+  safe_json_add_string(type, "next_cursor", next_cursor);
 
  out:
+  free(next_cursor);
   free_query_params(&query_params, 1);
 
   return ret;
@@ -4258,6 +4404,7 @@ search_artists(json_object *reply, struct httpd_request *hreq, const char *param
   json_object *type;
   json_object *items;
   struct query_params query_params;
+  char *next_cursor = NULL;
   int total;
   int ret;
 
@@ -4281,10 +4428,7 @@ search_artists(json_object *reply, struct httpd_request *hreq, const char *param
 
   if (param_query)
     {
-      if (media_kind)
-	query_params.filter = db_mprintf("(f.album_artist LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.album_artist LIKE '%%%q%%')", param_query);
+      query_params.filter = search_filter("f.album_artist", param_query, media_kind);
     }
   else
     {
@@ -4294,21 +4438,35 @@ search_artists(json_object *reply, struct httpd_request *hreq, const char *param
 
       if (smartpl_expression->limit > 0)
 	{
+	  // The limit of the expression isn't a page size, so no cursor
+	  if (httpd_query_value_find(hreq->query, "cursor"))
+	    {
+	      DPRINTF(E_LOG, L_WEB, "Query parameter 'cursor' can't be combined with an expression with a limit\n");
+	      ret = -2;
+	      goto out;
+	    }
+
 	  query_params.idx_type = I_SUB;
 	  query_params.limit = smartpl_expression->limit;
 	  query_params.offset = 0;
 	}
     }
 
-  ret = fetch_artists(&query_params, items, &total);
+  ret = query_params_cursor_set(&query_params, hreq);
+  if (ret < 0)
+    goto out;
+
+  ret = fetch_artists(&query_params, items, &total, &next_cursor);
   if (ret < 0)
     goto out;
 
   json_object_object_add(type, "total", json_object_new_int(total));
   json_object_object_add(type, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(type, "limit", json_object_new_int(query_params.limit));
+  safe_json_add_string(type, "next_cursor", next_cursor);
 
  out:
+  free(next_cursor);
   free_query_params(&query_params, 1);
 
   return ret;
@@ -4320,6 +4478,7 @@ search_albums(json_object *reply, struct httpd_request *hreq, const char *param_
   json_object *type;
   json_object *items;
   struct query_params query_params;
+  char *next_cursor = NULL;
   int total;
   int ret;
 
@@ -4343,10 +4502,7 @@ search_albums(json_object *reply, struct httpd_request *hreq, const char *param_
 
   if (param_query)
     {
-      if (media_kind)
-	query_params.filter = db_mprintf("(f.album LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.album LIKE '%%%q%%')", param_query);
+      query_params.filter = search_filter("f.album", param_query, media_kind);
     }
   else
     {
@@ -4356,21 +4512,35 @@ search_albums(json_object *reply, struct httpd_request *hreq, const char *param_
 
       if (smartpl_expression->limit > 0)
 	{
+	  // The limit of the expression isn't a page size, so no cursor
+	  if (httpd_query_value_find(hreq->query, "cursor"))
+	    {
+	      DPRINTF(E_LOG, L_WEB, "Query parameter 'cursor' can't be combined with an expression with a limit\n");
+	      ret = -2;
+	      goto out;
+	    }
+
 	  query_params.idx_type = I_SUB;
 	  query_params.limit = smartpl_expression->limit;
 	  query_params.offset = 0;
 	}
     }
 
-  ret = fetch_albums(&query_params, items, &total);
+  ret = query_params_cursor_set(&query_params, hreq);
+  if (ret < 0)
+    goto out;
+
+  ret = fetch_albums(&query_params, items, &total, &next_cursor);
   if (ret < 0)
     goto out;
 
   json_object_object_add(type, "total", json_object_new_int(total));
   json_object_object_add(type, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(type, "limit", json_object_new_int(query_params.limit));
+  safe_json_add_string(type, "next_cursor", next_cursor);
 
  out:
+  free(next_cursor);
   free_query_params(&query_params, 1);
 
   return ret;
@@ -4405,10 +4575,7 @@ search_composers(json_object *reply, struct httpd_request *hreq, const char *par
 
   if (param_query)
     {
-      if (media_kind)
-	query_params.filter = db_mprintf("(f.composer LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.composer LIKE '%%%q%%')", param_query);
+      query_params.filter = search_filter("f.composer", param_query, media_kind);
     }
   else
     {
@@ -4467,10 +4634,7 @@ search_genres(json_object *reply, struct httpd_request *hreq, const char *param_
 
   if (param_query)
     {
-      if (media_kind)
-	query_params.filter = db_mprintf("(f.genre LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.genre LIKE '%%%q%%')", param_query);
+      query_params.filter = search_filter("f.genre", param_query, media_kind);
     }
   else
     {
@@ -4506,6 +4670,7 @@ search_playlists(json_object *reply, struct httpd_request *hreq, const char *par
   json_object *type;
   json_object *items;
   struct query_params query_params;
+  char *like;
   int total;
   int ret;
 
@@ -4525,7 +4690,9 @@ search_playlists(json_object *reply, struct httpd_request *hreq, const char *par
 
   query_params.type = Q_PL;
   query_params.sort = S_PLAYLIST;
-  query_params.filter = db_mprintf("((f.type = %d OR f.type = %d OR f.type = %d) AND f.title LIKE '%%%q%%')", PL_PLAIN, PL_SMART, PL_RSS, param_query);
+  like = search_like_escape(param_query);
+  query_params.filter = db_mprintf("((f.type = %d OR f.type = %d OR f.type = %d) AND f.title LIKE '%%%q%%' ESCAPE '\\')", PL_PLAIN, PL_SMART, PL_RSS, like);
+  free(like);
 
   ret = fetch_playlists(&query_params, items, &total);
   if (ret < 0)
@@ -4645,7 +4812,7 @@ jsonapi_reply_search(struct httpd_request *hreq)
   free_smartpl(&smartpl_expression, 1);
 
   if (ret < 0)
-    return HTTP_INTERNAL;
+    return (ret == -2) ? HTTP_BADREQUEST : HTTP_INTERNAL;
 
   return HTTP_OK;
 }
@@ -4667,6 +4834,157 @@ jsonapi_reply_library_backup(struct httpd_request *hreq)
   return HTTP_OK;
 }
 
+static int
+jsonapi_reply_library_backup_status(struct httpd_request *hreq)
+{
+  static const char *state_label[] = { "idle", "running", "done", "failed" };
+  struct db_backup_status status;
+  json_object *jreply;
+
+  db_backup_status_get(&status);
+
+  CHECK_NULL(L_WEB, jreply = json_object_new_object());
+
+  json_object_object_add(jreply, "state", json_object_new_string(state_label[status.state]));
+  json_object_object_add(jreply, "pages_total", json_object_new_int(status.pages_total));
+  json_object_object_add(jreply, "pages_remaining", json_object_new_int(status.pages_remaining));
+  safe_json_add_time(jreply, "started_at", status.started);
+  safe_json_add_time(jreply, "finished_at", status.finished);
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(jreply)));
+  jparse_free(jreply);
+
+  return HTTP_OK;
+}
+
+static int
+query_stats_total_compare(const void *a, const void *b)
+{
+  const struct db_query_stats *stats_a = a;
+  const struct db_query_stats *stats_b = b;
+
+  return (stats_a->total_us < stats_b->total_us) - (stats_a->total_us > stats_b->total_us);
+}
+
+static json_object *
+query_stats_to_json(struct db_query_stats *stats)
+{
+  json_object *item;
+  json_object *histogram;
+  int i;
+
+  item = json_object_new_object();
+
+  json_object_object_add(item, "query", json_object_new_string(stats->query));
+  json_object_object_add(item, "count", json_object_new_int64(stats->count));
+  json_object_object_add(item, "rows", json_object_new_int64(stats->rows));
+  json_object_object_add(item, "total_us", json_object_new_int64(stats->total_us));
+  json_object_object_add(item, "max_us", json_object_new_int64(stats->max_us));
+  json_object_object_add(item, "fullscan_steps", json_object_new_int64(stats->fullscan_steps));
+  json_object_object_add(item, "sorts", json_object_new_int64(stats->sorts));
+  json_object_object_add(item, "autoindexes", json_object_new_int64(stats->autoindexes));
+
+  histogram = json_object_new_array();
+  for (i = 0; i < DB_QUERY_STATS_BUCKETS; i++)
+    json_object_array_add(histogram, json_object_new_int64(stats->histogram[i]));
+  json_object_object_add(item, "histogram", histogram);
+
+  return item;
+}
+
+static int
+jsonapi_reply_metrics(struct httpd_request *hreq)
+{
+  struct db_query_stats *stats;
+  struct db_reader_pool_stats pool_stats;
+  struct parse_cache_stats parse_stats;
+  struct cache_artwork_mem_stats artwork_stats;
+  json_object *jreply;
+  json_object *jcache;
+  json_object *jpool;
+  json_object *jparse;
+  json_object *jprofile;
+  json_object *items;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t dropped;
+  int nstats;
+  int ret;
+  int i;
+
+  CHECK_NULL(L_WEB, jreply = json_object_new_object());
+
+  db_stmt_cache_stats(&hits, &misses);
+
+  jcache = json_object_new_object();
+  json_object_object_add(jcache, "hits", json_object_new_int64(hits));
+  json_object_object_add(jcache, "misses", json_object_new_int64(misses));
+  json_object_object_add(jreply, "statement_cache", jcache);
+
+  db_reader_pool_stats_get(&pool_stats);
+
+  jpool = json_object_new_object();
+  json_object_object_add(jpool, "size", json_object_new_int(pool_stats.size));
+  json_object_object_add(jpool, "open", json_object_new_int(pool_stats.open));
+  json_object_object_add(jpool, "in_use", json_object_new_int(pool_stats.in_use));
+  json_object_object_add(jpool, "borrows", json_object_new_int64(pool_stats.borrows));
+  json_object_object_add(jpool, "waits", json_object_new_int64(pool_stats.waits));
+  json_object_object_add(jpool, "wait_us_total", json_object_new_int64(pool_stats.wait_us_total));
+  json_object_object_add(jpool, "wait_us_max", json_object_new_int64(pool_stats.wait_us_max));
+  json_object_object_add(jpool, "fallbacks", json_object_new_int64(pool_stats.fallbacks));
+  json_object_object_add(jreply, "read_pool", jpool);
+
+  jparse = json_object_new_object();
+  for (i = 0; i < PARSE_CACHE_NPARSERS; i++)
+    {
+      parse_cache_stats_get(&parse_stats, i);
+
+      jcache = json_object_new_object();
+      json_object_object_add(jcache, "hits", json_object_new_int64(parse_stats.hits));
+      json_object_object_add(jcache, "misses", json_object_new_int64(parse_stats.misses));
+      json_object_object_add(jcache, "evictions", json_object_new_int64(parse_stats.evictions));
+      json_object_object_add(jcache, "entries", json_object_new_int(parse_stats.entries));
+      json_object_object_add(jparse, parse_cache_parser_label(i), jcache);
+    }
+  json_object_object_add(jreply, "parse_cache", jparse);
+
+  cache_artwork_mem_stats_get(&artwork_stats);
+
+  jcache = json_object_new_object();
+  json_object_object_add(jcache, "hits", json_object_new_int64(artwork_stats.hits));
+  json_object_object_add(jcache, "misses", json_object_new_int64(artwork_stats.misses));
+  json_object_object_add(jcache, "evictions", json_object_new_int64(artwork_stats.evictions));
+  json_object_object_add(jcache, "entries", json_object_new_int(artwork_stats.entries));
+  json_object_object_add(jcache, "size", json_object_new_int64(artwork_stats.size));
+  json_object_object_add(jcache, "max_size", json_object_new_int64(artwork_stats.max_size));
+  json_object_object_add(jreply, "artwork_memory_cache", jcache);
+
+  jprofile = json_object_new_object();
+
+  ret = db_query_stats_get(&stats, &nstats, &dropped);
+  json_object_object_add(jprofile, "enabled", json_object_new_boolean(ret == 0));
+  if (ret == 0)
+    {
+      qsort(stats, nstats, sizeof(struct db_query_stats), query_stats_total_compare);
+
+      items = json_object_new_array();
+      for (i = 0; i < nstats; i++)
+	json_object_array_add(items, query_stats_to_json(&stats[i]));
+
+      json_object_object_add(jprofile, "dropped", json_object_new_int64(dropped));
+      json_object_object_add(jprofile, "queries", items);
+
+      db_query_stats_free(stats, nstats);
+    }
+
+  json_object_object_add(jreply, "query_profile", jprofile);
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->out_body, "%s", json_object_to_json_string(jreply)));
+  jparse_free(jreply);
+
+  return HTTP_OK;
+}
+
 
 static struct httpd_uri_map adm_handlers[] =
   {
@@ -4742,6 +5060,8 @@ static struct httpd_uri_map adm_handlers[] =
     { HTTPD_METHOD_GET,    "^/api/library/files$",                         jsonapi_reply_library_files },
     { HTTPD_METHOD_POST,   "^/api/library/add$",                           jsonapi_reply_library_add },
     { HTTPD_METHOD_PUT,    "^/api/library/backup$",                        jsonapi_reply_library_backup },
+    { HTTPD_METHOD_GET,    "^/api/library/backup$",                        jsonapi_reply_library_backup_status },
+    { HTTPD_METHOD_GET,    "^/api/metrics$",                               jsonapi_reply_metrics },
 
     { HTTPD_METHOD_GET,    "^/api/search$",                                jsonapi_reply_search },
 
@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <sys/queue.h>
 #include <sys/types.h>
 #include <limits.h>
@@ -38,6 +39,7 @@
 #include "misc_xml.h"
 #include "transcode.h"
 #include "parsers/rsp_parser.h"
+#include "parse_cache.h"
 
 #define RSP_VERSION "1.0"
 #define RSP_XML_DECLARATION "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\" ?>"
@@ -54,6 +56,21 @@ struct field_map {
   int flags;
 };
 
+enum rsp_type {
+  RSP_TYPE_STRING,
+  RSP_TYPE_UINT32,
+  RSP_TYPE_INT64,
+  RSP_TYPE_UINT64,
+};
+
+// Fields of struct media_file_info, with how they are stored there
+struct mfi_field_map {
+  char *field;
+  size_t offset;
+  enum rsp_type type;
+  int flags;
+};
+
 static char rsp_filter_files[32];
 
 static const struct field_map pl_fields[] =
@@ -69,50 +86,50 @@ static const struct field_map pl_fields[] =
     { NULL,           0,                            0 }
   };
 
-static const struct field_map rsp_fields[] =
+static const struct mfi_field_map rsp_fields[] =
   {
-    { "id",            dbmfi_offsetof(id),            F_ALWAYS },
-    { "path",          dbmfi_offsetof(path),          F_DETAILED },
-    { "fname",         dbmfi_offsetof(fname),         F_DETAILED },
-    { "title",         dbmfi_offsetof(title),         F_ALWAYS },
-    { "artist",        dbmfi_offsetof(artist),        F_DETAILED | F_FULL | F_BROWSE },
-    { "album",         dbmfi_offsetof(album),         F_DETAILED | F_FULL | F_BROWSE },
-    { "genre",         dbmfi_offsetof(genre),         F_DETAILED | F_FULL },
-    { "comment",       dbmfi_offsetof(comment),       F_DETAILED | F_FULL },
-    { "type",          dbmfi_offsetof(type),          F_ALWAYS },
-    { "composer",      dbmfi_offsetof(composer),      F_DETAILED | F_FULL },
-    { "orchestra",     dbmfi_offsetof(orchestra),     F_DETAILED | F_FULL },
-    { "conductor",     dbmfi_offsetof(conductor),     F_DETAILED | F_FULL },
-    { "url",           dbmfi_offsetof(url),           F_DETAILED | F_FULL },
-    { "bitrate",       dbmfi_offsetof(bitrate),       F_DETAILED | F_FULL },
-    { "samplerate",    dbmfi_offsetof(samplerate),    F_DETAILED | F_FULL },
-    { "song_length",   dbmfi_offsetof(song_length),   F_DETAILED | F_FULL },
-    { "file_size",     dbmfi_offsetof(file_size),     F_DETAILED | F_FULL },
-    { "year",          dbmfi_offsetof(year),          F_DETAILED | F_FULL },
-    { "track",         dbmfi_offsetof(track),         F_DETAILED | F_FULL | F_BROWSE },
-    { "total_tracks",  dbmfi_offsetof(total_tracks),  F_DETAILED | F_FULL },
-    { "disc",          dbmfi_offsetof(disc),          F_DETAILED | F_FULL | F_BROWSE },
-    { "total_discs",   dbmfi_offsetof(total_discs),   F_DETAILED | F_FULL },
-    { "bpm",           dbmfi_offsetof(bpm),           F_DETAILED | F_FULL },
-    { "compilation",   dbmfi_offsetof(compilation),   F_DETAILED | F_FULL },
-    { "rating",        dbmfi_offsetof(rating),        F_DETAILED | F_FULL },
-    { "play_count",    dbmfi_offsetof(play_count),    F_DETAILED | F_FULL },
-    { "skip_count",    dbmfi_offsetof(skip_count),    F_DETAILED | F_FULL },
-    { "data_kind",     dbmfi_offsetof(data_kind),     F_DETAILED },
-    { "item_kind",     dbmfi_offsetof(item_kind),     F_DETAILED },
-    { "description",   dbmfi_offsetof(description),   F_DETAILED | F_FULL },
-    { "time_added",    dbmfi_offsetof(time_added),    F_DETAILED | F_FULL },
-    { "time_modified", dbmfi_offsetof(time_modified), F_DETAILED | F_FULL },
-    { "time_played",   dbmfi_offsetof(time_played),   F_DETAILED | F_FULL },
-    { "time_skipped",  dbmfi_offsetof(time_skipped),  F_DETAILED | F_FULL },
-    { "db_timestamp",  dbmfi_offsetof(db_timestamp),  F_DETAILED },
-    { "disabled",      dbmfi_offsetof(disabled),      F_ALWAYS },
-    { "sample_count",  dbmfi_offsetof(sample_count),  F_DETAILED },
-    { "codectype",     dbmfi_offsetof(codectype),     F_ALWAYS },
-    { "idx",           dbmfi_offsetof(idx),           F_DETAILED },
-    { "has_video",     dbmfi_offsetof(has_video),     F_DETAILED },
-    { "contentrating", dbmfi_offsetof(contentrating), F_DETAILED },
-    { NULL,            0,                             0 }
+    { "id",            mfi_offsetof(id),            RSP_TYPE_UINT32, F_ALWAYS },
+    { "path",          mfi_offsetof(path),          RSP_TYPE_STRING, F_DETAILED },
+    { "fname",         mfi_offsetof(fname),         RSP_TYPE_STRING, F_DETAILED },
+    { "title",         mfi_offsetof(title),         RSP_TYPE_STRING, F_ALWAYS },
+    { "artist",        mfi_offsetof(artist),        RSP_TYPE_STRING, F_DETAILED | F_FULL | F_BROWSE },
+    { "album",         mfi_offsetof(album),         RSP_TYPE_STRING, F_DETAILED | F_FULL | F_BROWSE },
+    { "genre",         mfi_offsetof(genre),         RSP_TYPE_STRING, F_DETAILED | F_FULL },
+    { "comment",       mfi_offsetof(comment),       RSP_TYPE_STRING, F_DETAILED | F_FULL },
+    { "type",          mfi_offsetof(type),          RSP_TYPE_STRING, F_ALWAYS },
+    { "composer",      mfi_offsetof(composer),      RSP_TYPE_STRING, F_DETAILED | F_FULL },
+    { "orchestra",     mfi_offsetof(orchestra),     RSP_TYPE_STRING, F_DETAILED | F_FULL },
+    { "conductor",     mfi_offsetof(conductor),     RSP_TYPE_STRING, F_DETAILED | F_FULL },
+    { "url",           mfi_offsetof(url),           RSP_TYPE_STRING, F_DETAILED | F_FULL },
+    { "bitrate",       mfi_offsetof(bitrate),       RSP_TYPE_UINT32, F_DETAILED | F_FULL },
+    { "samplerate",    mfi_offsetof(samplerate),    RSP_TYPE_UINT32, F_DETAILED | F_FULL },
+    { "song_length",   mfi_offsetof(song_length),   RSP_TYPE_UINT32, F_DETAILED | F_FULL },
+    { "file_size",     mfi_offsetof(file_size),     RSP_TYPE_INT64,  F_DETAILED | F_FULL },
+    { "year",          mfi_offsetof(year),          RSP_TYPE_UINT32, F_DETAILED | F_FULL },
+    { "track",         mfi_offsetof(track),         RSP_TYPE_UINT32, F_DETAILED | F_FULL | F_BROWSE },
+    { "total_tracks",  mfi_offsetof(total_tracks),  RSP_TYPE_UINT32, F_DETAILED | F_FULL },
+    { "disc",          mfi_offsetof(disc),          RSP_TYPE_UINT32, F_DETAILED | F_FULL | F_BROWSE },
+    { "total_discs",   mfi_offsetof(total_discs),   RSP_TYPE_UINT32, F_DETAILED | F_FULL },
+    { "bpm",           mfi_offsetof(bpm),           RSP_TYPE_UINT32, F_DETAILED | F_FULL },
+    { "compilation",   mfi_offsetof(compilation),   RSP_TYPE_UINT32, F_DETAILED | F_FULL },
+    { "rating",        mfi_offsetof(rating),        RSP_TYPE_UINT32, F_DETAILED | F_FULL },
+    { "play_count",    mfi_offsetof(play_count),    RSP_TYPE_UINT32, F_DETAILED | F_FULL },
+    { "skip_count",    mfi_offsetof(skip_count),    RSP_TYPE_UINT32, F_DETAILED | F_FULL },
+    { "data_kind",     mfi_offsetof(data_kind),     RSP_TYPE_UINT32, F_DETAILED },
+    { "item_kind",     mfi_offsetof(item_kind),     RSP_TYPE_UINT32, F_DETAILED },
+    { "description",   mfi_offsetof(description),   RSP_TYPE_STRING, F_DETAILED | F_FULL },
+    { "time_added",    mfi_offsetof(time_added),    RSP_TYPE_UINT32, F_DETAILED | F_FULL },
+    { "time_modified", mfi_offsetof(time_modified), RSP_TYPE_UINT32, F_DETAILED | F_FULL },
+    { "time_played",   mfi_offsetof(time_played),   RSP_TYPE_UINT32, F_DETAILED | F_FULL },
+    { "time_skipped",  mfi_offsetof(time_skipped),  RSP_TYPE_UINT32, F_DETAILED | F_FULL },
+    { "db_timestamp",  mfi_offsetof(db_timestamp),  RSP_TYPE_UINT32, F_DETAILED },
+    { "disabled",      mfi_offsetof(disabled),      RSP_TYPE_INT64,  F_ALWAYS },
+    { "sample_count",  mfi_offsetof(sample_count),  RSP_TYPE_UINT64, F_DETAILED },
+    { "codectype",     mfi_offsetof(codectype),     RSP_TYPE_STRING, F_ALWAYS },
+    { "idx",           mfi_offsetof(idx),           RSP_TYPE_UINT32, F_DETAILED },
+    { "has_video",     mfi_offsetof(has_video),     RSP_TYPE_UINT32, F_DETAILED },
+    { "contentrating", mfi_offsetof(contentrating), RSP_TYPE_UINT32, F_DETAILED },
+    { NULL,            0,                           0,               0 }
   };
 
 
@@ -195,6 +212,7 @@ static int
 query_params_set(struct query_params *qp, struct httpd_request *hreq)
 {
   struct rsp_result parse_result;
+  struct parse_cache_sql sql;
   const char *param;
   char query[1024];
   int ret;
@@ -249,10 +267,20 @@ query_params_set(struct query_params *qp, struct httpd_request *hreq)
 	  return -1;
 	}
 
-      if (rsp_lex_parse(&parse_result, query) != 0)
+      if (parse_cache_get(&sql, PARSE_CACHE_RSP, query) == 0)
+	{
+	  qp->filter = safe_asprintf("(%s) AND %s", sql.where, rsp_filter_files);
+	  parse_cache_sql_free(&sql);
+	}
+      else if (rsp_lex_parse(&parse_result, query) != 0)
 	DPRINTF(E_LOG, L_RSP, "Ignoring improper RSP query: %s\n", query);
       else
-	qp->filter = safe_asprintf("(%s) AND %s", parse_result.str, rsp_filter_files);
+	{
+	  qp->filter = safe_asprintf("(%s) AND %s", parse_result.str, rsp_filter_files);
+
+	  sql.where = parse_result.str;
+	  parse_cache_add(PARSE_CACHE_RSP, query, &sql);
+	}
     }
 
   // Always filter to include only files (not streams and Spotify)
@@ -418,46 +446,45 @@ static int
 item_add(xml_node *parent, struct query_params *qp, enum transcode_profile spk_profile, const char *user_agent, const char *accept_codecs, int mode)
 {
   struct media_quality quality = { 0 };
-  struct db_media_file_info dbmfi;
-  struct transcode_metadata_string xcode_metadata;
+  struct media_file_info mfi;
+  struct transcode_metadata xcode_metadata;
   enum transcode_profile profile;
   const char *orgcodec = NULL;
-  uint32_t len_ms;
   xml_node *item;
-  char **strval;
+  char buf[32];
+  char *strval;
+  char *ptr;
   int ret;
   int i;
 
-  ret = db_query_fetch_file(&dbmfi, qp);
+  ret = db_query_fetch_mfi(&mfi, qp);
   if (ret != 0)
     return ret;
 
-  profile = transcode_needed(user_agent, accept_codecs, dbmfi.codectype);
+  profile = transcode_needed(user_agent, accept_codecs, mfi.codectype);
   if (profile == XCODE_UNKNOWN)
     {
-      DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", dbmfi.fname);
+      DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", mfi.fname);
     }
   else if (profile != XCODE_NONE)
     {
       if (spk_profile != XCODE_NONE)
 	profile = spk_profile; // User has configured a specific transcode format for this speaker
 
-      orgcodec = dbmfi.codectype;
-
-      if (safe_atou32(dbmfi.song_length, &len_ms) < 0)
-        len_ms = 3 * 60 * 1000; // just a fallback default
+      orgcodec = mfi.codectype;
 
-      safe_atoi32(dbmfi.samplerate, &quality.sample_rate);
-      safe_atoi32(dbmfi.bits_per_sample, &quality.bits_per_sample);
-      safe_atoi32(dbmfi.channels, &quality.channels);
+      quality.sample_rate = mfi.samplerate;
+      quality.bits_per_sample = mfi.bits_per_sample;
+      quality.channels = mfi.channels;
       quality.bit_rate = cfg_getint(cfg_getsec(cfg, "streaming"), "bit_rate");
 
-      transcode_metadata_strings_set(&xcode_metadata, profile, &quality, len_ms);
-      dbmfi.type        = xcode_metadata.type;
-      dbmfi.codectype   = xcode_metadata.codectype;
-      dbmfi.description = xcode_metadata.description;
-      dbmfi.file_size   = xcode_metadata.file_size;
-      dbmfi.bitrate     = xcode_metadata.bitrate;
+      // 3 minutes is just a fallback default
+      transcode_metadata_set(&xcode_metadata, profile, &quality, mfi.song_length ? mfi.song_length : 3 * 60 * 1000);
+      mfi.type        = xcode_metadata.type;
+      mfi.codectype   = xcode_metadata.codectype;
+      mfi.description = xcode_metadata.description;
+      mfi.file_size   = xcode_metadata.file_size;
+      mfi.bitrate     = xcode_metadata.bitrate;
     }
 
   // Now add block with content
@@ -468,14 +495,37 @@ item_add(xml_node *parent, struct query_params *qp, enum transcode_profile spk_p
       if (!(rsp_fields[i].flags & mode))
 	continue;
 
-      strval = (char **) ((char *)&dbmfi + rsp_fields[i].offset);
-      if (!(*strval) || (strlen(*strval) == 0))
+      ptr = (char *)&mfi + rsp_fields[i].offset;
+
+      switch (rsp_fields[i].type)
+	{
+	  case RSP_TYPE_STRING:
+	    strval = *(char **)ptr;
+	    break;
+
+	  case RSP_TYPE_UINT32:
+	    snprintf(buf, sizeof(buf), "%" PRIu32, *(uint32_t *)ptr);
+	    strval = buf;
+	    break;
+
+	  case RSP_TYPE_INT64:
+	    snprintf(buf, sizeof(buf), "%" PRIi64, *(int64_t *)ptr);
+	    strval = buf;
+	    break;
+
+	  case RSP_TYPE_UINT64:
+	    snprintf(buf, sizeof(buf), "%" PRIu64, *(uint64_t *)ptr);
+	    strval = buf;
+	    break;
+	}
+
+      if (!strval || (strlen(strval) == 0))
 	continue;
 
-      xml_new_node(item, rsp_fields[i].field, *strval);
+      xml_new_node(item, rsp_fields[i].field, strval);
 
       // In case we are transcoding
-      if (rsp_fields[i].offset == dbmfi_offsetof(codectype) && orgcodec)
+      if (rsp_fields[i].offset == mfi_offsetof(codectype) && orgcodec)
 	xml_new_node(item, "original_codec", orgcodec);
     }
 
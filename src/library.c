@@ -33,6 +33,7 @@
 #include <event2/event.h>
 
 #include "library.h"
+#include "artwork.h"
 #include "cache.h"
 #include "commands.h"
 #include "conffile.h"
@@ -121,9 +122,98 @@ static short deferred_update_events;
 // Stores callbacks that backends may have requested
 static struct library_callback_register library_cb_register[LIBRARY_MAX_CALLBACKS];
 
+// Media saved by sources between library_media_batch_begin() and _end() is
+// collected here and written to the db LIBRARY_MEDIA_BATCH_SIZE at a time
+static struct media_file_info *media_batch;
+static int media_batch_count;
+// Number of media in the current batch that could not be written
+static int media_batch_failed;
+
 
 /* ------------------- CALLED BY LIBRARY SOURCE MODULES -------------------- */
 
+static void
+media_batch_flush(void)
+{
+  int saved;
+  int i;
+
+  if (media_batch_count == 0)
+    return;
+
+  saved = db_file_save_batch(media_batch, media_batch_count);
+  media_batch_failed += media_batch_count - saved;
+
+  for (i = 0; i < media_batch_count; i++)
+    free_mfi(&media_batch[i], 1);
+
+  media_batch_count = 0;
+}
+
+// Takes over the content of mfi
+static int
+media_batch_add(struct media_file_info *mfi)
+{
+  struct media_file_info *pending = NULL;
+  int i;
+
+  // A source may save the same item twice, e.g. a track that is in two
+  // playlists, and it won't be found in the db until it has been written
+  for (i = 0; i < media_batch_count; i++)
+    {
+      if (strcmp(media_batch[i].path, mfi->path) == 0)
+	{
+	  pending = &media_batch[i];
+	  if (mfi->id == 0)
+	    mfi->id = pending->id;
+
+	  free_mfi(pending, 1);
+	  break;
+	}
+    }
+
+  if (!pending)
+    pending = &media_batch[media_batch_count++];
+
+  *pending = *mfi;
+  memset(mfi, 0, sizeof(struct media_file_info));
+
+  if (media_batch_count == LIBRARY_MEDIA_BATCH_SIZE)
+    media_batch_flush();
+
+  return 0;
+}
+
+void
+library_media_batch_begin(void)
+{
+  if (media_batch)
+    return;
+
+  CHECK_NULL(L_LIB, media_batch = calloc(LIBRARY_MEDIA_BATCH_SIZE, sizeof(struct media_file_info)));
+  media_batch_count = 0;
+  media_batch_failed = 0;
+}
+
+int
+library_media_batch_end(void)
+{
+  int failed;
+
+  if (!media_batch)
+    return 0;
+
+  media_batch_flush();
+
+  free(media_batch);
+  media_batch = NULL;
+
+  failed = media_batch_failed;
+  media_batch_failed = 0;
+
+  return failed;
+}
+
 int
 library_media_save(struct media_file_info *mfi)
 {
@@ -143,6 +233,9 @@ library_media_save(struct media_file_info *mfi)
 	      mfi->path, mfi->directory_id, mfi->virtual_path);
     }
 
+  if (media_batch)
+    return media_batch_add(mfi);
+
   if (mfi->id == 0)
     ret = db_file_add(mfi);
   else
@@ -353,6 +446,7 @@ rescan(void *arg, int *ret)
 
   DPRINTF(E_DBG, L_LIB, "Running post library scan jobs\n");
   db_hook_post_scan();
+  artwork_prerender_start();
 
   endtime = time(NULL);
   DPRINTF(E_LOG, L_LIB, "Library rescan completed in %.f sec (%d changes)\n", difftime(endtime, starttime), deferred_update_notifications);
@@ -405,6 +499,7 @@ metarescan(void *arg, int *ret)
 
   DPRINTF(E_DBG, L_LIB, "Running post library scan jobs\n");
   db_hook_post_scan();
+  artwork_prerender_start();
 
   endtime = time(NULL);
   DPRINTF(E_LOG, L_LIB, "Library meta rescan completed in %.f sec (%d changes)\n", difftime(endtime, starttime), deferred_update_notifications);
@@ -836,6 +931,7 @@ initscan()
 
       DPRINTF(E_DBG, L_LIB, "Running post library scan jobs\n");
       db_hook_post_scan();
+      artwork_prerender_start();
     }
 
   endtime = time(NULL);
@@ -30,6 +30,9 @@
 #define LIBRARY_ERROR -1
 #define LIBRARY_PATH_INVALID -2
 
+// Number of media that a batch of library_media_save() calls writes at a time
+#define LIBRARY_MEDIA_BATCH_SIZE 200
+
 typedef void (*library_cb)(void *arg);
 
 /*
@@ -132,7 +135,10 @@ struct library_source
 /* --------------------- Interface towards source backends ----------------- */
 
 /*
- * Adds a mfi if mfi->id == 0, otherwise updates.
+ * Adds a mfi if mfi->id == 0, otherwise updates. Within a batch the content of
+ * mfi is taken over (mfi is zeroed), and it is written to the db later, so a
+ * return value of 0 only means that it was queued. Errors writing the batch
+ * are reported by library_media_batch_end().
  *
  * @param mfi Media to save
  * @return    0 if operation succeeded, -1 on failure.
@@ -140,6 +146,21 @@ struct library_source
 int
 library_media_save(struct media_file_info *mfi);
 
+/*
+ * Starts/ends a batch of library_media_save() calls, which are then written to
+ * the db in groups. Ending the batch writes what is left. Media in the batch
+ * can't be found in the db until it has been written, so only use a batch if
+ * nothing needs to look it up before the batch ends.
+ *
+ * @return    library_media_batch_end() returns the number of media in the
+ *            batch that could not be saved, 0 if all were saved.
+ */
+void
+library_media_batch_begin(void);
+
+int
+library_media_batch_end(void);
+
 /*
  * Adds a playlist if pli->id == 0, otherwise updates.
  *
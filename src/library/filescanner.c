@@ -571,6 +571,8 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
   bool is_bulkscan = (flags & F_SCAN_BULK);
   struct media_file_info mfi;
   char virtual_path[PATH_MAX];
+  char dir[PATH_MAX];
+  char *ptr;
   int ret;
 
   if (!(flags & F_SCAN_METARESCAN))
@@ -590,6 +592,19 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
   // Sets id=0 if file is not in the library already
   mfi.id = db_file_id_bypath(file);
 
+  // A new file may have embedded artwork for an album that had none, and its
+  // mtime can't tell us if it is newer than the recorded miss
+  if (mfi.id == 0)
+    {
+      ret = snprintf(dir, sizeof(dir), "%s", file);
+      ptr = strrchr(dir, '/');
+      if (ret > 0 && ret < sizeof(dir) && ptr)
+	{
+	  *ptr = '\0';
+	  cache_artwork_miss_delete_by_dir(dir);
+	}
+    }
+
   mfi.fname = strdup(filename_from_path(file));
   mfi.path = strdup(file);
 
@@ -637,7 +652,6 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
   library_media_save(&mfi);
 
   cache_artwork_ping(file, sb->st_mtime, !is_bulkscan);
-  // TODO [artworkcache] If entry in artwork cache exists for no artwork available, delete the entry if media file has embedded artwork
 
   free_mfi(&mfi, 1);
 }
@@ -678,9 +692,6 @@ process_file(char *file, struct stat *sb, enum file_type file_type, int scan_typ
       case FILE_ARTWORK:
 	DPRINTF(E_DBG, L_SCAN, "Artwork file: %s\n", file);
 	cache_artwork_ping(file, sb->st_mtime, !(flags & F_SCAN_BULK));
-
-	// TODO [artworkcache] If entry in artwork cache exists for no artwork available for a album with files in the same directory, delete the entry
-
 	break;
 
       case FILE_CTRL_REMOTE:
@@ -808,6 +819,76 @@ read_attributes(char *resolved_path, const char *path, struct stat *sb, int *is_
   return 0;
 }
 
+// Keeps track of the preferred artwork file while going through a directory
+static void
+dir_artwork_candidate(int *best_rank, char *artwork_path, size_t len, const char *dir, const char *filename)
+{
+  int rank;
+
+  rank = artwork_dir_file_rank(dir, filename);
+  if (rank < 0 || (*best_rank >= 0 && rank >= *best_rank))
+    return;
+
+  if (snprintf(artwork_path, len, "%s/%s", dir, filename) >= len)
+    return;
+
+  *best_rank = rank;
+}
+
+// If file is an artwork candidate that was added or removed, then this updates
+// the artwork file of the directory it is in
+static void
+dir_artwork_update(const char *file, bool added)
+{
+  DIR *dirp;
+  struct dirent *de;
+  char dir[PATH_MAX];
+  char artwork_path[PATH_MAX];
+  char *ptr;
+  int artwork_rank;
+  int dir_id;
+
+  snprintf(dir, sizeof(dir), "%s", file);
+  ptr = strrchr(dir, '/');
+  if (!ptr || ptr == dir)
+    return;
+
+  *ptr = '\0';
+
+  if (artwork_dir_file_rank(dir, ptr + 1) < 0)
+    return;
+
+  // Whatever its mtime, a new candidate may be artwork for items that had none
+  if (added)
+    cache_artwork_miss_delete_by_dir(dir);
+
+  dir_id = db_directory_id_bypath(dir);
+  if (dir_id <= 0)
+    return;
+
+  dirp = opendir(dir);
+  if (!dirp)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Could not open directory %s: %s\n", dir, strerror(errno));
+      return;
+    }
+
+  artwork_path[0] = '\0';
+  artwork_rank = -1;
+
+  while ((de = readdir(dirp)))
+    {
+      if (de->d_name[0] != '.')
+	dir_artwork_candidate(&artwork_rank, artwork_path, sizeof(artwork_path), dir, de->d_name);
+    }
+
+  closedir(dirp);
+
+  DPRINTF(E_DBG, L_SCAN, "Artwork of directory %s is now '%s'\n", dir, artwork_path);
+
+  db_directory_artwork_update(dir_id, artwork_path);
+}
+
 static void
 process_directory(char *path, int parent_id, int flags)
 {
@@ -822,6 +903,8 @@ process_directory(char *path, int parent_id, int flags)
   int scan_type;
   enum file_type file_type;
   char virtual_path[PATH_MAX];
+  char artwork_path[PATH_MAX];
+  int artwork_rank;
   int dir_id;
   int ret;
 
@@ -860,6 +943,9 @@ process_directory(char *path, int parent_id, int flags)
 
   follow_symlinks = cfg_getbool(cfg_getsec(cfg, "library"), "follow_symlinks");
 
+  artwork_path[0] = '\0';
+  artwork_rank = -1;
+
   for (;;)
     {
       if (library_is_exiting())
@@ -874,11 +960,21 @@ process_directory(char *path, int parent_id, int flags)
 	}
 
       if (!de)
-	break;
+	{
+	  // Only if we saw all the entries, otherwise we might not have the best.
+	  // If the directory got artwork that wasn't in the db, then the scan
+	  // found a new cover file (e.g. added while we were not running).
+	  if (dir_id > 0 && db_directory_artwork_update(dir_id, artwork_path) > 0 && artwork_path[0] != '\0')
+	    cache_artwork_miss_delete_by_dir(path);
+	  break;
+	}
 
       if (de->d_name[0] == '.')
 	continue;
 
+      // Must be before file_type_get(), since that ignores some of the candidates
+      dir_artwork_candidate(&artwork_rank, artwork_path, sizeof(artwork_path), path, de->d_name);
+
       ret = snprintf(entry, sizeof(entry), "%s/%s", path, de->d_name);
       if ((ret < 0) || (ret >= sizeof(entry)))
 	{
@@ -1056,8 +1152,13 @@ bulk_scan(int flags)
 	}
 
       db_transaction_begin();
+      library_media_batch_begin();
 
       process_directories(deref, parent_id, flags);
+
+      ret = library_media_batch_end();
+      if (ret > 0)
+	DPRINTF(E_LOG, L_SCAN, "Could not save %d files from library directory %s\n", ret, path);
       db_transaction_end();
 
       free(deref);
@@ -1271,6 +1372,9 @@ process_inotify_file(struct watch_info *wi, char *path, struct inotify_event *ie
 
   DPRINTF(E_DBG, L_SCAN, "File event: 0x%08x, cookie 0x%08x, wd %d\n", ie->mask, ie->cookie, wi->wd);
 
+  if (ie->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+    dir_artwork_update(path, (ie->mask & (IN_CREATE | IN_MOVED_TO)));
+
   file_type = file_type_get(path);
   if (file_type == FILE_IGNORE)
     return;
@@ -407,11 +407,13 @@ rss_save(struct playlist_info *pli, int *count, enum rss_scan_type scan_type)
   // Walk through the xml, saving each item
   *count = 0;
   db_transaction_begin();
+  library_media_batch_begin();
   db_pl_clear_items(pli->id);
   for (item = xml_get_node(xml, "rss/channel/item"); item && (*count < pli->query_limit); item = xml_get_next(xml, item))
     {
       if (library_is_exiting())
 	{
+	  library_media_batch_end();
 	  db_transaction_rollback();
 	  xml_free(xml);
 	  return -1;
@@ -454,6 +456,16 @@ rss_save(struct playlist_info *pli, int *count, enum rss_scan_type scan_type)
       free_mfi(&mfi, 1);
     }
 
+  // Keeps the previous items of the feed if not all could be saved
+  ret = library_media_batch_end();
+  if (ret > 0)
+    {
+      DPRINTF(E_LOG, L_LIB, "Could not save %d items from RSS feed '%s'\n", ret, feed_title);
+      db_transaction_rollback();
+      xml_free(xml);
+      return -1;
+    }
+
   db_transaction_end();
   xml_free(xml);
 
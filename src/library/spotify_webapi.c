@@ -2162,6 +2162,7 @@ scan(enum spotify_request_type request_type)
   struct spotify_status sp_status;
   time_t start;
   time_t end;
+  int ret;
 
   if (!credentials_token_exists() || scanning)
     {
@@ -2175,6 +2176,10 @@ scan(enum spotify_request_type request_type)
   db_directory_enable_bypath("/spotify:");
   create_base_playlist();
 
+  // Tracks are looked up by uri before they are saved, but a track that is
+  // pending in the batch is replaced if it is saved again
+  library_media_batch_begin();
+
   scan_saved_albums(request_type);
   scan_playlists(request_type);
   spotify_status_get(&sp_status);
@@ -2182,6 +2187,10 @@ scan(enum spotify_request_type request_type)
     scan_saved_shows(request_type);
   scan_saved_audiobooks(request_type);
 
+  ret = library_media_batch_end();
+  if (ret > 0)
+    DPRINTF(E_LOG, L_SPOTIFY, "Could not save %d Spotify tracks\n", ret);
+
   scanning = false;
   end = time(NULL);
 
@@ -28,6 +28,8 @@ enum listener_event_type
   LISTENER_LASTFM = (1 << 10),
   /* Song rating changes */
   LISTENER_RATING = (1 << 11),
+  /* Database backup started or finished */
+  LISTENER_BACKUP = (1 << 12),
 };
 
 typedef void (*notify)(short event_mask, void *ctx);
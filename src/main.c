@@ -69,6 +69,7 @@
 #include "player.h"
 #include "worker.h"
 #include "library.h"
+#include "parse_cache.h"
 #include "ptpd.h"
 #ifdef LASTFM
 # include "lastfm.h"
@@ -983,6 +984,8 @@ main(int argc, char **argv)
   db_perthread_deinit();
   db_deinit();
 
+  parse_cache_deinit();
+
  db_fail:
   if (ret == EXIT_FAILURE)
     {
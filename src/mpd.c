@@ -59,6 +59,7 @@
 #include "player.h"
 #include "remote_pairing.h"
 #include "parsers/mpd_parser.h"
+#include "parse_cache.h"
 
 // TODO
 // optimize queries (map albumartist/album groupings to songalbumid/artistid in db.c)
@@ -700,26 +701,12 @@ mpd_add_db_queue_item(struct evbuffer *evbuf, struct db_queue_item *queue_item)
  * @return the number of bytes added if successful, or -1 if an error occurred.
  */
 static int
-mpd_add_db_media_file_info(struct evbuffer *evbuf, struct db_media_file_info *dbmfi)
+mpd_add_media_file_info(struct evbuffer *evbuf, struct media_file_info *mfi)
 {
   char modified[32];
-  uint32_t time_modified;
-  uint32_t songlength;
   int ret;
 
-  if (safe_atou32(dbmfi->time_modified, &time_modified) != 0)
-    {
-      DPRINTF(E_LOG, L_MPD, "Error converting time modified to uint32_t: %s\n", dbmfi->time_modified);
-      return -1;
-    }
-
-  mpd_time(modified, sizeof(modified), time_modified);
-
-  if (safe_atou32(dbmfi->song_length, &songlength) != 0)
-    {
-      DPRINTF(E_LOG, L_MPD, "Error converting song length to uint32_t: %s\n", dbmfi->song_length);
-      return -1;
-    }
+  mpd_time(modified, sizeof(modified), mfi->time_modified);
 
   ret = evbuffer_add_printf(evbuf,
       "file: %s\n"
@@ -732,24 +719,24 @@ mpd_add_db_media_file_info(struct evbuffer *evbuf, struct db_media_file_info *db
       "AlbumArtistSort: %s\n"
       "Album: %s\n"
       "Title: %s\n"
-      "Track: %s\n"
-      "Date: %s\n"
+      "Track: %d\n"
+      "Date: %d\n"
       "Genre: %s\n"
-      "Disc: %s\n",
-      (dbmfi->virtual_path + 1),
+      "Disc: %d\n",
+      (mfi->virtual_path + 1),
       modified,
-      (songlength / 1000),
-      ((float) songlength / 1000),
-      sanitize(dbmfi->artist),
-      sanitize(dbmfi->album_artist),
-      sanitize(dbmfi->artist_sort),
-      sanitize(dbmfi->album_artist_sort),
-      sanitize(dbmfi->album),
-      sanitize(dbmfi->title),
-      dbmfi->track,
-      dbmfi->year,
-      sanitize(dbmfi->genre),
-      dbmfi->disc);
+      (mfi->song_length / 1000),
+      ((float) mfi->song_length / 1000),
+      sanitize(mfi->artist),
+      sanitize(mfi->album_artist),
+      sanitize(mfi->artist_sort),
+      sanitize(mfi->album_artist_sort),
+      sanitize(mfi->album),
+      sanitize(mfi->title),
+      mfi->track,
+      mfi->year,
+      sanitize(mfi->genre),
+      mfi->disc);
 
   return ret;
 }
@@ -820,6 +807,7 @@ static int
 parse_command(struct query_params *qp, char **pos, char **tagtype, struct mpd_command_input *in)
 {
   struct mpd_result result;
+  struct parse_cache_sql sql;
   char args_reassembled[8192];
   int ret;
 
@@ -838,6 +826,30 @@ parse_command(struct query_params *qp, char **pos, char **tagtype, struct mpd_co
       return -1;
     }
 
+  ret = parse_cache_get(&sql, PARSE_CACHE_MPD, args_reassembled);
+  if (ret == 0)
+    {
+      qp->filter = sql.where;
+      qp->order = sql.order;
+      qp->group = sql.group;
+
+      qp->limit = sql.limit;
+      qp->offset = sql.offset;
+      qp->idx_type = (qp->limit || qp->offset) ? I_SUB : I_NONE;
+
+      if (pos)
+	*pos = sql.position;
+      else
+	free(sql.position);
+
+      if (tagtype)
+	*tagtype = sql.tagtype;
+      else
+	free(sql.tagtype);
+
+      return 0;
+    }
+
   DPRINTF(E_DBG, L_MPD, "Parse mpd query input '%s'\n", args_reassembled);
 
   ret = mpd_lex_parse(&result, args_reassembled);
@@ -847,6 +859,15 @@ parse_command(struct query_params *qp, char **pos, char **tagtype, struct mpd_co
       return -1;
     }
 
+  sql.where = (char *)result.where;
+  sql.order = (char *)result.order;
+  sql.group = (char *)result.group;
+  sql.position = (char *)result.position;
+  sql.tagtype = (char *)result.tagtype;
+  sql.limit = result.limit;
+  sql.offset = result.offset;
+  parse_cache_add(PARSE_CACHE_MPD, args_reassembled, &sql);
+
   qp->filter = safe_strdup(result.where);
   qp->order = safe_strdup(result.order);
   qp->group = safe_strdup(result.group);
@@ -1875,7 +1896,11 @@ mpd_command_playlistinfo(struct mpd_command_output *out, struct mpd_command_inpu
       if (start_pos < 0)
 	DPRINTF(E_DBG, L_MPD, "Command 'playlistinfo' called with pos < 0 (arg = '%s'), ignore arguments and return whole queue\n", in->argv[1]);
       else
-	qp.filter = db_mprintf("pos >= %d AND pos < %d", start_pos, end_pos);
+	{
+	  qp.idx_type = I_SUB;
+	  qp.offset = start_pos;
+	  qp.limit = end_pos - start_pos;
+	}
     }
 
   ret = db_queue_enum_start(&qp);
@@ -1998,10 +2023,14 @@ plchanges_build_queryparams(struct query_params *qp, uint32_t version, const cha
 	DPRINTF(E_DBG, L_MPD, "Invalid range '%s', will return entire queue\n", range);
     }
 
-  if (start_pos < 0 || end_pos <= 0)
-    qp->filter = db_mprintf("(queue_version > %d)", version);
-  else
-    qp->filter = db_mprintf("(queue_version > %d AND pos >= %d AND pos < %d)", version, start_pos, end_pos);
+  qp->filter = db_mprintf("(queue_version > %d)", version);
+
+  if (start_pos >= 0 && end_pos > 0)
+    {
+      qp->idx_type = I_SUB;
+      qp->offset = start_pos;
+      qp->limit = end_pos - start_pos;
+    }
 
   return 0;
 }
@@ -2148,7 +2177,7 @@ mpd_command_listplaylistinfo(struct mpd_command_output *out, struct mpd_command_
   char *path;
   struct playlist_info *pli;
   struct query_params qp = { .type = Q_PLITEMS, .idx_type = I_NONE };
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   int ret;
 
   if (!default_pl_dir || strstr(in->argv[1], ":/"))
@@ -2176,12 +2205,12 @@ mpd_command_listplaylistinfo(struct mpd_command_output *out, struct mpd_command_
       RETURN_ERROR(ACK_ERROR_UNKNOWN, "Could not start query");
     }
 
-  while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
+  while ((ret = db_query_fetch_mfi(&mfi, &qp)) == 0)
     {
-      ret = mpd_add_db_media_file_info(out->evbuf, &dbmfi);
+      ret = mpd_add_media_file_info(out->evbuf, &mfi);
       if (ret < 0)
 	{
-	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %s\n", dbmfi.id);
+	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %" PRIu32 "\n", mfi.id);
 	}
     }
 
@@ -2479,7 +2508,7 @@ static int
 mpd_command_find(struct mpd_command_output *out, struct mpd_command_input *in, struct mpd_client_ctx *ctx)
 {
   struct query_params qp = { .type = Q_ITEMS, .idx_type = I_NONE, .sort = S_ARTIST };
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   int ret;
 
   ret = parse_command(&qp, NULL, NULL, in);
@@ -2493,12 +2522,12 @@ mpd_command_find(struct mpd_command_output *out, struct mpd_command_input *in, s
       RETURN_ERROR(ACK_ERROR_UNKNOWN, "Could not start query");
     }
 
-  while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
+  while ((ret = db_query_fetch_mfi(&mfi, &qp)) == 0)
     {
-      ret = mpd_add_db_media_file_info(out->evbuf, &dbmfi);
+      ret = mpd_add_media_file_info(out->evbuf, &mfi);
       if (ret < 0)
 	{
-	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %s\n", dbmfi.id);
+	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %" PRIu32 "\n", mfi.id);
 	}
     }
 
@@ -2634,7 +2663,7 @@ mpd_add_directory(struct mpd_command_output *out, int directory_id, int listall,
   struct db_playlist_info dbpli;
   char modified[32];
   uint32_t time_modified;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   int ret;
 
   // Load playlists for dir-id
@@ -2714,21 +2743,21 @@ mpd_add_directory(struct mpd_command_output *out, int directory_id, int listall,
       free_query_params(&qp, 1);
       RETURN_ERROR(ACK_ERROR_UNKNOWN, "Could not start query");
     }
-  while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
+  while ((ret = db_query_fetch_mfi(&mfi, &qp)) == 0)
     {
       if (listinfo)
 	{
-	  ret = mpd_add_db_media_file_info(out->evbuf, &dbmfi);
+	  ret = mpd_add_media_file_info(out->evbuf, &mfi);
 	  if (ret < 0)
 	    {
-	      DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %s\n", dbmfi.id);
+	      DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %" PRIu32 "\n", mfi.id);
 	    }
 	}
       else
 	{
 	  evbuffer_add_printf(out->evbuf,
 	    "file: %s\n",
-	    (dbmfi.virtual_path + 1));
+	    (mfi.virtual_path + 1));
 	}
     }
   db_query_end(&qp);
@@ -2997,7 +3026,7 @@ static int
 mpd_sticker_find(struct mpd_command_output *out, struct mpd_command_input *in, const char *virtual_path)
 {
   struct query_params qp = { .type = Q_ITEMS, .idx_type = I_NONE, .sort = S_VPATH };
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   uint32_t rating = 0;
   uint32_t rating_arg = 0;
   const char *operator;
@@ -3034,24 +3063,16 @@ mpd_sticker_find(struct mpd_command_output *out, struct mpd_command_input *in, c
       RETURN_ERROR(ACK_ERROR_UNKNOWN, "Could not start query");
     }
 
-  while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
+  while ((ret = db_query_fetch_mfi(&mfi, &qp)) == 0)
     {
-      ret = safe_atou32(dbmfi.rating, &rating);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_MPD, "Error rating=%s doesn't convert to integer, song id: %s\n",
-		  dbmfi.rating, dbmfi.id);
-	  continue;
-	}
-
-      rating /= MPD_RATING_FACTOR;
+      rating = mfi.rating / MPD_RATING_FACTOR;
       ret = evbuffer_add_printf(out->evbuf,
 				"file: %s\n"
 				"sticker: rating=%d\n",
-				(dbmfi.virtual_path + 1),
+				(mfi.virtual_path + 1),
 				rating);
       if (ret < 0)
-	DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %s\n", dbmfi.id);
+	DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %" PRIu32 "\n", mfi.id);
     }
 
   db_query_end(&qp);
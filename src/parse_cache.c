@@ -0,0 +1,246 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <pthread.h>
+
+#include "logger.h"
+#include "misc.h"
+#include "parse_cache.h"
+
+// Max number of cached queries, and the number of hash buckets (power of 2)
+#define PARSE_CACHE_SIZE 256
+#define PARSE_CACHE_BUCKETS 512
+// Longer queries are not cached, they are unlikely to repeat
+#define PARSE_CACHE_INPUT_MAX 4096
+
+struct parse_cache_entry {
+  enum parse_cache_parser parser;
+  uint32_t hash;
+  char *input;
+  struct parse_cache_sql sql;
+
+  struct parse_cache_entry *bucket_next;
+  TAILQ_ENTRY(parse_cache_entry) lru;
+};
+
+TAILQ_HEAD(parse_cache_lru, parse_cache_entry);
+
+struct parse_cache {
+  pthread_mutex_t lck;
+  struct parse_cache_entry *buckets[PARSE_CACHE_BUCKETS];
+  struct parse_cache_lru lru; // Most recently used first
+  int nentries;
+  struct parse_cache_stats stats[PARSE_CACHE_NPARSERS];
+};
+
+static struct parse_cache parse_cache = { .lck = PTHREAD_MUTEX_INITIALIZER, .lru = TAILQ_HEAD_INITIALIZER(parse_cache.lru) };
+
+static const char *parse_cache_parser_labels[] = { "daap", "rsp", "smartpl", "mpd" };
+
+
+/* ---------------------------------- Helpers ------------------------------- */
+
+static uint32_t
+key_hash(enum parse_cache_parser parser, const char *input)
+{
+  return djb_hash(input, strlen(input)) ^ ((uint32_t)parser * 0x9e3779b9);
+}
+
+static void
+sql_copy(struct parse_cache_sql *dst, struct parse_cache_sql *src)
+{
+  dst->where = safe_strdup(src->where);
+  dst->having = safe_strdup(src->having);
+  dst->order = safe_strdup(src->order);
+  dst->group = safe_strdup(src->group);
+  dst->title = safe_strdup(src->title);
+  dst->tagtype = safe_strdup(src->tagtype);
+  dst->position = safe_strdup(src->position);
+  dst->limit = src->limit;
+  dst->offset = src->offset;
+}
+
+// Must be called with the lock held
+static struct parse_cache_entry **
+entry_find(enum parse_cache_parser parser, const char *input, uint32_t hash)
+{
+  struct parse_cache_entry **e;
+
+  for (e = &parse_cache.buckets[hash & (PARSE_CACHE_BUCKETS - 1)]; *e; e = &(*e)->bucket_next)
+    {
+      if ((*e)->hash == hash && (*e)->parser == parser && strcmp((*e)->input, input) == 0)
+	return e;
+    }
+
+  return NULL;
+}
+
+// Must be called with the lock held
+static void
+entry_remove(struct parse_cache_entry *entry)
+{
+  struct parse_cache_entry **e;
+
+  e = entry_find(entry->parser, entry->input, entry->hash);
+  if (e)
+    *e = entry->bucket_next;
+
+  TAILQ_REMOVE(&parse_cache.lru, entry, lru);
+  parse_cache.nentries--;
+  parse_cache.stats[entry->parser].entries--;
+
+  parse_cache_sql_free(&entry->sql);
+  free(entry->input);
+  free(entry);
+}
+
+
+/* ---------------------------------- API ----------------------------------- */
+
+int
+parse_cache_get(struct parse_cache_sql *sql, enum parse_cache_parser parser, const char *input)
+{
+  struct parse_cache_entry **e;
+  uint32_t hash;
+
+  memset(sql, 0, sizeof(struct parse_cache_sql));
+
+  if (!input || parser >= PARSE_CACHE_NPARSERS)
+    return -1;
+
+  hash = key_hash(parser, input);
+
+  CHECK_ERR(L_MISC, pthread_mutex_lock(&parse_cache.lck));
+
+  e = entry_find(parser, input, hash);
+  if (!e)
+    {
+      parse_cache.stats[parser].misses++;
+      CHECK_ERR(L_MISC, pthread_mutex_unlock(&parse_cache.lck));
+      return -1;
+    }
+
+  TAILQ_REMOVE(&parse_cache.lru, *e, lru);
+  TAILQ_INSERT_HEAD(&parse_cache.lru, *e, lru);
+
+  sql_copy(sql, &(*e)->sql);
+  parse_cache.stats[parser].hits++;
+
+  CHECK_ERR(L_MISC, pthread_mutex_unlock(&parse_cache.lck));
+
+  return 0;
+}
+
+void
+parse_cache_add(enum parse_cache_parser parser, const char *input, struct parse_cache_sql *sql)
+{
+  struct parse_cache_entry *entry;
+  uint32_t hash;
+
+  if (!input || parser >= PARSE_CACHE_NPARSERS || strlen(input) > PARSE_CACHE_INPUT_MAX)
+    return;
+
+  hash = key_hash(parser, input);
+
+  CHECK_NULL(L_MISC, entry = calloc(1, sizeof(struct parse_cache_entry)));
+  entry->parser = parser;
+  entry->hash = hash;
+  entry->input = strdup(input);
+  sql_copy(&entry->sql, sql);
+
+  CHECK_ERR(L_MISC, pthread_mutex_lock(&parse_cache.lck));
+
+  // Another thread may have added the same query while we were parsing
+  if (entry_find(parser, input, hash))
+    {
+      CHECK_ERR(L_MISC, pthread_mutex_unlock(&parse_cache.lck));
+      parse_cache_sql_free(&entry->sql);
+      free(entry->input);
+      free(entry);
+      return;
+    }
+
+  if (parse_cache.nentries >= PARSE_CACHE_SIZE)
+    {
+      parse_cache.stats[TAILQ_LAST(&parse_cache.lru, parse_cache_lru)->parser].evictions++;
+      entry_remove(TAILQ_LAST(&parse_cache.lru, parse_cache_lru));
+    }
+
+  entry->bucket_next = parse_cache.buckets[hash & (PARSE_CACHE_BUCKETS - 1)];
+  parse_cache.buckets[hash & (PARSE_CACHE_BUCKETS - 1)] = entry;
+  TAILQ_INSERT_HEAD(&parse_cache.lru, entry, lru);
+  parse_cache.nentries++;
+  parse_cache.stats[parser].entries++;
+
+  CHECK_ERR(L_MISC, pthread_mutex_unlock(&parse_cache.lck));
+}
+
+void
+parse_cache_sql_free(struct parse_cache_sql *sql)
+{
+  if (!sql)
+    return;
+
+  free(sql->where);
+  free(sql->having);
+  free(sql->order);
+  free(sql->group);
+  free(sql->title);
+  free(sql->tagtype);
+  free(sql->position);
+
+  memset(sql, 0, sizeof(struct parse_cache_sql));
+}
+
+const char *
+parse_cache_parser_label(enum parse_cache_parser parser)
+{
+  if (parser >= PARSE_CACHE_NPARSERS)
+    return NULL;
+
+  return parse_cache_parser_labels[parser];
+}
+
+void
+parse_cache_stats_get(struct parse_cache_stats *stats, enum parse_cache_parser parser)
+{
+  memset(stats, 0, sizeof(struct parse_cache_stats));
+
+  if (parser >= PARSE_CACHE_NPARSERS)
+    return;
+
+  CHECK_ERR(L_MISC, pthread_mutex_lock(&parse_cache.lck));
+  *stats = parse_cache.stats[parser];
+  CHECK_ERR(L_MISC, pthread_mutex_unlock(&parse_cache.lck));
+}
+
+void
+parse_cache_deinit(void)
+{
+  CHECK_ERR(L_MISC, pthread_mutex_lock(&parse_cache.lck));
+  while (!TAILQ_EMPTY(&parse_cache.lru))
+    entry_remove(TAILQ_FIRST(&parse_cache.lru));
+  CHECK_ERR(L_MISC, pthread_mutex_unlock(&parse_cache.lck));
+}
@@ -0,0 +1,65 @@
+#ifndef __PARSE_CACHE_H__
+#define __PARSE_CACHE_H__
+
+#include <stdint.h>
+
+/* Cache of query strings that have been compiled to SQL by one of the parsers,
+ * so that clients repeating the same queries don't go through the parsers each
+ * time. The cache is a bounded LRU, keyed by parser and query text, and is safe
+ * to use from any thread. Only successful parses should be added.
+ */
+
+enum parse_cache_parser {
+  PARSE_CACHE_DAAP,
+  PARSE_CACHE_RSP,
+  PARSE_CACHE_SMARTPL,
+  PARSE_CACHE_MPD,
+  PARSE_CACHE_NPARSERS,
+};
+
+// The SQL fragments from a parse, fields not used by a parser are NULL/0
+struct parse_cache_sql {
+  char *where;
+  char *having;
+  char *order;
+  char *group;
+  char *title;
+  char *tagtype;
+  char *position;
+  int limit;
+  int offset;
+};
+
+struct parse_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  int entries;
+};
+
+/* Looks up a query, on a hit sql is filled with allocated copies of the
+ * fragments, which the caller must free with parse_cache_sql_free().
+ *
+ * @return 0 on hit, -1 on miss
+ */
+int
+parse_cache_get(struct parse_cache_sql *sql, enum parse_cache_parser parser, const char *input);
+
+/* Adds the result of parsing input, the fragments are copied.
+ */
+void
+parse_cache_add(enum parse_cache_parser parser, const char *input, struct parse_cache_sql *sql);
+
+void
+parse_cache_sql_free(struct parse_cache_sql *sql);
+
+const char *
+parse_cache_parser_label(enum parse_cache_parser parser);
+
+void
+parse_cache_stats_get(struct parse_cache_stats *stats, enum parse_cache_parser parser);
+
+void
+parse_cache_deinit(void);
+
+#endif /* !__PARSE_CACHE_H__ */
@@ -191,7 +191,7 @@ int daap_lex_parse(struct daap_result *result, const char *input);
 /* Definition of struct that will hold the parsing result */
 %code requires {
 struct daap_result {
-  char str[1024];
+  char str[4096];
   int offset;
   int err;
   char errmsg[128];
@@ -273,6 +273,23 @@ static void sql_like_escape(char **value, char *escape_char)
   *value = new;
 }
 
+// Search index filter for a '*value*' wildcard, or NULL if it can't be used.
+// Values with escapes are skipped, since the LIKE gets them partially escaped.
+static char *daap_search_filter(const char *db_col, const char *wildcard)
+{
+  char *value;
+  char *filter;
+  size_t len = strlen(wildcard);
+
+  if (len < 2 || strchr(wildcard, '\\'))
+    return NULL;
+
+  value = strndup(wildcard + 1, len - 2);
+  filter = db_search_filter(db_col, value);
+  free(value);
+  return filter;
+}
+
 static void sql_str_escape(char **value)
 {
   char *s = *value;
@@ -290,6 +307,7 @@ static void sql_append_dmap_clause(struct daap_result *result, struct ast *a)
   struct ast *k = a->l;
   struct ast *v = a->r;
   bool is_equal = (a->type == DAAP_T_EQUAL);
+  char *search_filter = NULL;
   char escape_char;
   char *key;
   long long int intval;
@@ -336,6 +354,11 @@ static void sql_append_dmap_clause(struct daap_result *result, struct ast *a)
     }
   else if (!dqfm->as_int && v->type == DAAP_T_WILDCARD)
     {
+      // Use the search index to narrow down, the LIKE still does the matching
+      if (is_equal)
+        search_filter = daap_search_filter(dqfm->db_col, (char *)v->data);
+      if (search_filter)
+        sql_append(result, "(%s AND ", search_filter);
       sql_like_escape((char **)&v->data, &escape_char);
       sql_str_escape((char **)&v->data);
       sql_append(result, "%s", dqfm->db_col);
@@ -343,6 +366,9 @@ static void sql_append_dmap_clause(struct daap_result *result, struct ast *a)
       sql_append(result, "'%s'", (char *)v->data);
       if (escape_char)
         sql_append(result, " ESCAPE '%c'", escape_char);
+      if (search_filter)
+        sql_append(result, ")");
+      free(search_filter);
       return;
     }
   else if (!v->data)
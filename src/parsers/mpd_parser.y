@@ -228,6 +228,9 @@ struct mpd_result {
   char errmsg[128];
 
   int recursion_level;
+
+  // Greater than 0 while appending a negated subexpression
+  int not_level;
 };
 
 enum mpd_type {
@@ -420,6 +423,7 @@ static void sql_append(struct mpd_result *result, struct mpd_result_part *part,
 
 static void sql_append_recursive(struct mpd_result *result, struct mpd_result_part *part, struct ast *a, const char *op, const char *op_not, bool is_not, enum sql_append_type append_type)
 {
+  char *search_filter = NULL;
   char escape_char;
 
   if (result->recursion_level > RECURSION_MAX)
@@ -436,7 +440,9 @@ static void sql_append_recursive(struct mpd_result *result, struct mpd_result_pa
     case SQL_APPEND_OPERATOR:
       sql_from_ast(result, part, a->l);
       sql_append(result, part, " %s ", is_not ? op_not : op);
+      result->not_level += is_not;
       sql_from_ast(result, part, a->r);
+      result->not_level -= is_not;
       break;
     case SQL_APPEND_OPERATOR_STR:
       sql_from_ast(result, part, a->l);
@@ -445,6 +451,12 @@ static void sql_append_recursive(struct mpd_result *result, struct mpd_result_pa
       sql_append(result, part, "'");
       break;
     case SQL_APPEND_OPERATOR_LIKE:
+      // Use the search index to narrow down, the LIKE still does the matching.
+      // Not when negated, since NOT (index AND LIKE) would also match NULLs.
+      if (a->type == MPD_T_CONTAINS && !is_not && result->not_level == 0 && a->l->data)
+        search_filter = db_search_filter(tag_to_dbcol((char *)a->l->data), (char *)a->r->data);
+      if (search_filter)
+        sql_append(result, part, "(%s AND ", search_filter);
       sql_from_ast(result, part, a->l);
       sql_append(result, part, " %s '%s", is_not ? op_not : op, a->type == MPD_T_STARTSWITH ? "" : "%");
       sql_like_escape((char **)(&a->r->data), &escape_char);
@@ -452,6 +464,9 @@ static void sql_append_recursive(struct mpd_result *result, struct mpd_result_pa
       sql_append(result, part, "%s'", a->type == MPD_T_ENDSWITH ? "" : "%");
       if (escape_char)
         sql_append(result, part, " ESCAPE '%c'", escape_char);
+      if (search_filter)
+        sql_append(result, part, ")");
+      free(search_filter);
       break;
     case SQL_APPEND_FIELD:
       assert(a->l == NULL);
@@ -488,7 +503,9 @@ static void sql_append_recursive(struct mpd_result *result, struct mpd_result_pa
       if (is_not ? op_not : op)
         sql_append(result, part, "%s ", is_not ? op_not : op);
       sql_append(result, part, "(");
+      result->not_level += is_not;
       sql_from_ast(result, part, a->l);
+      result->not_level -= is_not;
       sql_append(result, part, ")");
       break;
   }
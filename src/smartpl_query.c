@@ -32,6 +32,7 @@
 #include <errno.h>
 
 #include "smartpl_query.h"
+#include "parse_cache.h"
 #include "parsers/smartpl_parser.h"
 #include "logger.h"
 #include "misc.h"
@@ -90,6 +91,7 @@ int
 smartpl_query_parse_string(struct smartpl *smartpl, const char *expression)
 {
   struct smartpl_result result;
+  struct parse_cache_sql sql;
 
   if (!expression)
     {
@@ -97,6 +99,18 @@ smartpl_query_parse_string(struct smartpl *smartpl, const char *expression)
       return -1;
     }
 
+  if (parse_cache_get(&sql, PARSE_CACHE_SMARTPL, expression) == 0)
+    {
+      free_smartpl(smartpl, 1);
+
+      smartpl->title = sql.title;
+      smartpl->query_where = sql.where;
+      smartpl->having = sql.having;
+      smartpl->order = sql.order;
+      smartpl->limit = sql.limit;
+      return 0;
+    }
+
   DPRINTF(E_SPAM, L_SCAN, "Parse smartpl query input '%s'\n", expression);
 
   if (smartpl_lex_parse(&result, expression) != 0)
@@ -128,6 +142,13 @@ smartpl_query_parse_string(struct smartpl *smartpl, const char *expression)
   DPRINTF(E_SPAM, L_SCAN, "Parse smartpl query output '%s': WHERE %s HAVING %s ORDER BY %s LIMIT %d\n",
     smartpl->title, smartpl->query_where, smartpl->having, smartpl->order, smartpl->limit);
 
+  sql.title = smartpl->title;
+  sql.where = smartpl->query_where;
+  sql.having = smartpl->having;
+  sql.order = smartpl->order;
+  sql.limit = smartpl->limit;
+  parse_cache_add(PARSE_CACHE_SMARTPL, expression, &sql);
+
   return 0;
 }
 
@@ -155,6 +155,10 @@ struct decode_ctx
   // Used to determine if ICY metadata is relevant to look for
   bool is_http;
 
+  // Images only, max dimensions the caller will scale the decoded image to
+  int max_width;
+  int max_height;
+
   // Set to true if we just seeked
   bool resume;
 
@@ -362,6 +366,19 @@ init_settings(struct settings_ctx *settings, enum transcode_profile profile, str
 	settings->video_codec = AV_CODEC_ID_VP8;
 	break;
 
+      case XCODE_WEBP:
+	settings->encode_video = true;
+	settings->silent = true;
+// See explanation above
+#if USE_IMAGE2PIPE
+	settings->format = "image2pipe";
+#else
+	settings->format = "image2";
+#endif
+	settings->pix_fmt = AV_PIX_FMT_YUV420P;
+	settings->video_codec = AV_CODEC_ID_WEBP;
+	break;
+
       default:
 	DPRINTF(E_LOG, L_XCODE, "Bug! Unknown transcoding profile\n");
 	return -1;
@@ -633,7 +650,10 @@ stream_add(struct encode_ctx *ctx, struct stream_ctx *s, enum AVCodecID codec_id
       return -1;
     }
 
-  encoder = avcodec_find_encoder(codec_id);
+  // avcodec_find_encoder() may select libwebp_anim, but we want a still image
+  encoder = (codec_id == AV_CODEC_ID_WEBP) ? avcodec_find_encoder_by_name("libwebp") : NULL;
+  if (!encoder)
+    encoder = avcodec_find_encoder(codec_id);
   if (!encoder)
     {
       DPRINTF(E_LOG, L_XCODE, "Necessary encoder (%s) not found\n", codec_desc->name);
@@ -1314,6 +1334,30 @@ make_mp4_header(struct evbuffer **mp4_header, const char *url)
 
 /* --------------------------- INPUT/OUTPUT INIT --------------------------- */
 
+// The JPEG decoder can decode directly at 1/2, 1/4 or 1/8 resolution from the
+// DCT coefficients, which is much cheaper than decoding the full image just to
+// scale it down afterwards. Returns the largest reduction (as a power of 2) that
+// still gives an image at least as large as what it will be scaled to.
+static int
+lowres_get(AVCodecContext *dec_ctx, int max_lowres, int max_w, int max_h)
+{
+  int lowres;
+
+  if (dec_ctx->codec_id != AV_CODEC_ID_MJPEG || max_w <= 0 || max_h <= 0)
+    return 0;
+
+  for (lowres = 0; lowres < max_lowres; lowres++)
+    {
+      if (AV_CEIL_RSHIFT(dec_ctx->width, lowres + 1) < max_w && AV_CEIL_RSHIFT(dec_ctx->height, lowres + 1) < max_h)
+	break;
+    }
+
+  if (lowres > 0)
+    DPRINTF(E_DBG, L_XCODE, "Decoding %dx%d image at 1/%d resolution\n", dec_ctx->width, dec_ctx->height, 1 << lowres);
+
+  return lowres;
+}
+
 static int
 open_decoder(AVCodecContext **dec_ctx, unsigned int *stream_index, struct decode_ctx *ctx, enum AVMediaType type)
 {
@@ -1348,6 +1392,9 @@ open_decoder(AVCodecContext **dec_ctx, unsigned int *stream_index, struct decode
       return ret;
     }
 
+  if (type == AVMEDIA_TYPE_VIDEO)
+    (*dec_ctx)->lowres = lowres_get(*dec_ctx, decoder->max_lowres, ctx->max_width, ctx->max_height);
+
   ret = avcodec_open2(*dec_ctx, NULL, NULL);
   if (ret < 0)
     {
@@ -1937,6 +1984,8 @@ transcode_decode_setup(struct transcode_decode_setup_args args)
   CHECK_NULL(L_XCODE, ctx->packet = av_packet_alloc());
 
   ctx->len_ms = args.len_ms;
+  ctx->max_width = args.width;
+  ctx->max_height = args.height;
 
   ret = init_settings(&ctx->settings, args.profile, args.quality);
   if (ret < 0)
@@ -2192,6 +2241,24 @@ transcode_needed(const char *user_agent, const char *client_codecs, const char *
   return XCODE_UNKNOWN;
 }
 
+bool
+transcode_encode_supported(enum transcode_profile profile)
+{
+  struct settings_ctx settings;
+
+  if (init_settings(&settings, profile, NULL) < 0)
+    return false;
+
+  if (settings.encode_audio && !avcodec_find_encoder(settings.audio_codec))
+    return false;
+  if (settings.encode_video && !avcodec_find_encoder(settings.video_codec))
+    return false;
+  if (settings.format && !av_guess_format(settings.format, NULL, NULL))
+    return false;
+
+  return true;
+}
+
 
 /*                                  Cleanup                                  */
 
@@ -2581,49 +2648,41 @@ transcode_metadata(struct transcode_ctx *ctx, int *changed)
 }
 
 void
-transcode_metadata_strings_set(struct transcode_metadata_string *s, enum transcode_profile profile, struct media_quality *q, uint32_t len_ms)
+transcode_metadata_set(struct transcode_metadata *m, enum transcode_profile profile, struct media_quality *q, uint32_t len_ms)
 {
-  off_t bytes;
-
-  memset(s, 0, sizeof(struct transcode_metadata_string));
+  memset(m, 0, sizeof(struct transcode_metadata));
 
   switch (profile)
     {
       case XCODE_WAV:
-	s->type = "wav";
-	s->codectype = "wav";
-	s->description = "WAV audio file";
-
-	snprintf(s->bitrate, sizeof(s->bitrate), "%d", 8 * STOB(q->sample_rate, q->bits_per_sample, q->channels) / 1000); // 44100/16/2 -> 1411
+	m->type = "wav";
+	m->codectype = "wav";
+	m->description = "WAV audio file";
 
-	bytes = size_estimate(profile, q->bit_rate, q->sample_rate, q->bits_per_sample / 8, q->channels, len_ms);
-	snprintf(s->file_size, sizeof(s->file_size), "%d", (int)bytes);
+	m->bitrate = 8 * STOB(q->sample_rate, q->bits_per_sample, q->channels) / 1000; // 44100/16/2 -> 1411
+	m->file_size = size_estimate(profile, q->bit_rate, q->sample_rate, q->bits_per_sample / 8, q->channels, len_ms);
 	break;
 
       case XCODE_MP3:
-	s->type = "mp3";
-	s->codectype = "mpeg";
-	s->description = "MPEG audio file";
+	m->type = "mp3";
+	m->codectype = "mpeg";
+	m->description = "MPEG audio file";
 
-	snprintf(s->bitrate, sizeof(s->bitrate), "%d", q->bit_rate / 1000);
-
-	bytes = size_estimate(profile, q->bit_rate, q->sample_rate, q->bits_per_sample / 8, q->channels, len_ms);
-	snprintf(s->file_size, sizeof(s->file_size), "%d", (int)bytes);
+	m->bitrate = q->bit_rate / 1000;
+	m->file_size = size_estimate(profile, q->bit_rate, q->sample_rate, q->bits_per_sample / 8, q->channels, len_ms);
 	break;
 
       case XCODE_MP4_ALAC:
-	s->type = "m4a";
-	s->codectype = "alac";
-	s->description = "Apple Lossless audio file";
-
-	snprintf(s->bitrate, sizeof(s->bitrate), "%d", 8 * STOB(q->sample_rate, q->bits_per_sample, q->channels) / 1000); // 44100/16/2 -> 1411
+	m->type = "m4a";
+	m->codectype = "alac";
+	m->description = "Apple Lossless audio file";
 
-	bytes = size_estimate(profile, q->bit_rate, q->sample_rate, q->bits_per_sample / 8, q->channels, len_ms);
-	snprintf(s->file_size, sizeof(s->file_size), "%d", (int)bytes);
+	m->bitrate = 8 * STOB(q->sample_rate, q->bits_per_sample, q->channels) / 1000; // 44100/16/2 -> 1411
+	m->file_size = size_estimate(profile, q->bit_rate, q->sample_rate, q->bits_per_sample / 8, q->channels, len_ms);
 	break;
 
       default:
-	DPRINTF(E_WARN, L_XCODE, "transcode_metadata_strings_set() called with unknown profile %d\n", profile);
+	DPRINTF(E_WARN, L_XCODE, "transcode_metadata_set() called with unknown profile %d\n", profile);
     }
 }
 
@@ -32,10 +32,11 @@ enum transcode_profile
   XCODE_MP4_ALAC_HEADER,
   // Transcodes the best audio stream from OGG
   XCODE_OGG,
-  // Transcodes the best video stream to JPEG/PNG/VP8
+  // Transcodes the best video stream to JPEG/PNG/VP8/WebP
   XCODE_JPEG,
   XCODE_PNG,
   XCODE_VP8,
+  XCODE_WEBP,
 };
 
 enum transcode_seek_type
@@ -75,6 +76,11 @@ struct transcode_decode_setup_args
   // Source must be either of these
   const char *path;
   struct transcode_evbuf_io *evbuf_io;
+
+  // Images only, max dimensions that the image will be scaled to. Lets the
+  // decoder decode JPEGs at reduced resolution. Zero for full resolution.
+  int width;
+  int height;
 };
 
 struct transcode_encode_setup_args
@@ -88,13 +94,13 @@ struct transcode_encode_setup_args
   int height;
 };
 
-struct transcode_metadata_string
+struct transcode_metadata
 {
   char *type;
   char *codectype;
   char *description;
-  char file_size[64];
-  char bitrate[32];
+  int64_t file_size;
+  uint32_t bitrate;
 };
 
 
@@ -114,6 +120,10 @@ transcode_decode_setup_raw(enum transcode_profile profile, struct media_quality
 enum transcode_profile
 transcode_needed(const char *user_agent, const char *client_codecs, const char *file_codectype);
 
+// Checks if the ffmpeg/libav build has the encoder and muxer that the profile needs
+bool
+transcode_encode_supported(enum transcode_profile profile);
+
 // Cleaning up
 void
 transcode_decode_cleanup(struct decode_ctx **ctx);
@@ -210,15 +220,15 @@ transcode_metadata(struct transcode_ctx *ctx, int *changed);
 
 /* When transcoding, we are in essence serving a different source file than the
  * original to the client. So we can't serve some of the file metadata from the
- * filescanner. This function creates strings to be used for override.
+ * filescanner. This function sets the values to be used for override.
  *
- * @out s          Structure with (non-allocated) strings
+ * @out m          Structure with the values (strings are not allocated)
  * @in  profile    Transcoding profile
  * @in  q          Transcoding quality
  * @in  len_ms     Length of source track
  */
 void
-transcode_metadata_strings_set(struct transcode_metadata_string *s, enum transcode_profile profile, struct media_quality *q, uint32_t len_ms);
+transcode_metadata_set(struct transcode_metadata *m, enum transcode_profile profile, struct media_quality *q, uint32_t len_ms);
 
 /* Creates a header for later transcoding of a source file. This header can be
  * given to transcode_encode_setup which in some cases will make it faster (MP4)
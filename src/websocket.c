@@ -173,6 +173,10 @@ process_notify_request(short *requested_events, void *in, size_t len)
 		{
 		  *requested_events |= LISTENER_QUEUE;
 		}
+	      else if (0 == strcmp(event_type, "backup"))
+		{
+		  *requested_events |= LISTENER_BACKUP;
+		}
 	    }
 	}
     }
@@ -243,6 +247,10 @@ send_notify_reply(short events, struct lws* wsi)
     {
       json_object_array_add(notify, json_object_new_string("queue"));
     }
+  if (events & LISTENER_BACKUP)
+    {
+      json_object_array_add(notify, json_object_new_string("backup"));
+    }
 
   reply = json_object_new_object();
   json_object_object_add(reply, "notify", notify);
@@ -416,7 +424,7 @@ websocket(void *arg)
   thread_setname("websocket");
 
   listener_add(listener_cb, LISTENER_UPDATE | LISTENER_DATABASE | LISTENER_PAIRING | LISTENER_SPOTIFY | LISTENER_LASTFM | LISTENER_SPEAKER
-               | LISTENER_PLAYER | LISTENER_OPTIONS | LISTENER_VOLUME | LISTENER_QUEUE, NULL);
+               | LISTENER_PLAYER | LISTENER_OPTIONS | LISTENER_VOLUME | LISTENER_QUEUE | LISTENER_BACKUP, NULL);
 
   while(!websocket_exit)
   {
@@ -44,8 +44,11 @@
 #include "misc.h"
 
 #define THREADPOOL_NTHREADS 4
+// Threads for worker_lookups_run(), which mostly wait for network replies
+#define THREADPOOL_LOOKUP_NTHREADS 4
 
 static struct evthr_pool *worker_threadpool;
+static struct evthr_pool *lookup_threadpool;
 static __thread struct evthr *worker_thr;
 
 
@@ -60,6 +63,26 @@ struct worker_arg
   struct event *timer;
 };
 
+struct worker_lookups
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int refcount;
+
+  int (*cb)(void *);
+  void (*free_cb)(void *);
+  int n;
+  void **cb_args;
+  int *rets;
+  bool *done;
+};
+
+struct lookup_arg
+{
+  struct worker_lookups *lookups;
+  int idx;
+};
+
 
 static void
 execute_cb(int fd, short what, void *arg)
@@ -93,6 +116,67 @@ execute(struct evthr *thr, void *arg, void *shared)
   free(cmdarg);
 }
 
+static void
+lookups_release(struct worker_lookups *lookups)
+{
+  int refcount;
+  int i;
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&lookups->mutex));
+  refcount = --lookups->refcount;
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&lookups->mutex));
+
+  if (refcount > 0)
+    return;
+
+  for (i = 0; i < lookups->n; i++)
+    lookups->free_cb(lookups->cb_args[i]);
+
+  CHECK_ERR(L_MAIN, pthread_cond_destroy(&lookups->cond));
+  CHECK_ERR(L_MAIN, pthread_mutex_destroy(&lookups->mutex));
+  free(lookups->cb_args);
+  free(lookups->rets);
+  free(lookups->done);
+  free(lookups);
+}
+
+// Must be called with the lock held
+static bool
+lookups_is_decided(struct worker_lookups *lookups, bool (*is_decided)(int))
+{
+  int i;
+
+  for (i = 0; i < lookups->n; i++)
+    {
+      if (!lookups->done[i])
+	return false;
+      if (is_decided(lookups->rets[i]))
+	return true;
+    }
+
+  return true;
+}
+
+static void
+lookup_execute(struct evthr *thr, void *arg, void *shared)
+{
+  struct lookup_arg *cmdarg = arg;
+  struct worker_lookups *lookups = cmdarg->lookups;
+  int ret;
+
+  ret = lookups->cb(lookups->cb_args[cmdarg->idx]);
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&lookups->mutex));
+  lookups->rets[cmdarg->idx] = ret;
+  lookups->done[cmdarg->idx] = true;
+  CHECK_ERR(L_MAIN, pthread_cond_signal(&lookups->cond));
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&lookups->mutex));
+
+  lookups_release(lookups);
+  free(cmdarg);
+}
+
+// shared is the name of the pool's threads
 static void
 init_cb(struct evthr *thr, void *shared)
 {
@@ -100,7 +184,7 @@ init_cb(struct evthr *thr, void *shared)
 
   worker_thr = thr;
 
-  thread_setname("worker");
+  thread_setname(shared);
 }
 
 static void
@@ -149,6 +233,69 @@ worker_execute(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay)
   evthr_pool_defer(worker_threadpool, execute, cmdarg);
 }
 
+struct worker_lookups *
+worker_lookups_run(int (*cb)(void *), void **cb_args, int n, void (*free_cb)(void *), bool (*is_decided)(int), int timeout, int *rets)
+{
+  struct worker_lookups *lookups;
+  struct lookup_arg *cmdarg;
+  struct timespec deadline;
+  int i;
+  int ret;
+
+  CHECK_NULL(L_MAIN, lookups = calloc(1, sizeof(struct worker_lookups)));
+  CHECK_NULL(L_MAIN, lookups->cb_args = calloc(n, sizeof(void *)));
+  CHECK_NULL(L_MAIN, lookups->rets = calloc(n, sizeof(int)));
+  CHECK_NULL(L_MAIN, lookups->done = calloc(n, sizeof(bool)));
+  CHECK_ERR(L_MAIN, mutex_init(&lookups->mutex));
+  CHECK_ERR(L_MAIN, pthread_cond_init(&lookups->cond, NULL));
+
+  lookups->cb = cb;
+  lookups->free_cb = free_cb;
+  lookups->n = n;
+  lookups->refcount = n + 1;
+  memcpy(lookups->cb_args, cb_args, n * sizeof(void *));
+
+  for (i = 0; i < n; i++)
+    {
+      CHECK_NULL(L_MAIN, cmdarg = calloc(1, sizeof(struct lookup_arg)));
+      cmdarg->lookups = lookups;
+      cmdarg->idx = i;
+
+      ret = evthr_pool_defer(lookup_threadpool, lookup_execute, cmdarg);
+      if (ret != EVTHR_RES_OK)
+	{
+	  DPRINTF(E_LOG, L_MAIN, "Could not start lookup %d of %d\n", i + 1, n);
+	  free(cmdarg);
+	  lookups_release(lookups);
+	}
+    }
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout;
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&lookups->mutex));
+
+  while (!lookups_is_decided(lookups, is_decided))
+    {
+      ret = pthread_cond_timedwait(&lookups->cond, &lookups->mutex, &deadline);
+      if (ret == ETIMEDOUT)
+	break;
+    }
+
+  for (i = 0; i < n; i++)
+    rets[i] = lookups->done[i] ? lookups->rets[i] : WORKER_LOOKUP_PENDING;
+
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&lookups->mutex));
+
+  return lookups;
+}
+
+void
+worker_lookups_free(struct worker_lookups *lookups)
+{
+  lookups_release(lookups);
+}
+
 struct event_base *
 worker_evbase_get(void)
 {
@@ -160,7 +307,7 @@ worker_init(void)
 {
   int ret;
 
-  worker_threadpool = evthr_pool_wexit_new(THREADPOOL_NTHREADS, init_cb, exit_cb, NULL);
+  worker_threadpool = evthr_pool_wexit_new(THREADPOOL_NTHREADS, init_cb, exit_cb, "worker");
   if (!worker_threadpool)
     {
       DPRINTF(E_LOG, L_MAIN, "Could not create worker thread pool\n");
@@ -174,6 +321,20 @@ worker_init(void)
       goto error;
     }
 
+  lookup_threadpool = evthr_pool_wexit_new(THREADPOOL_LOOKUP_NTHREADS, init_cb, exit_cb, "lookup");
+  if (!lookup_threadpool)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not create lookup thread pool\n");
+      goto error;
+    }
+
+  ret = evthr_pool_start(lookup_threadpool);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not spawn lookup threads\n");
+      goto error;
+    }
+
   return 0;
   
  error:
@@ -184,6 +345,8 @@ worker_init(void)
 void
 worker_deinit(void)
 {
+  evthr_pool_stop(lookup_threadpool);
+  evthr_pool_free(lookup_threadpool);
   evthr_pool_stop(worker_threadpool);
   evthr_pool_free(worker_threadpool);
 }
@@ -2,6 +2,8 @@
 #ifndef __WORKER_H__
 #define __WORKER_H__
 
+#include <stdbool.h>
+#include <limits.h>
 #include <event2/event.h>
 
 /* The worker thread is made for running asyncronous tasks from a real time
@@ -21,6 +23,38 @@
 void
 worker_execute(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay);
 
+// Return value of a lookup that did not finish, see worker_lookups_run()
+#define WORKER_LOOKUP_PENDING INT_MIN
+
+struct worker_lookups;
+
+/* Runs n lookups, e.g. requests to online services, in parallel on a pool of
+ * threads that is separate from the worker pool, so a worker callback can wait
+ * for them without holding up other worker jobs. The lookups are in order of
+ * priority. Waits until the result is decided, i.e. until a lookup for which
+ * is_decided() is true and all lookups before it have finished, or until all
+ * have finished, but at most timeout seconds.
+ *
+ * A lookup that didn't finish may still be running, so the caller may only use
+ * the cb_args of lookups that finished, and only until worker_lookups_free().
+ * The cb_args are freed with free_cb when both the caller and the lookups are
+ * done with them.
+ *
+ * @param cb the lookup function to call from a lookup thread
+ * @param cb_args argument for each lookup
+ * @param n number of lookups
+ * @param free_cb frees an argument
+ * @param is_decided true if the return value of a lookup decides the result
+ * @param timeout how long to wait in seconds
+ * @param rets the return value of each lookup, or WORKER_LOOKUP_PENDING
+ * @return handle to release with worker_lookups_free()
+ */
+struct worker_lookups *
+worker_lookups_run(int (*cb)(void *), void **cb_args, int n, void (*free_cb)(void *), bool (*is_decided)(int), int timeout, int *rets);
+
+void
+worker_lookups_free(struct worker_lookups *lookups);
+
 /* Can be called within a callback to get the worker thread's event base
  */
 struct event_base *
@@ -0,0 +1,10 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+/* Helpers for all the benchmarks, see bench.c */
+
+// Returns a monotonic time in seconds
+double
+bench_now(void);
+
+#endif /* !__BENCH_H__ */
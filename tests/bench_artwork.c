@@ -0,0 +1,214 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Runs transcode.c without the rest of the server for the artwork benchmarks.
+ * The modules that transcode.c calls into are replaced by the stubs below, and
+ * the configuration by the defaults from conffile.c.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+
+#include "bench_artwork.h"
+#include "conffile.h"
+#include "http.h"
+#include "logger.h"
+#include "misc.h"
+
+cfg_t *cfg;
+
+
+/* ---------------------------------- Stubs --------------------------------- */
+
+void
+DPRINTF(int severity, int domain, const char *fmt, ...)
+{
+  va_list ap;
+
+  if (severity > E_LOG)
+    return;
+
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
+
+// Only used for streams
+struct http_icy_metadata *
+http_icy_metadata_get(AVFormatContext *fmtctx, int packet_only)
+{
+  return NULL;
+}
+
+// Sections are just their names
+cfg_t *
+cfg_getsec(cfg_t *cfg, const char *name)
+{
+  return (cfg_t *)name;
+}
+
+// general:user_agent is the only string option, and is only used for streams
+char *
+cfg_getstr(cfg_t *sec, const char *name)
+{
+  return PACKAGE_NAME "/" PACKAGE_VERSION;
+}
+
+// general:ipv6 is the only bool option, and is only used by misc.c
+cfg_bool_t
+cfg_getbool(cfg_t *sec, const char *name)
+{
+  return cfg_false;
+}
+
+// The lists, e.g. library:decode_video_filters, are empty by default
+unsigned int
+cfg_size(cfg_t *sec, const char *name)
+{
+  return 0;
+}
+
+char *
+cfg_getnstr(cfg_t *sec, const char *name, unsigned int index)
+{
+  return NULL;
+}
+
+
+/* --------------------------------- Helpers -------------------------------- */
+
+void
+bench_artwork_corpus_load(struct bench_artwork_corpus *corpus, const char *dir, bool with_png)
+{
+  struct dirent *de;
+  const char *ext;
+  DIR *dh;
+
+  dh = opendir(dir);
+  if (!dh)
+    {
+      perror(dir);
+      exit(EXIT_FAILURE);
+    }
+
+  corpus->n = 0;
+  while ((de = readdir(dh)) && corpus->n < BENCH_ARTWORK_FILES_MAX)
+    {
+      ext = strrchr(de->d_name, '.');
+      if (!ext)
+	continue;
+      if (strcasecmp(ext, ".jpg") != 0 && strcasecmp(ext, ".jpeg") != 0 && !(with_png && strcasecmp(ext, ".png") == 0))
+	continue;
+
+      if (asprintf(&corpus->paths[corpus->n], "%s/%s", dir, de->d_name) < 0)
+	exit(EXIT_FAILURE);
+      corpus->n++;
+    }
+
+  closedir(dh);
+}
+
+void
+bench_artwork_corpus_free(struct bench_artwork_corpus *corpus)
+{
+  int i;
+
+  for (i = 0; i < corpus->n; i++)
+    free(corpus->paths[i]);
+
+  corpus->n = 0;
+}
+
+int
+bench_artwork_thumbnail(struct evbuffer *evbuf, double *encode_sec, const char *path, enum transcode_profile profile, int max_size, bool lowres)
+{
+  struct transcode_decode_setup_args decode_args = { .profile = XCODE_JPEG }; // Covers XCODE_PNG too
+  struct transcode_encode_setup_args encode_args = { 0 };
+  struct decode_ctx *decode_ctx = NULL;
+  struct encode_ctx *encode_ctx = NULL;
+  transcode_frame *frame;
+  double start;
+  int src_width;
+  int src_height;
+  int ret = -1;
+
+  decode_args.path = path;
+  if (lowres)
+    {
+      decode_args.width = max_size;
+      decode_args.height = max_size;
+    }
+
+  decode_ctx = transcode_decode_setup(decode_args);
+  if (!decode_ctx)
+    goto out;
+
+  src_width = transcode_decode_query(decode_ctx, "width");
+  src_height = transcode_decode_query(decode_ctx, "height");
+  if (src_width <= 0 || src_height <= 0)
+    goto out;
+
+  // Fit within max_size x max_size, like size_calculate() in artwork.c
+  encode_args.src_ctx = decode_ctx;
+  encode_args.profile = profile;
+  if (src_width <= max_size && src_height <= max_size)
+    {
+      encode_args.width = src_width;
+      encode_args.height = src_height;
+    }
+  else if (src_width > src_height)
+    {
+      encode_args.width = max_size;
+      encode_args.height = (int64_t)max_size * src_height / src_width;
+    }
+  else
+    {
+      encode_args.width = (int64_t)max_size * src_width / src_height;
+      encode_args.height = max_size;
+    }
+
+  // PNG prefers even row count
+  encode_args.width -= encode_args.width % 2;
+
+  encode_ctx = transcode_encode_setup(encode_args);
+  if (!encode_ctx)
+    goto out;
+
+  if (transcode_decode(&frame, decode_ctx) < 0)
+    goto out;
+
+  start = bench_now();
+
+  ret = transcode_encode(evbuf, encode_ctx, frame, 1);
+
+  if (encode_sec)
+    *encode_sec += bench_now() - start;
+
+ out:
+  transcode_encode_cleanup(&encode_ctx);
+  transcode_decode_cleanup(&decode_ctx);
+
+  return (ret < 0) ? -1 : 0;
+}
@@ -0,0 +1,42 @@
+#ifndef __BENCH_ARTWORK_H__
+#define __BENCH_ARTWORK_H__
+
+#include <stdbool.h>
+
+#include <event2/buffer.h>
+
+#include "bench.h"
+#include "transcode.h"
+
+/* Helpers for the artwork benchmarks, which run transcode.c without the rest
+ * of the server, see bench_artwork.c. The configuration that transcode.c reads
+ * has the defaults from conffile.c.
+ */
+
+#define BENCH_ARTWORK_FILES_MAX 4096
+
+struct bench_artwork_corpus
+{
+  char *paths[BENCH_ARTWORK_FILES_MAX];
+  int n;
+};
+
+// Loads the paths of the JPEG files in dir, and of the PNG files if with_png.
+// Exits on error.
+void
+bench_artwork_corpus_load(struct bench_artwork_corpus *corpus, const char *dir, bool with_png);
+
+void
+bench_artwork_corpus_free(struct bench_artwork_corpus *corpus);
+
+// Makes a thumbnail of the image file at path that fits within max_size x
+// max_size, and adds it to evbuf. It is made like artwork_get() does it, with
+// transcode_decode_setup() and transcode_encode_setup() for the profile. If
+// lowres is false, the decoder is not told the size, so it decodes JPEGs at
+// full resolution. The time spent in transcode_encode(), i.e. scaling and
+// encoding, is added to encode_sec, unless it is NULL. Returns 0 on success,
+// -1 on error.
+int
+bench_artwork_thumbnail(struct evbuffer *evbuf, double *encode_sec, const char *path, enum transcode_profile profile, int max_size, bool lowres);
+
+#endif /* !__BENCH_ARTWORK_H__ */
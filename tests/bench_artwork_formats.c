@@ -0,0 +1,157 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Measures the size and the encode time of artwork thumbnails in each of the
+ * formats that artwork.c can send: JPEG, PNG and WebP. The JPEG and PNG covers
+ * in a directory are made into thumbnails with transcode.c, like artwork_get()
+ * does it, with the XCODE_JPEG, XCODE_PNG and XCODE_WEBP profiles. Only
+ * transcode_encode(), i.e. scaling and encoding, is timed, so decoding, which
+ * is the same for all formats, doesn't blur the comparison.
+ *
+ * Usage: bench_artwork_formats <directory with covers> [max size] [passes]
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libavutil/log.h>
+
+#include "bench_artwork.h"
+
+struct bench_format
+{
+  const char *name;
+  enum transcode_profile profile;
+
+  // Results
+  int64_t bytes;
+  double encode_sec;
+  int encoded;
+  int failed;
+};
+
+static struct bench_format bench_formats[] =
+{
+  { "JPEG", XCODE_JPEG },
+  { "PNG", XCODE_PNG },
+  { "WebP", XCODE_WEBP },
+};
+
+static void
+bench_run(struct bench_artwork_corpus *corpus, int max_size, int passes)
+{
+  struct bench_format *bf;
+  struct evbuffer *evbuf;
+  int i;
+  int j;
+  int k;
+
+  evbuf = evbuffer_new();
+  if (!evbuf)
+    exit(EXIT_FAILURE);
+
+  for (i = 0; i < corpus->n; i++)
+    {
+      for (j = 0; j < sizeof(bench_formats) / sizeof(bench_formats[0]); j++)
+	{
+	  bf = &bench_formats[j];
+
+	  if (!transcode_encode_supported(bf->profile))
+	    continue;
+
+	  for (k = 0; k < passes; k++)
+	    {
+	      if (bench_artwork_thumbnail(evbuf, &bf->encode_sec, corpus->paths[i], bf->profile, max_size, true) < 0)
+		{
+		  bf->failed++;
+		  continue;
+		}
+
+	      bf->bytes += evbuffer_get_length(evbuf);
+	      bf->encoded++;
+	      evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+	    }
+	}
+    }
+
+  evbuffer_free(evbuf);
+}
+
+int
+main(int argc, char **argv)
+{
+  struct bench_artwork_corpus corpus;
+  struct bench_format *bf;
+  int max_size = 300;
+  int passes = 3;
+  int j;
+
+  if (argc < 2)
+    {
+      fprintf(stderr, "Usage: %s <directory with covers> [max size] [passes]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  if (argc > 2)
+    max_size = atoi(argv[2]);
+  if (argc > 3)
+    passes = atoi(argv[3]);
+
+  if (max_size <= 0 || passes <= 0)
+    {
+      fprintf(stderr, "Invalid max size or number of passes\n");
+      return EXIT_FAILURE;
+    }
+
+  bench_artwork_corpus_load(&corpus, argv[1], true);
+  if (corpus.n == 0)
+    {
+      fprintf(stderr, "No JPEG or PNG files in '%s'\n", argv[1]);
+      return EXIT_FAILURE;
+    }
+
+  av_log_set_level(AV_LOG_QUIET);
+
+  printf("%d covers, max size %dx%d, %d passes\n", corpus.n, max_size, max_size, passes);
+
+  bench_run(&corpus, max_size, passes);
+
+  for (j = 0; j < sizeof(bench_formats) / sizeof(bench_formats[0]); j++)
+    {
+      bf = &bench_formats[j];
+
+      if (bf->encoded == 0)
+	{
+	  printf("%-6s no encoder, or all encodes failed\n", bf->name);
+	  continue;
+	}
+
+      printf("%-6s %10.0f bytes/thumbnail %8.2f ms/encode", bf->name, (double)bf->bytes / bf->encoded, bf->encode_sec * 1000 / bf->encoded);
+      if (bf->failed > 0)
+	printf(" (%d failed)", bf->failed);
+      printf("\n");
+    }
+
+  bench_artwork_corpus_free(&corpus);
+
+  return EXIT_SUCCESS;
+}
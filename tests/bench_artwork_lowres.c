@@ -0,0 +1,136 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Measures thumbnails per second and peak RSS when making thumbnails of the
+ * JPEG covers in a directory with transcode.c, like artwork_get() does. The
+ * covers are decoded at full resolution, and at the reduced resolution that
+ * transcode.c picks when it is told the thumbnail size. Each mode runs in a
+ * child process, so that the peak RSS is its own.
+ *
+ * Usage: bench_artwork_lowres <directory with covers> [max size] [passes]
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <libavutil/log.h>
+
+#include "bench_artwork.h"
+
+static void
+bench_run(struct bench_artwork_corpus *corpus, int max_size, int passes, bool use_lowres)
+{
+  struct evbuffer *evbuf;
+  struct rusage ru;
+  double start;
+  double elapsed;
+  pid_t pid;
+  int status;
+  int failed;
+  int i;
+  int j;
+
+  fflush(stdout);
+
+  pid = fork();
+  if (pid < 0)
+    {
+      perror("fork");
+      exit(EXIT_FAILURE);
+    }
+
+  if (pid == 0)
+    {
+      evbuf = evbuffer_new();
+      failed = 0;
+      start = bench_now();
+
+      for (j = 0; j < passes; j++)
+	for (i = 0; i < corpus->n; i++)
+	  {
+	    failed += (bench_artwork_thumbnail(evbuf, NULL, corpus->paths[i], XCODE_JPEG, max_size, use_lowres) < 0);
+	    evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+	  }
+
+      elapsed = bench_now() - start;
+
+      printf("%-20s %10.1f thumbnails/s", use_lowres ? "reduced resolution" : "full resolution", (corpus->n * passes - failed) / elapsed);
+      if (failed > 0)
+	printf(" (%d failed)", failed / passes);
+      fflush(stdout);
+      _exit(EXIT_SUCCESS);
+    }
+
+  if (wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+    {
+      fprintf(stderr, "\nBenchmark process failed\n");
+      exit(EXIT_FAILURE);
+    }
+
+  printf(", peak RSS %ld KiB\n", ru.ru_maxrss);
+}
+
+int
+main(int argc, char **argv)
+{
+  struct bench_artwork_corpus corpus;
+  int max_size = 150;
+  int passes = 3;
+
+  if (argc < 2)
+    {
+      fprintf(stderr, "Usage: %s <directory with covers> [max size] [passes]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  if (argc > 2)
+    max_size = atoi(argv[2]);
+  if (argc > 3)
+    passes = atoi(argv[3]);
+
+  if (max_size <= 0 || passes <= 0)
+    {
+      fprintf(stderr, "Invalid max size or number of passes\n");
+      return EXIT_FAILURE;
+    }
+
+  bench_artwork_corpus_load(&corpus, argv[1], false);
+  if (corpus.n == 0)
+    {
+      fprintf(stderr, "No JPEG files in '%s'\n", argv[1]);
+      return EXIT_FAILURE;
+    }
+
+  av_log_set_level(AV_LOG_QUIET);
+
+  printf("%d covers, max size %dx%d, %d passes\n", corpus.n, max_size, max_size, passes);
+
+  bench_run(&corpus, max_size, passes, false);
+  bench_run(&corpus, max_size, passes, true);
+
+  bench_artwork_corpus_free(&corpus);
+
+  return EXIT_SUCCESS;
+}
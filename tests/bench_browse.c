@@ -0,0 +1,210 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Measures sorted browse queries on a large library (default 100000 files):
+ *  - the album and artist browse lists, like the DAAP/MPD/JSON API browse
+ *  - the first page of the tracks sorted by title, album and artist
+ * Each query is run with the default order, which is by the binary sort keys,
+ * and with an ORDER BY on the *_sort columns, which use the DAAP collation.
+ * Both must give the same order.
+ *
+ * Usage: bench_browse [nfiles] [db path]
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "bench_db.h"
+#include "misc.h"
+
+#define BENCH_BROWSE_ITERATIONS 5
+#define BENCH_BROWSE_PAGE 50
+
+struct bench_browse_query
+{
+  const char *name;
+  enum query_type type;
+  enum sort_type sort;
+  // The same order as the default, by the DAAP collated columns
+  const char *collate_order;
+};
+
+static const struct bench_browse_query bench_browse_queries[] =
+  {
+    { "browse albums",                  Q_BROWSE_ALBUMS,  S_NONE,   "f.album_sort, f.album" },
+    { "browse artists",                 Q_BROWSE_ARTISTS, S_NONE,   "f.album_artist_sort, f.album_artist" },
+    { "first page of tracks by title",  Q_ITEMS,          S_NAME,   "f.title_sort" },
+    { "first page of tracks by album",  Q_ITEMS,          S_ALBUM,  "f.album_sort, f.album, f.disc, f.track" },
+    { "first page of tracks by artist", Q_ITEMS,          S_ARTIST, "f.album_artist_sort, f.album_artist, f.album_sort, f.album, f.disc, f.track" },
+  };
+
+// Runs the query and returns the name of every row in a NULL terminated list
+static char **
+query_run(const struct bench_browse_query *bq, bool collate)
+{
+  struct query_params qp = { 0 };
+  struct db_media_file_info dbmfi;
+  char **names;
+  char *name;
+  char *sort;
+  int nnames = 0;
+  int ret;
+
+  qp.type = bq->type;
+  qp.sort = bq->sort;
+  if (collate)
+    qp.order = strdup(bq->collate_order);
+  if (bq->type == Q_ITEMS)
+    {
+      qp.idx_type = I_FIRST;
+      qp.limit = BENCH_BROWSE_PAGE;
+    }
+
+  if (db_query_start(&qp) < 0)
+    {
+      fprintf(stderr, "Could not start query '%s'\n", bq->name);
+      exit(EXIT_FAILURE);
+    }
+
+  names = calloc(qp.results + 1, sizeof(char *));
+
+  if (bq->type == Q_ITEMS)
+    {
+      while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0 && dbmfi.id && nnames < qp.results)
+	names[nnames++] = strdup(dbmfi.title);
+    }
+  else
+    {
+      while ((ret = db_query_fetch_string_sort(&name, &sort, &qp)) == 0 && name && nnames < qp.results)
+	names[nnames++] = strdup(name);
+    }
+
+  db_query_end(&qp);
+  free_query_params(&qp, 1);
+
+  if (ret < 0)
+    {
+      fprintf(stderr, "Could not fetch the rows of query '%s'\n", bq->name);
+      exit(EXIT_FAILURE);
+    }
+
+  return names;
+}
+
+static void
+names_free(char **names)
+{
+  int i;
+
+  for (i = 0; names[i]; i++)
+    free(names[i]);
+
+  free(names);
+}
+
+static double
+bench_query(const struct bench_browse_query *bq, bool collate, char ***names)
+{
+  double start;
+  int i;
+
+  start = bench_now();
+
+  for (i = 0; i < BENCH_BROWSE_ITERATIONS; i++)
+    {
+      if (*names)
+	names_free(*names);
+      *names = query_run(bq, collate);
+    }
+
+  return (bench_now() - start) * 1000 / BENCH_BROWSE_ITERATIONS;
+}
+
+int
+main(int argc, char **argv)
+{
+  const struct bench_browse_query *bq;
+  const char *path = "bench_browse.db";
+  char **names_key;
+  char **names_collate;
+  double elapsed_key;
+  double elapsed_collate;
+  double start;
+  int nfiles = 100000;
+  int ret = EXIT_SUCCESS;
+  int i;
+  int j;
+
+  if (argc > 1)
+    nfiles = atoi(argv[1]);
+  if (argc > 2)
+    path = argv[2];
+
+  if (nfiles < BENCH_BROWSE_PAGE)
+    {
+      fprintf(stderr, "Usage: %s [nfiles] [db path]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  bench_db_open(path);
+
+  start = bench_now();
+  bench_library_fill(nfiles);
+  // Like after a scan, so that the planner has statistics
+  db_hook_post_scan();
+
+  printf("Library with %d files\n", nfiles);
+  printf("%-40s %10.1f ms\n", "fill", (bench_now() - start) * 1000);
+  printf("%-40s %14s %14s\n", "", "sort key", "DAAP collation");
+
+  for (i = 0; i < ARRAY_SIZE(bench_browse_queries); i++)
+    {
+      bq = &bench_browse_queries[i];
+      names_key = NULL;
+      names_collate = NULL;
+
+      elapsed_key = bench_query(bq, false, &names_key);
+      elapsed_collate = bench_query(bq, true, &names_collate);
+
+      printf("%-40s %11.3f ms %11.3f ms\n", bq->name, elapsed_key, elapsed_collate);
+
+      for (j = 0; names_key[j] && names_collate[j]; j++)
+	{
+	  if (strcmp(names_key[j], names_collate[j]) != 0)
+	    break;
+	}
+
+      if (names_key[j] || names_collate[j])
+	{
+	  fprintf(stderr, "Query '%s' gave row %d as '%s' by sort key, but as '%s' by DAAP collation\n",
+		  bq->name, j, names_key[j] ? names_key[j] : "(none)", names_collate[j] ? names_collate[j] : "(none)");
+	  ret = EXIT_FAILURE;
+	}
+
+      names_free(names_key);
+      names_free(names_collate);
+    }
+
+  bench_db_close(path);
+
+  return ret;
+}
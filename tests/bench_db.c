@@ -0,0 +1,301 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Runs db.c without the rest of the server for the db benchmarks. The modules
+ * that db.c calls into are replaced by the stubs below, and the configuration
+ * by the defaults from conffile.c.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench_db.h"
+#include "cache.h"
+#include "conffile.h"
+#include "library.h"
+#include "listener.h"
+#include "logger.h"
+#include "misc.h"
+#include "worker.h"
+
+#define BENCH_FILL_BATCH 1000
+
+#ifndef SQLEXT_PATH
+# define SQLEXT_PATH "../sqlext/.libs/owntone-sqlext.so"
+#endif
+
+struct bench_cfg_opt
+{
+  const char *section;
+  const char *name;
+  const char *strval;
+  long int intval;
+};
+
+static char bench_db_path[PATH_MAX];
+
+// What db.c and misc.c read, with the defaults from conffile.c
+static struct bench_cfg_opt bench_cfg_opts[] =
+  {
+    { "general", "db_path", bench_db_path, 0 },
+    { "general", "db_backup_path", NULL, 0 },
+    { "general", "db_backup_compress", NULL, 0 },
+    { "general", "ipv6", NULL, 0 },
+    { "general", "bind_address", NULL, 0 },
+    { "library", "compilation_artist", NULL, 0 },
+    { "library", "name_library", "Library", 0 },
+    { "library", "name_music", "Music", 0 },
+    { "library", "name_movies", "Movies", 0 },
+    { "library", "name_tvshows", "TV Shows", 0 },
+    { "library", "name_podcasts", "Podcasts", 0 },
+    { "library", "name_audiobooks", "Audiobooks", 0 },
+    { "library", "name_unknown_title", "Unknown title", 0 },
+    { "library", "name_unknown_artist", "Unknown artist", 0 },
+    { "library", "name_unknown_album", "Unknown album", 0 },
+    { "library", "name_unknown_genre", "Unknown genre", 0 },
+    { "library", "name_unknown_composer", "Unknown composer", 0 },
+    { "library", "rating_updates", NULL, 0 },
+    { "sqlite", "pragma_cache_size_library", NULL, -1 },
+    { "sqlite", "pragma_journal_mode", NULL, 0 },
+    { "sqlite", "pragma_synchronous", NULL, -1 },
+    { "sqlite", "pragma_mmap_size_library", NULL, -1 },
+    { "sqlite", "vacuum", NULL, 1 },
+    { "sqlite", "profile", NULL, 0 },
+    { "sqlite", "profile_slow_ms", NULL, 200 },
+    { "sqlite", "read_pool_size", NULL, 0 },
+  };
+
+cfg_t *cfg;
+
+
+/* ---------------------------------- Stubs --------------------------------- */
+
+void
+DPRINTF(int severity, int domain, const char *fmt, ...)
+{
+  va_list ap;
+
+  if (severity > E_LOG)
+    return;
+
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
+
+int
+logger_severity(void)
+{
+  return E_LOG;
+}
+
+void
+cache_daap_suspend(void)
+{
+}
+
+void
+cache_daap_resume(void)
+{
+}
+
+void
+library_update_trigger(short update_events)
+{
+}
+
+void
+listener_notify(short event_mask)
+{
+}
+
+// Runs the job right away, none of the benchmarks depend on when it runs
+void
+worker_execute(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay)
+{
+  cb(cb_arg);
+}
+
+// Sections are just their names
+cfg_t *
+cfg_getsec(cfg_t *cfg, const char *name)
+{
+  return (cfg_t *)name;
+}
+
+static struct bench_cfg_opt *
+bench_cfg_opt_get(cfg_t *sec, const char *name)
+{
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(bench_cfg_opts); i++)
+    {
+      if (strcmp(bench_cfg_opts[i].section, (const char *)sec) == 0 && strcmp(bench_cfg_opts[i].name, name) == 0)
+	return &bench_cfg_opts[i];
+    }
+
+  fprintf(stderr, "Bench has no value for config option %s:%s\n", (const char *)sec, name);
+  abort();
+}
+
+char *
+cfg_getstr(cfg_t *sec, const char *name)
+{
+  return (char *)bench_cfg_opt_get(sec, name)->strval;
+}
+
+long int
+cfg_getint(cfg_t *sec, const char *name)
+{
+  return bench_cfg_opt_get(sec, name)->intval;
+}
+
+cfg_bool_t
+cfg_getbool(cfg_t *sec, const char *name)
+{
+  return bench_cfg_opt_get(sec, name)->intval ? cfg_true : cfg_false;
+}
+
+unsigned int
+cfg_size(cfg_t *sec, const char *name)
+{
+  return 0;
+}
+
+char *
+cfg_getnstr(cfg_t *sec, const char *name, unsigned int index)
+{
+  return NULL;
+}
+
+
+/* --------------------------------- Helpers -------------------------------- */
+
+void
+bench_db_open(const char *path)
+{
+  const char *ext_path;
+  char buf[PATH_MAX];
+
+  snprintf(bench_db_path, sizeof(bench_db_path), "%s", path);
+
+  unlink(path);
+  snprintf(buf, sizeof(buf), "%s-wal", path);
+  unlink(buf);
+  snprintf(buf, sizeof(buf), "%s-shm", path);
+  unlink(buf);
+
+  ext_path = getenv("OWNTONE_SQLEXT");
+  if (!ext_path)
+    ext_path = SQLEXT_PATH;
+
+  if (db_init((char *)ext_path) < 0 || db_perthread_init() < 0)
+    {
+      fprintf(stderr, "Could not open the database '%s' (with sqlext from '%s')\n", path, ext_path);
+      exit(EXIT_FAILURE);
+    }
+}
+
+void
+bench_db_close(const char *path)
+{
+  char buf[PATH_MAX];
+
+  db_perthread_deinit();
+  db_deinit();
+
+  unlink(path);
+  snprintf(buf, sizeof(buf), "%s-wal", path);
+  unlink(buf);
+  snprintf(buf, sizeof(buf), "%s-shm", path);
+  unlink(buf);
+}
+
+void
+bench_mfi_fill(struct media_file_info *mfi, int n)
+{
+  char buf[PATH_MAX];
+
+  memset(mfi, 0, sizeof(struct media_file_info));
+
+  snprintf(buf, sizeof(buf), "/music/artist %d/album %d/track %d.flac", n / 120, n / 12, n);
+  mfi->path = strdup(buf);
+  snprintf(buf, sizeof(buf), "/file:/music/artist %d/album %d/track %d.flac", n / 120, n / 12, n);
+  mfi->virtual_path = strdup(buf);
+  snprintf(buf, sizeof(buf), "track %d.flac", n);
+  mfi->fname = strdup(buf);
+
+  snprintf(buf, sizeof(buf), "Track %d", n);
+  mfi->title = strdup(buf);
+  snprintf(buf, sizeof(buf), "Artist %d", n / 120);
+  mfi->artist = strdup(buf);
+  mfi->album_artist = strdup(buf);
+  snprintf(buf, sizeof(buf), "Album %d", n / 12);
+  mfi->album = strdup(buf);
+  snprintf(buf, sizeof(buf), "Genre %d", (n / 120) % 20);
+  mfi->genre = strdup(buf);
+  mfi->type = strdup("flac");
+  mfi->codectype = strdup("flac");
+  mfi->description = strdup("FLAC audio file");
+
+  mfi->track = n % 12 + 1;
+  mfi->total_tracks = 12;
+  mfi->disc = 1;
+  mfi->total_discs = 1;
+  mfi->year = 1970 + (n / 12) % 50;
+  mfi->song_length = 180000 + (n % 100) * 1000;
+  mfi->file_size = 20000000 + n;
+  mfi->bitrate = 900;
+  mfi->samplerate = 44100;
+  mfi->channels = 2;
+  mfi->bits_per_sample = 16;
+  mfi->time_modified = 1600000000 + n;
+  mfi->data_kind = DATA_KIND_FILE;
+  mfi->media_kind = MEDIA_KIND_MUSIC;
+  mfi->item_kind = 2;
+  mfi->scan_kind = SCAN_KIND_FILES;
+}
+
+void
+bench_library_fill(int nfiles)
+{
+  struct media_file_info *mfis;
+  int n;
+  int i;
+
+  mfis = calloc(BENCH_FILL_BATCH, sizeof(struct media_file_info));
+
+  for (n = 0; n < nfiles; n += BENCH_FILL_BATCH)
+    {
+      for (i = 0; i < BENCH_FILL_BATCH && n + i < nfiles; i++)
+	bench_mfi_fill(&mfis[i], n + i);
+
+      db_file_save_batch(mfis, i);
+
+      while (i-- > 0)
+	free_mfi(&mfis[i], 1);
+    }
+
+  free(mfis);
+}
@@ -0,0 +1,31 @@
+#ifndef __BENCH_DB_H__
+#define __BENCH_DB_H__
+
+#include "bench.h"
+#include "db.h"
+
+/* Helpers for the benchmarks that run db.c against a scratch database, see
+ * bench_db.c. The configuration that db.c reads has the defaults from
+ * conffile.c.
+ */
+
+// Creates a new database at path (any existing one is deleted) with db_init(),
+// and sets up the calling thread. The DAAP collation used by the schema comes
+// from the sqlext module, which is loaded from SQLEXT_PATH, or from the path in
+// the OWNTONE_SQLEXT environment variable. Exits on error.
+void
+bench_db_open(const char *path);
+
+void
+bench_db_close(const char *path);
+
+// Fills mfi with the metadata of file number n of a library with albums of 12
+// tracks by artists with 10 albums. Use free_mfi(mfi, 1) to free.
+void
+bench_mfi_fill(struct media_file_info *mfi, int n);
+
+// Adds nfiles made by bench_mfi_fill() with db_file_save_batch()
+void
+bench_library_fill(int nfiles);
+
+#endif /* !__BENCH_DB_H__ */
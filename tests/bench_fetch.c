@@ -0,0 +1,231 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Measures how many rows per second a full track listing (like a DAAP
+ * songlist or /api/library/tracks) can read from a large library (default
+ * 100000 files), with the integer columns the DAAP encoder sends:
+ *  - db_query_fetch_file(), converting the columns with safe_atou32() and
+ *    safe_atoi64() like the encoders did before
+ *  - db_query_fetch_mfi(), reading the typed struct fields
+ * Both must give the same sum of the columns.
+ *
+ * Usage: bench_fetch [nfiles] [db path]
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "bench_db.h"
+#include "misc.h"
+
+#define BENCH_FETCH_ITERATIONS 5
+
+struct bench_fetch_col
+{
+  ssize_t dbmfi_offset;
+  ssize_t mfi_offset;
+  bool is_int64;
+};
+
+#define BENCH_FETCH_COL(field, is_int64) { dbmfi_offsetof(field), mfi_offsetof(field), is_int64 }
+
+static const struct bench_fetch_col bench_fetch_cols[] =
+  {
+    BENCH_FETCH_COL(id, false),
+    BENCH_FETCH_COL(item_kind, false),
+    BENCH_FETCH_COL(data_kind, false),
+    BENCH_FETCH_COL(media_kind, false),
+    BENCH_FETCH_COL(songalbumid, true),
+    BENCH_FETCH_COL(songartistid, true),
+    BENCH_FETCH_COL(bitrate, false),
+    BENCH_FETCH_COL(samplerate, false),
+    BENCH_FETCH_COL(song_length, false),
+    BENCH_FETCH_COL(file_size, true),
+    BENCH_FETCH_COL(year, false),
+    BENCH_FETCH_COL(track, false),
+    BENCH_FETCH_COL(total_tracks, false),
+    BENCH_FETCH_COL(disc, false),
+    BENCH_FETCH_COL(total_discs, false),
+    BENCH_FETCH_COL(bpm, false),
+    BENCH_FETCH_COL(compilation, false),
+    BENCH_FETCH_COL(rating, false),
+    BENCH_FETCH_COL(play_count, false),
+    BENCH_FETCH_COL(skip_count, false),
+    BENCH_FETCH_COL(time_added, false),
+    BENCH_FETCH_COL(time_modified, false),
+    BENCH_FETCH_COL(time_played, false),
+    BENCH_FETCH_COL(time_skipped, false),
+    BENCH_FETCH_COL(date_released, true),
+    BENCH_FETCH_COL(disabled, true),
+    BENCH_FETCH_COL(contentrating, false),
+    BENCH_FETCH_COL(has_video, false),
+    BENCH_FETCH_COL(tv_episode_sort, false),
+    BENCH_FETCH_COL(tv_season_num, false),
+  };
+
+static void
+query_start(struct query_params *qp)
+{
+  memset(qp, 0, sizeof(struct query_params));
+  qp->type = Q_ITEMS;
+
+  if (db_query_start(qp) < 0)
+    {
+      fprintf(stderr, "Could not start query\n");
+      exit(EXIT_FAILURE);
+    }
+}
+
+static int64_t
+rows_fetch_file(int *nrows)
+{
+  struct query_params qp;
+  struct db_media_file_info dbmfi;
+  uint32_t u32;
+  int64_t i64;
+  int64_t sum = 0;
+  char *strval;
+  int ret;
+  int i;
+
+  query_start(&qp);
+
+  while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
+    {
+      for (i = 0; i < ARRAY_SIZE(bench_fetch_cols); i++)
+	{
+	  strval = *(char **) ((char *)&dbmfi + bench_fetch_cols[i].dbmfi_offset);
+
+	  if (bench_fetch_cols[i].is_int64)
+	    sum += (safe_atoi64(strval, &i64) == 0) ? i64 : 0;
+	  else
+	    sum += (safe_atou32(strval, &u32) == 0) ? u32 : 0;
+	}
+
+      (*nrows)++;
+    }
+
+  db_query_end(&qp);
+
+  if (ret < 0)
+    exit(EXIT_FAILURE);
+
+  return sum;
+}
+
+static int64_t
+rows_fetch_mfi(int *nrows)
+{
+  struct query_params qp;
+  struct media_file_info mfi;
+  int64_t sum = 0;
+  char *ptr;
+  int ret;
+  int i;
+
+  query_start(&qp);
+
+  while ((ret = db_query_fetch_mfi(&mfi, &qp)) == 0)
+    {
+      for (i = 0; i < ARRAY_SIZE(bench_fetch_cols); i++)
+	{
+	  ptr = (char *)&mfi + bench_fetch_cols[i].mfi_offset;
+
+	  if (bench_fetch_cols[i].is_int64)
+	    sum += *(int64_t *)ptr;
+	  else
+	    sum += *(uint32_t *)ptr;
+	}
+
+      (*nrows)++;
+    }
+
+  db_query_end(&qp);
+
+  if (ret < 0)
+    exit(EXIT_FAILURE);
+
+  return sum;
+}
+
+static double
+bench_rows(int64_t (*rows_fetch)(int *nrows), int64_t *sum)
+{
+  double start;
+  int nrows = 0;
+  int i;
+
+  start = bench_now();
+
+  for (i = 0; i < BENCH_FETCH_ITERATIONS; i++)
+    *sum = rows_fetch(&nrows);
+
+  return nrows / (bench_now() - start);
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *path = "bench_fetch.db";
+  int64_t sum_file;
+  int64_t sum_mfi;
+  double rate_file;
+  double rate_mfi;
+  double start;
+  int nfiles = 100000;
+
+  if (argc > 1)
+    nfiles = atoi(argv[1]);
+  if (argc > 2)
+    path = argv[2];
+
+  if (nfiles < 1)
+    {
+      fprintf(stderr, "Usage: %s [nfiles] [db path]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  bench_db_open(path);
+
+  start = bench_now();
+  bench_library_fill(nfiles);
+
+  printf("Library with %d files\n", nfiles);
+  printf("%-40s %10.1f ms\n", "fill", (bench_now() - start) * 1000);
+
+  rate_file = bench_rows(rows_fetch_file, &sum_file);
+  rate_mfi = bench_rows(rows_fetch_mfi, &sum_mfi);
+
+  printf("%-40s %10.0f rows/s\n", "db_query_fetch_file() + safe_ato*()", rate_file);
+  printf("%-40s %10.0f rows/s\n", "db_query_fetch_mfi()", rate_mfi);
+
+  bench_db_close(path);
+
+  if (sum_file != sum_mfi)
+    {
+      fprintf(stderr, "Sum of the columns is %" PRIi64 " with db_query_fetch_file(), but %" PRIi64 " with db_query_fetch_mfi()\n", sum_file, sum_mfi);
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
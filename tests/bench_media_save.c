@@ -0,0 +1,143 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Measures how many files per second library_media_save() can write to a new
+ * library (default 20000 files), through the db.c functions that it calls:
+ *  - db_file_add() for each file in its own transaction, like outside a scan
+ *    (only the first BENCH_AUTOCOMMIT_MAX files, since it is slow)
+ *  - db_file_add() for each file, with a transaction per
+ *    LIBRARY_MEDIA_BATCH_SIZE files, like a bulk scan did before batching
+ *  - db_file_save_batch() with LIBRARY_MEDIA_BATCH_SIZE files, like a bulk
+ *    scan that flushes its batch
+ * Each run starts with a new database, and must save all the files.
+ *
+ * Usage: bench_media_save [nfiles] [db path]
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_db.h"
+#include "library.h"
+
+#define BENCH_AUTOCOMMIT_MAX 1000
+
+enum bench_save_mode
+{
+  BENCH_SAVE_AUTOCOMMIT,
+  BENCH_SAVE_TRANSACTION,
+  BENCH_SAVE_BATCH,
+};
+
+// Saves nfiles from n with mode, returns the number saved
+static int
+files_save(enum bench_save_mode mode, struct media_file_info *mfis, int n, int nfiles)
+{
+  int saved = 0;
+  int i;
+
+  for (i = 0; i < nfiles; i++)
+    bench_mfi_fill(&mfis[i], n + i);
+
+  if (mode == BENCH_SAVE_BATCH)
+    {
+      saved = db_file_save_batch(mfis, nfiles);
+    }
+  else
+    {
+      if (mode == BENCH_SAVE_TRANSACTION)
+	db_transaction_begin();
+
+      for (i = 0; i < nfiles; i++)
+	saved += (db_file_add(&mfis[i]) == 0);
+
+      if (mode == BENCH_SAVE_TRANSACTION)
+	db_transaction_end();
+    }
+
+  for (i = 0; i < nfiles; i++)
+    free_mfi(&mfis[i], 1);
+
+  return saved;
+}
+
+static double
+bench_save(enum bench_save_mode mode, const char *path, int nfiles)
+{
+  struct media_file_info *mfis;
+  uint32_t nitems;
+  uint32_t nstreams;
+  double start;
+  double elapsed;
+  int saved = 0;
+  int batch;
+  int n;
+
+  bench_db_open(path);
+
+  batch = (mode == BENCH_SAVE_AUTOCOMMIT) ? 1 : LIBRARY_MEDIA_BATCH_SIZE;
+  mfis = calloc(batch, sizeof(struct media_file_info));
+
+  start = bench_now();
+
+  for (n = 0; n < nfiles; n += batch)
+    saved += files_save(mode, mfis, n, (nfiles - n < batch) ? nfiles - n : batch);
+
+  elapsed = bench_now() - start;
+
+  free(mfis);
+
+  if (saved != nfiles || db_files_get_count(&nitems, &nstreams, NULL) < 0 || nitems != nfiles)
+    {
+      fprintf(stderr, "Saved %d of %d files\n", saved, nfiles);
+      exit(EXIT_FAILURE);
+    }
+
+  bench_db_close(path);
+
+  return nfiles / elapsed;
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *path = "bench_media_save.db";
+  int nfiles = 20000;
+
+  if (argc > 1)
+    nfiles = atoi(argv[1]);
+  if (argc > 2)
+    path = argv[2];
+
+  if (nfiles < 1)
+    {
+      fprintf(stderr, "Usage: %s [nfiles] [db path]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  printf("Library with %d files, %d per batch\n", nfiles, LIBRARY_MEDIA_BATCH_SIZE);
+  printf("%-40s %10.0f files/s\n", "db_file_add(), autocommit",
+	 bench_save(BENCH_SAVE_AUTOCOMMIT, path, (nfiles < BENCH_AUTOCOMMIT_MAX) ? nfiles : BENCH_AUTOCOMMIT_MAX));
+  printf("%-40s %10.0f files/s\n", "db_file_add(), transaction per batch", bench_save(BENCH_SAVE_TRANSACTION, path, nfiles));
+  printf("%-40s %10.0f files/s\n", "db_file_save_batch()", bench_save(BENCH_SAVE_BATCH, path, nfiles));
+
+  return EXIT_SUCCESS;
+}
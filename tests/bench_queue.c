@@ -0,0 +1,198 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Measures the queue operations of db.c on a large queue (default 50000
+ * items):
+ *  - inserting an item in the middle, like "add next" from a client
+ *  - moving an item from the first to the last half, and deleting one
+ *  - reading 10 items from the middle, like MPD playlistinfo START:END, with
+ *    the position window (I_SUB) and with a filter on the positions
+ *
+ * Usage: bench_queue [nitems] [db path]
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "bench_db.h"
+
+#define BENCH_QUEUE_ITERATIONS 200
+#define BENCH_QUEUE_WINDOW 10
+
+static void
+queue_add(int pos, int n, int count)
+{
+  struct db_queue_add_info queue_add_info;
+  struct media_file_info mfi;
+  struct db_queue_item qi;
+  int ret;
+  int i;
+
+  ret = db_queue_add_start(&queue_add_info, pos);
+  if (ret < 0)
+    {
+      fprintf(stderr, "Could not start queue add\n");
+      exit(EXIT_FAILURE);
+    }
+
+  for (i = 0; i < count && ret >= 0; i++)
+    {
+      bench_mfi_fill(&mfi, n + i);
+      mfi.id = n + i + 1;
+
+      db_queue_item_from_mfi(&qi, &mfi);
+      ret = db_queue_add_next(&queue_add_info, &qi);
+
+      free_queue_item(&qi, 1);
+      free_mfi(&mfi, 1);
+    }
+
+  // db_queue_add_next() returns the id of the new item
+  ret = db_queue_add_end(&queue_add_info, 0, 0, (ret < 0) ? -1 : 0);
+  if (ret < 0)
+    {
+      fprintf(stderr, "Could not add to queue\n");
+      exit(EXIT_FAILURE);
+    }
+}
+
+// Reads BENCH_QUEUE_WINDOW items from pos, returns how many were read
+static int
+queue_read(int pos, bool window)
+{
+  struct query_params qp = { 0 };
+  struct db_queue_item qi;
+  int nitems = 0;
+
+  if (window)
+    {
+      qp.idx_type = I_SUB;
+      qp.offset = pos;
+      qp.limit = BENCH_QUEUE_WINDOW;
+    }
+  else
+    qp.filter = db_mprintf("pos >= %d AND pos < %d", pos, pos + BENCH_QUEUE_WINDOW);
+
+  if (db_queue_enum_start(&qp) < 0)
+    {
+      fprintf(stderr, "Could not start queue enum\n");
+      exit(EXIT_FAILURE);
+    }
+
+  while (db_queue_enum_fetch(&qp, &qi) == 0 && qi.id > 0)
+    {
+      if (qi.pos != pos + nitems)
+	fprintf(stderr, "Item %d at position %d, expected %d\n", qi.id, qi.pos, pos + nitems);
+      nitems++;
+    }
+
+  db_queue_enum_end(&qp);
+  free(qp.filter);
+
+  return nitems;
+}
+
+static double
+bench_read(int pos, bool window)
+{
+  double start;
+  int i;
+
+  start = bench_now();
+
+  for (i = 0; i < BENCH_QUEUE_ITERATIONS; i++)
+    {
+      if (queue_read(pos, window) != BENCH_QUEUE_WINDOW)
+	{
+	  fprintf(stderr, "Queue read at position %d gave the wrong number of items\n", pos);
+	  exit(EXIT_FAILURE);
+	}
+    }
+
+  return (bench_now() - start) * 1000 / BENCH_QUEUE_ITERATIONS;
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *path = "bench_queue.db";
+  uint32_t count;
+  double start;
+  double elapsed;
+  int nitems = 50000;
+  int i;
+
+  if (argc > 1)
+    nitems = atoi(argv[1]);
+  if (argc > 2)
+    path = argv[2];
+
+  if (nitems < 2 * BENCH_QUEUE_WINDOW)
+    {
+      fprintf(stderr, "Usage: %s [nitems] [db path]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  bench_db_open(path);
+
+  start = bench_now();
+  queue_add(-1, 0, nitems);
+  elapsed = bench_now() - start;
+
+  printf("Queue with %d items\n", nitems);
+  printf("%-40s %10.1f ms\n", "fill", elapsed * 1000);
+
+  start = bench_now();
+  for (i = 0; i < BENCH_QUEUE_ITERATIONS; i++)
+    queue_add(nitems / 2, nitems + i, 1);
+  elapsed = bench_now() - start;
+
+  printf("%-40s %10.3f ms\n", "insert 1 item in the middle", elapsed * 1000 / BENCH_QUEUE_ITERATIONS);
+
+  start = bench_now();
+  for (i = 0; i < BENCH_QUEUE_ITERATIONS; i++)
+    db_queue_move_bypos(nitems / 4, 3 * nitems / 4);
+  elapsed = bench_now() - start;
+
+  printf("%-40s %10.3f ms\n", "move 1 item across the middle", elapsed * 1000 / BENCH_QUEUE_ITERATIONS);
+
+  start = bench_now();
+  for (i = 0; i < BENCH_QUEUE_ITERATIONS; i++)
+    db_queue_delete_bypos(nitems / 2, 1);
+  elapsed = bench_now() - start;
+
+  printf("%-40s %10.3f ms\n", "delete 1 item in the middle", elapsed * 1000 / BENCH_QUEUE_ITERATIONS);
+
+  db_queue_get_count(&count);
+  if (count != nitems)
+    {
+      fprintf(stderr, "Queue has %u items, expected %d\n", count, nitems);
+      return EXIT_FAILURE;
+    }
+
+  printf("%-40s %10.3f ms\n", "read 10 items, position window", bench_read(nitems / 2, true));
+  printf("%-40s %10.3f ms\n", "read 10 items, filter on positions", bench_read(nitems / 2, false));
+
+  bench_db_close(path);
+
+  return EXIT_SUCCESS;
+}
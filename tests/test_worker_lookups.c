@@ -0,0 +1,401 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Tests worker_lookups_run(), which artwork.c uses to query online sources in
+ * parallel, against a local HTTP server that stands in for the services. The
+ * server answers "/hit" with 200 and "/miss" with 404, after the number of ms
+ * given with "?delay=". Each lookup makes a blocking request and returns 1 for
+ * 200 and 0 for 404, like an artwork source that found or didn't find artwork.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <event2/event.h>
+#include <event2/http.h>
+
+#include "db.h"
+#include "logger.h"
+#include "misc.h"
+#include "worker.h"
+
+#define TEST_LOOKUPS_MAX 8
+
+struct test_lookup
+{
+  char uri[64];
+};
+
+struct test_worker_arg
+{
+  int *rets;
+  int *ndone;
+};
+
+static struct event_base *server_evbase;
+static int server_port;
+static int nfreed;
+static int nfailed;
+
+
+/* ------------------------------ Stubs for worker.c ------------------------ */
+
+void
+DPRINTF(int severity, int domain, const char *fmt, ...)
+{
+  va_list ap;
+
+  if (severity > E_LOG)
+    return;
+
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
+
+void
+log_fatal_err(int domain, const char *func, int line, int err)
+{
+  fprintf(stderr, "%s failed at line %d, error %d\n", func, line, err);
+  abort();
+}
+
+void
+log_fatal_null(int domain, const char *func, int line)
+{
+  fprintf(stderr, "%s returned NULL at line %d\n", func, line);
+  abort();
+}
+
+int
+db_perthread_init(void)
+{
+  return 0;
+}
+
+void
+db_perthread_deinit(void)
+{
+}
+
+void
+thread_setname(const char *name)
+{
+}
+
+int
+mutex_init(pthread_mutex_t *mutex)
+{
+  return pthread_mutex_init(mutex, NULL);
+}
+
+
+/* ---------------------------- HTTP stand-in server ------------------------ */
+
+static void
+reply_cb(evutil_socket_t fd, short what, void *arg)
+{
+  struct evhttp_request *req = arg;
+
+  if (strncmp(evhttp_request_get_uri(req), "/hit", 4) == 0)
+    evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+  else
+    evhttp_send_reply(req, HTTP_NOTFOUND, "Not Found", NULL);
+}
+
+static void
+request_cb(struct evhttp_request *req, void *arg)
+{
+  const char *param;
+  struct timeval tv = { 0, 0 };
+  int delay = 0;
+
+  param = strstr(evhttp_request_get_uri(req), "delay=");
+  if (param)
+    delay = atoi(param + strlen("delay="));
+
+  tv.tv_sec = delay / 1000;
+  tv.tv_usec = (delay % 1000) * 1000;
+
+  event_base_once(server_evbase, -1, EV_TIMEOUT, reply_cb, req, &tv);
+}
+
+static void *
+server_run(void *arg)
+{
+  event_base_dispatch(server_evbase);
+
+  return NULL;
+}
+
+static void
+server_start(void)
+{
+  struct evhttp *http;
+  struct evhttp_bound_socket *sock;
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  pthread_t tid;
+
+  server_evbase = event_base_new();
+  http = evhttp_new(server_evbase);
+  sock = evhttp_bind_socket_with_handle(http, "127.0.0.1", 0);
+  if (!sock || getsockname(evhttp_bound_socket_get_fd(sock), (struct sockaddr *)&sin, &len) < 0)
+    {
+      fprintf(stderr, "Could not start the HTTP server\n");
+      exit(EXIT_FAILURE);
+    }
+
+  server_port = ntohs(sin.sin_port);
+
+  evhttp_set_gencb(http, request_cb, NULL);
+
+  pthread_create(&tid, NULL, server_run, NULL);
+  pthread_detach(tid);
+}
+
+
+/* --------------------------------- Lookups -------------------------------- */
+
+// Blocking request to the server, returns 1 for 200, 0 for 404, -1 on error
+static int
+lookup_cb(void *arg)
+{
+  struct test_lookup *lookup = arg;
+  struct sockaddr_in sin = { 0 };
+  char buf[256];
+  ssize_t len;
+  int status;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(server_port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.0\r\n\r\n", lookup->uri);
+  if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 || send(fd, buf, len, 0) != len)
+    {
+      close(fd);
+      return -1;
+    }
+
+  len = recv(fd, buf, sizeof(buf) - 1, MSG_WAITALL);
+  close(fd);
+  if (len <= 0)
+    return -1;
+
+  buf[len] = '\0';
+  if (sscanf(buf, "HTTP/1.%*d %d", &status) != 1)
+    return -1;
+
+  return (status == HTTP_OK) ? 1 : 0;
+}
+
+static void
+lookup_free(void *arg)
+{
+  __atomic_add_fetch(&nfreed, 1, __ATOMIC_SEQ_CST);
+  free(arg);
+}
+
+static bool
+lookup_is_decided(int ret)
+{
+  return (ret > 0);
+}
+
+static double
+now_sec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs lookups of the given uris, returns the seconds it took
+static double
+lookups_run(int *rets, int timeout, int n, ...)
+{
+  struct worker_lookups *lookups;
+  struct test_lookup *args[TEST_LOOKUPS_MAX];
+  double start;
+  va_list ap;
+  int i;
+
+  va_start(ap, n);
+  for (i = 0; i < n; i++)
+    {
+      args[i] = calloc(1, sizeof(struct test_lookup));
+      snprintf(args[i]->uri, sizeof(args[i]->uri), "%s", va_arg(ap, const char *));
+    }
+  va_end(ap);
+
+  start = now_sec();
+  lookups = worker_lookups_run(lookup_cb, (void **)args, n, lookup_free, lookup_is_decided, timeout, rets);
+  worker_lookups_free(lookups);
+
+  return now_sec() - start;
+}
+
+static void
+check(bool ok, const char *what)
+{
+  printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+  if (!ok)
+    nfailed++;
+}
+
+
+/* ---------------------------------- Tests --------------------------------- */
+
+static void
+test_parallel(void)
+{
+  int rets[3];
+  double elapsed;
+
+  elapsed = lookups_run(rets, 5, 3, "/miss?delay=800", "/miss?delay=800", "/miss?delay=800");
+
+  check(rets[0] == 0 && rets[1] == 0 && rets[2] == 0, "all sources answer a miss");
+  check(elapsed < 1.6, "sources are queried in parallel");
+}
+
+static void
+test_priority(void)
+{
+  int rets[2];
+  double elapsed;
+
+  elapsed = lookups_run(rets, 5, 2, "/hit?delay=500", "/hit");
+
+  check(rets[0] == 1 && rets[1] == 1, "a hit waits for the source before it");
+  check(elapsed >= 0.4, "the first source in the list is waited for");
+
+  elapsed = lookups_run(rets, 5, 2, "/miss?delay=300", "/hit");
+
+  check(rets[0] == 0 && rets[1] == 1, "a miss lets the next source decide");
+}
+
+static void
+test_decided(void)
+{
+  int rets[2];
+  double elapsed;
+  int freed;
+
+  freed = __atomic_load_n(&nfreed, __ATOMIC_SEQ_CST);
+
+  elapsed = lookups_run(rets, 5, 2, "/hit", "/hit?delay=1500");
+
+  check(rets[0] == 1 && rets[1] == WORKER_LOOKUP_PENDING, "a hit decides without waiting for later sources");
+  check(elapsed < 1.0, "no wait for sources after a hit");
+
+  // The pending lookup finishes on its own and frees the arguments
+  sleep(2);
+  check(__atomic_load_n(&nfreed, __ATOMIC_SEQ_CST) == freed + 2, "arguments are freed when the last lookup is done");
+}
+
+static void
+test_timeout(void)
+{
+  int rets[2];
+  double elapsed;
+
+  elapsed = lookups_run(rets, 1, 2, "/miss?delay=2500", "/hit?delay=2500");
+
+  check(rets[0] == WORKER_LOOKUP_PENDING && rets[1] == WORKER_LOOKUP_PENDING, "sources that don't answer in time are pending, not a miss");
+  check(elapsed >= 0.9 && elapsed < 2.0, "the wait ends at the timeout");
+
+  sleep(2);
+}
+
+static void
+worker_job(void *arg)
+{
+  struct test_worker_arg *cmdarg = arg;
+
+  lookups_run(cmdarg->rets, 5, 2, "/miss?delay=500", "/miss?delay=500");
+
+  __atomic_add_fetch(cmdarg->ndone, 1, __ATOMIC_SEQ_CST);
+}
+
+// Lookups don't run on the worker threads, so all the workers can wait for
+// lookups at the same time
+static void
+test_from_workers(void)
+{
+  struct test_worker_arg cmdarg;
+  int rets[8][2];
+  int ndone = 0;
+  bool answered = true;
+  int i;
+
+  for (i = 0; i < 8; i++)
+    {
+      cmdarg.rets = rets[i];
+      cmdarg.ndone = &ndone;
+      worker_execute(worker_job, &cmdarg, sizeof(struct test_worker_arg), 0);
+    }
+
+  for (i = 0; i < 100 && __atomic_load_n(&ndone, __ATOMIC_SEQ_CST) < 8; i++)
+    usleep(100000);
+
+  for (i = 0; i < 8; i++)
+    answered = answered && rets[i][0] == 0 && rets[i][1] == 0;
+
+  check(ndone == 8, "worker jobs waiting for lookups finish");
+  check(answered, "lookups from busy workers are answered in time");
+}
+
+int
+main(int argc, char **argv)
+{
+  server_start();
+
+  if (worker_init() < 0)
+    {
+      fprintf(stderr, "Could not start the worker threads\n");
+      return EXIT_FAILURE;
+    }
+
+  test_parallel();
+  test_priority();
+  test_decided();
+  test_timeout();
+  test_from_workers();
+
+  worker_deinit();
+
+  return (nfailed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}